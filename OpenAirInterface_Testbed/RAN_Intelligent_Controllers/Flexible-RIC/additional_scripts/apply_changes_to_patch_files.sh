@@ -52,11 +52,19 @@ cd flexric/
 # Update the patch files
 cp examples/xApp/c/metrics_factory.h ../install_patch_files/flexric/examples/xApp/c/metrics_factory.h
 cp examples/xApp/c/metrics_factory.c ../install_patch_files/flexric/examples/xApp/c/metrics_factory.c
+cp examples/xApp/c/kpm_capture.h ../install_patch_files/flexric/examples/xApp/c/kpm_capture.h
+cp examples/xApp/c/kpm_capture.c ../install_patch_files/flexric/examples/xApp/c/kpm_capture.c
+cp examples/xApp/c/metrics_exporter.h ../install_patch_files/flexric/examples/xApp/c/metrics_exporter.h
+cp examples/xApp/c/metrics_exporter.c ../install_patch_files/flexric/examples/xApp/c/metrics_exporter.c
 
 git diff examples/xApp/c/monitor/xapp_kpm_moni.c >../install_patch_files/flexric/examples/xApp/c/monitor/xapp_kpm_moni.c.patch
 git diff examples/xApp/c/monitor/CMakeLists.txt >../install_patch_files/flexric/examples/xApp/c/monitor/CMakeLists.txt.patch
 cp examples/xApp/c/monitor/xapp_kpm_moni_write_to_csv.c ../install_patch_files/flexric/examples/xApp/c/monitor/xapp_kpm_moni_write_to_csv.c
 cp examples/xApp/c/monitor/xapp_kpm_moni_write_to_influxdb.c ../install_patch_files/flexric/examples/xApp/c/monitor/xapp_kpm_moni_write_to_influxdb.c
+cp examples/xApp/c/monitor/kpm_capture_to_csv.c ../install_patch_files/flexric/examples/xApp/c/monitor/kpm_capture_to_csv.c
+cp examples/xApp/c/monitor/metrics_factory_bench.c ../install_patch_files/flexric/examples/xApp/c/monitor/metrics_factory_bench.c
+cp examples/xApp/c/monitor/act_proc_bench.c ../install_patch_files/flexric/examples/xApp/c/monitor/act_proc_bench.c
+cp src/xApp/db/db.c ../install_patch_files/flexric/disable_database_option/src/xApp/db/db.c
 
 git diff examples/xApp/c/kpm_rc/xapp_kpm_rc.c >../install_patch_files/flexric/examples/xApp/c/kpm_rc/xapp_kpm_rc.c.patch
 git diff examples/xApp/c/kpm_rc/CMakeLists.txt >../install_patch_files/flexric/examples/xApp/c/kpm_rc/CMakeLists.txt.patch
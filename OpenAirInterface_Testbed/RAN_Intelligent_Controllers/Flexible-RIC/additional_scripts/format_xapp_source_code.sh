@@ -74,9 +74,16 @@ UseTab: Never
 EOF
 
 FILES=(
+    "flexric/examples/xApp/c/kpm_capture.h"
+    "flexric/examples/xApp/c/kpm_capture.c"
+    "flexric/examples/xApp/c/metrics_exporter.h"
+    "flexric/examples/xApp/c/metrics_exporter.c"
     "flexric/examples/xApp/c/monitor/xapp_kpm_moni.c"
     "flexric/examples/xApp/c/monitor/xapp_kpm_moni_write_to_csv.c"
     "flexric/examples/xApp/c/monitor/xapp_kpm_moni_write_to_influxdb.c"
+    "flexric/examples/xApp/c/monitor/kpm_capture_to_csv.c"
+    "flexric/examples/xApp/c/monitor/metrics_factory_bench.c"
+    "flexric/examples/xApp/c/monitor/act_proc_bench.c"
 )
 
 for FILE in "${FILES[@]}"; do
@@ -34,11 +34,19 @@ import urllib.parse
 import mmap
 import time
 import random
+import struct
 
 script_dir = os.path.dirname(os.path.abspath(__file__))
 parent_dir = os.path.dirname(script_dir)
 base_dir = os.path.dirname(os.path.dirname(os.path.dirname(parent_dir)))
 
+# Index written by the xApp next to each CSV file (<csv_path>.idx): a header of the magic, the version and the record size,
+# followed by one (timestamp_ms, byte_offset, batch_id) record per row.
+INDEX_MAGIC = b'KPMIDX01'
+INDEX_VERSION = 1
+INDEX_HEADER = struct.Struct('<8sII')
+INDEX_RECORD = struct.Struct('<qQq')
+
 class SingleFileHTTPRequestHandler(http.server.SimpleHTTPRequestHandler):
 
     # Perform a binary search to find the offset in the mmap file where the timestamp is greater than or equal to the target timestamp.
@@ -85,6 +93,71 @@ class SingleFileHTTPRequestHandler(http.server.SimpleHTTPRequestHandler):
         # If no timestamp equal to or greater than the target was found, return the start of data (just after header)
         return header_end_offset
 
+    # Check that a row of the CSV file starts at the offset and has the timestamp given by the index.
+    def _row_matches_index(self, mmap_file: mmap.mmap, header_end_offset: int, offset: int, timestamp: int):
+        if offset < header_end_offset or offset >= mmap_file.size() or mmap_file[offset - 1:offset] != b'\n':
+            return False
+        prefix = str(timestamp).encode() + b','
+        return mmap_file[offset:offset + len(prefix)] == prefix
+
+    # Find the offset of the first row with a timestamp greater than or equal to the target timestamp using the index of the CSV file.
+    # Returns None if there is no index, or if it does not match the CSV file, in which case find_offset() should be used instead.
+    def find_offset_from_index(self, csv_path: str, mmap_file: mmap.mmap, header_end_offset: int, target_timestamp: int):
+        try:
+            with open(csv_path + '.idx', 'rb') as f:
+                if os.fstat(f.fileno()).st_size < INDEX_HEADER.size + INDEX_RECORD.size:
+                    return None
+                index = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        except (OSError, ValueError):
+            return None
+
+        with index:
+            magic, version, record_size = INDEX_HEADER.unpack_from(index, 0)
+            if magic != INDEX_MAGIC or version != INDEX_VERSION or record_size != INDEX_RECORD.size:
+                return None
+            num_records = (index.size() - INDEX_HEADER.size) // record_size
+
+            def read_record(i):
+                return INDEX_RECORD.unpack_from(index, INDEX_HEADER.size + i * record_size)
+
+            # Ignore trailing records that point past the end of the CSV file, e.g. if it was truncated by a crash
+            while num_records > 0 and read_record(num_records - 1)[1] >= mmap_file.size():
+                num_records -= 1
+            if num_records == 0:
+                return None
+
+            low, high = 0, num_records
+            while low < high:
+                mid = (low + high) // 2
+                if read_record(mid)[0] < target_timestamp:
+                    low = mid + 1
+                else:
+                    high = mid
+
+            if low < num_records:
+                timestamp, offset, _ = read_record(low)
+                return offset if self._row_matches_index(mmap_file, header_end_offset, offset, timestamp) else None
+
+            # All indexed rows are older than the target, but rows may have been written after the index was last flushed
+            timestamp, offset, _ = read_record(num_records - 1)
+            if not self._row_matches_index(mmap_file, header_end_offset, offset, timestamp):
+                return None
+
+        mmap_file.seek(offset)
+        mmap_file.readline()
+        while True:
+            pos = mmap_file.tell()
+            line = mmap_file.readline()
+            if not line:
+                break
+            try:
+                if int(line.split(b',', 1)[0]) >= target_timestamp:
+                    return pos
+            except ValueError:
+                continue
+        # Same as find_offset(), return the start of data if no timestamp equal to or greater than the target was found
+        return header_end_offset
+
     def _safe_write(self, data: bytes):
         try:
             self.wfile.write(data)
@@ -158,7 +231,11 @@ class SingleFileHTTPRequestHandler(http.server.SimpleHTTPRequestHandler):
                         last_timestamp_in_file = int(mmap_file.readline().split(b',', 1)[0])
                 except Exception:
                     pass
-                start = header_end if from_timestamp is None else self.find_offset(mmap_file, header_end, from_timestamp)
+                start = header_end
+                if from_timestamp is not None:
+                    start = self.find_offset_from_index(csv_path, mmap_file, header_end, from_timestamp)
+                    if start is None:
+                        start = self.find_offset(mmap_file, header_end, from_timestamp)
                 print(f"Start position for mmap: {start}")
 
                 # If the start position is beyond the file size, return the header
@@ -287,6 +364,9 @@ class SingleFileHTTPRequestHandler(http.server.SimpleHTTPRequestHandler):
                     full = os.path.join(logs_dir, name)
                     if os.path.islink(full):
                         continue
+                    # Skip the index files of the CSV files
+                    if name.endswith('.csv.idx'):
+                        continue
                     if not os.path.isfile(full):
                         continue
                     real = os.path.realpath(full)
@@ -39,6 +39,7 @@ CLEAN_INSTALL=false
 DEBUG_SYMBOLS=false
 E2AP_VERSION="E2AP_V3"        # E2AP_V1, E2AP_V2, E2AP_V3
 KPM_VERSION="KPM_V3_00"       # KPM_V2_03, KPM_V3_00
+XAPP_DB="NONE_XAPP"           # NONE_XAPP, SQLITE3_XAPP (store all xApp indications in an SQLite database)
 E2_TERM_PORT=36421            # Ensure this matches the gNodeB's full_install.sh E2_TERM_PORT. Default is 36421, which will result in no modification
 E2_TERM_PORT_SUBSTITUTE=36423 # If E2_TERM_PORT is used already, substitute it before replacing with E2_TERM_PORT
 APTVARS="NEEDRESTART_MODE=l NEEDRESTART_SUSPEND=1 DEBIAN_FRONTEND=noninteractive"
@@ -157,7 +158,7 @@ PREFIX_DIR="${FLEXRIC_LIBRARY_DIR%/lib/flexric*}"
 if [[ "$PREFIX_DIR" != /* ]]; then
     PREFIX_DIR="$SCRIPT_DIR/$PREFIX_DIR"
 fi
-CC=gcc CXX=g++ cmake .. -DCMAKE_INSTALL_PREFIX="$PREFIX_DIR" -DXAPP_DB=NONE_XAPP -DE2AP_VERSION=$E2AP_VERSION -DKPM_VERSION=$KPM_VERSION $ADDITIONAL_FLAGS
+CC=gcc CXX=g++ cmake .. -DCMAKE_INSTALL_PREFIX="$PREFIX_DIR" -DXAPP_DB=$XAPP_DB -DE2AP_VERSION=$E2AP_VERSION -DKPM_VERSION=$KPM_VERSION $ADDITIONAL_FLAGS
 make -j$(nproc)
 
 echo "Installing FlexRIC..."
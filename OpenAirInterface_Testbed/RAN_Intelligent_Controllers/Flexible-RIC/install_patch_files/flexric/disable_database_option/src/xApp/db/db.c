@@ -0,0 +1,237 @@
+/*
+ * SPDX-License-Identifier: LicenseRef-CSSL-1.0
+ */
+
+#include "db.h"
+#include "db_generic.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct{
+  global_e2_node_id_t id;
+  sm_ag_if_rd_t rd;
+} db_row_t;
+
+// Only the DB thread pops rows
+static
+_Thread_local db_row_t popped_row;
+
+static
+void* create_row(void* it)
+{
+  if(it == NULL)
+    return NULL;
+
+  memcpy(&popped_row, it, sizeof(db_row_t));
+  return &popped_row;
+}
+
+static
+void free_row(void* it)
+{
+  assert(it != NULL);
+  db_row_t* row = (db_row_t*)it;
+  free_global_e2_node_id(&row->id);
+  free_sm_ag_if_rd(&row->rd);
+}
+
+static
+size_t conf_from_env(char const* name, size_t def, size_t min, size_t max)
+{
+  char const* str = getenv(name);
+  if(str == NULL || *str == '\0')
+    return def;
+
+  char* end = NULL;
+  unsigned long long v = strtoull(str, &end, 10);
+  if(*end != '\0' || v < min || v > max){
+    printf("[xApp]: Invalid %s = %s, using %zu\n", name, str, def);
+    return def;
+  }
+  return v;
+}
+
+#ifdef SQLITE3_XAPP
+static
+void exec_sql(sqlite3* handler, char const* sql)
+{
+  char* err = NULL;
+  int rc = sqlite3_exec(handler, sql, NULL, NULL, &err);
+  if(rc != SQLITE_OK){
+    fprintf(stderr, "[xApp]: DB error in \"%s\": %s\n", sql, err != NULL ? err : sqlite3_errstr(rc));
+    sqlite3_free(err);
+  }
+}
+#endif
+
+// Waits until a row is queued, the writer stops or the deadline passes.
+// Returns whether a row can be popped.
+static
+bool wait_for_row(db_xapp_t* db, struct timespec const* deadline)
+{
+  pthread_mutex_lock(&db->batch_mtx);
+  // Set before checking the queue: a producer that pushes after the check
+  // sees it and signals, and cannot signal before the wait starts, since it
+  // takes batch_mtx to do so
+  atomic_store(&db->waiting, true);
+  int rc = 0;
+  while(size_tsnq(&db->q) == 0 && !db->stop && rc != ETIMEDOUT)
+    rc = pthread_cond_timedwait(&db->batch_cv, &db->batch_mtx, deadline);
+  atomic_store_explicit(&db->waiting, false, memory_order_relaxed);
+  bool const ready = size_tsnq(&db->q) > 0 && !db->stop;
+  pthread_mutex_unlock(&db->batch_mtx);
+  return ready;
+}
+
+// Group commit: every transaction holds up to batch_max_rows rows. Once the
+// queue drains, the transaction stays open for at most batch_max_ms, so that
+// the rows of the following indications can still join it
+static
+void* worker_thread(void* arg)
+{
+  db_xapp_t* db = (db_xapp_t*)arg;
+
+  while(true){
+    db_row_t* row = wait_and_pop_tsnq(&db->q, create_row);
+    if(row == NULL)
+      break;
+
+#ifdef SQLITE3_XAPP
+    exec_sql(db->handler, "BEGIN TRANSACTION;");
+#endif
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += db->batch_max_ms / 1000;
+    deadline.tv_nsec += (db->batch_max_ms % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000){
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000;
+    }
+    size_t rows = 0;
+    while(row != NULL){
+      write_db_gen(db->handler, &row->id, &row->rd);
+      free_row(row);
+      row = NULL;
+      ++rows;
+
+      if(rows == db->batch_max_rows)
+        break;
+
+      // Single consumer, so the pop does not block if a row is queued
+      if(wait_for_row(db, &deadline))
+        row = wait_and_pop_tsnq(&db->q, create_row);
+    }
+#ifdef SQLITE3_XAPP
+    exec_sql(db->handler, "COMMIT;");
+#endif
+
+    atomic_fetch_add_explicit(&db->written, rows, memory_order_relaxed);
+  }
+  db->q.stopped = true;
+
+  return NULL;
+}
+
+void init_db_xapp(db_xapp_t* db, char const* db_filename)
+{
+  assert(db != NULL);
+
+  db->queue_max = conf_from_env("XAPP_DB_QUEUE_MAX", 8192, 1, 1 << 24);
+  db->batch_max_rows = conf_from_env("XAPP_DB_BATCH_ROWS", 512, 1, 1 << 20);
+  db->batch_max_ms = conf_from_env("XAPP_DB_BATCH_MS", 100, 0, 60000);
+  atomic_init(&db->written, 0);
+  atomic_init(&db->dropped, 0);
+
+  init_db_gen(&db->handler, db_filename);
+
+#ifdef SQLITE3_XAPP
+  // With WAL, a commit appends to the log instead of rewriting the database,
+  // and synchronous=NORMAL only syncs the log at checkpoints
+  exec_sql(db->handler, "PRAGMA journal_mode=WAL;");
+  exec_sql(db->handler, "PRAGMA synchronous=NORMAL;");
+  printf("[xApp]: DB transactions of up to %zu rows or %" PRId64 " ms, queue of %zu rows\n",
+         db->batch_max_rows, db->batch_max_ms, db->queue_max);
+#endif
+
+  // The transaction deadline is taken from the monotonic clock
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&db->batch_cv, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&db->batch_mtx, NULL);
+  atomic_init(&db->waiting, false);
+  db->stop = false;
+
+  init_tsnq(&db->q, sizeof(db_row_t));
+  int rc = pthread_create(&db->p, NULL, worker_thread, db);
+  assert(rc == 0);
+}
+
+void close_db_xapp(db_xapp_t* db)
+{
+  assert(db != NULL);
+
+  // Ends the open transaction instead of waiting for its deadline
+  pthread_mutex_lock(&db->batch_mtx);
+  db->stop = true;
+  pthread_cond_signal(&db->batch_cv);
+  pthread_mutex_unlock(&db->batch_mtx);
+
+  free_tsnq(&db->q, free_row);
+  int rc = pthread_join(db->p, NULL);
+  assert(rc == 0);
+
+  pthread_cond_destroy(&db->batch_cv);
+  pthread_mutex_destroy(&db->batch_mtx);
+
+  close_db_gen(db->handler);
+
+#ifdef SQLITE3_XAPP
+  printf("[xApp]: DB rows written = %" PRIu64 ", dropped = %" PRIu64 "\n",
+         atomic_load(&db->written), atomic_load(&db->dropped));
+#endif
+}
+
+void write_db_xapp(db_xapp_t* db, global_e2_node_id_t const* id, sm_ag_if_rd_t const* rd)
+{
+  assert(db != NULL);
+  assert(id != NULL);
+  assert(rd != NULL);
+
+#ifdef NONE_XAPP
+  // Nothing is stored, so do not copy the indication
+  (void)db;
+  (void)id;
+  (void)rd;
+#else
+  // Drop the indication rather than let the queue grow without bound if the
+  // disk cannot keep up
+  if(size_tsnq(&db->q) >= db->queue_max){
+    uint64_t const dropped = atomic_fetch_add_explicit(&db->dropped, 1, memory_order_relaxed) + 1;
+    if(dropped == 1 || dropped % 1000 == 0)
+      printf("[xApp]: DB queue full, %" PRIu64 " rows dropped\n", dropped);
+    return;
+  }
+
+  db_row_t row = {.id = cp_global_e2_node_id(id),
+                  .rd = cp_sm_ag_if_rd(rd) };
+  push_tsnq(&db->q, &row, sizeof(db_row_t));
+
+  // The DB thread only waits once the queue has drained, while it keeps a
+  // transaction open for more rows, so only the rows queued while it waits
+  // need to wake it
+  if(atomic_load(&db->waiting)){
+    pthread_mutex_lock(&db->batch_mtx);
+    pthread_cond_signal(&db->batch_cv);
+    pthread_mutex_unlock(&db->batch_mtx);
+  }
+#endif
+}
+
@@ -0,0 +1,720 @@
+#include "kpm_capture.h"
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void buf_reserve(kpm_capture_buf_t *b, size_t extra) {
+  if (b->len + extra <= b->cap)
+    return;
+  size_t new_cap = b->cap ? b->cap : 4096;
+  while (new_cap < b->len + extra)
+    new_cap *= 2;
+  b->data = realloc(b->data, new_cap);
+  assert(b->data != NULL && "Memory exhausted");
+  b->cap = new_cap;
+}
+
+static void buf_put(kpm_capture_buf_t *b, const void *src, size_t n) {
+  buf_reserve(b, n);
+  memcpy(b->data + b->len, src, n);
+  b->len += n;
+}
+
+static void buf_put_u8(kpm_capture_buf_t *b, uint8_t v) {
+  buf_put(b, &v, sizeof(v));
+}
+
+static void buf_put_u16(kpm_capture_buf_t *b, uint16_t v) {
+  buf_put(b, &v, sizeof(v));
+}
+
+static void buf_put_u32(kpm_capture_buf_t *b, uint32_t v) {
+  buf_put(b, &v, sizeof(v));
+}
+
+static void buf_put_f64(kpm_capture_buf_t *b, double v) {
+  buf_put(b, &v, sizeof(v));
+}
+
+// Zigzag varint, so that small counters (most distribution bins are 0) take a single byte
+static void buf_put_varint(kpm_capture_buf_t *b, int64_t v) {
+  uint64_t z = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+  buf_reserve(b, 10);
+  while (z >= 0x80) {
+    b->data[b->len++] = (uint8_t)(z | 0x80);
+    z >>= 7;
+  }
+  b->data[b->len++] = (uint8_t)z;
+}
+
+static void buf_put_str(kpm_capture_buf_t *b, const char *s) {
+  size_t len = strlen(s);
+  if (len >= KPM_CAPTURE_SAME_E2_NODE_ID)
+    len = KPM_CAPTURE_SAME_E2_NODE_ID - 1;
+  buf_put_u16(b, (uint16_t)len);
+  buf_put(b, s, len);
+}
+
+static void *writer_thread(void *arg) {
+  kpm_capture_t *cap = (kpm_capture_t *)arg;
+  pthread_mutex_lock(&cap->mtx);
+  while (true) {
+    while (cap->pending.len == 0 && !cap->stop)
+      pthread_cond_wait(&cap->cv, &cap->mtx);
+    // Stopped and drained
+    if (cap->pending.len == 0)
+      break;
+
+    kpm_capture_buf_t const tmp = cap->writing;
+    cap->writing = cap->pending;
+    cap->pending = tmp;
+    pthread_mutex_unlock(&cap->mtx);
+
+    // Whole blocks are flushed at once, so that a reader of a capture being written only sees complete blocks
+    fwrite(cap->writing.data, 1, cap->writing.len, cap->file);
+    fflush(cap->file);
+    cap->writing.len = 0;
+
+    pthread_mutex_lock(&cap->mtx);
+  }
+  pthread_mutex_unlock(&cap->mtx);
+  return NULL;
+}
+
+// Hands the block encoded in cap->out to the writer thread. Returns false if it was dropped.
+static bool write_block(kpm_capture_t *cap, kpm_capture_block_e type) {
+  uint32_t hdr[2] = {(uint32_t)type, (uint32_t)cap->out.len};
+  size_t const block_len = sizeof(hdr) + cap->out.len;
+  bool queued = true;
+
+  pthread_mutex_lock(&cap->mtx);
+  if (type == KPM_CAPTURE_BLOCK_ROWS && cap->pending.len + block_len > KPM_CAPTURE_MAX_PENDING_BYTES) {
+    queued = false;
+  } else {
+    buf_put(&cap->pending, hdr, sizeof(hdr));
+    buf_put(&cap->pending, cap->out.data, cap->out.len);
+    pthread_cond_signal(&cap->cv);
+  }
+  pthread_mutex_unlock(&cap->mtx);
+
+  if (queued)
+    cap->bytes_written += block_len;
+  cap->out.len = 0;
+  return queued;
+}
+
+bool kpm_capture_open(kpm_capture_t *cap, const char *path, bool is_cell) {
+  memset(cap, 0, sizeof(*cap));
+  cap->file = fopen(path, "wb");
+  if (cap->file == NULL) {
+    fprintf(stderr, "Failed to open KPM capture file: %s\n", path);
+    return false;
+  }
+  cap->is_cell = is_cell;
+
+  uint32_t version = KPM_CAPTURE_VERSION;
+  uint32_t flags = is_cell ? KPM_CAPTURE_FLAG_CELL : 0;
+  fwrite(KPM_CAPTURE_MAGIC, 1, strlen(KPM_CAPTURE_MAGIC), cap->file);
+  fwrite(&version, sizeof(version), 1, cap->file);
+  fwrite(&flags, sizeof(flags), 1, cap->file);
+  fflush(cap->file);
+  cap->bytes_written = strlen(KPM_CAPTURE_MAGIC) + sizeof(version) + sizeof(flags);
+
+  int rc = pthread_mutex_init(&cap->mtx, NULL);
+  assert(rc == 0);
+  rc = pthread_cond_init(&cap->cv, NULL);
+  assert(rc == 0);
+  rc = pthread_create(&cap->writer, NULL, writer_thread, cap);
+  assert(rc == 0);
+  return true;
+}
+
+static kpm_capture_column_t *add_row_col(kpm_capture_row_t *row, kpm_capture_col_kind_e kind, const char *name,
+                                         const char *unit, uint32_t nbins) {
+  if (row->ncols == row->cols_cap) {
+    row->cols_cap = row->cols_cap ? row->cols_cap * 2 : 32;
+    row->cols = realloc(row->cols, row->cols_cap * sizeof(kpm_capture_column_t));
+    assert(row->cols != NULL && "Memory exhausted");
+  }
+  kpm_capture_column_t *col = &row->cols[row->ncols++];
+  memset(col, 0, sizeof(*col));
+  col->kind = kind;
+  snprintf(col->name, sizeof(col->name), "%s", name ? name : "");
+  snprintf(col->unit, sizeof(col->unit), "%s", unit ? unit : "");
+  col->nbins = nbins;
+
+  if (row->nvalues + nbins > row->values_cap) {
+    while (row->nvalues + nbins > row->values_cap)
+      row->values_cap = row->values_cap ? row->values_cap * 2 : 256;
+    row->values = realloc(row->values, row->values_cap * sizeof(kpm_capture_value_t));
+    assert(row->values != NULL && "Memory exhausted");
+  }
+  return col;
+}
+
+void kpm_capture_add_int(kpm_capture_row_t *row, const char *name, const char *unit, int64_t val) {
+  add_row_col(row, KPM_CAPTURE_COL_INT, name, unit, 1);
+  kpm_capture_value_t *v = &row->values[row->nvalues++];
+  v->tag = KPM_CAPTURE_VAL_INT;
+  v->int_val = val;
+}
+
+void kpm_capture_add_real(kpm_capture_row_t *row, const char *name, const char *unit, double val) {
+  add_row_col(row, KPM_CAPTURE_COL_REAL, name, unit, 1);
+  kpm_capture_value_t *v = &row->values[row->nvalues++];
+  v->tag = KPM_CAPTURE_VAL_REAL;
+  v->real_val = val;
+}
+
+void kpm_capture_add_array(kpm_capture_row_t *row, const char *name, const char *unit,
+                           const label_info_lst_t *label_info_lst, size_t label_info_lst_len,
+                           const meas_record_lst_t *meas_record_lst, size_t rec_idx_start) {
+  kpm_capture_column_t *col = add_row_col(row, KPM_CAPTURE_COL_ARRAY, name, unit, (uint32_t)label_info_lst_len);
+  col->has_x = label_info_lst_len > 0 && label_info_lst[0].distBinX != NULL;
+  col->has_y = label_info_lst_len > 0 && label_info_lst[0].distBinY != NULL;
+  col->has_z = label_info_lst_len > 0 && label_info_lst[0].distBinZ != NULL;
+  col->src_labels = label_info_lst;
+
+  for (size_t i = 0; i < label_info_lst_len; i++) {
+    const meas_record_lst_t *rec = &meas_record_lst[rec_idx_start + i];
+    kpm_capture_value_t *v = &row->values[row->nvalues++];
+    if (rec->value == INTEGER_MEAS_VALUE) {
+      v->tag = KPM_CAPTURE_VAL_INT;
+      v->int_val = rec->int_val;
+    } else if (rec->value == REAL_MEAS_VALUE) {
+      v->tag = KPM_CAPTURE_VAL_REAL;
+      v->real_val = rec->real_val;
+    } else {
+      v->tag = KPM_CAPTURE_VAL_NULL;
+      v->int_val = 0;
+    }
+  }
+}
+
+static uint32_t label_bin(const label_info_lst_t *label, size_t axis) {
+  const uint32_t *src = axis == 0 ? label->distBinX : axis == 1 ? label->distBinY : label->distBinZ;
+  return src ? *src : 0;
+}
+
+// The bin labels are part of the schema: a distribution reported with other bins needs a new one
+static bool bins_match(const kpm_capture_column_t *col, const label_info_lst_t *labels) {
+  if (col->nbins == 0)
+    return true;
+  if (col->has_x != (labels[0].distBinX != NULL) || col->has_y != (labels[0].distBinY != NULL) ||
+      col->has_z != (labels[0].distBinZ != NULL))
+    return false;
+  for (uint32_t j = 0; j < col->nbins; j++) {
+    if (label_bin(&labels[j], 0) != col->bin_x[j] || label_bin(&labels[j], 1) != col->bin_y[j] ||
+        label_bin(&labels[j], 2) != col->bin_z[j])
+      return false;
+  }
+  return true;
+}
+
+static bool row_matches_schema(const kpm_capture_row_t *row, const kpm_capture_schema_t *schema) {
+  if (schema->ncols != row->ncols)
+    return false;
+  for (size_t i = 0; i < schema->ncols; i++) {
+    const kpm_capture_column_t *a = &schema->cols[i];
+    const kpm_capture_column_t *b = &row->cols[i];
+    if (a->kind != b->kind || a->nbins != b->nbins || strcmp(a->name, b->name) != 0 || strcmp(a->unit, b->unit) != 0)
+      return false;
+    if (a->kind == KPM_CAPTURE_COL_ARRAY && !bins_match(a, b->src_labels))
+      return false;
+  }
+  return true;
+}
+
+static void put_schema(kpm_capture_buf_t *b, const kpm_capture_schema_t *schema) {
+  buf_put_u32(b, schema->id);
+  buf_put_u32(b, (uint32_t)schema->ncols);
+  for (size_t i = 0; i < schema->ncols; i++) {
+    const kpm_capture_column_t *col = &schema->cols[i];
+    buf_put_u8(b, (uint8_t)col->kind);
+    buf_put_u8(b, (uint8_t)((col->has_x ? 0x1 : 0) | (col->has_y ? 0x2 : 0) | (col->has_z ? 0x4 : 0)));
+    buf_put_u32(b, col->nbins);
+    buf_put_str(b, col->name);
+    buf_put_str(b, col->unit);
+    if (col->kind == KPM_CAPTURE_COL_ARRAY) {
+      for (uint32_t j = 0; j < col->nbins; j++) {
+        buf_put_u32(b, col->has_x ? col->bin_x[j] : 0);
+        buf_put_u32(b, col->has_y ? col->bin_y[j] : 0);
+        buf_put_u32(b, col->has_z ? col->bin_z[j] : 0);
+      }
+    }
+  }
+}
+
+static kpm_capture_schema_t *append_schema(kpm_capture_schema_t **schemas, size_t *num_schemas) {
+  *schemas = realloc(*schemas, (*num_schemas + 1) * sizeof(kpm_capture_schema_t));
+  assert(*schemas != NULL && "Memory exhausted");
+  kpm_capture_schema_t *schema = &(*schemas)[*num_schemas];
+  memset(schema, 0, sizeof(*schema));
+  schema->id = (uint32_t)*num_schemas;
+  (*num_schemas)++;
+  return schema;
+}
+
+static uint32_t *copy_bins(const label_info_lst_t *labels, uint32_t n, size_t axis) {
+  uint32_t *bins = calloc(n ? n : 1, sizeof(uint32_t));
+  assert(bins != NULL && "Memory exhausted");
+  for (uint32_t j = 0; j < n; j++)
+    bins[j] = label_bin(&labels[j], axis);
+  return bins;
+}
+
+static const kpm_capture_schema_t *schema_for_row(kpm_capture_t *cap, const kpm_capture_row_t *row) {
+  if (cap->active_schema && row_matches_schema(row, cap->active_schema))
+    return cap->active_schema;
+  for (size_t i = 0; i < cap->num_schemas; i++) {
+    if (row_matches_schema(row, &cap->schemas[i]))
+      return &cap->schemas[i];
+  }
+
+  // The schemas array may move, so the active schema is re-resolved by ID
+  uint32_t active_id = cap->active_schema ? cap->active_schema->id : 0;
+  kpm_capture_schema_t *schema = append_schema(&cap->schemas, &cap->num_schemas);
+  if (cap->active_schema)
+    cap->active_schema = &cap->schemas[active_id];
+
+  schema->ncols = row->ncols;
+  schema->cols = calloc(schema->ncols ? schema->ncols : 1, sizeof(kpm_capture_column_t));
+  assert(schema->cols != NULL && "Memory exhausted");
+  for (size_t i = 0; i < schema->ncols; i++) {
+    kpm_capture_column_t *col = &schema->cols[i];
+    *col = row->cols[i];
+    col->src_labels = NULL;
+    if (col->kind == KPM_CAPTURE_COL_ARRAY) {
+      col->bin_x = copy_bins(row->cols[i].src_labels, col->nbins, 0);
+      col->bin_y = copy_bins(row->cols[i].src_labels, col->nbins, 1);
+      col->bin_z = copy_bins(row->cols[i].src_labels, col->nbins, 2);
+    }
+    schema->row_width += col->nbins;
+  }
+
+  // Rows of the previous schema must be written before the block that refers to the new one
+  kpm_capture_flush(cap);
+  put_schema(&cap->out, schema);
+  write_block(cap, KPM_CAPTURE_BLOCK_SCHEMA);
+  return schema;
+}
+
+static kpm_capture_encoding_e column_encoding(const kpm_capture_t *cap, size_t offset, uint32_t nbins) {
+  const kpm_capture_schema_t *schema = cap->active_schema;
+  bool all_int = true;
+  bool all_real = true;
+  for (size_t r = 0; r < cap->block_nrows; r++) {
+    const kpm_capture_value_t *vals = &cap->block_values[r * schema->row_width + offset];
+    for (uint32_t j = 0; j < nbins; j++) {
+      all_int &= vals[j].tag == KPM_CAPTURE_VAL_INT;
+      all_real &= vals[j].tag == KPM_CAPTURE_VAL_REAL;
+    }
+  }
+  if (all_int)
+    return KPM_CAPTURE_ENC_VARINT;
+  if (all_real)
+    return KPM_CAPTURE_ENC_FLOAT64;
+  return KPM_CAPTURE_ENC_TAGGED;
+}
+
+void kpm_capture_flush(kpm_capture_t *cap) {
+  if (cap->file == NULL || cap->block_nrows == 0)
+    return;
+
+  const kpm_capture_schema_t *schema = cap->active_schema;
+  kpm_capture_buf_t *b = &cap->out;
+  size_t const n = cap->block_nrows;
+
+  buf_put_u32(b, schema->id);
+  buf_put_u32(b, (uint32_t)n);
+
+  // Row metadata columns. Timestamps and batch IDs are delta encoded against the previous row of the block, and an
+  // E2 node ID equal to the one of the previous row is only written as KPM_CAPTURE_SAME_E2_NODE_ID.
+  for (size_t r = 0; r < n; r++)
+    buf_put_varint(b, cap->block_infos[r].arrival_ms - (r > 0 ? cap->block_infos[r - 1].arrival_ms : 0));
+  for (size_t r = 0; r < n; r++)
+    buf_put_varint(b, cap->block_infos[r].batch_id - (r > 0 ? cap->block_infos[r - 1].batch_id : 0));
+  for (size_t r = 0; r < n; r++) {
+    int64_t offset = cap->block_infos[r].reporting_offset_ms;
+    buf_put_u8(b, offset != KPM_CAPTURE_NO_OFFSET);
+    if (offset != KPM_CAPTURE_NO_OFFSET)
+      buf_put_varint(b, offset);
+  }
+  for (size_t r = 0; r < n; r++)
+    buf_put_varint(b, cap->block_infos[r].latency_ms);
+  for (size_t r = 0; r < n; r++)
+    buf_put_varint(b, (int64_t)cap->block_infos[r].ue_id);
+  for (size_t r = 0; r < n; r++) {
+    if (r > 0 && strcmp(cap->block_infos[r].e2_node_id, cap->block_infos[r - 1].e2_node_id) == 0)
+      buf_put_u16(b, KPM_CAPTURE_SAME_E2_NODE_ID);
+    else
+      buf_put_str(b, cap->block_infos[r].e2_node_id);
+  }
+
+  // Measurement columns
+  size_t offset = 0;
+  for (size_t c = 0; c < schema->ncols; c++) {
+    uint32_t const nbins = schema->cols[c].nbins;
+    kpm_capture_encoding_e const enc = column_encoding(cap, offset, nbins);
+    buf_put_u8(b, (uint8_t)enc);
+    for (size_t r = 0; r < n; r++) {
+      const kpm_capture_value_t *vals = &cap->block_values[r * schema->row_width + offset];
+      for (uint32_t j = 0; j < nbins; j++) {
+        if (enc == KPM_CAPTURE_ENC_TAGGED)
+          buf_put_u8(b, vals[j].tag);
+        if (vals[j].tag == KPM_CAPTURE_VAL_INT)
+          buf_put_varint(b, vals[j].int_val);
+        else if (vals[j].tag == KPM_CAPTURE_VAL_REAL)
+          buf_put_f64(b, vals[j].real_val);
+      }
+    }
+    offset += nbins;
+  }
+
+  if (write_block(cap, KPM_CAPTURE_BLOCK_ROWS))
+    cap->rows_written += n;
+  else
+    cap->rows_dropped += n;
+  cap->block_nrows = 0;
+}
+
+void kpm_capture_discard_row(kpm_capture_row_t *row) {
+  row->ncols = 0;
+  row->nvalues = 0;
+}
+
+void kpm_capture_row_free(kpm_capture_row_t *row) {
+  free(row->cols);
+  free(row->values);
+  memset(row, 0, sizeof(*row));
+}
+
+void kpm_capture_end_row(kpm_capture_t *cap, kpm_capture_row_t *row, const kpm_capture_row_info_t *info) {
+  if (cap->file == NULL) {
+    kpm_capture_discard_row(row);
+    return;
+  }
+
+  const kpm_capture_schema_t *schema = schema_for_row(cap, row);
+  if (schema != cap->active_schema) {
+    kpm_capture_flush(cap);
+    cap->active_schema = schema;
+  } else if (cap->block_nrows > 0 &&
+             info->arrival_ms - cap->block_infos[0].arrival_ms >= KPM_CAPTURE_MAX_BLOCK_AGE_MS) {
+    kpm_capture_flush(cap);
+  }
+
+  if (cap->block_infos == NULL) {
+    cap->block_infos = calloc(KPM_CAPTURE_MAX_ROWS_PER_BLOCK, sizeof(kpm_capture_row_info_t));
+    assert(cap->block_infos != NULL && "Memory exhausted");
+  }
+  size_t const needed = KPM_CAPTURE_MAX_ROWS_PER_BLOCK * schema->row_width;
+  if (needed > cap->block_values_cap) {
+    cap->block_values = realloc(cap->block_values, needed * sizeof(kpm_capture_value_t));
+    assert(cap->block_values != NULL && "Memory exhausted");
+    cap->block_values_cap = needed;
+  }
+
+  cap->block_infos[cap->block_nrows] = *info;
+  memcpy(&cap->block_values[cap->block_nrows * schema->row_width], row->values,
+         schema->row_width * sizeof(kpm_capture_value_t));
+  cap->block_nrows++;
+  kpm_capture_discard_row(row);
+
+  if (cap->block_nrows == KPM_CAPTURE_MAX_ROWS_PER_BLOCK)
+    kpm_capture_flush(cap);
+}
+
+static void free_schemas(kpm_capture_schema_t *schemas, size_t num_schemas) {
+  for (size_t i = 0; i < num_schemas; i++) {
+    for (size_t c = 0; c < schemas[i].ncols; c++) {
+      free(schemas[i].cols[c].bin_x);
+      free(schemas[i].cols[c].bin_y);
+      free(schemas[i].cols[c].bin_z);
+    }
+    free(schemas[i].cols);
+  }
+  free(schemas);
+}
+
+void kpm_capture_close(kpm_capture_t *cap) {
+  if (cap->file != NULL) {
+    kpm_capture_flush(cap);
+    pthread_mutex_lock(&cap->mtx);
+    cap->stop = true;
+    pthread_cond_signal(&cap->cv);
+    pthread_mutex_unlock(&cap->mtx);
+    pthread_join(cap->writer, NULL);
+    pthread_cond_destroy(&cap->cv);
+    pthread_mutex_destroy(&cap->mtx);
+    fclose(cap->file);
+    cap->file = NULL;
+  }
+  free_schemas(cap->schemas, cap->num_schemas);
+  free(cap->block_infos);
+  free(cap->block_values);
+  free(cap->out.data);
+  free(cap->pending.data);
+  free(cap->writing.data);
+  memset(cap, 0, sizeof(*cap));
+}
+
+//
+// Reader
+//
+
+typedef struct {
+  const uint8_t *p;
+  const uint8_t *end;
+  bool ok;
+} cursor_t;
+
+static bool cur_get(cursor_t *c, void *dst, size_t n) {
+  if (!c->ok || (size_t)(c->end - c->p) < n) {
+    c->ok = false;
+    memset(dst, 0, n);
+    return false;
+  }
+  memcpy(dst, c->p, n);
+  c->p += n;
+  return true;
+}
+
+static uint8_t cur_u8(cursor_t *c) {
+  uint8_t v;
+  cur_get(c, &v, sizeof(v));
+  return v;
+}
+
+static uint16_t cur_u16(cursor_t *c) {
+  uint16_t v;
+  cur_get(c, &v, sizeof(v));
+  return v;
+}
+
+static uint32_t cur_u32(cursor_t *c) {
+  uint32_t v;
+  cur_get(c, &v, sizeof(v));
+  return v;
+}
+
+static double cur_f64(cursor_t *c) {
+  double v;
+  cur_get(c, &v, sizeof(v));
+  return v;
+}
+
+static int64_t cur_varint(cursor_t *c) {
+  uint64_t z = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t byte = cur_u8(c);
+    if (!c->ok)
+      return 0;
+    z |= (uint64_t)(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0)
+      return (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+  }
+  c->ok = false;
+  return 0;
+}
+
+static void cur_str(cursor_t *c, char *dst, size_t dst_size) {
+  uint16_t len = cur_u16(c);
+  if (!c->ok || (size_t)(c->end - c->p) < len) {
+    c->ok = false;
+    dst[0] = '\0';
+    return;
+  }
+  size_t copy = len < dst_size - 1 ? len : dst_size - 1;
+  memcpy(dst, c->p, copy);
+  dst[copy] = '\0';
+  c->p += len;
+}
+
+bool kpm_capture_reader_open(kpm_capture_reader_t *rd, const char *path) {
+  memset(rd, 0, sizeof(*rd));
+  rd->file = fopen(path, "rb");
+  if (rd->file == NULL) {
+    fprintf(stderr, "Failed to open KPM capture file: %s\n", path);
+    return false;
+  }
+
+  char magic[8];
+  uint32_t version = 0, flags = 0;
+  if (fread(magic, 1, sizeof(magic), rd->file) != sizeof(magic) ||
+      memcmp(magic, KPM_CAPTURE_MAGIC, sizeof(magic)) != 0 || fread(&version, sizeof(version), 1, rd->file) != 1 ||
+      fread(&flags, sizeof(flags), 1, rd->file) != 1) {
+    fprintf(stderr, "Not a KPM capture file: %s\n", path);
+    fclose(rd->file);
+    rd->file = NULL;
+    return false;
+  }
+  if (version != KPM_CAPTURE_VERSION) {
+    fprintf(stderr, "Unsupported KPM capture version %u in %s\n", version, path);
+    fclose(rd->file);
+    rd->file = NULL;
+    return false;
+  }
+  rd->is_cell = (flags & KPM_CAPTURE_FLAG_CELL) != 0;
+  return true;
+}
+
+static bool read_schema_block(kpm_capture_reader_t *rd, cursor_t *c) {
+  uint32_t id = cur_u32(c);
+  uint32_t ncols = cur_u32(c);
+  if (!c->ok || id != rd->num_schemas || ncols > (size_t)(c->end - c->p))
+    return false;
+
+  // The current schema pointer may move with the array
+  size_t active_idx = rd->schema ? (size_t)(rd->schema - rd->schemas) : 0;
+  kpm_capture_schema_t *schema = append_schema(&rd->schemas, &rd->num_schemas);
+  if (rd->schema)
+    rd->schema = &rd->schemas[active_idx];
+
+  schema->ncols = ncols;
+  schema->cols = calloc(ncols ? ncols : 1, sizeof(kpm_capture_column_t));
+  assert(schema->cols != NULL && "Memory exhausted");
+  for (uint32_t i = 0; i < ncols && c->ok; i++) {
+    kpm_capture_column_t *col = &schema->cols[i];
+    col->kind = (kpm_capture_col_kind_e)cur_u8(c);
+    uint8_t axes = cur_u8(c);
+    col->has_x = axes & 0x1;
+    col->has_y = axes & 0x2;
+    col->has_z = axes & 0x4;
+    col->nbins = cur_u32(c);
+    cur_str(c, col->name, sizeof(col->name));
+    cur_str(c, col->unit, sizeof(col->unit));
+    if (col->kind == KPM_CAPTURE_COL_ARRAY) {
+      if (col->nbins > (size_t)(c->end - c->p) / 12)
+        return false;
+      col->bin_x = calloc(col->nbins ? col->nbins : 1, sizeof(uint32_t));
+      col->bin_y = calloc(col->nbins ? col->nbins : 1, sizeof(uint32_t));
+      col->bin_z = calloc(col->nbins ? col->nbins : 1, sizeof(uint32_t));
+      assert(col->bin_x != NULL && col->bin_y != NULL && col->bin_z != NULL && "Memory exhausted");
+      for (uint32_t j = 0; j < col->nbins; j++) {
+        col->bin_x[j] = cur_u32(c);
+        col->bin_y[j] = cur_u32(c);
+        col->bin_z[j] = cur_u32(c);
+      }
+    } else if (col->nbins != 1) {
+      return false;
+    }
+    schema->row_width += col->nbins;
+  }
+  return c->ok;
+}
+
+static bool read_rows_block(kpm_capture_reader_t *rd, cursor_t *c) {
+  uint32_t schema_id = cur_u32(c);
+  uint32_t n = cur_u32(c);
+  if (!c->ok || schema_id >= rd->num_schemas || n > (size_t)(c->end - c->p))
+    return false;
+  const kpm_capture_schema_t *schema = &rd->schemas[schema_id];
+
+  free(rd->infos);
+  free(rd->values);
+  rd->infos = calloc(n ? n : 1, sizeof(kpm_capture_row_info_t));
+  size_t const nvalues = (size_t)n * schema->row_width;
+  rd->values = calloc(nvalues ? nvalues : 1, sizeof(kpm_capture_value_t));
+  assert(rd->infos != NULL && rd->values != NULL && "Memory exhausted");
+
+  for (uint32_t r = 0; r < n; r++)
+    rd->infos[r].arrival_ms = cur_varint(c) + (r > 0 ? rd->infos[r - 1].arrival_ms : 0);
+  for (uint32_t r = 0; r < n; r++)
+    rd->infos[r].batch_id = cur_varint(c) + (r > 0 ? rd->infos[r - 1].batch_id : 0);
+  for (uint32_t r = 0; r < n; r++)
+    rd->infos[r].reporting_offset_ms = cur_u8(c) ? cur_varint(c) : KPM_CAPTURE_NO_OFFSET;
+  for (uint32_t r = 0; r < n; r++)
+    rd->infos[r].latency_ms = cur_varint(c);
+  for (uint32_t r = 0; r < n; r++)
+    rd->infos[r].ue_id = (uint64_t)cur_varint(c);
+  for (uint32_t r = 0; r < n; r++) {
+    uint16_t len = 0;
+    if (c->ok && (size_t)(c->end - c->p) >= sizeof(len))
+      memcpy(&len, c->p, sizeof(len));
+    if (r > 0 && len == KPM_CAPTURE_SAME_E2_NODE_ID) {
+      c->p += sizeof(len);
+      memcpy(rd->infos[r].e2_node_id, rd->infos[r - 1].e2_node_id, sizeof(rd->infos[r].e2_node_id));
+    } else {
+      cur_str(c, rd->infos[r].e2_node_id, sizeof(rd->infos[r].e2_node_id));
+    }
+  }
+
+  size_t offset = 0;
+  for (size_t col = 0; col < schema->ncols && c->ok; col++) {
+    uint32_t const nbins = schema->cols[col].nbins;
+    kpm_capture_encoding_e const enc = (kpm_capture_encoding_e)cur_u8(c);
+    for (uint32_t r = 0; r < n; r++) {
+      kpm_capture_value_t *vals = &rd->values[r * schema->row_width + offset];
+      for (uint32_t j = 0; j < nbins; j++) {
+        uint8_t tag = enc == KPM_CAPTURE_ENC_TAGGED   ? cur_u8(c)
+                      : enc == KPM_CAPTURE_ENC_VARINT ? KPM_CAPTURE_VAL_INT
+                                                      : KPM_CAPTURE_VAL_REAL;
+        vals[j].tag = tag;
+        if (tag == KPM_CAPTURE_VAL_INT)
+          vals[j].int_val = cur_varint(c);
+        else if (tag == KPM_CAPTURE_VAL_REAL)
+          vals[j].real_val = cur_f64(c);
+        else
+          vals[j].int_val = 0;
+      }
+    }
+    offset += nbins;
+  }
+  if (!c->ok)
+    return false;
+
+  rd->schema = schema;
+  rd->nrows = n;
+  rd->next_row = 0;
+  return true;
+}
+
+bool kpm_capture_reader_next(kpm_capture_reader_t *rd, const kpm_capture_schema_t **schema,
+                             const kpm_capture_row_info_t **info, const kpm_capture_value_t **values) {
+  if (rd->file == NULL)
+    return false;
+
+  while (rd->next_row >= rd->nrows) {
+    uint32_t hdr[2];
+    if (fread(hdr, sizeof(hdr), 1, rd->file) != 1)
+      return false;
+
+    rd->in.len = 0;
+    buf_reserve(&rd->in, hdr[1]);
+    if (fread(rd->in.data, 1, hdr[1], rd->file) != hdr[1]) {
+      // A capture that is still being written may end in a partial block
+      fprintf(stderr, "Truncated block at the end of the KPM capture file\n");
+      return false;
+    }
+    cursor_t c = {.p = rd->in.data, .end = rd->in.data + hdr[1], .ok = true};
+
+    bool ok = true;
+    if (hdr[0] == KPM_CAPTURE_BLOCK_SCHEMA)
+      ok = read_schema_block(rd, &c);
+    else if (hdr[0] == KPM_CAPTURE_BLOCK_ROWS)
+      ok = read_rows_block(rd, &c);
+    // Unknown block types are skipped for forward compatibility
+    if (!ok) {
+      fprintf(stderr, "Malformed block of type %u in the KPM capture file\n", hdr[0]);
+      return false;
+    }
+  }
+
+  *schema = rd->schema;
+  *info = &rd->infos[rd->next_row];
+  *values = &rd->values[rd->next_row * rd->schema->row_width];
+  rd->next_row++;
+  return true;
+}
+
+void kpm_capture_reader_close(kpm_capture_reader_t *rd) {
+  if (rd->file != NULL)
+    fclose(rd->file);
+  free_schemas(rd->schemas, rd->num_schemas);
+  free(rd->infos);
+  free(rd->values);
+  free(rd->in.data);
+  memset(rd, 0, sizeof(*rd));
+}
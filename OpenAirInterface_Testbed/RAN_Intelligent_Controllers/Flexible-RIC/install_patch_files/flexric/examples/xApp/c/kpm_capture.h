@@ -0,0 +1,204 @@
+#ifndef KPM_CAPTURE_H
+#define KPM_CAPTURE_H
+
+#include "../../../src/xApp/e42_xapp_api.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Append-only, column-oriented binary capture of KPM rows.
+//
+// File layout (little-endian):
+//   "KPMCAP01" | uint32 version | uint32 flags (bit 0: cell file)
+//   followed by blocks of: uint32 block type | uint32 payload length | payload
+//
+// A SCHEMA block describes the columns of a row (name, unit, kind, and for distributions the bin labels).
+// A ROWS block holds up to KPM_CAPTURE_MAX_ROWS_PER_BLOCK rows of one schema, stored column by column.
+// Integer values are zigzag varints, real values are float64, and columns that mix value types carry a tag per value.
+// The row metadata (timestamps, batch, UE and E2 node IDs) is delta or run-length encoded within a block.
+
+#define KPM_CAPTURE_MAGIC "KPMCAP01"
+#define KPM_CAPTURE_VERSION 1
+#define KPM_CAPTURE_FLAG_CELL 0x1
+
+#define KPM_CAPTURE_MAX_ROWS_PER_BLOCK 64
+#define KPM_CAPTURE_MAX_BLOCK_AGE_MS 5000
+
+// Bytes of finished blocks that may wait for the writer thread. Beyond that, ROWS blocks are dropped (SCHEMA blocks
+// never are, as the rows that follow refer to them).
+#define KPM_CAPTURE_MAX_PENDING_BYTES (8 << 20)
+
+#define KPM_CAPTURE_NAME_LEN 128
+#define KPM_CAPTURE_UNIT_LEN 64
+
+// E2 node ID length that marks a row with the same E2 node ID as the previous row of the block
+#define KPM_CAPTURE_SAME_E2_NODE_ID UINT16_MAX
+
+typedef enum {
+  KPM_CAPTURE_BLOCK_SCHEMA = 1,
+  KPM_CAPTURE_BLOCK_ROWS = 2,
+} kpm_capture_block_e;
+
+typedef enum {
+  KPM_CAPTURE_COL_INT = 0,
+  KPM_CAPTURE_COL_REAL = 1,
+  KPM_CAPTURE_COL_ARRAY = 2,
+} kpm_capture_col_kind_e;
+
+typedef enum {
+  KPM_CAPTURE_ENC_VARINT = 0,
+  KPM_CAPTURE_ENC_FLOAT64 = 1,
+  KPM_CAPTURE_ENC_TAGGED = 2,
+} kpm_capture_encoding_e;
+
+// Value tags match meas_value_e so distributions can be handed back to format_meas_record_array()
+typedef enum {
+  KPM_CAPTURE_VAL_INT = 0,
+  KPM_CAPTURE_VAL_REAL = 1,
+  KPM_CAPTURE_VAL_NULL = 2,
+} kpm_capture_value_tag_e;
+
+typedef struct {
+  uint8_t tag;
+  union {
+    int64_t int_val;
+    double real_val;
+  };
+} kpm_capture_value_t;
+
+typedef struct {
+  kpm_capture_col_kind_e kind;
+  char name[KPM_CAPTURE_NAME_LEN];
+  char unit[KPM_CAPTURE_UNIT_LEN];
+  // Number of values of the column in each row (1 for scalars, number of bins for distributions)
+  uint32_t nbins;
+  bool has_x;
+  bool has_y;
+  bool has_z;
+  uint32_t *bin_x;
+  uint32_t *bin_y;
+  uint32_t *bin_z;
+  // Labels of the message being captured, only set while a row is being built
+  const label_info_lst_t *src_labels;
+} kpm_capture_column_t;
+
+typedef struct {
+  uint32_t id;
+  size_t ncols;
+  kpm_capture_column_t *cols;
+  // Sum of nbins over all columns
+  size_t row_width;
+} kpm_capture_schema_t;
+
+#define KPM_CAPTURE_NO_OFFSET INT64_MIN
+
+typedef struct {
+  int64_t arrival_ms;
+  int64_t batch_id;
+  // KPM_CAPTURE_NO_OFFSET when the reporting time offset is not known yet
+  int64_t reporting_offset_ms;
+  int64_t latency_ms;
+  uint64_t ue_id;
+  char e2_node_id[256];
+} kpm_capture_row_info_t;
+
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t cap;
+} kpm_capture_buf_t;
+
+// Columns and values of a row being built. Rows are owned by the caller, so threads building rows in parallel only
+// need to serialize kpm_capture_end_row().
+typedef struct {
+  kpm_capture_column_t *cols;
+  size_t ncols;
+  size_t cols_cap;
+  kpm_capture_value_t *values;
+  size_t nvalues;
+  size_t values_cap;
+} kpm_capture_row_t;
+
+typedef struct {
+  FILE *file;
+  bool is_cell;
+
+  kpm_capture_schema_t *schemas;
+  size_t num_schemas;
+
+  // Rows buffered for the next ROWS block, all of schema active_schema
+  const kpm_capture_schema_t *active_schema;
+  kpm_capture_row_info_t *block_infos;
+  kpm_capture_value_t *block_values;
+  size_t block_values_cap;
+  size_t block_nrows;
+
+  // Block being encoded
+  kpm_capture_buf_t out;
+
+  // Finished blocks are handed to a writer thread, so that building rows never waits for the disk. The thread swaps
+  // pending with writing and writes the latter without holding mtx.
+  pthread_t writer;
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;
+  kpm_capture_buf_t pending;
+  kpm_capture_buf_t writing;
+  bool stop;
+
+  // Rows and bytes handed to the writer thread, and rows dropped because too many blocks were pending
+  uint64_t rows_written;
+  uint64_t bytes_written;
+  uint64_t rows_dropped;
+} kpm_capture_t;
+
+typedef struct {
+  FILE *file;
+  bool is_cell;
+
+  kpm_capture_schema_t *schemas;
+  size_t num_schemas;
+
+  const kpm_capture_schema_t *schema;
+  kpm_capture_row_info_t *infos;
+  kpm_capture_value_t *values;
+  size_t nrows;
+  size_t next_row;
+
+  kpm_capture_buf_t in;
+} kpm_capture_reader_t;
+
+bool kpm_capture_open(kpm_capture_t *cap, const char *path, bool is_cell);
+
+void kpm_capture_add_int(kpm_capture_row_t *row, const char *name, const char *unit, int64_t val);
+
+// NaN values are stored as such and written back as empty CSV cells
+void kpm_capture_add_real(kpm_capture_row_t *row, const char *name, const char *unit, double val);
+
+void kpm_capture_add_array(kpm_capture_row_t *row, const char *name, const char *unit,
+                           const label_info_lst_t *label_info_lst, size_t label_info_lst_len,
+                           const meas_record_lst_t *meas_record_lst, size_t rec_idx_start);
+
+// Buffers the row in cap and clears it for the next one. Not thread-safe with respect to other calls on cap.
+void kpm_capture_end_row(kpm_capture_t *cap, kpm_capture_row_t *row, const kpm_capture_row_info_t *info);
+
+void kpm_capture_discard_row(kpm_capture_row_t *row);
+
+void kpm_capture_row_free(kpm_capture_row_t *row);
+
+// Hands the buffered rows to the writer thread
+void kpm_capture_flush(kpm_capture_t *cap);
+
+// Writes the pending blocks and closes the file
+void kpm_capture_close(kpm_capture_t *cap);
+
+bool kpm_capture_reader_open(kpm_capture_reader_t *rd, const char *path);
+
+// Returns false at the end of the file or on a malformed block
+bool kpm_capture_reader_next(kpm_capture_reader_t *rd, const kpm_capture_schema_t **schema,
+                             const kpm_capture_row_info_t **info, const kpm_capture_value_t **values);
+
+void kpm_capture_reader_close(kpm_capture_reader_t *rd);
+
+#endif // KPM_CAPTURE_H
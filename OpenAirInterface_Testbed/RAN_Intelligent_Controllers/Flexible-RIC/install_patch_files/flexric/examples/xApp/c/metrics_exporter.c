@@ -0,0 +1,657 @@
+#include "metrics_exporter.h"
+#include "../../../src/util/alg_ds/alg/murmur_hash_32.h"
+#include "../../../src/util/e.h"
+#include "../../../src/util/time_now_us.h"
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Families are indexed by the interned measurement name ID, followed by the name IDs of the factory outputs
+#define EXPORTER_FACTORY_BASE METRIC_FACTORY_MAX_MEAS_NAMES
+#define EXPORTER_NUM_FAMILIES (EXPORTER_FACTORY_BASE + METRIC_FACTORY_NUM_IDS * METRIC_FACTORY_MAX_OUTPUTS)
+
+// The accept loop wakes up this often to check whether the exporter was stopped
+#define EXPORTER_POLL_MS 200
+// Stale series are evicted before every scrape, and at least this often when there are no scrapes
+#define EXPORTER_EVICT_INTERVAL_US 1000000
+// Send and receive timeout of a scrape, so that a stuck client does not block the endpoint
+#define EXPORTER_IO_TIMEOUT_MS 2000
+#define EXPORTER_MAX_REQUEST 2048
+
+typedef enum {
+  EXPORTER_GAUGE = 0,
+  EXPORTER_HISTOGRAM = 1,
+} exporter_type_e;
+
+typedef struct exporter_series_s {
+  uint32_t hash;
+  uint16_t family;
+  char *node_id;
+  uint64_t ue_id;
+  bool is_cell;
+  int64_t updated_us;
+  double value;
+  // Histograms: counts per value, bucket_le points to the value table of the metric factory
+  size_t nbuckets;
+  const double *bucket_le;
+  uint64_t *bucket_counts;
+  double sum;
+  uint64_t count;
+  // Next series of the same family, in creation order
+  struct exporter_series_s *next;
+} exporter_series_t;
+
+typedef struct {
+  bool used;
+  exporter_type_e type;
+  char name[METRIC_FACTORY_COLUMN_LEN];
+  char help[METRIC_FACTORY_COLUMN_LEN];
+  exporter_series_t *head;
+  exporter_series_t *tail;
+} exporter_family_t;
+
+// Growable output buffer, reused by every scrape
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} exporter_buf_t;
+
+typedef struct {
+  // Series table, open addressing with linear probing; cap is a power of two and the table is kept at most half full
+  exporter_series_t **slots;
+  size_t cap;
+  size_t len;
+  exporter_family_t families[EXPORTER_NUM_FAMILIES];
+  // Families in the order they were first updated, so that a scrape does not walk the unused ones
+  uint16_t used_families[EXPORTER_NUM_FAMILIES];
+  size_t num_used_families;
+  pthread_mutex_t mtx;
+
+  atomic_bool enabled;
+  atomic_bool running;
+  int listen_fd;
+  pthread_t thread;
+  int64_t stale_us;
+  exporter_buf_t body;
+} exporter_t;
+
+static exporter_t exporter = {.mtx = PTHREAD_MUTEX_INITIALIZER, .listen_fd = -1};
+
+static void buf_reserve(exporter_buf_t *b, size_t extra) {
+  if (b->len + extra <= b->cap)
+    return;
+  size_t new_cap = b->cap ? b->cap : 16384;
+  while (new_cap < b->len + extra)
+    new_cap *= 2;
+  b->data = realloc(b->data, new_cap);
+  assert(b->data != NULL && "Memory exhausted");
+  b->cap = new_cap;
+}
+
+static void buf_puts(exporter_buf_t *b, const char *s) {
+  size_t n = strlen(s);
+  buf_reserve(b, n + 1);
+  memcpy(b->data + b->len, s, n + 1);
+  b->len += n;
+}
+
+static void buf_printf(exporter_buf_t *b, const char *fmt, ...) {
+  buf_reserve(b, 64);
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+  va_end(ap);
+  assert(n >= 0);
+  if (b->len + (size_t)n >= b->cap) {
+    buf_reserve(b, (size_t)n + 1);
+    va_start(ap, fmt);
+    vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+    va_end(ap);
+  }
+  b->len += (size_t)n;
+}
+
+// Prometheus spells the special values NaN, +Inf and -Inf
+static void buf_put_value(exporter_buf_t *b, double v) {
+  if (isnan(v))
+    buf_puts(b, "NaN");
+  else if (isinf(v))
+    buf_puts(b, v > 0 ? "+Inf" : "-Inf");
+  else
+    buf_printf(b, "%.10g", v);
+}
+
+// Metric names match [a-zA-Z_:][a-zA-Z0-9_:]*; every other character becomes '_'
+static void format_metric_name(const char *prefix, const char *name, char *out, size_t out_size) {
+  int n = snprintf(out, out_size, "%s", prefix);
+  size_t j = n > 0 ? (size_t)n : 0;
+  for (size_t i = 0; name[i] != '\0' && j < out_size - 1; i++) {
+    char c = name[i];
+    bool ok = (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_' || c == ':';
+    out[j++] = ok ? c : '_';
+  }
+  out[j] = '\0';
+}
+
+// Whether name is one of the series names of the histogram base: <base>_bucket, <base>_sum or <base>_count
+static bool is_histogram_series_name(const char *name, const char *base) {
+  size_t n = strlen(base);
+  return strncmp(name, base, n) == 0 &&
+         (strcmp(name + n, "_bucket") == 0 || strcmp(name + n, "_sum") == 0 || strcmp(name + n, "_count") == 0);
+}
+
+// Whether f, registered before, is rendered under a name that a family named name of the given type would also use.
+// Measurement names that differ only in the characters replaced by '_' (e.g. DRB.UEThpDl and DRB_UEThpDl) give the
+// same name.
+static bool family_name_clashes(const exporter_family_t *f, const char *name, exporter_type_e type) {
+  return strcmp(f->name, name) == 0 || (f->type == EXPORTER_HISTOGRAM && is_histogram_series_name(name, f->name)) ||
+         (type == EXPORTER_HISTOGRAM && is_histogram_series_name(f->name, name));
+}
+
+// Names the family after the measurement, suffixed with _2, _3, ... if a family registered before already renders that
+// name, so that every name has a single HELP and TYPE line. Called with the lock held, before the family is added to
+// the used ones.
+static void name_family(exporter_family_t *f, const char *prefix, const char *name) {
+  // Room for the suffix. Measurement names are shorter than METRIC_FACTORY_NAME_LEN, so they are never truncated.
+  char base[sizeof(f->name) - 8];
+  format_metric_name(prefix, name, base, sizeof(base));
+  snprintf(f->name, sizeof(f->name), "%s", base);
+  for (unsigned k = 2;; k++) {
+    bool clash = false;
+    for (size_t i = 0; i < exporter.num_used_families && !clash; i++)
+      clash = family_name_clashes(&exporter.families[exporter.used_families[i]], f->name, f->type);
+    if (!clash)
+      break;
+    snprintf(f->name, sizeof(f->name), "%s_%u", base, k);
+  }
+  if (strcmp(f->name, base) != 0)
+    printf("Measurement %s is exported as %s, as %s is already used\n", name, f->name, base);
+}
+
+// HELP text: the measurement name and its unit, with '\' and line feeds escaped
+static void format_help(const char *name, const char *unit, char *out, size_t out_size) {
+  char raw[METRIC_FACTORY_COLUMN_LEN];
+  if (unit != NULL && unit[0] != '\0')
+    snprintf(raw, sizeof(raw), "%s [%s]", name, unit);
+  else
+    snprintf(raw, sizeof(raw), "%s", name);
+
+  size_t j = 0;
+  for (size_t i = 0; raw[i] != '\0' && j + 2 < out_size; i++) {
+    if (raw[i] == '\\' || raw[i] == '\n') {
+      out[j++] = '\\';
+      out[j++] = raw[i] == '\n' ? 'n' : '\\';
+    } else {
+      out[j++] = raw[i];
+    }
+  }
+  out[j] = '\0';
+}
+
+static uint32_t series_hash(const metrics_exporter_row_t *row, uint16_t family) {
+  uint8_t key[sizeof(uint64_t) + sizeof(uint16_t) + 1];
+  memcpy(key, &row->ue_id, sizeof(uint64_t));
+  memcpy(key + sizeof(uint64_t), &family, sizeof(uint16_t));
+  key[sizeof(key) - 1] = row->is_cell;
+  return murmur3_32(key, sizeof(key), row->node_hash);
+}
+
+static exporter_series_t **series_slot(exporter_series_t **slots, size_t cap, uint32_t hash,
+                                       const metrics_exporter_row_t *row, uint16_t family) {
+  size_t i = hash & (cap - 1);
+  while (slots[i] != NULL) {
+    const exporter_series_t *s = slots[i];
+    if (s->hash == hash && s->family == family && s->ue_id == row->ue_id && s->is_cell == row->is_cell &&
+        strcmp(s->node_id, row->node_id) == 0)
+      break;
+    i = (i + 1) & (cap - 1);
+  }
+  return &slots[i];
+}
+
+static void series_table_grow(exporter_t *e) {
+  size_t new_cap = e->cap ? e->cap * 2 : 256;
+  exporter_series_t **new_slots = ecalloc(new_cap, sizeof(exporter_series_t *));
+  for (size_t i = 0; i < e->cap; i++) {
+    exporter_series_t *s = e->slots[i];
+    if (s == NULL)
+      continue;
+    size_t j = s->hash & (new_cap - 1);
+    while (new_slots[j] != NULL)
+      j = (j + 1) & (new_cap - 1);
+    new_slots[j] = s;
+  }
+  free(e->slots);
+  e->slots = new_slots;
+  e->cap = new_cap;
+}
+
+// Clears the slot of a series and reinserts the rest of its probe run, as linear probing stops at the first empty slot
+static void series_table_remove(exporter_t *e, const exporter_series_t *s) {
+  size_t mask = e->cap - 1;
+  size_t i = s->hash & mask;
+  while (e->slots[i] != s)
+    i = (i + 1) & mask;
+  e->slots[i] = NULL;
+  e->len--;
+
+  for (size_t j = (i + 1) & mask; e->slots[j] != NULL; j = (j + 1) & mask) {
+    exporter_series_t *moved = e->slots[j];
+    e->slots[j] = NULL;
+    size_t k = moved->hash & mask;
+    while (e->slots[k] != NULL)
+      k = (k + 1) & mask;
+    e->slots[k] = moved;
+  }
+}
+
+static void series_free(exporter_series_t *s) {
+  free(s->node_id);
+  free(s->bucket_counts);
+  free(s);
+}
+
+// Frees the series that were not updated for stale_us, e.g. those of UEs that detached. Called with the lock held.
+static void evict_stale_series(exporter_t *e, int64_t now) {
+  if (e->stale_us <= 0)
+    return;
+  for (size_t i = 0; i < e->num_used_families; i++) {
+    exporter_family_t *f = &e->families[e->used_families[i]];
+    exporter_series_t *prev = NULL;
+    exporter_series_t *s = f->head;
+    while (s != NULL) {
+      exporter_series_t *next = s->next;
+      if (now - s->updated_us > e->stale_us) {
+        if (prev != NULL)
+          prev->next = next;
+        else
+          f->head = next;
+        if (f->tail == s)
+          f->tail = prev;
+        series_table_remove(e, s);
+        series_free(s);
+      } else {
+        prev = s;
+      }
+      s = next;
+    }
+  }
+}
+
+// Returns the series of family for the row, registering the family with the given name and unit on its first update.
+// NULL if the family was registered with another type. Called with the lock held.
+static exporter_series_t *get_series(const metrics_exporter_row_t *row, uint16_t family, exporter_type_e type,
+                                     const char *name, const char *unit) {
+  exporter_family_t *f = &exporter.families[family];
+  if (!f->used) {
+    f->used = true;
+    f->type = type;
+    // Derived metrics get their own prefix, as E2 nodes may report measurements with the same names (e.g. RSRP.Count)
+    name_family(f, family >= EXPORTER_FACTORY_BASE ? "kpm_dist_" : "kpm_", name);
+    format_help(name, unit, f->help, sizeof(f->help));
+    exporter.used_families[exporter.num_used_families++] = family;
+  } else if (f->type != type) {
+    return NULL;
+  }
+
+  if (2 * (exporter.len + 1) > exporter.cap)
+    series_table_grow(&exporter);
+
+  uint32_t hash = series_hash(row, family);
+  exporter_series_t **slot = series_slot(exporter.slots, exporter.cap, hash, row, family);
+  if (*slot == NULL) {
+    exporter_series_t *s = ecalloc(1, sizeof(exporter_series_t));
+    s->hash = hash;
+    s->family = family;
+    s->node_id = strdup(row->node_id);
+    assert(s->node_id != NULL && "Memory exhausted");
+    s->ue_id = row->ue_id;
+    s->is_cell = row->is_cell;
+    s->value = NAN;
+    if (f->tail != NULL)
+      f->tail->next = s;
+    else
+      f->head = s;
+    f->tail = s;
+    *slot = s;
+    exporter.len++;
+  }
+  return *slot;
+}
+
+static void set_gauge(const metrics_exporter_row_t *row, uint16_t family, const char *name, const char *unit,
+                      double value) {
+  int64_t now = time_now_us();
+  pthread_mutex_lock(&exporter.mtx);
+  // Checked again under the lock, as metrics_exporter_stop() may have freed the series since the caller checked it
+  exporter_series_t *s = metrics_exporter_enabled() ? get_series(row, family, EXPORTER_GAUGE, name, unit) : NULL;
+  if (s != NULL) {
+    s->value = value;
+    s->updated_us = now;
+  }
+  pthread_mutex_unlock(&exporter.mtx);
+}
+
+bool metrics_exporter_enabled(void) {
+  return atomic_load_explicit(&exporter.enabled, memory_order_relaxed);
+}
+
+void metrics_exporter_row_init(metrics_exporter_row_t *row, const char *node_id, uint64_t ue_id, bool is_cell) {
+  row->node_id = (node_id != NULL && node_id[0] != '\0') ? node_id : "unknown";
+  row->node_hash = murmur3_32((const uint8_t *)row->node_id, strlen(row->node_id), 0);
+  row->ue_id = is_cell ? 0 : ue_id;
+  row->is_cell = is_cell;
+}
+
+void metrics_exporter_set_meas(const metrics_exporter_row_t *row, const metric_factory_meas_t *meas,
+                               const meas_record_lst_t *meas_record) {
+  if (!metrics_exporter_enabled() || meas->name_id == METRIC_FACTORY_NO_NAME_ID)
+    return;
+
+  double value;
+  if (meas_record->value == INTEGER_MEAS_VALUE)
+    value = meas_record->int_val;
+  else if (meas_record->value == REAL_MEAS_VALUE)
+    value = meas_record->real_val;
+  else
+    return;
+  set_gauge(row, meas->name_id, meas->name, meas->unit, value);
+}
+
+void metrics_exporter_set_factory(const metrics_exporter_row_t *row, const factory_metric_t *metric) {
+  if (!metrics_exporter_enabled() || metric->name_id >= METRIC_FACTORY_NUM_IDS * METRIC_FACTORY_MAX_OUTPUTS)
+    return;
+
+  double value = metric->value_type == 0 ? metric->int_val : metric->real_val;
+  set_gauge(row, (uint16_t)(EXPORTER_FACTORY_BASE + metric->name_id), metric->name, metric->unit, value);
+}
+
+void metrics_exporter_set_dist(const metrics_exporter_row_t *row, const metric_factory_meas_t *meas,
+                               const meas_record_lst_t *meas_record_lst, size_t rec_idx_start, size_t len) {
+  if (!metrics_exporter_enabled() || meas->name_id == METRIC_FACTORY_NO_NAME_ID)
+    return;
+
+  uint64_t hist[METRIC_FACTORY_MAX_AXIS_BINS];
+  const double *values = NULL;
+  size_t nvalues = metric_factory_value_hist(meas->id, meas_record_lst, rec_idx_start, len, hist, &values);
+  if (nvalues == 0)
+    return;
+
+  double sum = 0;
+  uint64_t count = 0;
+  for (size_t v = 0; v < nvalues; v++) {
+    sum += values[v] * hist[v];
+    count += hist[v];
+  }
+
+  int64_t now = time_now_us();
+  pthread_mutex_lock(&exporter.mtx);
+  exporter_series_t *s =
+      metrics_exporter_enabled() ? get_series(row, meas->name_id, EXPORTER_HISTOGRAM, meas->name, meas->unit) : NULL;
+  if (s != NULL) {
+    if (s->nbuckets != nvalues) {
+      free(s->bucket_counts);
+      s->bucket_counts = ecalloc(nvalues, sizeof(uint64_t));
+      s->nbuckets = nvalues;
+    }
+    memcpy(s->bucket_counts, hist, nvalues * sizeof(uint64_t));
+    s->bucket_le = values;
+    s->sum = sum;
+    s->count = count;
+    s->updated_us = now;
+  }
+  pthread_mutex_unlock(&exporter.mtx);
+}
+
+// Label values escape '\', '"' and line feeds
+static void buf_put_label_value(exporter_buf_t *b, const char *v) {
+  buf_reserve(b, 2 * strlen(v) + 1);
+  for (size_t i = 0; v[i] != '\0'; i++) {
+    if (v[i] == '\\' || v[i] == '"' || v[i] == '\n') {
+      b->data[b->len++] = '\\';
+      b->data[b->len++] = v[i] == '\n' ? 'n' : v[i];
+    } else {
+      b->data[b->len++] = v[i];
+    }
+  }
+  b->data[b->len] = '\0';
+}
+
+// Writes the labels of a series without the closing brace, so that histogram buckets can append le
+static void buf_put_labels(exporter_buf_t *b, const exporter_series_t *s) {
+  buf_puts(b, "{e2_node_id=\"");
+  buf_put_label_value(b, s->node_id);
+  buf_puts(b, "\"");
+  if (!s->is_cell)
+    buf_printf(b, ",ue_id=\"%" PRIu64 "\"", s->ue_id);
+}
+
+static void render_series(exporter_buf_t *b, const exporter_family_t *f, const exporter_series_t *s) {
+  if (f->type == EXPORTER_GAUGE) {
+    buf_puts(b, f->name);
+    buf_put_labels(b, s);
+    buf_puts(b, "} ");
+    buf_put_value(b, s->value);
+    buf_puts(b, "\n");
+    return;
+  }
+
+  uint64_t cumulative = 0;
+  for (size_t v = 0; v < s->nbuckets; v++) {
+    cumulative += s->bucket_counts[v];
+    buf_printf(b, "%s_bucket", f->name);
+    buf_put_labels(b, s);
+    buf_puts(b, ",le=\"");
+    buf_put_value(b, s->bucket_le[v]);
+    buf_printf(b, "\"} %" PRIu64 "\n", cumulative);
+  }
+  buf_printf(b, "%s_bucket", f->name);
+  buf_put_labels(b, s);
+  buf_printf(b, ",le=\"+Inf\"} %" PRIu64 "\n", s->count);
+  buf_printf(b, "%s_sum", f->name);
+  buf_put_labels(b, s);
+  buf_puts(b, "} ");
+  buf_put_value(b, s->sum);
+  buf_puts(b, "\n");
+  buf_printf(b, "%s_count", f->name);
+  buf_put_labels(b, s);
+  buf_printf(b, "} %" PRIu64 "\n", s->count);
+}
+
+// Renders every family into the body buffer, after evicting the stale series. Only the families that were updated and
+// their series are visited.
+static void render_metrics(exporter_buf_t *b) {
+  b->len = 0;
+  buf_reserve(b, 1);
+  b->data[0] = '\0';
+
+  pthread_mutex_lock(&exporter.mtx);
+  evict_stale_series(&exporter, time_now_us());
+  for (size_t i = 0; i < exporter.num_used_families; i++) {
+    const exporter_family_t *f = &exporter.families[exporter.used_families[i]];
+    if (f->head == NULL)
+      continue;
+    buf_printf(b, "# HELP %s %s\n# TYPE %s %s\n", f->name, f->help, f->name,
+               f->type == EXPORTER_GAUGE ? "gauge" : "histogram");
+    for (const exporter_series_t *s = f->head; s != NULL; s = s->next)
+      render_series(b, f, s);
+  }
+  pthread_mutex_unlock(&exporter.mtx);
+}
+
+static bool send_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static void send_response(int fd, const char *status, const char *content_type, const char *body, size_t body_len) {
+  char header[256];
+  int n = snprintf(header, sizeof(header),
+                   "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", status,
+                   content_type, body_len);
+  if (send_all(fd, header, (size_t)n))
+    send_all(fd, body, body_len);
+}
+
+static void serve_client(int fd) {
+  struct timeval tv = {.tv_sec = EXPORTER_IO_TIMEOUT_MS / 1000, .tv_usec = (EXPORTER_IO_TIMEOUT_MS % 1000) * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  // Only the request line is needed; read until it is complete
+  char req[EXPORTER_MAX_REQUEST];
+  size_t len = 0;
+  while (len < sizeof(req) - 1 && memchr(req, '\n', len) == NULL) {
+    ssize_t n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    len += (size_t)n;
+  }
+  req[len] = '\0';
+
+  static const char not_allowed[] = "Only GET is supported\n";
+  static const char not_found[] = "Not found, try /metrics\n";
+  if (strncmp(req, "GET ", 4) != 0) {
+    send_response(fd, "405 Method Not Allowed", "text/plain", not_allowed, sizeof(not_allowed) - 1);
+    return;
+  }
+  const char *path = req + 4;
+  size_t path_len = strcspn(path, " ?\r\n");
+  if (path_len != strlen("/metrics") || strncmp(path, "/metrics", path_len) != 0) {
+    send_response(fd, "404 Not Found", "text/plain", not_found, sizeof(not_found) - 1);
+    return;
+  }
+
+  // The body is rendered under the lock and sent without it, so that a slow client does not hold back the updates
+  render_metrics(&exporter.body);
+  send_response(fd, "200 OK", "text/plain; version=0.0.4; charset=utf-8", exporter.body.data, exporter.body.len);
+}
+
+static void *exporter_thread(void *arg) {
+  (void)arg;
+  int64_t last_evict_us = time_now_us();
+  while (atomic_load(&exporter.running)) {
+    int64_t now = time_now_us();
+    if (now - last_evict_us >= EXPORTER_EVICT_INTERVAL_US) {
+      pthread_mutex_lock(&exporter.mtx);
+      evict_stale_series(&exporter, now);
+      pthread_mutex_unlock(&exporter.mtx);
+      last_evict_us = now;
+    }
+
+    struct pollfd pfd = {.fd = exporter.listen_fd, .events = POLLIN};
+    if (poll(&pfd, 1, EXPORTER_POLL_MS) <= 0)
+      continue;
+    int fd = accept(exporter.listen_fd, NULL, NULL);
+    if (fd < 0)
+      continue;
+    serve_client(fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+static long long env_number(const char *name, long long def, long long min, long long max, bool *ok) {
+  const char *str = getenv(name);
+  *ok = true;
+  if (str == NULL || *str == '\0')
+    return def;
+
+  char *end = NULL;
+  long long v = strtoll(str, &end, 10);
+  if (*end != '\0' || v < min || v > max) {
+    fprintf(stderr, "Invalid %s value: '%s'. Must be between %lld and %lld.\n", name, str, min, max);
+    *ok = false;
+    return def;
+  }
+  return v;
+}
+
+bool metrics_exporter_start(void) {
+  if (getenv(METRICS_EXPORTER_PORT_ENV) == NULL)
+    return true;
+
+  bool ok = false;
+  long long port = env_number(METRICS_EXPORTER_PORT_ENV, 0, 1, 65535, &ok);
+  if (!ok)
+    return false;
+  long long stale_s = env_number(METRICS_EXPORTER_STALE_ENV, METRICS_EXPORTER_DEFAULT_STALE_S, 0, 86400 * 365, &ok);
+  if (!ok)
+    return false;
+  exporter.stale_us = stale_s * 1000000;
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("Metrics endpoint socket");
+    return false;
+  }
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET, .sin_port = htons((uint16_t)port), .sin_addr.s_addr = htonl(INADDR_ANY)};
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+    fprintf(stderr, "Cannot listen for metrics on port %lld: %s\n", port, strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  exporter.listen_fd = fd;
+  atomic_store(&exporter.running, true);
+  int rc = pthread_create(&exporter.thread, NULL, exporter_thread, NULL);
+  assert(rc == 0);
+  atomic_store(&exporter.enabled, true);
+  printf("Serving KPM metrics on http://0.0.0.0:%lld/metrics\n", port);
+  return true;
+}
+
+void metrics_exporter_stop(void) {
+  if (!atomic_load(&exporter.running))
+    return;
+
+  atomic_store(&exporter.running, false);
+  pthread_join(exporter.thread, NULL);
+  close(exporter.listen_fd);
+  exporter.listen_fd = -1;
+
+  // Updates check enabled under the lock, so none of them can use the series once they are freed
+  pthread_mutex_lock(&exporter.mtx);
+  atomic_store(&exporter.enabled, false);
+  for (size_t i = 0; i < exporter.cap; i++) {
+    if (exporter.slots[i] != NULL)
+      series_free(exporter.slots[i]);
+  }
+  free(exporter.slots);
+  exporter.slots = NULL;
+  exporter.cap = 0;
+  exporter.len = 0;
+  memset(exporter.families, 0, sizeof(exporter.families));
+  exporter.num_used_families = 0;
+  pthread_mutex_unlock(&exporter.mtx);
+
+  free(exporter.body.data);
+  exporter.body = (exporter_buf_t){0};
+}
@@ -0,0 +1,63 @@
+#ifndef METRICS_EXPORTER_H
+#define METRICS_EXPORTER_H
+
+#include "metrics_factory.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Pull endpoint for Prometheus.
+//
+// The exporter keeps the latest value of every (E2 node, UE, metric) series in memory and serves them on
+// http://<host>:<port>/metrics in the text exposition format (version 0.0.4), so that a scrape costs O(series) however
+// many indications were received in between. Scalar measurements and the metrics derived by the metric factory are
+// gauges, distributions known to the metric factory are histograms with one bucket per value of their value axis.
+//
+// Metric names are kpm_<measurement name>, and kpm_dist_<metric name> for the metrics derived by the metric factory,
+// with the characters that Prometheus does not accept replaced by '_', e.g. kpm_DRB_UEThpDl, kpm_L1M_SS_RSRP or
+// kpm_dist_RSRP_P50. Series carry the labels e2_node_id and, for UE rows, ue_id.
+
+// Environment variable holding the TCP port of the endpoint. The exporter is disabled when it is not set.
+#define METRICS_EXPORTER_PORT_ENV "KPM_METRICS_PORT"
+
+// Environment variable holding the number of seconds after which a series that was not updated is dropped (e.g. UEs
+// that detached), 0 to keep every series
+#define METRICS_EXPORTER_STALE_ENV "KPM_METRICS_STALE_S"
+#define METRICS_EXPORTER_DEFAULT_STALE_S 300
+
+// Series labels of a row of measurements, shared by all the updates of one indication so that the E2 node ID is only
+// hashed once
+typedef struct {
+  const char *node_id;
+  uint32_t node_hash;
+  // 0 for cell rows
+  uint64_t ue_id;
+  bool is_cell;
+} metrics_exporter_row_t;
+
+// Starts the endpoint on the port given by KPM_METRICS_PORT. Returns true if the exporter is listening or the variable
+// is not set, false if the port is invalid or cannot be bound.
+bool metrics_exporter_start(void);
+
+// Stops the endpoint and frees the series. Updates that are still being made are dropped.
+void metrics_exporter_stop(void);
+
+// Updates are dropped right away while the exporter is disabled
+bool metrics_exporter_enabled(void);
+
+void metrics_exporter_row_init(metrics_exporter_row_t *row, const char *node_id, uint64_t ue_id, bool is_cell);
+
+// Sets the gauge of a scalar measurement. Records that are neither int nor real are ignored.
+void metrics_exporter_set_meas(const metrics_exporter_row_t *row, const metric_factory_meas_t *meas,
+                               const meas_record_lst_t *meas_record);
+
+// Sets the gauge of a metric derived by the metric factory
+void metrics_exporter_set_factory(const metrics_exporter_row_t *row, const factory_metric_t *metric);
+
+// Sets the histogram of a distribution from its len bins starting at rec_idx_start. The E2 nodes report cumulative
+// counts, which are exposed as they are. Distributions unknown to the metric factory are ignored, as the values of
+// their bins are not known.
+void metrics_exporter_set_dist(const metrics_exporter_row_t *row, const metric_factory_meas_t *meas,
+                               const meas_record_lst_t *meas_record_lst, size_t rec_idx_start, size_t len);
+
+#endif // METRICS_EXPORTER_H
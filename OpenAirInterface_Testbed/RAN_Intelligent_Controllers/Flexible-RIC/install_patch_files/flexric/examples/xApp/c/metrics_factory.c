@@ -3,32 +3,168 @@
 #include "../../../src/util/alg_ds/ds/assoc_container/assoc_generic.h"
 #include "../../../src/util/e.h"
 
+#include <inttypes.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
 
-static e2_node_dist_state_t dist_state[MAX_E2_NODES] = {0};
-static int dist_state_count = 0;
+typedef struct
+{
+  dist_state_t **slots;
+  size_t cap;
+  size_t len;
+  pthread_mutex_t mtx;
+} dist_state_table_t;
+
+static dist_state_table_t dist_states = {.mtx = PTHREAD_MUTEX_INITIALIZER};
+
+static uint32_t dist_state_hash(const char *e2_id, const char *metric_name)
+{
+  uint32_t h = murmur3_32((const uint8_t *)e2_id, strlen(e2_id), 0);
+  return murmur3_32((const uint8_t *)metric_name, strlen(metric_name), h);
+}
+
+// Open addressing with linear probing; cap is a power of two and the table is kept at most half full
+static dist_state_t **dist_state_slot(dist_state_t **slots, size_t cap, uint32_t hash, const char *e2_id, const char *metric_name)
+{
+  size_t i = hash & (cap - 1);
+  while (slots[i] != NULL)
+  {
+    if (slots[i]->hash == hash && strcmp(slots[i]->node_id, e2_id) == 0 && strcmp(slots[i]->metric_name, metric_name) == 0)
+      break;
+    i = (i + 1) & (cap - 1);
+  }
+  return &slots[i];
+}
+
+static void dist_state_table_grow(dist_state_table_t *t)
+{
+  size_t new_cap = t->cap ? t->cap * 2 : 64;
+  dist_state_t **new_slots = ecalloc(new_cap, sizeof(dist_state_t *));
+  for (size_t i = 0; i < t->cap; i++)
+  {
+    if (t->slots[i] != NULL)
+      *dist_state_slot(new_slots, new_cap, t->slots[i]->hash, t->slots[i]->node_id, t->slots[i]->metric_name) = t->slots[i];
+  }
+  free(t->slots);
+  t->slots = new_slots;
+  t->cap = new_cap;
+}
 
-e2_node_dist_state_t *get_dist_state(const char *e2_id)
+dist_state_t *get_dist_state(const char *e2_id, const char *metric_name, size_t nbins)
 {
-  for (int i = 0; i < dist_state_count; i++)
+  uint32_t hash = dist_state_hash(e2_id, metric_name);
+
+  pthread_mutex_lock(&dist_states.mtx);
+  if (2 * (dist_states.len + 1) > dist_states.cap)
+    dist_state_table_grow(&dist_states);
+
+  dist_state_t **slot = dist_state_slot(dist_states.slots, dist_states.cap, hash, e2_id, metric_name);
+  if (*slot == NULL)
   {
-    if (strncmp(dist_state[i].node_id_str, e2_id, sizeof(dist_state[i].node_id_str)) == 0)
+    dist_state_t *state = ecalloc(1, sizeof(dist_state_t));
+    state->hash = hash;
+    state->node_id = strdup(e2_id);
+    state->metric_name = strdup(metric_name);
+    assert(state->node_id != NULL && state->metric_name != NULL);
+    state->nbins = nbins;
+    state->last_dist = ecalloc(nbins ? nbins : 1, sizeof(uint32_t));
+    pthread_mutex_init(&state->mtx, NULL);
+    *slot = state;
+    dist_states.len++;
+  }
+  dist_state_t *state = *slot;
+  pthread_mutex_unlock(&dist_states.mtx);
+
+  return state;
+}
+
+static void update_dist(dist_state_t *state, const uint32_t *current_dist, size_t limit, const double *bin_weight, uint32_t *cumulative, dist_delta_t *delta)
+{
+  pthread_mutex_lock(&state->mtx);
+  if (state->nbins < limit)
+  {
+    uint32_t *last_dist = ecalloc(limit, sizeof(uint32_t));
+    memcpy(last_dist, state->last_dist, state->nbins * sizeof(uint32_t));
+    free(state->last_dist);
+    state->last_dist = last_dist;
+    state->nbins = limit;
+  }
+
+  uint32_t count = 0;
+  double weighted_sum = 0;
+  int min_bin = -1;
+  int max_bin = -1;
+  uint32_t *last_dist = state->last_dist;
+  for (size_t i = 0; i < limit; i++)
+  {
+    uint32_t diff = current_dist[i] >= last_dist[i] ? current_dist[i] - last_dist[i] : current_dist[i];
+    last_dist[i] = current_dist[i];
+    count += diff;
+    cumulative[i] = count;
+    weighted_sum += bin_weight[i] * diff;
+    if (diff != 0)
     {
-      return &dist_state[i];
+      if (min_bin < 0)
+        min_bin = (int)i;
+      max_bin = (int)i;
     }
   }
+  pthread_mutex_unlock(&state->mtx);
 
-  if (dist_state_count < MAX_E2_NODES)
+  delta->count = count;
+  delta->weighted_sum = weighted_sum;
+  delta->min_bin = min_bin;
+  delta->max_bin = max_bin;
+}
+
+void update_dist_state(const char *node_id, const char *metric_name, const uint32_t *current_dist, size_t limit, const double *bin_weight, uint32_t *cumulative, dist_delta_t *delta)
+{
+  update_dist(get_dist_state(node_id, metric_name, limit), current_dist, limit, bin_weight, cumulative, delta);
+}
+
+void dist_percentiles(const uint32_t *cumulative, size_t nbins, const double *bin_values, const double *levels, size_t num_levels, double *out)
+{
+  uint32_t total = nbins > 0 ? cumulative[nbins - 1] : 0;
+  size_t bin = 0;
+  for (size_t k = 0; k < num_levels; k++)
   {
-    strncpy(dist_state[dist_state_count].node_id_str, e2_id, sizeof(dist_state[dist_state_count].node_id_str) - 1);
-    return &dist_state[dist_state_count++];
+    if (total == 0)
+    {
+      out[k] = NAN;
+      continue;
+    }
+    uint32_t rank = (uint32_t)(levels[k] / 100.0 * total);
+    if (rank >= total)
+      rank = total - 1;
+    while (cumulative[bin] <= rank)
+      bin++;
+    out[k] = bin_values[bin];
   }
+}
 
-  return NULL;
+void free_dist_states(void)
+{
+  pthread_mutex_lock(&dist_states.mtx);
+  for (size_t i = 0; i < dist_states.cap; i++)
+  {
+    dist_state_t *state = dist_states.slots[i];
+    if (state == NULL)
+      continue;
+    pthread_mutex_destroy(&state->mtx);
+    free(state->node_id);
+    free(state->metric_name);
+    free(state->last_dist);
+    free(state);
+  }
+  free(dist_states.slots);
+  dist_states.slots = NULL;
+  dist_states.cap = 0;
+  dist_states.len = 0;
+  pthread_mutex_unlock(&dist_states.mtx);
 }
 
 double get_sinr_percentile_val(uint32_t *dist, size_t index)
@@ -62,79 +198,521 @@ int get_percentile_val(uint32_t *dist, size_t index)
   return -(156 + 1) + 127;
 }
 
-bool compute_rsrp_metrics(const char *node_id, const uint32_t *current_dist, size_t limit, dist_metrics_t *out_metrics)
+const double dist_percentile_levels[DIST_NUM_PERCENTILES] = {5.0, 50.0, 95.0};
+
+#define DIST_REDUCERS (METRIC_FACTORY_MEAN | METRIC_FACTORY_MIN | METRIC_FACTORY_MAX | METRIC_FACTORY_COUNT | METRIC_FACTORY_PERCENTILES)
+
+// Bins are laid out as in populate_label_info(): X outermost, Z innermost
+static const metric_factory_entry_t metric_factory_registry[METRIC_FACTORY_NUM_IDS] = {
+    // 38.133 Table 10.1.6.1-1: SS-RSRP and CSI-RSRP measurement report mapping
+    [METRIC_FACTORY_SS_RSRP] = {
+        .meas_name = "L1M.SS-RSRP",
+        .prefix = "RSRP",
+        .unit = "dBm",
+        .naxes = 1,
+        .dims = {128, 1, 1},
+        .first_label = {1, 0, 0},
+        .value_axis = 0,
+        .value_offset = -(156 + 1),
+        .value_step = 1.0,
+        .mean_in_linear = true,
+        .marginal_axis = -1,
+        .reducers = DIST_REDUCERS,
+    },
+    [METRIC_FACTORY_SS_SINR] = {
+        .meas_name = "MR.NRScSSSINR",
+        .prefix = "SINR",
+        .unit = "dB",
+        .naxes = 1,
+        .dims = {128, 1, 1},
+        .first_label = {1, 0, 0},
+        .value_axis = 0,
+        .value_offset = -23.5,
+        .value_step = 0.5,
+        .mean_in_linear = true,
+        .marginal_axis = -1,
+        .reducers = DIST_REDUCERS,
+    },
+    // 0-15 CQI, 1-8 RI, 1-3 CQI table
+    [METRIC_FACTORY_WB_CQI] = {
+        .meas_name = "CARR.WBCQIDist",
+        .prefix = "WBCQI",
+        .unit = "",
+        .naxes = 3,
+        .dims = {16, 8, 3},
+        .first_label = {0, 1, 1},
+        .value_axis = 0,
+        .value_offset = 0,
+        .value_step = 1.0,
+        .mean_in_linear = false,
+        .marginal_axis = 1,
+        .marginal_name = "RI",
+        .reducers = DIST_REDUCERS | METRIC_FACTORY_MARGINAL,
+    },
+    // 1-8 RI, 1-3 MCS table, 0-31 MCS value
+    [METRIC_FACTORY_PDSCH_MCS] = {
+        .meas_name = "CARR.PDSCHMCSDist",
+        .prefix = "PDSCHMCS",
+        .unit = "",
+        .naxes = 3,
+        .dims = {8, 3, 32},
+        .first_label = {1, 1, 0},
+        .value_axis = 2,
+        .value_offset = 0,
+        .value_step = 1.0,
+        .mean_in_linear = false,
+        .marginal_axis = 0,
+        .marginal_name = "RI",
+        .reducers = DIST_REDUCERS | METRIC_FACTORY_MARGINAL,
+    },
+    // 1-8 RI, 1-2 MCS table, 0-31 MCS value
+    [METRIC_FACTORY_PUSCH_MCS] = {
+        .meas_name = "CARR.PUSCHMCSDist",
+        .prefix = "PUSCHMCS",
+        .unit = "",
+        .naxes = 3,
+        .dims = {8, 2, 32},
+        .first_label = {1, 1, 0},
+        .value_axis = 2,
+        .value_offset = 0,
+        .value_step = 1.0,
+        .mean_in_linear = false,
+        .marginal_axis = 0,
+        .marginal_name = "RI",
+        .reducers = DIST_REDUCERS | METRIC_FACTORY_MARGINAL,
+    },
+};
+
+// Lookup tables derived from a registry entry, filled once by init_metric_factory_tables()
+typedef struct
 {
-  if (!out_metrics)
-    return false;
-  out_metrics->mean = NAN;
-  out_metrics->min = NAN;
-  out_metrics->max = NAN;
-  out_metrics->count = 0;
+  size_t nbins;
+  // Value and marginal axis index of every bin
+  uint8_t value_idx[METRIC_FACTORY_MAX_BINS];
+  uint8_t marginal_idx[METRIC_FACTORY_MAX_BINS];
+  // Weight of every bin in the mean: the value itself, or its linear scale for entries averaged in linear scale
+  double weight[METRIC_FACTORY_MAX_BINS];
+  // Value of each bin of the value axis
+  double values[METRIC_FACTORY_MAX_AXIS_BINS];
+  size_t num_outputs;
+  char output_names[METRIC_FACTORY_MAX_OUTPUTS][64];
+  const char *output_units[METRIC_FACTORY_MAX_OUTPUTS];
+  char output_field_names[METRIC_FACTORY_MAX_OUTPUTS][METRIC_FACTORY_COLUMN_LEN];
+} metric_factory_tables_t;
 
-  e2_node_dist_state_t *state = get_dist_state(node_id);
-  if (!state)
-    return false;
+static metric_factory_tables_t metric_factory_tables[METRIC_FACTORY_NUM_IDS];
+static pthread_once_t metric_factory_once = PTHREAD_ONCE_INIT;
 
-  uint32_t diff_dist[128] = {0};
-  uint32_t total_count = 0;
-  uint32_t total_current = 0;
+// InfluxDB field key: the name without the characters that are not accepted in field keys, followed by _<unit>
+static void format_field_name(const char *name, const char *unit, char *out, size_t out_size)
+{
+  size_t j = 0;
+  for (size_t i = 0; name[i] != '\0' && j < out_size - 1; i++)
+  {
+    char c = name[i];
+    if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_' || c == '.')
+      out[j++] = c;
+  }
+  out[j] = '\0';
+  if (j > 0 && unit[0] != '\0')
+    snprintf(out + j, out_size - j, "_%s", unit);
+}
 
-  for (size_t i = 0; i < limit; i++)
+static void add_metric_factory_output(metric_factory_tables_t *t, const char *prefix, const char *suffix, const char *unit)
+{
+  assert(t->num_outputs < METRIC_FACTORY_MAX_OUTPUTS);
+  snprintf(t->output_names[t->num_outputs], sizeof(t->output_names[0]), "%s.%s", prefix, suffix);
+  t->output_units[t->num_outputs] = unit;
+  format_field_name(t->output_names[t->num_outputs], unit, t->output_field_names[t->num_outputs],
+                    sizeof(t->output_field_names[0]));
+  t->num_outputs++;
+}
+
+static void init_metric_factory_tables(void)
+{
+  for (int id = 0; id < METRIC_FACTORY_NUM_IDS; id++)
   {
-    total_current += current_dist[i];
+    const metric_factory_entry_t *e = &metric_factory_registry[id];
+    metric_factory_tables_t *t = &metric_factory_tables[id];
+
+    t->nbins = (size_t)e->dims[0] * e->dims[1] * e->dims[2];
+    assert(t->nbins <= METRIC_FACTORY_MAX_BINS && e->dims[e->value_axis] <= METRIC_FACTORY_MAX_AXIS_BINS);
+
+    for (uint32_t i = 0; i < e->dims[e->value_axis]; i++)
+      t->values[i] = e->value_offset + e->value_step * i;
+
+    for (size_t bin = 0; bin < t->nbins; bin++)
+    {
+      uint32_t idx[3] = {bin / (e->dims[1] * e->dims[2]), (bin / e->dims[2]) % e->dims[1], bin % e->dims[2]};
+      t->value_idx[bin] = idx[e->value_axis];
+      t->marginal_idx[bin] = e->marginal_axis >= 0 ? idx[e->marginal_axis] : 0;
+      double value = t->values[idx[e->value_axis]];
+      t->weight[bin] = e->mean_in_linear ? pow(10.0, value / 10.0) : value;
+    }
+
+    if (e->reducers & METRIC_FACTORY_MEAN)
+      add_metric_factory_output(t, e->prefix, "Mean", e->unit);
+    if (e->reducers & METRIC_FACTORY_MIN)
+      add_metric_factory_output(t, e->prefix, "Minimum", e->unit);
+    if (e->reducers & METRIC_FACTORY_MAX)
+      add_metric_factory_output(t, e->prefix, "Maximum", e->unit);
+    if (e->reducers & METRIC_FACTORY_COUNT)
+      add_metric_factory_output(t, e->prefix, "Count", "");
+    if (e->reducers & METRIC_FACTORY_PERCENTILES)
+    {
+      for (size_t k = 0; k < DIST_NUM_PERCENTILES; k++)
+      {
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), "P%g", dist_percentile_levels[k]);
+        add_metric_factory_output(t, e->prefix, suffix, e->unit);
+      }
+    }
+    if (e->reducers & METRIC_FACTORY_MARGINAL)
+    {
+      char suffix[64];
+      snprintf(suffix, sizeof(suffix), "%s.Mean", e->marginal_name);
+      add_metric_factory_output(t, e->prefix, suffix, "");
+    }
   }
+}
 
-  // Per-UE metrics don't have RSRP; return early
-  if (total_current == 0)
+const metric_factory_entry_t *metric_factory_entry(metric_factory_id_e id)
+{
+  if (id < 0 || id >= METRIC_FACTORY_NUM_IDS)
+    return NULL;
+  return &metric_factory_registry[id];
+}
+
+metric_factory_id_e metric_factory_lookup(const char *meas_name)
+{
+  for (int id = 0; id < METRIC_FACTORY_NUM_IDS; id++)
   {
-    return true;
+    if (strcmp(metric_factory_registry[id].meas_name, meas_name) == 0)
+      return (metric_factory_id_e)id;
   }
+  return METRIC_FACTORY_NONE;
+}
 
-  for (size_t i = 0; i < limit; i++)
+metric_factory_id_e metric_factory_lookup_ba(byte_array_t meas_name)
+{
+  for (int id = 0; id < METRIC_FACTORY_NUM_IDS; id++)
+  {
+    if (cmp_str_ba(metric_factory_registry[id].meas_name, meas_name) == 0)
+      return (metric_factory_id_e)id;
+  }
+  return METRIC_FACTORY_NONE;
+}
+
+// Interned measurement names. Slots below len are written once and never change, so readers do not lock.
+static struct
+{
+  char names[METRIC_FACTORY_MAX_MEAS_NAMES][METRIC_FACTORY_NAME_LEN];
+  _Atomic size_t len;
+  pthread_mutex_t mtx;
+} meas_names = {.mtx = PTHREAD_MUTEX_INITIALIZER};
+
+uint16_t metric_factory_intern(const char *name, size_t len)
+{
+  if (len >= METRIC_FACTORY_NAME_LEN)
+    return METRIC_FACTORY_NO_NAME_ID;
+
+  pthread_mutex_lock(&meas_names.mtx);
+  size_t n = atomic_load_explicit(&meas_names.len, memory_order_relaxed);
+  uint16_t name_id = METRIC_FACTORY_NO_NAME_ID;
+  for (size_t i = 0; i < n; i++)
   {
-    if (current_dist[i] >= state->last_ss_rsrp_dist[i])
+    if (strncmp(meas_names.names[i], name, len) == 0 && meas_names.names[i][len] == '\0')
     {
-      diff_dist[i] = current_dist[i] - state->last_ss_rsrp_dist[i];
+      name_id = (uint16_t)i;
+      break;
     }
-    else
+  }
+  if (name_id == METRIC_FACTORY_NO_NAME_ID && n < METRIC_FACTORY_MAX_MEAS_NAMES)
+  {
+    memcpy(meas_names.names[n], name, len);
+    meas_names.names[n][len] = '\0';
+    atomic_store_explicit(&meas_names.len, n + 1, memory_order_release);
+    name_id = (uint16_t)n;
+  }
+  pthread_mutex_unlock(&meas_names.mtx);
+  return name_id;
+}
+
+const char *metric_factory_meas_name(uint16_t name_id)
+{
+  if (name_id >= atomic_load_explicit(&meas_names.len, memory_order_acquire))
+    return NULL;
+  return meas_names.names[name_id];
+}
+
+void metric_factory_meas_compile(metric_factory_meas_t *meas, const meas_type_t *meas_type, metric_factory_unit_fn unit_of)
+{
+  memset(meas, 0, sizeof(*meas));
+  meas->id = METRIC_FACTORY_NONE;
+  meas->name_id = METRIC_FACTORY_NO_NAME_ID;
+  if (meas_type->type != NAME_MEAS_TYPE)
+    return;
+
+  meas->id = metric_factory_lookup_ba(meas_type->name);
+  meas->name_len = meas_type->name.len;
+  meas->name_id = metric_factory_intern((const char *)meas_type->name.buf, meas_type->name.len);
+  snprintf(meas->name, sizeof(meas->name), "%.*s", (int)meas_type->name.len, (const char *)meas_type->name.buf);
+
+  // Strip the square brackets around units such as "[dBm]"
+  const char *unit = unit_of != NULL ? unit_of(meas->name) : NULL;
+  size_t unit_len = unit != NULL ? strlen(unit) : 0;
+  if (unit_len >= 2 && unit[0] == '[' && unit[unit_len - 1] == ']')
+    snprintf(meas->unit, sizeof(meas->unit), "%.*s", (int)(unit_len - 2), unit + 1);
+  else if (unit != NULL)
+    snprintf(meas->unit, sizeof(meas->unit), "%s", unit);
+
+  if (meas->unit[0] != '\0')
+    snprintf(meas->csv_column, sizeof(meas->csv_column), "%s (%s)", meas->name, meas->unit);
+  else
+    snprintf(meas->csv_column, sizeof(meas->csv_column), "%s", meas->name);
+  format_field_name(meas->name, meas->unit, meas->field_name, sizeof(meas->field_name));
+}
+
+void metric_factory_plan_build(metric_factory_plan_t *plan, const meas_info_format_1_lst_t *meas_info_lst, size_t len, metric_factory_unit_fn unit_of)
+{
+  metric_factory_plan_free(plan);
+  plan->meas = ecalloc(len ? len : 1, sizeof(metric_factory_meas_t));
+  for (size_t i = 0; i < len; i++)
+    metric_factory_meas_compile(&plan->meas[i], &meas_info_lst[i].meas_type, unit_of);
+  plan->len = len;
+  plan->unit_of = unit_of;
+}
+
+// Whether the idx-th measurement of the plan is named name. Names too long for the plan are never matched.
+static bool plan_matches(const metric_factory_plan_t *plan, size_t idx, const uint8_t *name, size_t name_len)
+{
+  if (plan == NULL || idx >= plan->len)
+    return false;
+  const metric_factory_meas_t *meas = &plan->meas[idx];
+  return meas->name_len == name_len && name_len < sizeof(meas->name) && memcmp(meas->name, name, name_len) == 0;
+}
+
+// plan_matches() for a measurement type, measurements identified by ID are compiled without a name
+static bool plan_matches_type(const metric_factory_plan_t *plan, size_t idx, const meas_type_t *meas_type)
+{
+  bool is_name = meas_type->type == NAME_MEAS_TYPE;
+  return plan_matches(plan, idx, is_name ? meas_type->name.buf : NULL, is_name ? meas_type->name.len : 0);
+}
+
+const metric_factory_meas_t *metric_factory_plan_meas(const metric_factory_plan_t *plan, size_t idx, const meas_type_t *meas_type, metric_factory_meas_t *tmp)
+{
+  if (plan_matches_type(plan, idx, meas_type))
+    return &plan->meas[idx];
+  // Indication that does not follow the action definition of the plan
+  metric_factory_meas_compile(tmp, meas_type, plan != NULL ? plan->unit_of : NULL);
+  return tmp;
+}
+
+metric_factory_id_e metric_factory_plan_id(const metric_factory_plan_t *plan, size_t idx, byte_array_t meas_name)
+{
+  if (plan_matches(plan, idx, meas_name.buf, meas_name.len))
+    return plan->meas[idx].id;
+  // Indication that does not follow the action definition of the plan
+  return metric_factory_lookup_ba(meas_name);
+}
+
+void metric_factory_plan_free(metric_factory_plan_t *plan)
+{
+  free(plan->meas);
+  plan->meas = NULL;
+  plan->len = 0;
+  plan->unit_of = NULL;
+}
+
+void metric_factory_node_name(const global_e2_node_id_t *node_id, char *buf, size_t len)
+{
+  if (node_id == NULL)
+    snprintf(buf, len, "Unknown");
+  else if (node_id->type == ngran_gNB_DU)
+    snprintf(buf, len, "DU:%" PRIu64, *node_id->cu_du_id);
+  else if (node_id->type == ngran_gNB_CU)
+    snprintf(buf, len, "CU:%" PRIu64, *node_id->cu_du_id);
+  else if (node_id->type == ngran_gNB_CUUP)
+    snprintf(buf, len, "CUUP:%" PRIu64, *node_id->cu_du_id);
+  else if (node_id->type == ngran_gNB_CUCP)
+    snprintf(buf, len, "CUCP:%" PRIu64, *node_id->cu_du_id);
+  else
+    snprintf(buf, len, "gNB:%u", node_id->nb_id.nb_id);
+}
+
+struct metric_factory_plan_node_s
+{
+  // Fields of the E2 node ID that identify it, as in the indication dispatcher
+  ngran_node_t type;
+  uint16_t mcc;
+  uint16_t mnc;
+  uint32_t nb_id;
+  bool has_cu_du_id;
+  uint64_t cu_du_id;
+  format_action_def_e format;
+  metric_factory_plan_t plan;
+  _Atomic(metric_factory_plan_node_t *) next;
+  // Next node replaced by a later subscription, only accessed under the mutex
+  metric_factory_plan_node_t *next_retired;
+};
+
+static bool plan_node_matches(const metric_factory_plan_node_t *node, const global_e2_node_id_t *node_id, format_action_def_e format)
+{
+  return node->format == format && node->type == node_id->type && node->mcc == node_id->plmn.mcc && node->mnc == node_id->plmn.mnc
+         && node->nb_id == node_id->nb_id.nb_id && node->has_cu_du_id == (node_id->cu_du_id != NULL)
+         && (node_id->cu_du_id == NULL || node->cu_du_id == *node_id->cu_du_id);
+}
+
+// Whether the first len measurements of the plan are those of meas_info_lst
+static bool plan_follows(const metric_factory_plan_t *plan, const meas_info_format_1_lst_t *meas_info_lst, size_t len)
+{
+  if (len > plan->len)
+    return false;
+  for (size_t i = 0; i < len; i++)
+  {
+    if (!plan_matches_type(plan, i, &meas_info_lst[i].meas_type))
+      return false;
+  }
+  return true;
+}
+
+static metric_factory_plan_node_t *plan_node_new(const metric_factory_plans_t *plans, const global_e2_node_id_t *node_id, format_action_def_e format, const meas_info_format_1_lst_t *meas_info_lst, size_t len)
+{
+  metric_factory_plan_node_t *node = ecalloc(1, sizeof(metric_factory_plan_node_t));
+  node->type = node_id->type;
+  node->mcc = node_id->plmn.mcc;
+  node->mnc = node_id->plmn.mnc;
+  node->nb_id = node_id->nb_id.nb_id;
+  node->has_cu_du_id = node_id->cu_du_id != NULL;
+  node->cu_du_id = node_id->cu_du_id != NULL ? *node_id->cu_du_id : 0;
+  node->format = format;
+  metric_factory_plan_build(&node->plan, meas_info_lst, len, plans->none.unit_of);
+
+  // Resolve the distribution states of the node here, so that indications do not hash its name
+  char node_name[64];
+  metric_factory_node_name(node_id, node_name, sizeof(node_name));
+  pthread_once(&metric_factory_once, init_metric_factory_tables);
+  for (size_t i = 0; i < node->plan.len; i++)
+  {
+    metric_factory_meas_t *meas = &node->plan.meas[i];
+    const metric_factory_entry_t *e = metric_factory_entry(meas->id);
+    if (e != NULL)
+      meas->dist_state = get_dist_state(node_name, e->meas_name, metric_factory_tables[meas->id].nbins);
+  }
+  return node;
+}
+
+// Call with the mutex held. The node is published with a release store, so readers see it fully built.
+static void plan_node_push(metric_factory_plans_t *plans, metric_factory_plan_node_t *node)
+{
+  atomic_store_explicit(&node->next, atomic_load_explicit(&plans->head, memory_order_relaxed), memory_order_relaxed);
+  atomic_store_explicit(&plans->head, node, memory_order_release);
+}
+
+void metric_factory_plans_add(metric_factory_plans_t *plans, const global_e2_node_id_t *node_id, const kpm_act_def_t *ad)
+{
+  const meas_info_format_1_lst_t *meas_info_lst;
+  size_t len;
+  if (ad->type == FORMAT_1_ACTION_DEFINITION)
+  {
+    meas_info_lst = ad->frm_1.meas_info_lst;
+    len = ad->frm_1.meas_info_lst_len;
+  }
+  else if (ad->type == FORMAT_4_ACTION_DEFINITION)
+  {
+    meas_info_lst = ad->frm_4.action_def_format_1.meas_info_lst;
+    len = ad->frm_4.action_def_format_1.meas_info_lst_len;
+  }
+  else
+  {
+    return;
+  }
+
+  metric_factory_plan_node_t *node = plan_node_new(plans, node_id, ad->type, meas_info_lst, len);
+
+  // The plans of a previous subscription of the node, and the layouts learnt from its indications, are unlinked but
+  // not freed: a reader may still walk through them, and their next pointers are left untouched for it
+  pthread_mutex_lock(&plans->mtx);
+  _Atomic(metric_factory_plan_node_t *) *link = &plans->head;
+  metric_factory_plan_node_t *old;
+  while ((old = atomic_load_explicit(link, memory_order_relaxed)) != NULL)
+  {
+    if (!plan_node_matches(old, node_id, ad->type))
     {
-      diff_dist[i] = current_dist[i];
+      link = &old->next;
+      continue;
     }
-    total_count += diff_dist[i];
-    state->last_ss_rsrp_dist[i] = current_dist[i];
+    atomic_store_explicit(link, atomic_load_explicit(&old->next, memory_order_relaxed), memory_order_release);
+    old->next_retired = plans->retired;
+    plans->retired = old;
   }
+  plan_node_push(plans, node);
+  pthread_mutex_unlock(&plans->mtx);
+}
 
-  if (total_count == 0)
+const metric_factory_plan_t *metric_factory_plans_find(metric_factory_plans_t *plans, const global_e2_node_id_t *node_id, format_action_def_e format, const meas_info_format_1_lst_t *meas_info_lst, size_t len)
+{
+  if (node_id == NULL)
+    return &plans->none;
+  for (const metric_factory_plan_node_t *node = atomic_load_explicit(&plans->head, memory_order_acquire); node != NULL;
+       node = atomic_load_explicit(&node->next, memory_order_acquire))
   {
-    return true;
+    if (plan_node_matches(node, node_id, format) && plan_follows(&node->plan, meas_info_lst, len))
+      return &node->plan;
   }
 
-  double sum = 0;
-  int min_val = 9999, max_val = -9999;
-  for (size_t i = 0; i < limit; i++)
+  // Indication that does not follow any plan of the node: its layout is compiled once, as a plan of the node. Past
+  // METRIC_FACTORY_MAX_LAYOUTS plans, the measurements are compiled from every indication instead.
+  const metric_factory_plan_t *plan = NULL;
+  size_t num_layouts = 0;
+  pthread_mutex_lock(&plans->mtx);
+  for (const metric_factory_plan_node_t *node = atomic_load_explicit(&plans->head, memory_order_relaxed); node != NULL;
+       node = atomic_load_explicit(&node->next, memory_order_relaxed))
   {
-    if (diff_dist[i] > 0)
+    if (!plan_node_matches(node, node_id, format))
+      continue;
+    // Added by another thread since the lookup
+    if (plan_follows(&node->plan, meas_info_lst, len))
     {
-      // 38.133 Table 10.1.6.1-1: SS-RSRP and CSI-RSRP measurement report mapping
-      int dbm_val = -(156 + 1) + i;
-      double linear_val = pow(10.0, dbm_val / 10.0);
-      sum += linear_val * diff_dist[i];
-      if (dbm_val < min_val)
-        min_val = dbm_val;
-      if (dbm_val > max_val)
-        max_val = dbm_val;
+      plan = &node->plan;
+      break;
     }
+    num_layouts++;
   }
+  if (plan == NULL && num_layouts < METRIC_FACTORY_MAX_LAYOUTS)
+  {
+    metric_factory_plan_node_t *node = plan_node_new(plans, node_id, format, meas_info_lst, len);
+    plan_node_push(plans, node);
+    plan = &node->plan;
+  }
+  pthread_mutex_unlock(&plans->mtx);
+  return plan != NULL ? plan : &plans->none;
+}
 
-  out_metrics->mean = 10.0 * log10(sum / total_count);
-  out_metrics->min = (double)min_val;
-  out_metrics->max = (double)max_val;
-  out_metrics->count = total_count;
+static void plan_nodes_free(metric_factory_plan_node_t *node, bool retired)
+{
+  while (node != NULL)
+  {
+    metric_factory_plan_node_t *next = retired ? node->next_retired : atomic_load_explicit(&node->next, memory_order_relaxed);
+    metric_factory_plan_free(&node->plan);
+    free(node);
+    node = next;
+  }
+}
 
-  return true;
+void metric_factory_plans_free(metric_factory_plans_t *plans)
+{
+  pthread_mutex_lock(&plans->mtx);
+  metric_factory_plan_node_t *node = atomic_exchange_explicit(&plans->head, NULL, memory_order_acq_rel);
+  metric_factory_plan_node_t *retired = plans->retired;
+  plans->retired = NULL;
+  pthread_mutex_unlock(&plans->mtx);
+  plan_nodes_free(node, false);
+  plan_nodes_free(retired, true);
 }
 
-bool compute_sinr_metrics(const char *node_id, const uint32_t *current_dist, size_t limit, dist_metrics_t *out_metrics)
+// compute_dist_metrics() against state, or against the state of node_id if state is NULL
+static bool compute_dist_metrics_state(metric_factory_id_e id, const char *node_id, dist_state_t *state, const uint32_t *current_dist, size_t limit, dist_metrics_t *out_metrics)
 {
   if (!out_metrics)
     return false;
@@ -142,337 +720,514 @@ bool compute_sinr_metrics(const char *node_id, const uint32_t *current_dist, siz
   out_metrics->min = NAN;
   out_metrics->max = NAN;
   out_metrics->count = 0;
+  for (size_t k = 0; k < DIST_NUM_PERCENTILES; k++)
+    out_metrics->percentiles[k] = NAN;
+  out_metrics->marginal_mean = NAN;
 
-  e2_node_dist_state_t *state = get_dist_state(node_id);
-  if (!state)
+  const metric_factory_entry_t *e = metric_factory_entry(id);
+  if (e == NULL)
     return false;
+  pthread_once(&metric_factory_once, init_metric_factory_tables);
+  const metric_factory_tables_t *t = &metric_factory_tables[id];
 
-  uint32_t diff_dist[128] = {0};
-  uint32_t total_count = 0;
-  uint32_t total_current = 0;
+  // 1-D distributions may be reported with fewer bins, multi-dimensional ones must match the registered layout
+  if (limit > t->nbins || (e->naxes > 1 && limit != t->nbins))
+    return false;
 
+  uint32_t total_current = 0;
   for (size_t i = 0; i < limit; i++)
   {
     total_current += current_dist[i];
   }
 
+  // Per-UE metrics don't have these distributions; return early
   if (total_current == 0)
   {
     return true;
   }
 
-  for (size_t i = 0; i < limit; i++)
+  uint32_t cumulative[METRIC_FACTORY_MAX_BINS];
+  dist_delta_t delta;
+  if (state == NULL)
+    state = get_dist_state(node_id, e->meas_name, limit);
+  update_dist(state, current_dist, limit, t->weight, cumulative, &delta);
+
+  if (delta.count == 0)
   {
-    if (current_dist[i] >= state->last_ss_sinr_dist[i])
-    {
-      diff_dist[i] = current_dist[i] - state->last_ss_sinr_dist[i];
-    }
-    else
-    {
-      diff_dist[i] = current_dist[i];
-    }
-    total_count += diff_dist[i];
-    state->last_ss_sinr_dist[i] = current_dist[i];
+    return true;
   }
 
-  if (total_count == 0)
+  out_metrics->mean = e->mean_in_linear ? 10.0 * log10(delta.weighted_sum / delta.count) : delta.weighted_sum / delta.count;
+  out_metrics->count = delta.count;
+
+  if (e->naxes == 1)
   {
+    out_metrics->min = t->values[delta.min_bin];
+    out_metrics->max = t->values[delta.max_bin];
+    dist_percentiles(cumulative, limit, t->values, dist_percentile_levels, DIST_NUM_PERCENTILES, out_metrics->percentiles);
     return true;
   }
 
-  double sum = 0;
-  double min_val = 9999.0, max_val = -9999.0;
-  for (size_t i = 0; i < limit; i++)
+  // Fold the bins onto the value axis and the marginal axis. All bins before min_bin have a zero difference.
+  uint32_t value_hist[METRIC_FACTORY_MAX_AXIS_BINS] = {0};
+  double marginal_sum = 0;
+  uint32_t prev = 0;
+  for (size_t i = (size_t)delta.min_bin; i <= (size_t)delta.max_bin; i++)
+  {
+    uint32_t diff = cumulative[i] - prev;
+    prev = cumulative[i];
+    value_hist[t->value_idx[i]] += diff;
+    if (e->marginal_axis >= 0)
+      marginal_sum += (double)(e->first_label[e->marginal_axis] + t->marginal_idx[i]) * diff;
+  }
+  size_t nvalues = e->dims[e->value_axis];
+  uint32_t value_cumulative[METRIC_FACTORY_MAX_AXIS_BINS];
+  uint32_t count = 0;
+  int min_idx = -1, max_idx = -1;
+  for (size_t v = 0; v < nvalues; v++)
   {
-    if (diff_dist[i] > 0)
+    count += value_hist[v];
+    value_cumulative[v] = count;
+    if (value_hist[v] != 0)
     {
-      double db_val = (i == 0) ? -23.5 : (-23.5 + 0.5 * i);
-      double linear_val = pow(10.0, db_val / 10.0);
-      sum += linear_val * diff_dist[i];
-      if (db_val < min_val)
-        min_val = db_val;
-      if (db_val > max_val)
-        max_val = db_val;
+      if (min_idx < 0)
+        min_idx = (int)v;
+      max_idx = (int)v;
     }
   }
 
-  out_metrics->mean = 10.0 * log10(sum / total_count);
-  out_metrics->min = min_val;
-  out_metrics->max = max_val;
-  out_metrics->count = total_count;
+  out_metrics->min = t->values[min_idx];
+  out_metrics->max = t->values[max_idx];
+  dist_percentiles(value_cumulative, nvalues, t->values, dist_percentile_levels, DIST_NUM_PERCENTILES, out_metrics->percentiles);
+  if (e->marginal_axis >= 0)
+    out_metrics->marginal_mean = marginal_sum / delta.count;
 
   return true;
 }
 
-factory_metrics_array_t process_metric_factory(const char *node_id, const char *metric_name, const label_info_lst_t *label_info_lst, size_t label_info_lst_len, const meas_record_lst_t *meas_record_lst, size_t rec_idx_start)
+bool compute_dist_metrics(metric_factory_id_e id, const char *node_id, const uint32_t *current_dist, size_t limit, dist_metrics_t *out_metrics)
 {
-  (void)label_info_lst;
-  factory_metrics_array_t ret = {0};
+  return compute_dist_metrics_state(id, node_id, NULL, current_dist, limit, out_metrics);
+}
 
-  // Derive RSRP.Mean, RSRP.Minimum, RSRP.Maximum, and RSRP.Count from L1M.SS-RSRP
-  if (strcmp(metric_name, "L1M.SS-RSRP") == 0 && label_info_lst_len <= 128)
-  {
-    uint32_t current_dist[128] = {0};
-    for (size_t i = 0; i < label_info_lst_len; i++)
-    {
-      if (meas_record_lst[rec_idx_start + i].value == 0)
-        current_dist[i] = meas_record_lst[rec_idx_start + i].int_val;
-      else if (meas_record_lst[rec_idx_start + i].value == 1)
-        current_dist[i] = (uint32_t)meas_record_lst[rec_idx_start + i].real_val;
-    }
+bool compute_rsrp_metrics(const char *node_id, const uint32_t *current_dist, size_t limit, dist_metrics_t *out_metrics)
+{
+  return compute_dist_metrics(METRIC_FACTORY_SS_RSRP, node_id, current_dist, limit, out_metrics);
+}
 
-    dist_metrics_t metrics;
-    if (compute_rsrp_metrics(node_id, current_dist, label_info_lst_len, &metrics))
-    {
-      ret.count = 4;
-      ret.metrics = calloc(ret.count, sizeof(factory_metric_t));
+bool compute_sinr_metrics(const char *node_id, const uint32_t *current_dist, size_t limit, dist_metrics_t *out_metrics)
+{
+  return compute_dist_metrics(METRIC_FACTORY_SS_SINR, node_id, current_dist, limit, out_metrics);
+}
 
-      snprintf(ret.metrics[0].name, sizeof(ret.metrics[0].name), "RSRP.Mean");
-      ret.metrics[0].value_type = 1;
-      ret.metrics[0].real_val = metrics.mean;
+const char *factory_metric_name(uint16_t name_id)
+{
+  size_t id = name_id / METRIC_FACTORY_MAX_OUTPUTS;
+  size_t k = name_id % METRIC_FACTORY_MAX_OUTPUTS;
+  if (id >= METRIC_FACTORY_NUM_IDS)
+    return NULL;
+  pthread_once(&metric_factory_once, init_metric_factory_tables);
+  if (k >= metric_factory_tables[id].num_outputs)
+    return NULL;
+  return metric_factory_tables[id].output_names[k];
+}
 
-      snprintf(ret.metrics[1].name, sizeof(ret.metrics[1].name), "RSRP.Minimum");
-      ret.metrics[1].value_type = 1;
-      ret.metrics[1].real_val = metrics.min;
+const char *factory_metric_field_name(uint16_t name_id)
+{
+  size_t id = name_id / METRIC_FACTORY_MAX_OUTPUTS;
+  size_t k = name_id % METRIC_FACTORY_MAX_OUTPUTS;
+  if (id >= METRIC_FACTORY_NUM_IDS)
+    return NULL;
+  pthread_once(&metric_factory_once, init_metric_factory_tables);
+  if (k >= metric_factory_tables[id].num_outputs)
+    return NULL;
+  return metric_factory_tables[id].output_field_names[k];
+}
 
-      snprintf(ret.metrics[2].name, sizeof(ret.metrics[2].name), "RSRP.Maximum");
-      ret.metrics[2].value_type = 1;
-      ret.metrics[2].real_val = metrics.max;
+static void set_factory_metric(factory_metric_t *out, size_t capacity, size_t *k, const metric_factory_tables_t *t, uint16_t name_base, int value_type, int int_val, double real_val)
+{
+  if (*k >= capacity)
+    return;
+  factory_metric_t *m = &out[*k];
+  m->name_id = name_base + *k;
+  m->name = t->output_names[*k];
+  m->unit = t->output_units[*k];
+  m->value_type = value_type;
+  m->int_val = int_val;
+  m->real_val = real_val;
+  (*k)++;
+}
 
-      snprintf(ret.metrics[3].name, sizeof(ret.metrics[3].name), "RSRP.Count");
-      ret.metrics[3].value_type = 0;
-      ret.metrics[3].int_val = metrics.count;
-    }
+static void read_dist_records(const meas_record_lst_t *meas_record_lst, size_t rec_idx_start, size_t len, uint32_t *dist)
+{
+  for (size_t i = 0; i < len; i++)
+  {
+    const meas_record_lst_t *rec = &meas_record_lst[rec_idx_start + i];
+    if (rec->value == 0)
+      dist[i] = rec->int_val;
+    else if (rec->value == 1)
+      dist[i] = (uint32_t)rec->real_val;
+    else
+      dist[i] = 0;
   }
+}
 
-  // Derive SINR metrics
-  if (strcmp(metric_name, "MR.NRScSSSINR") == 0 && label_info_lst_len <= 128)
+size_t process_metric_factory_into(metric_factory_id_e id, const char *node_id, dist_state_t *state, const label_info_lst_t *label_info_lst, size_t label_info_lst_len, const meas_record_lst_t *meas_record_lst, size_t rec_idx_start, factory_metric_t *out, size_t capacity)
+{
+  (void)label_info_lst;
+
+  const metric_factory_entry_t *e = metric_factory_entry(id);
+  if (e == NULL || label_info_lst_len > METRIC_FACTORY_MAX_BINS)
+    return 0;
+
+  uint32_t current_dist[METRIC_FACTORY_MAX_BINS];
+  read_dist_records(meas_record_lst, rec_idx_start, label_info_lst_len, current_dist);
+
+  dist_metrics_t metrics;
+  if (!compute_dist_metrics_state(id, node_id, state, current_dist, label_info_lst_len, &metrics))
+    return 0;
+
+  // Outputs follow the order of the reducer flags, as laid out by init_metric_factory_tables()
+  const metric_factory_tables_t *t = &metric_factory_tables[id];
+  uint16_t name_base = (uint16_t)(id * METRIC_FACTORY_MAX_OUTPUTS);
+  size_t k = 0;
+  if (e->reducers & METRIC_FACTORY_MEAN)
+    set_factory_metric(out, capacity, &k, t, name_base, 1, 0, metrics.mean);
+  if (e->reducers & METRIC_FACTORY_MIN)
+    set_factory_metric(out, capacity, &k, t, name_base, 1, 0, metrics.min);
+  if (e->reducers & METRIC_FACTORY_MAX)
+    set_factory_metric(out, capacity, &k, t, name_base, 1, 0, metrics.max);
+  if (e->reducers & METRIC_FACTORY_COUNT)
+    set_factory_metric(out, capacity, &k, t, name_base, 0, metrics.count, 0);
+  if (e->reducers & METRIC_FACTORY_PERCENTILES)
   {
-    uint32_t current_dist[128] = {0};
-    for (size_t i = 0; i < label_info_lst_len; i++)
-    {
-      if (meas_record_lst[rec_idx_start + i].value == 0)
-        current_dist[i] = meas_record_lst[rec_idx_start + i].int_val;
-      else if (meas_record_lst[rec_idx_start + i].value == 1)
-        current_dist[i] = (uint32_t)meas_record_lst[rec_idx_start + i].real_val;
-    }
+    for (size_t p = 0; p < DIST_NUM_PERCENTILES; p++)
+      set_factory_metric(out, capacity, &k, t, name_base, 1, 0, metrics.percentiles[p]);
+  }
+  if (e->reducers & METRIC_FACTORY_MARGINAL)
+    set_factory_metric(out, capacity, &k, t, name_base, 1, 0, metrics.marginal_mean);
 
-    dist_metrics_t metrics;
-    if (compute_sinr_metrics(node_id, current_dist, label_info_lst_len, &metrics))
-    {
-      ret.count = 4;
-      ret.metrics = calloc(ret.count, sizeof(factory_metric_t));
+  return k;
+}
 
-      snprintf(ret.metrics[0].name, sizeof(ret.metrics[0].name), "SINR.Mean");
-      ret.metrics[0].value_type = 1;
-      ret.metrics[0].real_val = metrics.mean;
+size_t metric_factory_value_hist(metric_factory_id_e id, const meas_record_lst_t *meas_record_lst, size_t rec_idx_start, size_t len, uint64_t *hist, const double **values)
+{
+  const metric_factory_entry_t *e = metric_factory_entry(id);
+  if (e == NULL)
+    return 0;
+  pthread_once(&metric_factory_once, init_metric_factory_tables);
+  const metric_factory_tables_t *t = &metric_factory_tables[id];
+  if (len > t->nbins || (e->naxes > 1 && len != t->nbins))
+    return 0;
 
-      snprintf(ret.metrics[1].name, sizeof(ret.metrics[1].name), "SINR.Minimum");
-      ret.metrics[1].value_type = 1;
-      ret.metrics[1].real_val = metrics.min;
+  uint32_t dist[METRIC_FACTORY_MAX_BINS];
+  read_dist_records(meas_record_lst, rec_idx_start, len, dist);
 
-      snprintf(ret.metrics[2].name, sizeof(ret.metrics[2].name), "SINR.Maximum");
-      ret.metrics[2].value_type = 1;
-      ret.metrics[2].real_val = metrics.max;
+  size_t nvalues = e->dims[e->value_axis];
+  memset(hist, 0, nvalues * sizeof(hist[0]));
+  for (size_t i = 0; i < len; i++)
+    hist[t->value_idx[i]] += dist[i];
+  *values = t->values;
+  return nvalues;
+}
 
-      snprintf(ret.metrics[3].name, sizeof(ret.metrics[3].name), "SINR.Count");
-      ret.metrics[3].value_type = 0;
-      ret.metrics[3].int_val = metrics.count;
-    }
-  }
+factory_metrics_array_t process_metric_factory_id(metric_factory_id_e id, const char *node_id, const label_info_lst_t *label_info_lst, size_t label_info_lst_len, const meas_record_lst_t *meas_record_lst, size_t rec_idx_start)
+{
+  static _Thread_local factory_metric_t thread_metrics[METRIC_FACTORY_MAX_OUTPUTS];
 
+  factory_metrics_array_t ret = {0};
+  ret.metrics = thread_metrics;
+  ret.count = process_metric_factory_into(id, node_id, NULL, label_info_lst, label_info_lst_len, meas_record_lst, rec_idx_start, thread_metrics, METRIC_FACTORY_MAX_OUTPUTS);
   return ret;
 }
 
+factory_metrics_array_t process_metric_factory(const char *node_id, const char *metric_name, const label_info_lst_t *label_info_lst, size_t label_info_lst_len, const meas_record_lst_t *meas_record_lst, size_t rec_idx_start)
+{
+  return process_metric_factory_id(metric_factory_lookup(metric_name), node_id, label_info_lst, label_info_lst_len, meas_record_lst, rec_idx_start);
+}
+
 void free_factory_metrics(factory_metrics_array_t *arr)
 {
-  if (arr->metrics)
+  arr->metrics = NULL;
+  arr->count = 0;
+}
+
+bool meas_array_buf_write(void *ctx, const char *data, size_t len)
+{
+  meas_array_buf_t *b = ctx;
+  if (b->cap == 0 || len > b->cap - 1 - b->len)
+    return false;
+  memcpy(b->buf + b->len, data, len);
+  b->len += len;
+  b->buf[b->len] = '\0';
+  return true;
+}
+
+bool meas_array_file_write(void *ctx, const char *data, size_t len)
+{
+  return fwrite(data, 1, len, (FILE *)ctx) == len;
+}
+
+// Output is staged in a small chunk and handed to the sink whenever the chunk fills up
+typedef struct
+{
+  meas_array_write_fn write;
+  void *ctx;
+  bool ok;
+  size_t len;
+  char chunk[512];
+} meas_array_stream_t;
+
+static void stream_flush(meas_array_stream_t *s)
+{
+  if (s->ok && s->len > 0)
+    s->ok = s->write(s->ctx, s->chunk, s->len);
+  s->len = 0;
+}
+
+static void stream_put(meas_array_stream_t *s, const char *data, size_t len)
+{
+  if (s->len + len > sizeof(s->chunk))
+    stream_flush(s);
+  if (len > sizeof(s->chunk))
   {
-    free(arr->metrics);
-    arr->metrics = NULL;
+    if (s->ok)
+      s->ok = s->write(s->ctx, data, len);
+    return;
   }
-  arr->count = 0;
+  memcpy(s->chunk + s->len, data, len);
+  s->len += len;
+}
+
+// Writes the decimal digits of v so that they end right before end, and returns the first digit
+static char *format_u64_backwards(char *end, uint64_t v)
+{
+  do
+  {
+    *--end = (char)('0' + v % 10);
+    v /= 10;
+  } while (v != 0);
+  return end;
+}
+
+static void stream_put_int(meas_array_stream_t *s, int64_t v)
+{
+  char buf[24];
+  char *end = buf + sizeof(buf);
+  uint64_t mag = v < 0 ? (uint64_t)0 - (uint64_t)v : (uint64_t)v;
+  char *p = format_u64_backwards(end, mag);
+  if (v < 0)
+    *--p = '-';
+  stream_put(s, p, (size_t)(end - p));
+}
+
+// Same output as printf("%.2f"). Values whose third decimal is close to a rounding tie, large values and non-finite
+// values go through snprintf; all others are rounded in fixed point.
+static void stream_put_real(meas_array_stream_t *s, double v)
+{
+  double mag = fabs(v);
+  if (isfinite(v) && mag < 1e7)
+  {
+    double scaled = mag * 100.0;
+    double frac = scaled - floor(scaled);
+    if (fabs(frac - 0.5) > 1e-6)
+    {
+      uint64_t cents = (uint64_t)llround(scaled);
+      char buf[32];
+      char *end = buf + sizeof(buf);
+      char *p = end;
+      *--p = (char)('0' + cents % 10);
+      *--p = (char)('0' + cents / 10 % 10);
+      *--p = '.';
+      p = format_u64_backwards(p, cents / 100);
+      if (signbit(v))
+        *--p = '-';
+      stream_put(s, p, (size_t)(end - p));
+      return;
+    }
+  }
+
+  char buf[352];
+  int n = snprintf(buf, sizeof(buf), "%.2f", v);
+  if (n > 0)
+    stream_put(s, buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+static bool is_zero_record(const meas_record_lst_t *rec)
+{
+  return (rec->value == 0 && rec->int_val == 0) || (rec->value == 1 && rec->real_val == 0.0 && !signbit(rec->real_val));
+}
+
+// A run of n zero bins is written as 0 when n is 1 and as -n otherwise
+static void stream_put_zero_run(meas_array_stream_t *s, int64_t n)
+{
+  stream_put_int(s, n == 1 ? 0 : -n);
 }
 
-void format_meas_record_array(char *arr_str, size_t max_len, const label_info_lst_t *label_info_lst, size_t label_info_lst_len, const meas_record_lst_t *meas_record_lst, size_t rec_idx_start)
+bool write_meas_record_array(meas_array_write_fn write, void *ctx, const label_info_lst_t *label_info_lst, size_t label_info_lst_len, const meas_record_lst_t *meas_record_lst, size_t rec_idx_start, bool compact)
 {
-  size_t arr_len = 0;
-  arr_str[0] = '\0';
+  meas_array_stream_t s = {.write = write, .ctx = ctx, .ok = true};
   uint32_t last_x = 0, last_y = 0;
   bool has_y = label_info_lst_len > 0 && label_info_lst[0].distBinY != NULL;
   bool has_z = label_info_lst_len > 0 && label_info_lst[0].distBinZ != NULL;
+  // Zero bins of the current innermost array that are not written yet
+  int64_t zero_run = 0;
 
-  size_t rec_idx = rec_idx_start;
-
-  for (size_t z = 0; z < label_info_lst_len; z++)
+  for (size_t z = 0; z < label_info_lst_len && s.ok; z++)
   {
-    const label_info_lst_t label_info = label_info_lst[z];
-    const meas_record_lst_t record_item = meas_record_lst[rec_idx++];
+    const label_info_lst_t *label_info = &label_info_lst[z];
+    const meas_record_lst_t *record_item = &meas_record_lst[rec_idx_start + z];
 
-    uint32_t cur_x = label_info.distBinX ? *label_info.distBinX : 0;
-    uint32_t cur_y = label_info.distBinY ? *label_info.distBinY : 0;
+    uint32_t cur_x = label_info->distBinX ? *label_info->distBinX : 0;
+    uint32_t cur_y = label_info->distBinY ? *label_info->distBinY : 0;
 
-    int n = 0;
+    const char *sep = ", ";
     if (z == 0)
+      sep = has_z ? "[[[" : has_y ? "[[" : "[";
+    else if (has_z && cur_x != last_x)
+      sep = "]], [[";
+    else if ((has_z && cur_y != last_y) || (has_y && cur_x != last_x))
+      sep = "], [";
+    last_x = cur_x;
+    last_y = cur_y;
+
+    bool zero = compact && is_zero_record(record_item);
+    // Extend the run while the bins stay in the same innermost array
+    if (zero && zero_run > 0 && sep[0] == ',')
     {
-      if (has_z)
-        n = snprintf(arr_str + arr_len, max_len - arr_len, "[[[");
-      else if (has_y)
-        n = snprintf(arr_str + arr_len, max_len - arr_len, "[[");
-      else
-        n = snprintf(arr_str + arr_len, max_len - arr_len, "[");
+      zero_run++;
+      continue;
     }
-    else
+    if (zero_run > 0)
     {
-      if (has_z && cur_x != last_x)
-        n = snprintf(arr_str + arr_len, max_len - arr_len, "]], [[");
-      else if (has_z && cur_y != last_y)
-        n = snprintf(arr_str + arr_len, max_len - arr_len, "], [");
-      else if (has_y && cur_x != last_x)
-        n = snprintf(arr_str + arr_len, max_len - arr_len, "], [");
-      else
-        n = snprintf(arr_str + arr_len, max_len - arr_len, ", ");
+      stream_put_zero_run(&s, zero_run);
+      zero_run = 0;
     }
-    if (n > 0)
-      arr_len += ((size_t)n < max_len - arr_len) ? (size_t)n : max_len - arr_len - 1;
 
-    if (record_item.value == 0)
-      n = snprintf(arr_str + arr_len, max_len - arr_len, "%d", record_item.int_val);
-    else if (record_item.value == 1)
-      n = snprintf(arr_str + arr_len, max_len - arr_len, "%.2f", record_item.real_val);
+    stream_put(&s, sep, strlen(sep));
+    if (zero)
+      zero_run = 1;
+    else if (record_item->value == 0)
+      stream_put_int(&s, (int)record_item->int_val);
+    else if (record_item->value == 1)
+      stream_put_real(&s, record_item->real_val);
     else
-      n = snprintf(arr_str + arr_len, max_len - arr_len, "null");
-
-    if (n > 0)
-      arr_len += ((size_t)n < max_len - arr_len) ? (size_t)n : max_len - arr_len - 1;
-
-    last_x = cur_x;
-    last_y = cur_y;
+      stream_put(&s, "null", 4);
   }
 
+  if (zero_run > 0)
+    stream_put_zero_run(&s, zero_run);
   if (label_info_lst_len > 0)
   {
-    int n = 0;
-    if (has_z)
-      n = snprintf(arr_str + arr_len, max_len - arr_len, "]]]");
-    else if (has_y)
-      n = snprintf(arr_str + arr_len, max_len - arr_len, "]]");
-    else
-      n = snprintf(arr_str + arr_len, max_len - arr_len, "]");
-    if (n > 0)
-      arr_len += ((size_t)n < max_len - arr_len) ? (size_t)n : max_len - arr_len - 1;
+    const char *end = has_z ? "]]]" : has_y ? "]]" : "]";
+    stream_put(&s, end, strlen(end));
   }
+  stream_flush(&s);
+  return s.ok;
 }
 
-static label_info_lst_t fill_kpm_label(void)
+bool format_meas_record_array(char *arr_str, size_t max_len, const label_info_lst_t *label_info_lst, size_t label_info_lst_len, const meas_record_lst_t *meas_record_lst, size_t rec_idx_start)
 {
-  label_info_lst_t label_item = {0};
-  label_item.noLabel = ecalloc(1, sizeof(enum_value_e));
-  *label_item.noLabel = TRUE_ENUM_VALUE;
-  return label_item;
+  meas_array_buf_t buf = {.buf = arr_str, .len = 0, .cap = max_len};
+  if (max_len > 0)
+    arr_str[0] = '\0';
+  return write_meas_record_array(meas_array_buf_write, &buf, label_info_lst, label_info_lst_len, meas_record_lst, rec_idx_start, false);
 }
 
-static label_info_lst_t fill_distribution_bin_1d_label(const uint32_t x)
-{
-  label_info_lst_t label_item = {0};
-  label_item.distBinX = calloc(1, sizeof(uint32_t));
-  assert(label_item.distBinX != NULL);
-  *label_item.distBinX = x;
-  return label_item;
-}
+// Label tables shared by all subscriptions, built once by init_shared_label_info() and never freed.
+// The label values point into shared_label_values.
+static enum_value_e shared_no_label = TRUE_ENUM_VALUE;
+static label_info_lst_t shared_kpm_label_info = {.noLabel = &shared_no_label};
+static uint32_t shared_label_values[METRIC_FACTORY_MAX_AXIS_BINS + 1];
+static label_info_lst_t *shared_label_info[METRIC_FACTORY_NUM_IDS];
+static pthread_once_t shared_label_info_once = PTHREAD_ONCE_INIT;
 
-static label_info_lst_t fill_distribution_bin_label(const uint32_t x, const uint32_t y, const uint32_t z)
+static void init_shared_label_info(void)
 {
-  label_info_lst_t label_item = {0};
-  label_item.distBinX = calloc(1, sizeof(uint32_t));
-  assert(label_item.distBinX != NULL);
-  *label_item.distBinX = x;
-
-  label_item.distBinY = calloc(1, sizeof(uint32_t));
-  assert(label_item.distBinY != NULL);
-  *label_item.distBinY = y;
-
-  label_item.distBinZ = calloc(1, sizeof(uint32_t));
-  assert(label_item.distBinZ != NULL);
-  *label_item.distBinZ = z;
-  return label_item;
-}
+  for (uint32_t v = 0; v <= METRIC_FACTORY_MAX_AXIS_BINS; v++)
+    shared_label_values[v] = v;
 
-void populate_label_info(meas_info_format_1_lst_t *meas_item)
-{
-  if (cmp_str_ba("CARR.WBCQIDist", meas_item->meas_type.name) == 0)
-  {
-    /// 0-15 CQI, 1-8 RI, 1-3 CQI table
-    meas_item->label_info_lst_len = 16 * 8 * 3;
-    meas_item->label_info_lst = ecalloc(meas_item->label_info_lst_len, sizeof(label_info_lst_t));
-    size_t idx = 0;
-    for (uint32_t x = 0; x <= 15; x++)
-    {
-      for (uint32_t y = 1; y <= 8; y++)
-      {
-        for (uint32_t z = 1; z <= 3; z++)
-        {
-          meas_item->label_info_lst[idx++] = fill_distribution_bin_label(x, y, z);
-        }
-      }
-    }
-  }
-  else if (cmp_str_ba("CARR.PDSCHMCSDist", meas_item->meas_type.name) == 0)
+  for (int id = 0; id < METRIC_FACTORY_NUM_IDS; id++)
   {
-    /// 1-8 RI, 1-3 MCS table, 0-31 MCS value
-    meas_item->label_info_lst_len = 8 * 3 * 32;
-    meas_item->label_info_lst = ecalloc(meas_item->label_info_lst_len, sizeof(label_info_lst_t));
-    size_t idx = 0;
-    for (uint32_t x = 1; x <= 8; x++)
-    {
-      for (uint32_t y = 1; y <= 3; y++)
-      {
-        for (uint32_t z = 0; z <= 31; z++)
-        {
-          meas_item->label_info_lst[idx++] = fill_distribution_bin_label(x, y, z);
-        }
-      }
-    }
-  }
-  else if (cmp_str_ba("CARR.PUSCHMCSDist", meas_item->meas_type.name) == 0)
-  {
-    /// 1-8 RI, 1-2 MCS table, 0-31 MCS value
-    meas_item->label_info_lst_len = 8 * 2 * 32;
-    meas_item->label_info_lst = ecalloc(meas_item->label_info_lst_len, sizeof(label_info_lst_t));
+    const metric_factory_entry_t *e = &metric_factory_registry[id];
+    size_t nbins = (size_t)e->dims[0] * e->dims[1] * e->dims[2];
+    label_info_lst_t *labels = ecalloc(nbins, sizeof(label_info_lst_t));
+
+    // One label per bin, X outermost and Z innermost
     size_t idx = 0;
-    for (uint32_t x = 1; x <= 8; x++)
+    for (uint32_t x = 0; x < e->dims[0]; x++)
     {
-      for (uint32_t y = 1; y <= 2; y++)
+      for (uint32_t y = 0; y < e->dims[1]; y++)
       {
-        for (uint32_t z = 0; z <= 31; z++)
+        for (uint32_t z = 0; z < e->dims[2]; z++)
         {
-          meas_item->label_info_lst[idx++] = fill_distribution_bin_label(x, y, z);
+          assert(e->first_label[0] + x <= METRIC_FACTORY_MAX_AXIS_BINS && e->first_label[1] + y <= METRIC_FACTORY_MAX_AXIS_BINS && e->first_label[2] + z <= METRIC_FACTORY_MAX_AXIS_BINS);
+          labels[idx].distBinX = &shared_label_values[e->first_label[0] + x];
+          if (e->naxes > 1)
+          {
+            labels[idx].distBinY = &shared_label_values[e->first_label[1] + y];
+            labels[idx].distBinZ = &shared_label_values[e->first_label[2] + z];
+          }
+          idx++;
         }
       }
     }
+    shared_label_info[id] = labels;
   }
-  else if (cmp_str_ba("L1M.SS-RSRP", meas_item->meas_type.name) == 0)
+}
+
+static bool is_shared_label_info(const label_info_lst_t *label_info_lst)
+{
+  if (label_info_lst == &shared_kpm_label_info)
+    return true;
+  for (int id = 0; id < METRIC_FACTORY_NUM_IDS; id++)
   {
-    meas_item->label_info_lst_len = 128;
-    meas_item->label_info_lst = ecalloc(meas_item->label_info_lst_len, sizeof(label_info_lst_t));
-    for (uint32_t x = 1; x <= 128; x++)
-    {
-      meas_item->label_info_lst[x - 1] = fill_distribution_bin_1d_label(x);
-    }
+    if (label_info_lst != NULL && label_info_lst == shared_label_info[id])
+      return true;
   }
-  else if (cmp_str_ba("MR.NRScSSSINR", meas_item->meas_type.name) == 0)
+  return false;
+}
+
+void populate_label_info(meas_info_format_1_lst_t *meas_item)
+{
+  pthread_once(&shared_label_info_once, init_shared_label_info);
+
+  metric_factory_id_e id = metric_factory_lookup_ba(meas_item->meas_type.name);
+  const metric_factory_entry_t *e = metric_factory_entry(id);
+  if (e == NULL)
   {
-    meas_item->label_info_lst_len = 128;
-    meas_item->label_info_lst = ecalloc(meas_item->label_info_lst_len, sizeof(label_info_lst_t));
-    for (uint32_t x = 1; x <= 128; x++)
-    {
-      meas_item->label_info_lst[x - 1] = fill_distribution_bin_1d_label(x);
-    }
+    meas_item->label_info_lst_len = 1;
+    meas_item->label_info_lst = &shared_kpm_label_info;
+    return;
   }
-  else
+
+  meas_item->label_info_lst_len = (size_t)e->dims[0] * e->dims[1] * e->dims[2];
+  meas_item->label_info_lst = shared_label_info[id];
+}
+
+void release_label_info(meas_info_format_1_lst_t *meas_item)
+{
+  if (!is_shared_label_info(meas_item->label_info_lst))
+    return;
+  // free_kpm_sub_data() expects at least one label, so leave it an empty one of its own
+  meas_item->label_info_lst_len = 1;
+  meas_item->label_info_lst = ecalloc(1, sizeof(label_info_lst_t));
+}
+
+static void release_act_def_frm_1_label_info(kpm_act_def_format_1_t *act_def)
+{
+  for (size_t i = 0; i < act_def->meas_info_lst_len; i++)
+    release_label_info(&act_def->meas_info_lst[i]);
+}
+
+void release_kpm_sub_label_info(kpm_sub_data_t *kpm_sub)
+{
+  for (size_t i = 0; i < kpm_sub->sz_ad; i++)
   {
-    meas_item->label_info_lst_len = 1;
-    meas_item->label_info_lst = ecalloc(meas_item->label_info_lst_len, sizeof(label_info_lst_t));
-    meas_item->label_info_lst[0] = fill_kpm_label();
+    kpm_act_def_t *act_def = &kpm_sub->ad[i];
+    if (act_def->type == FORMAT_1_ACTION_DEFINITION)
+      release_act_def_frm_1_label_info(&act_def->frm_1);
+    else if (act_def->type == FORMAT_4_ACTION_DEFINITION)
+      release_act_def_frm_1_label_info(&act_def->frm_4.action_def_format_1);
   }
 }
@@ -4,16 +4,26 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "../../../src/xApp/e42_xapp_api.h"
 
-#define MAX_E2_NODES 16
-
+// Last cumulative distribution reported by one E2 node for one metric, used to derive per-period deltas.
+// Entries live in a hash table keyed by (node ID, metric name) that grows with the number of nodes.
 typedef struct
 {
-  char node_id_str[256];
-  uint32_t last_ss_rsrp_dist[128];
-  uint32_t last_ss_sinr_dist[128];
-} e2_node_dist_state_t;
+  uint32_t hash;
+  char *node_id;
+  char *metric_name;
+  size_t nbins;
+  uint32_t *last_dist;
+  // Held while the delta against last_dist is computed
+  pthread_mutex_t mtx;
+} dist_state_t;
+
+// Percentiles derived from the distributions (RSRP.P5, RSRP.P50, ...)
+#define DIST_NUM_PERCENTILES 3
+extern const double dist_percentile_levels[DIST_NUM_PERCENTILES];
 
 typedef struct
 {
@@ -21,11 +31,142 @@ typedef struct
   double min;
   double max;
   uint32_t count;
+  double percentiles[DIST_NUM_PERCENTILES];
+  // Mean label of the marginal axis (e.g. the mean RI), NaN for distributions without one
+  double marginal_mean;
 } dist_metrics_t;
 
+// Reduction of the per-bin difference between two cumulative distributions
+typedef struct
+{
+  uint32_t count;
+  // Sum of the weight of each bin times its difference
+  double weighted_sum;
+  // First and last bin with a non-zero difference, -1 if there is none
+  int min_bin;
+  int max_bin;
+} dist_delta_t;
+
+// Distribution measurements known to the metric factory. IDs are resolved from the measurement names once, when the
+// subscription is generated, so that indications are processed without comparing names.
+typedef enum
+{
+  METRIC_FACTORY_NONE = -1,
+  METRIC_FACTORY_SS_RSRP = 0,
+  METRIC_FACTORY_SS_SINR,
+  METRIC_FACTORY_WB_CQI,
+  METRIC_FACTORY_PDSCH_MCS,
+  METRIC_FACTORY_PUSCH_MCS,
+  METRIC_FACTORY_NUM_IDS,
+} metric_factory_id_e;
+
+// Reducers applied to a distribution, emitted in this order as <prefix>.Mean, .Minimum, .Maximum, .Count, .P<level>
+// and .<marginal name>.Mean
+typedef enum
+{
+  METRIC_FACTORY_MEAN = 1 << 0,
+  METRIC_FACTORY_MIN = 1 << 1,
+  METRIC_FACTORY_MAX = 1 << 2,
+  METRIC_FACTORY_COUNT = 1 << 3,
+  METRIC_FACTORY_PERCENTILES = 1 << 4,
+  METRIC_FACTORY_MARGINAL = 1 << 5,
+} metric_factory_reducer_e;
+
+#define METRIC_FACTORY_MAX_BINS 768
+#define METRIC_FACTORY_MAX_AXIS_BINS 128
+#define METRIC_FACTORY_MAX_OUTPUTS (4 + DIST_NUM_PERCENTILES + 1)
+
+typedef struct
+{
+  const char *meas_name;
+  // Prefix and unit of the derived metrics
+  const char *prefix;
+  const char *unit;
+  // Number of bins and first bin label of the X, Y and Z axes, unused axes have one bin
+  int naxes;
+  uint32_t dims[3];
+  uint32_t first_label[3];
+  // Axis holding the measured value; bin i of that axis has the value value_offset + value_step * i
+  int value_axis;
+  double value_offset;
+  double value_step;
+  // Average the values in linear scale (dB values)
+  bool mean_in_linear;
+  // Axis averaged by METRIC_FACTORY_MARGINAL, -1 if none
+  int marginal_axis;
+  const char *marginal_name;
+  uint32_t reducers;
+} metric_factory_entry_t;
+
+#define METRIC_FACTORY_NAME_LEN 160
+#define METRIC_FACTORY_UNIT_LEN 64
+#define METRIC_FACTORY_COLUMN_LEN (METRIC_FACTORY_NAME_LEN + METRIC_FACTORY_UNIT_LEN + 4)
+
+// Measurement names are interned in a process-wide table, IDs stay valid until the process exits
+#define METRIC_FACTORY_MAX_MEAS_NAMES 512
+#define METRIC_FACTORY_NO_NAME_ID UINT16_MAX
+
+// Unit of a measurement as listed in the KPM measurement list (e.g. "[dBm]"), NULL or "" if it has none
+typedef const char *(*metric_factory_unit_fn)(const char *meas_name);
+
+// Measurement of an action definition, compiled when the subscription is generated so that indications are processed by
+// index, without copying, hashing or formatting names
+typedef struct
+{
+  metric_factory_id_e id;
+  // State of the distribution on the E2 node of the plan, resolved by metric_factory_plans_add(). NULL for measurements
+  // without derived metrics and for those compiled from an indication, whose state is looked up by node ID and name.
+  dist_state_t *dist_state;
+  // Length of the measurement name, compared with name to detect indications that do not follow the action definition
+  size_t name_len;
+  // METRIC_FACTORY_NO_NAME_ID if the name could not be interned
+  uint16_t name_id;
+  char name[METRIC_FACTORY_NAME_LEN];
+  // Unit without the square brackets, "" if none
+  char unit[METRIC_FACTORY_UNIT_LEN];
+  // CSV header column, "<name> (<unit>)" or "<name>"
+  char csv_column[METRIC_FACTORY_COLUMN_LEN];
+  // InfluxDB field key, "<name>_<unit>" or "<name>" without the characters of the name that are not accepted in field
+  // keys. Empty if no character of the name is left.
+  char field_name[METRIC_FACTORY_COLUMN_LEN];
+} metric_factory_meas_t;
+
+// Compiled measurements of an action definition, by position
 typedef struct
 {
-  char name[128];
+  size_t len;
+  metric_factory_meas_t *meas;
+  // Resolves the units of measurements that do not follow the plan
+  metric_factory_unit_fn unit_of;
+} metric_factory_plan_t;
+
+typedef struct metric_factory_plan_node_s metric_factory_plan_node_t;
+
+// Plans of the subscriptions, by E2 node and action definition format, as the E2 nodes do not necessarily report the
+// same measurements. Plans are added when the subscriptions are generated and looked up without locking by the
+// indication callbacks, they stay valid until metric_factory_plans_free(), even once replaced.
+typedef struct
+{
+  _Atomic(metric_factory_plan_node_t *) head;
+  pthread_mutex_t mtx;
+  // Nodes replaced by a later subscription, freed with the others
+  metric_factory_plan_node_t *retired;
+  // Plan without measurements, returned for indications of unknown subscriptions
+  metric_factory_plan_t none;
+} metric_factory_plans_t;
+
+#define METRIC_FACTORY_PLANS_INIT(unit_fn) {.head = NULL, .mtx = PTHREAD_MUTEX_INITIALIZER, .retired = NULL, .none = {.unit_of = (unit_fn)}}
+
+// Plans kept per E2 node and action definition format: the plan of the subscription and those compiled from indications
+// that do not follow it
+#define METRIC_FACTORY_MAX_LAYOUTS 4
+
+typedef struct
+{
+  // Interned name, name_id maps back to it with factory_metric_name()
+  uint16_t name_id;
+  const char *name;
+  const char *unit;
   // 0 for int, 1 for real
   int value_type;
   int int_val;
@@ -38,20 +179,133 @@ typedef struct
   size_t count;
 } factory_metrics_array_t;
 
-e2_node_dist_state_t *get_dist_state(const char *e2_id);
+// Returns the state of (e2_id, metric_name), creating it with nbins zeroed bins if needed. Thread-safe.
+dist_state_t *get_dist_state(const char *e2_id, const char *metric_name, size_t nbins);
+
+// Stores current_dist as the last distribution of (node_id, metric_name) and, in the same pass, reduces the per-bin
+// difference to the previously stored one into delta, weighting each bin by bin_weight, and its prefix sums into
+// cumulative (limit entries). Bins that went down (counter reset) count from zero.
+void update_dist_state(const char *node_id, const char *metric_name, const uint32_t *current_dist, size_t limit, const double *bin_weight, uint32_t *cumulative, dist_delta_t *delta);
+
+// Values of the given ascending percentiles of a distribution with prefix sums cumulative, in one sweep over the bins.
+// A percentile is the value of the first bin whose cumulative count exceeds that share of the total.
+void dist_percentiles(const uint32_t *cumulative, size_t nbins, const double *bin_values, const double *levels, size_t num_levels, double *out);
+
+void free_dist_states(void);
 
 int get_percentile_val(uint32_t *dist, size_t index);
 double get_sinr_percentile_val(uint32_t *dist, size_t index);
 
+const metric_factory_entry_t *metric_factory_entry(metric_factory_id_e id);
+
+// Returns METRIC_FACTORY_NONE for measurements without derived metrics
+metric_factory_id_e metric_factory_lookup(const char *meas_name);
+metric_factory_id_e metric_factory_lookup_ba(byte_array_t meas_name);
+
+// Returns the ID of a measurement name, interning it if needed, or METRIC_FACTORY_NO_NAME_ID if the name is too long or
+// the table is full. Thread-safe, but meant to be called when subscriptions are generated.
+uint16_t metric_factory_intern(const char *name, size_t len);
+
+// Name of an interned measurement name ID, NULL for unknown IDs
+const char *metric_factory_meas_name(uint16_t name_id);
+
+// Compiles a measurement, looking up its unit with unit_of (may be NULL)
+void metric_factory_meas_compile(metric_factory_meas_t *meas, const meas_type_t *meas_type, metric_factory_unit_fn unit_of);
+
+// Compiles the measurements of an action definition. Call when the subscription is generated.
+void metric_factory_plan_build(metric_factory_plan_t *plan, const meas_info_format_1_lst_t *meas_info_lst, size_t len, metric_factory_unit_fn unit_of);
+
+// Compiled idx-th measurement of an indication. When the indication does not match the plan, the measurement is compiled
+// into tmp, which is returned instead.
+const metric_factory_meas_t *metric_factory_plan_meas(const metric_factory_plan_t *plan, size_t idx, const meas_type_t *meas_type, metric_factory_meas_t *tmp);
+
+// Factory ID of the idx-th measurement of an indication. Falls back to a name lookup when the indication does not
+// match the plan.
+metric_factory_id_e metric_factory_plan_id(const metric_factory_plan_t *plan, size_t idx, byte_array_t meas_name);
+
+void metric_factory_plan_free(metric_factory_plan_t *plan);
+
+// Name of an E2 node in the distribution states and in the exported rows, e.g. "DU:3584", or "Unknown" if node_id is NULL
+void metric_factory_node_name(const global_e2_node_id_t *node_id, char *buf, size_t len);
+
+// Compiles the measurements of the action definition subscribed to on node_id and resolves the distribution states of
+// the node, which stay valid until free_dist_states(). Call when the subscription is generated, before it is sent.
+// Replaces the plans of a previous subscription of the node with the same format. Action definitions other than format
+// 1 and 4 are ignored.
+void metric_factory_plans_add(metric_factory_plans_t *plans, const global_e2_node_id_t *node_id, const kpm_act_def_t *ad);
+
+// Plan of node_id with the given action definition format whose measurements are those of an indication (meas_info_lst,
+// len). An indication that does not follow the subscription, or of a node without one, gets a plan compiled from its
+// measurements on first sight. Returns the plan without measurements if node_id is NULL or the node has too many
+// layouts, so that the measurements are compiled from the indication.
+const metric_factory_plan_t *metric_factory_plans_find(metric_factory_plans_t *plans, const global_e2_node_id_t *node_id, format_action_def_e format, const meas_info_format_1_lst_t *meas_info_lst, size_t len);
+
+// Call once no indication can be received anymore
+void metric_factory_plans_free(metric_factory_plans_t *plans);
+
+bool compute_dist_metrics(metric_factory_id_e id, const char *node_id, const uint32_t *current_dist, size_t limit, dist_metrics_t *out_metrics);
 bool compute_rsrp_metrics(const char *node_id, const uint32_t *current_dist, size_t limit, dist_metrics_t *out_metrics);
 bool compute_sinr_metrics(const char *node_id, const uint32_t *current_dist, size_t limit, dist_metrics_t *out_metrics);
 
+// Name of an interned factory metric name ID, NULL for unknown IDs
+const char *factory_metric_name(uint16_t name_id);
+
+// InfluxDB field key of a factory metric, built like metric_factory_meas_t.field_name. NULL for unknown IDs.
+const char *factory_metric_field_name(uint16_t name_id);
+
+// Writes the metrics derived from a distribution into out, which has room for capacity metrics (METRIC_FACTORY_MAX_OUTPUTS
+// is always enough), and returns how many were written. state is the distribution state of node_id
+// (metric_factory_meas_t.dist_state), or NULL to look it up. Does not allocate once the state exists.
+size_t process_metric_factory_into(metric_factory_id_e id, const char *node_id, dist_state_t *state, const label_info_lst_t *label_info_lst, size_t label_info_lst_len, const meas_record_lst_t *meas_record_lst, size_t rec_idx_start, factory_metric_t *out, size_t capacity);
+
+// Folds a distribution onto its value axis without touching the per-node state: hist[v] is the number of samples, since
+// the E2 node started counting, whose value is (*values)[v]. hist has room for METRIC_FACTORY_MAX_AXIS_BINS counts and
+// the values are ascending. Returns the number of values, 0 if the distribution does not follow the registered layout.
+size_t metric_factory_value_hist(metric_factory_id_e id, const meas_record_lst_t *meas_record_lst, size_t rec_idx_start, size_t len, uint64_t *hist, const double **values);
+
+// Same as process_metric_factory_into(), returning a view of a per-thread buffer that is valid until the next call on
+// the same thread
+factory_metrics_array_t process_metric_factory_id(metric_factory_id_e id, const char *node_id, const label_info_lst_t *label_info_lst, size_t label_info_lst_len, const meas_record_lst_t *meas_record_lst, size_t rec_idx_start);
+
+// Same as process_metric_factory_id(), resolving the ID from the measurement name
 factory_metrics_array_t process_metric_factory(const char *node_id, const char *metric_name, const label_info_lst_t *label_info_lst, size_t label_info_lst_len, const meas_record_lst_t *meas_record_lst, size_t rec_idx_start);
 
+// Resets the view, the per-thread buffer is reused
 void free_factory_metrics(factory_metrics_array_t *arr);
 
-void format_meas_record_array(char *arr_str, size_t max_len, const label_info_lst_t *label_info_lst, size_t label_info_lst_len, const meas_record_lst_t *meas_record_lst, size_t rec_idx_start);
+// Sink of write_meas_record_array(). Returns false if the data could not be written.
+typedef bool (*meas_array_write_fn)(void *ctx, const char *data, size_t len);
+
+// Fixed-size sink that keeps buf NUL terminated. A write that does not fit fails without writing anything.
+typedef struct
+{
+  char *buf;
+  size_t len;
+  size_t cap;
+} meas_array_buf_t;
+
+bool meas_array_buf_write(void *ctx, const char *data, size_t len);
+
+// Sink writing to the FILE * passed as ctx
+bool meas_array_file_write(void *ctx, const char *data, size_t len);
+
+// Streams a distribution to the sink as nested JSON arrays, one level per label axis, e.g. [[0, 1], [2, 0]].
+// In compact mode, a run of n > 1 zero bins within an innermost array is written as -n, e.g. [3, -5, 1] for
+// [3, 0, 0, 0, 0, 0, 1]. Returns false if the sink rejected part of the output.
+bool write_meas_record_array(meas_array_write_fn write, void *ctx, const label_info_lst_t *label_info_lst, size_t label_info_lst_len, const meas_record_lst_t *meas_record_lst, size_t rec_idx_start, bool compact);
 
+// write_meas_record_array() into arr_str. Returns false if the array does not fit in max_len bytes.
+bool format_meas_record_array(char *arr_str, size_t max_len, const label_info_lst_t *label_info_lst, size_t label_info_lst_len, const meas_record_lst_t *meas_record_lst, size_t rec_idx_start);
+
+// Points the labels of a measurement to a table shared by all subscriptions, built once per measurement type.
+// The table is immutable and must be detached with release_label_info() before the measurement is freed.
 void populate_label_info(meas_info_format_1_lst_t *meas_item);
 
+// Replaces shared labels with an empty label owned by the measurement, so that it can be freed as usual
+void release_label_info(meas_info_format_1_lst_t *meas_item);
+
+// release_label_info() for every measurement of the action definitions of a subscription. Call right before
+// free_kpm_sub_data().
+void release_kpm_sub_label_info(kpm_sub_data_t *kpm_sub);
+
 #endif // METRICS_FACTORY_H
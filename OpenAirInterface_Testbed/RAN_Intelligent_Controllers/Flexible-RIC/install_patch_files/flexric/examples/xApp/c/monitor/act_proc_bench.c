@@ -0,0 +1,241 @@
+// NIST-developed software is provided by NIST as a public service. You may use,
+// copy, and distribute copies of the software in any medium, provided that you
+// keep intact this entire notice. You may improve, modify, and create derivative
+// works of the software or any portion of the software, and you may copy and
+// distribute such modifications or works. Modified works should carry a notice
+// stating that you changed the software and should note the date and nature of
+// any such change. Please explicitly acknowledge the National Institute of
+// Standards and Technology as the source of the software.
+//
+// NIST-developed software is expressly provided "AS IS." NIST MAKES NO WARRANTY
+// OF ANY KIND, EXPRESS, IMPLIED, IN FACT, OR ARISING BY OPERATION OF LAW,
+// INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTY OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE, NON-INFRINGEMENT, AND DATA ACCURACY. NIST
+// NEITHER REPRESENTS NOR WARRANTS THAT THE OPERATION OF THE SOFTWARE WILL BE
+// UNINTERRUPTED OR ERROR-FREE, OR THAT ANY DEFECTS WILL BE CORRECTED. NIST DOES
+// NOT WARRANT OR MAKE ANY REPRESENTATIONS REGARDING THE USE OF THE SOFTWARE OR
+// THE RESULTS THEREOF, INCLUDING BUT NOT LIMITED TO THE CORRECTNESS, ACCURACY,
+// RELIABILITY, OR USEFULNESS OF THE SOFTWARE.
+//
+// You are solely responsible for determining the appropriateness of using and
+// distributing the software and you assume all risks associated with its use,
+// including but not limited to the risks and costs of program errors, compliance
+// with applicable laws, damage to or loss of data, programs or equipment, and
+// the unavailability or interruption of operation. This software is not intended
+// to be used in any situation where a failure could cause risk of injury or
+// damage to property. The software developed by NIST employees is not subject to
+// copyright protection within the United States.
+
+
+
+// Micro-benchmark of the active procedure lookup that runs for every RIC indication. The lock-free table of act_proc is
+// compared against a reference that takes a mutex and scans the registered procedures linearly, as the assoc_reg_t
+// based registry did. Both are run with 1, 100 and 10000 active subscriptions and several reader threads, while a
+// writer thread keeps adding and removing one extra subscription. Every lookup result is checked.
+//
+// Usage: act_proc_bench [num_threads] [lookups_per_thread]
+
+#include "../../../../src/xApp/act_proc.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct {
+  uint16_t ric_req_id;
+  act_proc_val_t val;
+} reference_item_t;
+
+typedef struct {
+  reference_item_t *items;
+  size_t len;
+  pthread_mutex_t mtx;
+} reference_registry_t;
+
+static bool reference_find(reference_registry_t *r, uint16_t ric_req_id, act_proc_val_t *out) {
+  pthread_mutex_lock(&r->mtx);
+  bool found = false;
+  for (size_t i = 0; i < r->len; i++) {
+    if (r->items[i].ric_req_id == ric_req_id) {
+      *out = r->items[i].val;
+      found = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&r->mtx);
+  return found;
+}
+
+static void dummy_cb(sm_ag_if_rd_t const *rd, global_e2_node_id_t const *e2_node) {
+  (void)rd;
+  (void)e2_node;
+}
+
+typedef struct {
+  act_proc_t *act;
+  reference_registry_t *ref;
+  size_t num_subs;
+  size_t num_lookups;
+  unsigned seed;
+  size_t errors;
+  double ms;
+} reader_arg_t;
+
+static atomic_bool writer_stop;
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// The ran_func_id of every subscription is set to its ric_req_id, so that torn reads are detected
+static bool valid_val(const act_proc_val_t *val, uint16_t ric_req_id) {
+  return val->id.ric_req_id == ric_req_id && val->id.ran_func_id == ric_req_id && val->sm_cb == dummy_cb;
+}
+
+static void *act_proc_reader(void *arg) {
+  reader_arg_t *a = arg;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (size_t i = 0; i < a->num_lookups; i++) {
+    uint16_t const ric_req_id = rand_r(&a->seed) % a->num_subs;
+    act_proc_ans_t ans = find_act_proc(a->act, ric_req_id);
+    if (!ans.ok || !valid_val(&ans.val, ric_req_id))
+      a->errors++;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  a->ms = elapsed_ms(&t0, &t1);
+  return NULL;
+}
+
+static void *reference_reader(void *arg) {
+  reader_arg_t *a = arg;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (size_t i = 0; i < a->num_lookups; i++) {
+    uint16_t const ric_req_id = rand_r(&a->seed) % a->num_subs;
+    act_proc_val_t val;
+    if (!reference_find(a->ref, ric_req_id, &val) || !valid_val(&val, ric_req_id))
+      a->errors++;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  a->ms = elapsed_ms(&t0, &t1);
+  return NULL;
+}
+
+static void *act_proc_writer(void *arg) {
+  act_proc_t *act = arg;
+  global_e2_node_id_t e2_node = {.type = ngran_gNB};
+  while (!atomic_load(&writer_stop)) {
+    ric_gen_id_t id = {.ran_func_id = 0xFFFF};
+    uint32_t const ric_req_id = add_act_proc(act, RIC_SUBSCRIPTION_PROCEDURE_ACTIVE, id, &e2_node, dummy_cb);
+    rm_act_proc(act, ric_req_id);
+  }
+  return NULL;
+}
+
+static void *reference_writer(void *arg) {
+  reference_registry_t *ref = arg;
+  uint16_t ric_req_id = ref->len;
+  while (!atomic_load(&writer_stop)) {
+    pthread_mutex_lock(&ref->mtx);
+    ref->items[ref->len].ric_req_id = ric_req_id;
+    ref->items[ref->len].val.id.ran_func_id = 0xFFFF;
+    ref->len++;
+    pthread_mutex_unlock(&ref->mtx);
+
+    pthread_mutex_lock(&ref->mtx);
+    ref->len--;
+    pthread_mutex_unlock(&ref->mtx);
+  }
+  return NULL;
+}
+
+// Runs the readers next to one writer and returns the average time per lookup in ns
+static double run(bool reference, act_proc_t *act, reference_registry_t *ref, size_t num_subs, size_t num_threads,
+                  size_t num_lookups, size_t *errors) {
+  reader_arg_t *args = calloc(num_threads, sizeof(reader_arg_t));
+  pthread_t *readers = calloc(num_threads, sizeof(pthread_t));
+  if (!args || !readers) {
+    fprintf(stderr, "Memory exhausted\n");
+    exit(EXIT_FAILURE);
+  }
+
+  atomic_store(&writer_stop, false);
+  pthread_t writer;
+  pthread_create(&writer, NULL, reference ? reference_writer : act_proc_writer, reference ? (void *)ref : (void *)act);
+
+  for (size_t t = 0; t < num_threads; t++) {
+    args[t] = (reader_arg_t){.act = act, .ref = ref, .num_subs = num_subs, .num_lookups = num_lookups, .seed = t + 1};
+    pthread_create(&readers[t], NULL, reference ? reference_reader : act_proc_reader, &args[t]);
+  }
+
+  double ms = 0;
+  for (size_t t = 0; t < num_threads; t++) {
+    pthread_join(readers[t], NULL);
+    ms += args[t].ms;
+    *errors += args[t].errors;
+  }
+  atomic_store(&writer_stop, true);
+  pthread_join(writer, NULL);
+
+  free(args);
+  free(readers);
+  return ms * 1e6 / (num_threads * num_lookups);
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+  size_t num_lookups = argc > 2 ? strtoul(argv[2], NULL, 10) : 200000;
+  if (num_threads == 0 || num_lookups == 0) {
+    fprintf(stderr, "Usage: %s [num_threads] [lookups_per_thread]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const size_t num_subs_cases[] = {1, 100, 10000};
+  size_t errors = 0;
+
+  printf("Reader threads: %zu, lookups per thread: %zu, 1 writer thread adding and removing a subscription\n",
+         num_threads, num_lookups);
+  printf("%10s %18s %18s %10s\n", "Subs", "Reference (ns)", "act_proc (ns)", "Speedup");
+
+  for (size_t c = 0; c < sizeof(num_subs_cases) / sizeof(num_subs_cases[0]); c++) {
+    size_t const num_subs = num_subs_cases[c];
+
+    act_proc_t *act = calloc(1, sizeof(act_proc_t));
+    reference_registry_t ref = {.items = calloc(num_subs + 1, sizeof(reference_item_t)), .len = 0};
+    if (!act || !ref.items) {
+      fprintf(stderr, "Memory exhausted\n");
+      return EXIT_FAILURE;
+    }
+    init_act_proc(act);
+    pthread_mutex_init(&ref.mtx, NULL);
+
+    global_e2_node_id_t e2_node = {.type = ngran_gNB};
+    for (size_t i = 0; i < num_subs; i++) {
+      ric_gen_id_t id = {.ran_func_id = i};
+      uint32_t const ric_req_id = add_act_proc(act, RIC_SUBSCRIPTION_PROCEDURE_ACTIVE, id, &e2_node, dummy_cb);
+      if (ric_req_id != i) {
+        fprintf(stderr, "Unexpected ric_req_id %u for subscription %zu\n", ric_req_id, i);
+        return EXIT_FAILURE;
+      }
+      ref.items[ref.len].ric_req_id = ric_req_id;
+      ref.items[ref.len].val = (act_proc_val_t){.type = RIC_SUBSCRIPTION_PROCEDURE_ACTIVE, .sm_cb = dummy_cb};
+      ref.items[ref.len].val.id = id;
+      ref.items[ref.len].val.id.ric_req_id = ric_req_id;
+      ref.len++;
+    }
+
+    double const ref_ns = run(true, act, &ref, num_subs, num_threads, num_lookups, &errors);
+    double const act_ns = run(false, act, &ref, num_subs, num_threads, num_lookups, &errors);
+    printf("%10zu %18.1f %18.1f %9.1fx\n", num_subs, ref_ns, act_ns, act_ns > 0 ? ref_ns / act_ns : 0.0);
+
+    free_act_proc(act);
+    free(act);
+    pthread_mutex_destroy(&ref.mtx);
+    free(ref.items);
+  }
+
+  printf("Failed lookups: %zu\n", errors);
+  return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
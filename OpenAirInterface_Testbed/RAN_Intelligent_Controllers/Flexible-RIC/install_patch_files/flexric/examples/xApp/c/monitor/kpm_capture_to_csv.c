@@ -0,0 +1,160 @@
+// NIST-developed software is provided by NIST as a public service. You may use,
+// copy, and distribute copies of the software in any medium, provided that you
+// keep intact this entire notice. You may improve, modify, and create derivative
+// works of the software or any portion of the software, and you may copy and
+// distribute such modifications or works. Modified works should carry a notice
+// stating that you changed the software and should note the date and nature of
+// any such change. Please explicitly acknowledge the National Institute of
+// Standards and Technology as the source of the software.
+//
+// NIST-developed software is expressly provided "AS IS." NIST MAKES NO WARRANTY
+// OF ANY KIND, EXPRESS, IMPLIED, IN FACT, OR ARISING BY OPERATION OF LAW,
+// INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTY OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE, NON-INFRINGEMENT, AND DATA ACCURACY. NIST
+// NEITHER REPRESENTS NOR WARRANTS THAT THE OPERATION OF THE SOFTWARE WILL BE
+// UNINTERRUPTED OR ERROR-FREE, OR THAT ANY DEFECTS WILL BE CORRECTED. NIST DOES
+// NOT WARRANT OR MAKE ANY REPRESENTATIONS REGARDING THE USE OF THE SOFTWARE OR
+// THE RESULTS THEREOF, INCLUDING BUT NOT LIMITED TO THE CORRECTNESS, ACCURACY,
+// RELIABILITY, OR USEFULNESS OF THE SOFTWARE.
+//
+// You are solely responsible for determining the appropriateness of using and
+// distributing the software and you assume all risks associated with its use,
+// including but not limited to the risks and costs of program errors, compliance
+// with applicable laws, damage to or loss of data, programs or equipment, and
+// the unavailability or interruption of operation. This software is not intended
+// to be used in any situation where a failure could cause risk of injury or
+// damage to property. The software developed by NIST employees is not subject to
+// copyright protection within the United States.
+
+// Converts a binary KPM capture written by xapp_kpm_moni_write_to_csv (KPM_CAPTURE_FORMAT=binary or both) back into
+// the CSV format written by the xApp.
+
+#include "../kpm_capture.h"
+#include "../metrics_factory.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Same as the xApp, runs of zero bins are collapsed when the environment variable KPM_ARRAY_FORMAT is compact
+static bool compact_arrays = false;
+
+static void write_header(FILE *out, const kpm_capture_schema_t *schema, bool is_cell) {
+  fprintf(out, "Time (UNIX ms),Batch ID (Mapping Cell with UE),Reporting Time Offset (ms),Indication Latency (ms),"
+               "E2 Node ID,");
+  if (!is_cell)
+    fprintf(out, "UE ID,");
+  for (size_t c = 0; c < schema->ncols; c++) {
+    const kpm_capture_column_t *col = &schema->cols[c];
+    if (col->unit[0] != '\0')
+      fprintf(out, "%s (%s),", col->name, col->unit);
+    else
+      fprintf(out, "%s,", col->name);
+  }
+  fputc('\n', out);
+}
+
+static void write_array(FILE *out, const kpm_capture_column_t *col, const kpm_capture_value_t *values) {
+  label_info_lst_t *labels = calloc(col->nbins ? col->nbins : 1, sizeof(label_info_lst_t));
+  meas_record_lst_t *records = calloc(col->nbins ? col->nbins : 1, sizeof(meas_record_lst_t));
+  assert(labels != NULL && records != NULL && "Memory exhausted");
+
+  for (uint32_t j = 0; j < col->nbins; j++) {
+    labels[j].distBinX = col->has_x ? &col->bin_x[j] : NULL;
+    labels[j].distBinY = col->has_y ? &col->bin_y[j] : NULL;
+    labels[j].distBinZ = col->has_z ? &col->bin_z[j] : NULL;
+    if (values[j].tag == KPM_CAPTURE_VAL_INT) {
+      records[j].value = INTEGER_MEAS_VALUE;
+      records[j].int_val = (uint32_t)values[j].int_val;
+    } else if (values[j].tag == KPM_CAPTURE_VAL_REAL) {
+      records[j].value = REAL_MEAS_VALUE;
+      records[j].real_val = values[j].real_val;
+    } else {
+      records[j].value = NO_VALUE_MEAS_VALUE;
+    }
+  }
+
+  // Unlike the xApp, the array is streamed to the file and never truncated
+  fputc('"', out);
+  write_meas_record_array(meas_array_file_write, out, labels, col->nbins, records, 0, compact_arrays);
+  fputs("\",", out);
+
+  free(records);
+  free(labels);
+}
+
+static void write_row(FILE *out, const kpm_capture_schema_t *schema, const kpm_capture_row_info_t *info,
+                      const kpm_capture_value_t *values, bool is_cell) {
+  if (info->reporting_offset_ms == KPM_CAPTURE_NO_OFFSET)
+    fprintf(out, "%" PRId64 ",%" PRId64 ",,%" PRId64 ",", info->arrival_ms, info->batch_id, info->latency_ms);
+  else
+    fprintf(out, "%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",", info->arrival_ms, info->batch_id,
+            info->reporting_offset_ms, info->latency_ms);
+  fprintf(out, "%s,", info->e2_node_id);
+  if (!is_cell)
+    fprintf(out, "%" PRIu64 ",", info->ue_id);
+
+  for (size_t c = 0; c < schema->ncols; c++) {
+    const kpm_capture_column_t *col = &schema->cols[c];
+    if (col->kind == KPM_CAPTURE_COL_ARRAY) {
+      write_array(out, col, values);
+    } else if (values[0].tag == KPM_CAPTURE_VAL_INT) {
+      fprintf(out, "%ld,", (long)values[0].int_val);
+    } else if (values[0].tag == KPM_CAPTURE_VAL_REAL && !isnan(values[0].real_val)) {
+      fprintf(out, "%.2f,", values[0].real_val);
+    } else {
+      fputc(',', out);
+    }
+    values += col->nbins;
+  }
+  fputc('\n', out);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <capture_file_path.kpmcap> <csv_file_path>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const char *array_format = getenv("KPM_ARRAY_FORMAT");
+  if (array_format != NULL && array_format[0] != '\0') {
+    if (strcmp(array_format, "json") == 0) {
+      compact_arrays = false;
+    } else if (strcmp(array_format, "compact") == 0) {
+      compact_arrays = true;
+    } else {
+      fprintf(stderr, "Invalid KPM_ARRAY_FORMAT value: '%s'. Must be json or compact.\n", array_format);
+      return EXIT_FAILURE;
+    }
+  }
+
+  kpm_capture_reader_t rd;
+  if (!kpm_capture_reader_open(&rd, argv[1]))
+    return EXIT_FAILURE;
+
+  FILE *out = fopen(argv[2], "w");
+  if (out == NULL) {
+    fprintf(stderr, "Failed to open CSV file: %s\n", argv[2]);
+    kpm_capture_reader_close(&rd);
+    return EXIT_FAILURE;
+  }
+
+  // As in the xApp, the header is taken from the first row and is not rewritten if the measurements change later
+  uint64_t num_rows = 0;
+  const kpm_capture_schema_t *schema = NULL;
+  const kpm_capture_row_info_t *info = NULL;
+  const kpm_capture_value_t *values = NULL;
+  while (kpm_capture_reader_next(&rd, &schema, &info, &values)) {
+    if (num_rows == 0)
+      write_header(out, schema, rd.is_cell);
+    write_row(out, schema, info, values, rd.is_cell);
+    num_rows++;
+  }
+
+  fclose(out);
+  kpm_capture_reader_close(&rd);
+  printf("Converted %" PRIu64 " rows from %s to %s\n", num_rows, argv[1], argv[2]);
+  return EXIT_SUCCESS;
+}
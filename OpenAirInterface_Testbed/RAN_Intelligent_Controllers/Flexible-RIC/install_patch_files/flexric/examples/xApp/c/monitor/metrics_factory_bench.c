@@ -0,0 +1,219 @@
+// NIST-developed software is provided by NIST as a public service. You may use,
+// copy, and distribute copies of the software in any medium, provided that you
+// keep intact this entire notice. You may improve, modify, and create derivative
+// works of the software or any portion of the software, and you may copy and
+// distribute such modifications or works. Modified works should carry a notice
+// stating that you changed the software and should note the date and nature of
+// any such change. Please explicitly acknowledge the National Institute of
+// Standards and Technology as the source of the software.
+//
+// NIST-developed software is expressly provided "AS IS." NIST MAKES NO WARRANTY
+// OF ANY KIND, EXPRESS, IMPLIED, IN FACT, OR ARISING BY OPERATION OF LAW,
+// INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTY OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE, NON-INFRINGEMENT, AND DATA ACCURACY. NIST
+// NEITHER REPRESENTS NOR WARRANTS THAT THE OPERATION OF THE SOFTWARE WILL BE
+// UNINTERRUPTED OR ERROR-FREE, OR THAT ANY DEFECTS WILL BE CORRECTED. NIST DOES
+// NOT WARRANT OR MAKE ANY REPRESENTATIONS REGARDING THE USE OF THE SOFTWARE OR
+// THE RESULTS THEREOF, INCLUDING BUT NOT LIMITED TO THE CORRECTNESS, ACCURACY,
+// RELIABILITY, OR USEFULNESS OF THE SOFTWARE.
+//
+// You are solely responsible for determining the appropriateness of using and
+// distributing the software and you assume all risks associated with its use,
+// including but not limited to the risks and costs of program errors, compliance
+// with applicable laws, damage to or loss of data, programs or equipment, and
+// the unavailability or interruption of operation. This software is not intended
+// to be used in any situation where a failure could cause risk of injury or
+// damage to property. The software developed by NIST employees is not subject to
+// copyright protection within the United States.
+
+
+// Micro-benchmark of the RSRP and SINR distribution metrics of the metrics factory against a reference implementation
+// that recomputes the per-bin difference, converts every bin to linear scale with pow() and rescans the distribution for
+// each percentile. Both implementations are fed the same randomly growing distributions and their results are compared.
+//
+// Usage: metrics_factory_bench [num_nodes] [num_reports]
+
+#include "../metrics_factory.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NUM_BINS 128
+
+typedef struct
+{
+  uint32_t last_dist[NUM_BINS];
+} reference_state_t;
+
+static double rsrp_bin_value(size_t i)
+{
+  return -(156 + 1) + (double)i;
+}
+
+static double sinr_bin_value(size_t i)
+{
+  return -23.5 + 0.5 * i;
+}
+
+// Per-bin difference, pow() per bin and one scan of the distribution per percentile
+static void reference_dist_metrics(reference_state_t *state, const uint32_t *current_dist, double (*bin_value)(size_t), dist_metrics_t *out)
+{
+  uint32_t diff_dist[NUM_BINS];
+  uint32_t total_count = 0;
+  for (size_t i = 0; i < NUM_BINS; i++)
+  {
+    diff_dist[i] = current_dist[i] >= state->last_dist[i] ? current_dist[i] - state->last_dist[i] : current_dist[i];
+    total_count += diff_dist[i];
+    state->last_dist[i] = current_dist[i];
+  }
+
+  out->mean = NAN;
+  out->min = NAN;
+  out->max = NAN;
+  out->count = total_count;
+  for (size_t k = 0; k < DIST_NUM_PERCENTILES; k++)
+    out->percentiles[k] = NAN;
+  if (total_count == 0)
+    return;
+
+  double sum = 0;
+  double min_val = 9999.0, max_val = -9999.0;
+  for (size_t i = 0; i < NUM_BINS; i++)
+  {
+    if (diff_dist[i] > 0)
+    {
+      double val = bin_value(i);
+      sum += pow(10.0, val / 10.0) * diff_dist[i];
+      if (val < min_val)
+        min_val = val;
+      if (val > max_val)
+        max_val = val;
+    }
+  }
+  out->mean = 10.0 * log10(sum / total_count);
+  out->min = min_val;
+  out->max = max_val;
+
+  for (size_t k = 0; k < DIST_NUM_PERCENTILES; k++)
+  {
+    uint32_t rank = (uint32_t)(dist_percentile_levels[k] / 100.0 * total_count);
+    if (rank >= total_count)
+      rank = total_count - 1;
+    uint32_t cumulative = 0;
+    for (size_t i = 0; i < NUM_BINS; i++)
+    {
+      cumulative += diff_dist[i];
+      if (cumulative > rank)
+      {
+        out->percentiles[k] = bin_value(i);
+        break;
+      }
+    }
+  }
+}
+
+static bool same_value(double a, double b)
+{
+  if (isnan(a) || isnan(b))
+    return isnan(a) && isnan(b);
+  return fabs(a - b) <= 1e-9 * fmax(1.0, fabs(a));
+}
+
+static bool same_metrics(const dist_metrics_t *a, const dist_metrics_t *b)
+{
+  if (a->count != b->count || !same_value(a->mean, b->mean) || !same_value(a->min, b->min) || !same_value(a->max, b->max))
+    return false;
+  for (size_t k = 0; k < DIST_NUM_PERCENTILES; k++)
+    if (!same_value(a->percentiles[k], b->percentiles[k]))
+      return false;
+  return true;
+}
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Grows the counters of a narrow band of bins around a per-node center, as a UE population would
+static void grow_dist(uint32_t *dist, size_t node)
+{
+  size_t center = 20 + (node * 7) % 88;
+  for (int j = 0; j < 16; j++)
+  {
+    int bin = (int)center + (rand() % 21) - 10;
+    dist[bin] += 1 + rand() % 4;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  size_t num_nodes = argc > 1 ? strtoul(argv[1], NULL, 10) : 16;
+  size_t num_reports = argc > 2 ? strtoul(argv[2], NULL, 10) : 20000;
+  if (num_nodes == 0 || num_reports == 0)
+  {
+    fprintf(stderr, "Usage: %s [num_nodes] [num_reports]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  srand(1);
+  uint32_t (*rsrp_dists)[NUM_BINS] = calloc(num_nodes, sizeof(*rsrp_dists));
+  uint32_t (*sinr_dists)[NUM_BINS] = calloc(num_nodes, sizeof(*sinr_dists));
+  reference_state_t *rsrp_states = calloc(num_nodes, sizeof(reference_state_t));
+  reference_state_t *sinr_states = calloc(num_nodes, sizeof(reference_state_t));
+  char (*node_ids)[32] = calloc(num_nodes, sizeof(*node_ids));
+  if (!rsrp_dists || !sinr_dists || !rsrp_states || !sinr_states || !node_ids)
+  {
+    fprintf(stderr, "Memory exhausted\n");
+    return EXIT_FAILURE;
+  }
+  for (size_t n = 0; n < num_nodes; n++)
+    snprintf(node_ids[n], sizeof(node_ids[n]), "gnb-%zu", n);
+
+  double reference_ms = 0;
+  double factory_ms = 0;
+  size_t mismatches = 0;
+  volatile double sink = 0;
+
+  for (size_t r = 0; r < num_reports; r++)
+  {
+    size_t n = r % num_nodes;
+    grow_dist(rsrp_dists[n], n);
+    grow_dist(sinr_dists[n], n + 1);
+
+    dist_metrics_t ref_rsrp, ref_sinr, rsrp, sinr;
+    struct timespec t0, t1, t2;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    reference_dist_metrics(&rsrp_states[n], rsrp_dists[n], rsrp_bin_value, &ref_rsrp);
+    reference_dist_metrics(&sinr_states[n], sinr_dists[n], sinr_bin_value, &ref_sinr);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    compute_rsrp_metrics(node_ids[n], rsrp_dists[n], NUM_BINS, &rsrp);
+    compute_sinr_metrics(node_ids[n], sinr_dists[n], NUM_BINS, &sinr);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    reference_ms += elapsed_ms(&t0, &t1);
+    factory_ms += elapsed_ms(&t1, &t2);
+    sink += ref_rsrp.mean + rsrp.mean + ref_sinr.mean + sinr.mean;
+
+    if (!same_metrics(&ref_rsrp, &rsrp) || !same_metrics(&ref_sinr, &sinr))
+      mismatches++;
+  }
+
+  printf("Reports: %zu (%zu E2 nodes, %d bins, %d percentiles)\n", num_reports, num_nodes, NUM_BINS, DIST_NUM_PERCENTILES);
+  printf("Reference: %10.3f ms (%8.1f ns/report)\n", reference_ms, reference_ms * 1e6 / num_reports);
+  printf("Factory:   %10.3f ms (%8.1f ns/report)\n", factory_ms, factory_ms * 1e6 / num_reports);
+  printf("Speedup:   %10.2fx\n", factory_ms > 0 ? reference_ms / factory_ms : 0.0);
+  printf("Mismatching reports: %zu\n", mismatches);
+
+  free_dist_states();
+  free(rsrp_dists);
+  free(sinr_dists);
+  free(rsrp_states);
+  free(sinr_states);
+  free(node_ids);
+
+  return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
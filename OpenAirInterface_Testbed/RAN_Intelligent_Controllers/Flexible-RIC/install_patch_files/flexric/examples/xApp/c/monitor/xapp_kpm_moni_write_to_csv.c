@@ -33,12 +33,15 @@
 #include "../../../../src/util/e.h"
 #include "../../../../src/util/time_now_us.h"
 #include "../../../../src/xApp/e42_xapp_api.h"
+#include "../kpm_capture.h"
+#include "../metrics_exporter.h"
 #include "../metrics_factory.h"
 #include <errno.h>
 #include <inttypes.h>
 #include <math.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -50,12 +53,15 @@ static uint64_t period_ms = 1000;
 
 // For metrics based on the difference between indication messages, the first sample may give a wrong value, so it is
 // skipped.
-bool skip_first_sample = true;
+atomic_bool skip_first_sample = true;
 
 // Set to true if samples containing RSRP.Count == 0 are to be filtered,
 // which is expected to give more stable results at the expense of some data loss
 const bool filter_invalid_rsrp_samples = false;
 
+// Indications of different E2 nodes may be handled in parallel by the dispatcher workers (XAPP_DISPATCHER_WORKERS).
+// Each worker formats its rows in thread-local buffers; mtx only guards the batch state and the hand-off of finished
+// rows and headers to the CSV writer and the binary capture.
 static pthread_mutex_t mtx;
 
 static assoc_ht_open_t ht = {0};
@@ -101,7 +107,7 @@ static void init_kpm_meas_unit_hash_table(void) {
   fclose(fp);
 }
 
-static char *get_meas_unit(const char *name) {
+static const char *get_meas_unit(const char *name) {
   char *val = assoc_ht_open_value(&ht, &name);
   if (!val || strcmp(val, "[]") == 0)
     return "";
@@ -113,52 +119,95 @@ static uint8_t cfg_slicing_sst = 1;
 static uint32_t cfg_slicing_sd = 0xFFFFFF; // 0xFFFFFF for any SD
 
 // Variables that change during runtime
-bool csv_wrote_header = false;
+#define CSV_HEADER_SIZE 2048
+atomic_bool csv_wrote_header = false;
 const char *csv_file_path = NULL;
-char csv_header_buffer[2048];
-char csv_line_buffer[9000];
+char csv_header_buffer[CSV_HEADER_SIZE];
+// The line buffer points into the row the current indication is formatted in, see csv_row_begin()
+#define CSV_LINE_SIZE 9000
+_Thread_local char *csv_line_buffer;
 
-bool csv_wrote_cell_header = false;
+atomic_bool csv_wrote_cell_header = false;
 char csv_cell_file_path[1024];
-char csv_cell_header_buffer[2048];
-char csv_cell_line_buffer[9000];
-bool is_cell_metric = false;
+char csv_cell_header_buffer[CSV_HEADER_SIZE];
+atomic_uint csv_num_rows = 0;
 
-unsigned int csv_num_rows = 0;
-uint64_t current_ue_id = 0;
-bool filter_current_sample = false;
-int64_t prev_now = 0;
+// State of the indication being logged, kept per dispatcher worker
+_Thread_local bool is_cell_metric = false;
+_Thread_local uint64_t current_ue_id = 0;
+_Thread_local bool filter_current_sample = false;
+// Arrival time of the previous batch, copied from the batch state when the indication arrives
+_Thread_local int64_t prev_now = 0;
+static _Thread_local bool skip_current_sample;
 
 // Buffer to store the current E2 Node ID
-static char current_e2_id_str[256];
+static _Thread_local char current_e2_id_str[256];
 
-static void csv_append_name_to_csv_header(const char *name, const char *unit) {
-  char *target_buffer = is_cell_metric ? csv_cell_header_buffer : csv_header_buffer;
-  size_t buffer_size = is_cell_metric ? sizeof(csv_cell_header_buffer) : sizeof(csv_header_buffer);
+// Measurement columns of the row being logged, collected while the header of its file is not written yet and appended
+// to csv_header_buffer or csv_cell_header_buffer by the first row that writes it
+static _Thread_local bool csv_building_header;
+static _Thread_local char csv_row_header[CSV_HEADER_SIZE];
+
+// Labels of the row being logged, for the metrics endpoint (see metrics_exporter.h)
+static _Thread_local metrics_exporter_row_t export_row;
+
+// Compiled measurements (factory IDs, names, units and CSV columns) of the subscriptions, by E2 node and action
+// definition format: format 1 is reported in indication format 1 and format 4 per UE in indication format 3
+static metric_factory_plans_t factory_plans = METRIC_FACTORY_PLANS_INIT(get_meas_unit);
+
+// Interned name of RSRP.Count, checked for invalid samples
+static uint16_t rsrp_count_name_id = METRIC_FACTORY_NO_NAME_ID;
+
+// Output formats, selected with the environment variable KPM_CAPTURE_FORMAT (csv, binary, both or none).
+// The binary capture is written next to the CSV file with the extension .kpmcap and can be converted back to CSV with
+// kpm_capture_to_csv. With none, the measurements are only served on the metrics endpoint (KPM_METRICS_PORT).
+static bool capture_csv = true;
+static bool capture_binary = false;
+static kpm_capture_t kpm_capture_ue;
+static kpm_capture_t kpm_capture_cell;
+static _Thread_local kpm_capture_row_t capture_row;
+
+// Distribution arrays are written as plain JSON arrays, or with runs of zero bins collapsed when the environment variable
+// KPM_ARRAY_FORMAT is compact (see write_meas_record_array)
+static bool compact_arrays = false;
+
+static kpm_capture_t *current_capture(void) { return is_cell_metric ? &kpm_capture_cell : &kpm_capture_ue; }
+
+// header is one of the CSV_HEADER_SIZE header buffers
+static void csv_append_column_to_csv_header(char *header, const char *column) {
+  char *target_buffer = header;
+  size_t buffer_size = CSV_HEADER_SIZE;
 
-  if (!name)
-    name = "";
-  if (!unit)
-    unit = "";
   size_t current_len = strlen(target_buffer);
-  size_t name_len = strlen(name);
-  size_t unit_len = strlen(unit);
+  size_t column_len = strlen(column);
 
   // Don't overflow the buffer
-  if (current_len + name_len + unit_len + 4 < buffer_size) { // +4 for " ()", comma, and null terminator
-    if (unit != NULL && unit_len > 0) {
-      snprintf(target_buffer + current_len, buffer_size - current_len, "%s (%s),", name, unit);
-    } else {
-      snprintf(target_buffer + current_len, buffer_size - current_len, "%s,", name);
-    }
+  if (current_len + column_len + 2 < buffer_size) { // +2 for comma and null terminator
+    memcpy(target_buffer + current_len, column, column_len);
+    target_buffer[current_len + column_len] = ',';
+    target_buffer[current_len + column_len + 1] = '\0';
   } else {
     fprintf(stderr, "CSV header buffer is full, cannot append more names.\n");
   }
 }
 
+static void csv_append_name_to_csv_header(char *header, const char *name, const char *unit) {
+  if (!name)
+    name = "";
+  if (!unit)
+    unit = "";
+
+  char column[METRIC_FACTORY_COLUMN_LEN];
+  if (unit[0] != '\0')
+    snprintf(column, sizeof(column), "%s (%s)", name, unit);
+  else
+    snprintf(column, sizeof(column), "%s", name);
+  csv_append_column_to_csv_header(header, column);
+}
+
 static void csv_append_int_to_csv_line(meas_record_lst_t meas_record) {
-  char *target_buffer = is_cell_metric ? csv_cell_line_buffer : csv_line_buffer;
-  size_t buffer_size = is_cell_metric ? sizeof(csv_cell_line_buffer) : sizeof(csv_line_buffer);
+  char *target_buffer = csv_line_buffer;
+  size_t buffer_size = CSV_LINE_SIZE;
   size_t current_len = strlen(target_buffer);
 
   if (current_len + 32 < buffer_size) { // Reserve space for int/float and comma
@@ -169,8 +218,8 @@ static void csv_append_int_to_csv_line(meas_record_lst_t meas_record) {
 }
 
 static void csv_append_real_to_csv_line(meas_record_lst_t meas_record) {
-  char *target_buffer = is_cell_metric ? csv_cell_line_buffer : csv_line_buffer;
-  size_t buffer_size = is_cell_metric ? sizeof(csv_cell_line_buffer) : sizeof(csv_line_buffer);
+  char *target_buffer = csv_line_buffer;
+  size_t buffer_size = CSV_LINE_SIZE;
   size_t current_len = strlen(target_buffer);
 
   if (current_len + 32 < buffer_size) { // Reserve space for float and comma
@@ -184,17 +233,41 @@ static void csv_append_real_to_csv_line(meas_record_lst_t meas_record) {
   }
 }
 
-static void csv_append_string_to_csv_line(const char *str) {
-  if (!str)
-    str = "";
-  char *target_buffer = is_cell_metric ? csv_cell_line_buffer : csv_line_buffer;
-  size_t buffer_size = is_cell_metric ? sizeof(csv_cell_line_buffer) : sizeof(csv_line_buffer);
+// Streams the distribution straight into the CSV line as a quoted JSON array. If it does not fit, the cell is left empty
+// rather than holding a truncated array.
+static void csv_append_array_to_csv_line(const label_info_lst_t *label_info_lst, size_t label_info_lst_len,
+                                         const meas_record_lst_t *meas_record_lst, size_t rec_idx_start) {
+  char *target_buffer = csv_line_buffer;
+  size_t buffer_size = CSV_LINE_SIZE;
   size_t current_len = strlen(target_buffer);
+  meas_array_buf_t sink = {.buf = target_buffer, .len = current_len, .cap = buffer_size};
 
-  if (current_len + strlen(str) + 32 < buffer_size) {
-    snprintf(target_buffer + current_len, buffer_size - current_len, "\"%s\",", str);
+  if (meas_array_buf_write(&sink, "\"", 1) &&
+      write_meas_record_array(meas_array_buf_write, &sink, label_info_lst, label_info_lst_len, meas_record_lst,
+                              rec_idx_start, compact_arrays) &&
+      meas_array_buf_write(&sink, "\",", 2))
+    return;
+
+  target_buffer[current_len] = '\0';
+  sink.len = current_len;
+  meas_array_buf_write(&sink, ",", 1);
+  fprintf(stderr, "CSV line buffer is full, cannot append a distribution of %zu bins.\n", label_info_lst_len);
+}
+
+// Bytes reserved in front of each row for the columns prepended once its values are known
+#define CSV_ROW_PREFIX_SIZE 512
+static _Thread_local size_t csv_line_prefix_len = 0;
+
+// The prefix is written into the room reserved in front of the line buffer, so the row is not moved
+static void csv_prepend_to_csv_line(const char *prefix, const char *what) {
+  char *target_buffer = csv_line_buffer;
+  size_t prefix_len = strlen(prefix);
+
+  if (csv_line_prefix_len + prefix_len <= CSV_ROW_PREFIX_SIZE) {
+    csv_line_prefix_len += prefix_len;
+    memcpy(target_buffer - csv_line_prefix_len, prefix, prefix_len);
   } else {
-    fprintf(stderr, "CSV line buffer is full, cannot append more values.\n");
+    fprintf(stderr, "CSV line buffer is full, cannot prepend %s.\n", what);
   }
 }
 
@@ -205,27 +278,7 @@ static void csv_prepend_e2_node_id() {
   } else {
     snprintf(e2_node_id_buffer, sizeof(e2_node_id_buffer), "%s,", current_e2_id_str);
   }
-
-  size_t e2_node_id_len = strlen(e2_node_id_buffer);
-  char *target_buffer = is_cell_metric ? csv_cell_line_buffer : csv_line_buffer;
-  size_t buffer_size = is_cell_metric ? sizeof(csv_cell_line_buffer) : sizeof(csv_line_buffer);
-  size_t current_len = strlen(target_buffer);
-
-  if (e2_node_id_len + current_len < buffer_size) {
-    // Temporary buffer to construct the new line
-    char temp_buffer[9000];
-    size_t total_len = 0;
-    temp_buffer[0] = '\0';
-    strncat(temp_buffer, e2_node_id_buffer, sizeof(temp_buffer) - 1);
-    total_len = strlen(temp_buffer);
-    if (total_len < sizeof(temp_buffer) - 1) {
-      strncat(temp_buffer, target_buffer, sizeof(temp_buffer) - 1 - total_len);
-    }
-    strncpy(target_buffer, temp_buffer, buffer_size - 1);
-    target_buffer[buffer_size - 1] = '\0';
-  } else {
-    fprintf(stderr, "CSV line buffer is full, cannot prepend E2 Node ID.\n");
-  }
+  csv_prepend_to_csv_line(e2_node_id_buffer, "E2 Node ID");
 }
 static void csv_prepend_ue_id() {
   // Ensure the current UE ID is valid
@@ -234,27 +287,9 @@ static void csv_prepend_ue_id() {
       fprintf(stderr, "ERROR: No valid UE ID found.\n");
   }
 
-  // Ensure the buffer won't overflow
   char ue_id_buffer[32];
   snprintf(ue_id_buffer, sizeof(ue_id_buffer), "%" PRIu64 ",", current_ue_id);
-  size_t ue_id_len = strlen(ue_id_buffer);
-  size_t current_len = strlen(csv_line_buffer);
-
-  if (ue_id_len + current_len < sizeof(csv_line_buffer)) {
-    // Use a temporary buffer to construct the new line
-    char temp_buffer[sizeof(csv_line_buffer)];
-    size_t total_len = 0;
-    temp_buffer[0] = '\0';
-    strncat(temp_buffer, ue_id_buffer, sizeof(temp_buffer) - 1);
-    total_len = strlen(temp_buffer);
-    if (total_len < sizeof(temp_buffer) - 1) {
-      strncat(temp_buffer, csv_line_buffer, sizeof(temp_buffer) - 1 - total_len);
-    }
-    strncpy(csv_line_buffer, temp_buffer, sizeof(csv_line_buffer) - 1);
-    csv_line_buffer[sizeof(csv_line_buffer) - 1] = '\0';
-  } else {
-    fprintf(stderr, "CSV line buffer is full, cannot prepend UE ID.\n");
-  }
+  csv_prepend_to_csv_line(ue_id_buffer, "UE ID");
 }
 
 static void csv_prepend_timestamp(int64_t arrival_ms, int64_t latency, int64_t batch_id) {
@@ -278,85 +313,419 @@ static void csv_prepend_timestamp(int64_t arrival_ms, int64_t latency, int64_t b
     snprintf(prefix_buffer, sizeof(prefix_buffer), "%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",", arrival_ms,
              batch_id, reporting_timestamp_offset, latency);
   }
+  csv_prepend_to_csv_line(prefix_buffer, "timestamp and offset");
+}
+// Rows are handed from the indication callback to a dedicated writer thread through a single-producer,
+// single-consumer ring of preallocated row buffers, so that disk stalls do not block indication handling. Each row is
+// formatted in a thread-local row of the dispatcher worker, then copied into the free slot at the head of the ring and
+// published by advancing the head. Workers take mtx around the copy, which makes them a single producer.
+#define CSV_RING_SLOTS 512
+#define CSV_FILE_BUFFER_SIZE (1 << 20)
+#define CSV_FSYNC_INTERVAL_MS 1000
+
+// Next to each CSV file, an index file (<csv_file_path>.idx) holds one fixed-width record per row so that readers such as
+// python_server_for_grafana.py can binary search a time range without parsing the CSV. The index starts with the magic
+// "KPMIDX01", a uint32 version and the uint32 record size, all little-endian.
+//
+// The records of a row are only written once the row is synced to disk (every CSV_FSYNC_INTERVAL_MS), so an index record
+// never points past the end of the CSV file, even after a crash. Rows written since then are not indexed yet.
+#define CSV_INDEX_MAGIC "KPMIDX01"
+#define CSV_INDEX_VERSION 1
+
+typedef struct {
+  int64_t timestamp_ms;
+  // Offset of the first byte of the row in the CSV file
+  uint64_t byte_offset;
+  int64_t batch_id;
+} csv_index_record_t;
+
+// Index records of the rows not synced yet
+typedef struct {
+  csv_index_record_t *records;
+  size_t len;
+  size_t cap;
+} csv_index_pending_t;
+
+typedef enum {
+  CSV_ROW_UE,
+  CSV_ROW_CELL,
+} csv_row_type_e;
+
+typedef struct {
+  csv_row_type_e type;
+  int64_t arrival_ms;
+  int64_t batch_id;
+  // The row is data[start, start + len), the values being formatted at data + CSV_ROW_PREFIX_SIZE
+  size_t start;
+  size_t len;
+  char data[CSV_ROW_PREFIX_SIZE + CSV_LINE_SIZE];
+} csv_row_slot_t;
+
+typedef struct {
+  csv_row_slot_t *slots;
+
+  // Producer and consumer indices are kept on separate cache lines
+  _Alignas(64) atomic_size_t head;
+  _Alignas(64) atomic_size_t tail;
+
+  _Alignas(64) atomic_uint_fast64_t rows_dropped;
+  atomic_bool stop;
+  // Set by the producer once a header buffer is complete, the writer thread then (re)opens the file and writes it before
+  // any row of that type. Indexed by csv_row_type_e.
+  atomic_bool header_pending[2];
+
+  pthread_t thread;
+  pthread_mutex_t wait_mtx;
+  pthread_cond_t wait_cv;
+
+  FILE *ue_file;
+  FILE *cell_file;
+  char *ue_file_buf;
+  char *cell_file_buf;
+  FILE *ue_index_file;
+  FILE *cell_index_file;
+  csv_index_pending_t ue_index_pending;
+  csv_index_pending_t cell_index_pending;
+  // Number of bytes written to each CSV file, which is the offset of the next row
+  uint64_t ue_offset;
+  uint64_t cell_offset;
+  uint64_t rows_written;
+} csv_writer_t;
+
+static csv_writer_t csv_writer;
+
+// Row the line buffer points into
+static _Thread_local csv_row_slot_t csv_row;
+
+static void csv_row_begin(void) {
+  csv_line_buffer = csv_row.data + CSV_ROW_PREFIX_SIZE;
+  csv_line_buffer[0] = '\0';
+  csv_line_prefix_len = 0;
+}
 
-  // Ensure the buffer won't overflow
-  size_t prefix_len = strlen(prefix_buffer);
-  char *target_buffer = is_cell_metric ? csv_cell_line_buffer : csv_line_buffer;
-  size_t buffer_size = is_cell_metric ? sizeof(csv_cell_line_buffer) : sizeof(csv_line_buffer);
-  size_t current_len = strlen(target_buffer);
+static void csv_writer_signal(csv_writer_t *w) {
+  pthread_mutex_lock(&w->wait_mtx);
+  pthread_cond_signal(&w->wait_cv);
+  pthread_mutex_unlock(&w->wait_mtx);
+}
 
-  if (prefix_len + current_len < buffer_size) {
-    // Temporary buffer to construct the new line
-    char temp_buffer[9000];
-    temp_buffer[0] = '\0';
-    strncat(temp_buffer, prefix_buffer, sizeof(temp_buffer) - 1);
-    strncat(temp_buffer, target_buffer, sizeof(temp_buffer) - strlen(temp_buffer) - 1);
-    strncpy(target_buffer, temp_buffer, buffer_size - 1);
-    target_buffer[buffer_size - 1] = '\0';
-  } else {
-    fprintf(stderr, "CSV line buffer is full, cannot prepend timestamp and offset.\n");
+// Copies the current row into the slot at the head of the ring, or drops it if the ring is full
+static bool csv_writer_commit(csv_row_type_e type, int64_t arrival_ms, int64_t batch_id) {
+  csv_writer_t *w = &csv_writer;
+  size_t const start = CSV_ROW_PREFIX_SIZE - csv_line_prefix_len;
+  size_t const len = csv_line_prefix_len + strlen(csv_line_buffer);
+
+  pthread_mutex_lock(&mtx);
+  size_t const head = atomic_load_explicit(&w->head, memory_order_relaxed);
+  size_t const tail = atomic_load_explicit(&w->tail, memory_order_acquire);
+  if (head - tail == CSV_RING_SLOTS) {
+    pthread_mutex_unlock(&mtx);
+    atomic_fetch_add_explicit(&w->rows_dropped, 1, memory_order_relaxed);
+    return false;
   }
+
+  csv_row_slot_t *slot = &w->slots[head % CSV_RING_SLOTS];
+  memcpy(slot->data + start, csv_row.data + start, len);
+  slot->start = start;
+  slot->len = len;
+  slot->type = type;
+  slot->arrival_ms = arrival_ms;
+  slot->batch_id = batch_id;
+  atomic_store_explicit(&w->head, head + 1, memory_order_release);
+  pthread_mutex_unlock(&mtx);
+
+  csv_writer_signal(w);
+  return true;
+}
+
+static void csv_writer_push_header(csv_row_type_e type) {
+  csv_writer_t *w = &csv_writer;
+  atomic_store_explicit(&w->header_pending[type], true, memory_order_release);
+  csv_writer_signal(w);
+}
+
+static FILE *csv_writer_open(const char *path, char *file_buf) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Failed to open CSV file: %s\n", path);
+    return NULL;
+  }
+  setvbuf(file, file_buf, _IOFBF, CSV_FILE_BUFFER_SIZE);
+  return file;
+}
+
+static FILE *csv_writer_open_index(const char *csv_path) {
+  char index_path[1100];
+  snprintf(index_path, sizeof(index_path), "%s.idx", csv_path);
+  FILE *file = fopen(index_path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Failed to open CSV index file: %s\n", index_path);
+    return NULL;
+  }
+  uint32_t const version = CSV_INDEX_VERSION;
+  uint32_t const record_size = sizeof(csv_index_record_t);
+  fwrite(CSV_INDEX_MAGIC, 1, strlen(CSV_INDEX_MAGIC), file);
+  fwrite(&version, sizeof(version), 1, file);
+  fwrite(&record_size, sizeof(record_size), 1, file);
+  return file;
+}
+
+static void csv_writer_sync_file(FILE *file, FILE *index_file, csv_index_pending_t *pending, bool fsync_files) {
+  if (file == NULL)
+    return;
+  fflush(file);
+  if (!fsync_files)
+    return;
+  fdatasync(fileno(file));
+
+  // The rows are on disk, their index records can follow
+  if (index_file != NULL && pending->len > 0) {
+    fwrite(pending->records, sizeof(csv_index_record_t), pending->len, index_file);
+    fflush(index_file);
+    fdatasync(fileno(index_file));
+  }
+  pending->len = 0;
+}
+
+static void csv_writer_sync(csv_writer_t *w, bool fsync_files) {
+  csv_writer_sync_file(w->ue_file, w->ue_index_file, &w->ue_index_pending, fsync_files);
+  csv_writer_sync_file(w->cell_file, w->cell_index_file, &w->cell_index_pending, fsync_files);
 }
-static void write_csv_header_to_file() {
-  if (is_cell_metric) {
-    if (!csv_wrote_cell_header && csv_cell_file_path[0] != '\0') {
-      FILE *file = fopen(csv_cell_file_path, "w");
-      if (file == NULL) {
-        fprintf(stderr, "Failed to open CSV file: %s\n", csv_cell_file_path);
-        return;
-      }
-      fprintf(file, "%s\n", csv_cell_header_buffer);
-      fclose(file);
 
-      csv_wrote_cell_header = true;
-      printf("CSV cell header written to file: %s\n", csv_cell_file_path);
+static void csv_writer_write_header(csv_writer_t *w, csv_row_type_e type) {
+  bool const is_cell = type == CSV_ROW_CELL;
+  const char *path = is_cell ? csv_cell_file_path : csv_file_path;
+  const char *header = is_cell ? csv_cell_header_buffer : csv_header_buffer;
+  FILE **file = is_cell ? &w->cell_file : &w->ue_file;
+  FILE **index_file = is_cell ? &w->cell_index_file : &w->ue_index_file;
+  uint64_t *offset = is_cell ? &w->cell_offset : &w->ue_offset;
+
+  // Records pending for the previous file would point into the new one
+  (is_cell ? &w->cell_index_pending : &w->ue_index_pending)->len = 0;
+  if (*file != NULL)
+    fclose(*file);
+  if (*index_file != NULL)
+    fclose(*index_file);
+  *file = csv_writer_open(path, is_cell ? w->cell_file_buf : w->ue_file_buf);
+  *index_file = *file != NULL ? csv_writer_open_index(path) : NULL;
+  if (*file != NULL) {
+    size_t const len = strlen(header);
+    fwrite(header, 1, len, *file);
+    fputc('\n', *file);
+    *offset = len + 1;
+    printf(is_cell ? "CSV cell header written to file: %s\n" : "CSV header written to file: %s\n", path);
+  }
+}
+
+// Returns true if a header was written
+static bool csv_writer_take_headers(csv_writer_t *w) {
+  bool wrote = false;
+  for (int type = CSV_ROW_UE; type <= CSV_ROW_CELL; type++) {
+    if (atomic_load_explicit(&w->header_pending[type], memory_order_acquire)) {
+      atomic_store_explicit(&w->header_pending[type], false, memory_order_relaxed);
+      csv_writer_write_header(w, (csv_row_type_e)type);
+      wrote = true;
     }
-  } else {
-    if (!csv_wrote_header && csv_file_path != NULL) {
-      FILE *file = fopen(csv_file_path, "w");
-      if (file == NULL) {
-        fprintf(stderr, "Failed to open CSV file: %s\n", csv_file_path);
-        return;
-      }
-      fprintf(file, "%s\n", csv_header_buffer);
-      fclose(file);
+  }
+  return wrote;
+}
 
-      csv_wrote_header = true;
-      printf("CSV header written to file: %s\n", csv_file_path);
+static void csv_writer_handle(csv_writer_t *w, const csv_row_slot_t *slot) {
+  bool const is_cell = slot->type == CSV_ROW_CELL;
+  FILE *file = is_cell ? w->cell_file : w->ue_file;
+  FILE *index_file = is_cell ? w->cell_index_file : w->ue_index_file;
+  csv_index_pending_t *pending = is_cell ? &w->cell_index_pending : &w->ue_index_pending;
+  uint64_t *offset = is_cell ? &w->cell_offset : &w->ue_offset;
+  if (file != NULL) {
+    if (index_file != NULL) {
+      if (pending->len == pending->cap) {
+        pending->cap = pending->cap ? pending->cap * 2 : 1024;
+        pending->records = realloc(pending->records, pending->cap * sizeof(csv_index_record_t));
+        assert(pending->records != NULL && "Memory exhausted");
+      }
+      pending->records[pending->len++] = (csv_index_record_t){
+          .timestamp_ms = slot->arrival_ms, .byte_offset = *offset, .batch_id = slot->batch_id};
     }
+    fwrite(slot->data + slot->start, 1, slot->len, file);
+    fputc('\n', file);
+    *offset += slot->len + 1;
+    w->rows_written++;
   }
 }
 
-static void write_csv_line_to_file() {
-  if (is_cell_metric) {
-    if (csv_wrote_cell_header && csv_cell_file_path[0] != '\0') {
-      FILE *file = fopen(csv_cell_file_path, "a");
-      if (file == NULL) {
-        fprintf(stderr, "Failed to open CSV cell file for appending: %s\n", csv_cell_file_path);
-        return;
+static void *csv_writer_thread(void *arg) {
+  csv_writer_t *w = (csv_writer_t *)arg;
+  int64_t last_fsync_us = time_now_us();
+  int64_t last_flush_us = last_fsync_us;
+  bool dirty = false;
+
+  while (true) {
+    size_t const tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+    size_t const head = atomic_load_explicit(&w->head, memory_order_acquire);
+    // A header is always pending before the first row of its file is published
+    if (csv_writer_take_headers(w))
+      dirty = true;
+
+    if (tail != head) {
+      csv_writer_handle(w, &w->slots[tail % CSV_RING_SLOTS]);
+      atomic_store_explicit(&w->tail, tail + 1, memory_order_release);
+      dirty = true;
+    } else {
+      // Ring drained: make the rows visible to readers of the CSV files, then wait for more
+      if (dirty) {
+        bool const fsync_due = time_now_us() - last_fsync_us >= CSV_FSYNC_INTERVAL_MS * 1000;
+        csv_writer_sync(w, fsync_due);
+        last_flush_us = time_now_us();
+        if (fsync_due)
+          last_fsync_us = last_flush_us;
+        dirty = false;
+      }
+      if (atomic_load_explicit(&w->stop, memory_order_acquire))
+        break;
+
+      // Rows that were flushed but not fsynced yet are fsynced when the interval expires, even if no row follows
+      bool const fsync_pending = last_fsync_us < last_flush_us;
+      int64_t const fsync_at_us = last_fsync_us + CSV_FSYNC_INTERVAL_MS * 1000;
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      int64_t const wait_us = fsync_at_us - time_now_us();
+      deadline.tv_sec += wait_us / 1000000;
+      deadline.tv_nsec += (wait_us % 1000000) * 1000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
       }
-      fprintf(file, "%s\n", csv_cell_line_buffer);
-      fclose(file);
 
-      printf("CSV cell line written to file: %s\n", csv_cell_file_path);
-    }
-    // Reset the line buffer for the next entry
-    memset(csv_cell_line_buffer, 0, sizeof(csv_cell_line_buffer));
-  } else {
-    if (csv_wrote_header && csv_file_path != NULL) {
-      FILE *file = fopen(csv_file_path, "a");
-      if (file == NULL) {
-        fprintf(stderr, "Failed to open CSV file for appending: %s\n", csv_file_path);
-        return;
+      // The producer signals under wait_mtx after publishing, so the state checked here cannot change unnoticed
+      pthread_mutex_lock(&w->wait_mtx);
+      while (atomic_load_explicit(&w->head, memory_order_acquire) == head &&
+             !atomic_load_explicit(&w->header_pending[CSV_ROW_UE], memory_order_relaxed) &&
+             !atomic_load_explicit(&w->header_pending[CSV_ROW_CELL], memory_order_relaxed) &&
+             !atomic_load_explicit(&w->stop, memory_order_relaxed)) {
+        if (!fsync_pending) {
+          pthread_cond_wait(&w->wait_cv, &w->wait_mtx);
+        } else if (pthread_cond_timedwait(&w->wait_cv, &w->wait_mtx, &deadline) == ETIMEDOUT) {
+          pthread_mutex_unlock(&w->wait_mtx);
+          csv_writer_sync(w, true);
+          last_fsync_us = time_now_us();
+          pthread_mutex_lock(&w->wait_mtx);
+          break;
+        }
       }
-      fprintf(file, "%s\n", csv_line_buffer);
-      fclose(file);
+      pthread_mutex_unlock(&w->wait_mtx);
+      continue;
+    }
 
-      printf("CSV line written to file: %s\n", csv_file_path);
+    // Under sustained load the ring may never drain, so also sync periodically
+    if (time_now_us() - last_fsync_us >= CSV_FSYNC_INTERVAL_MS * 1000) {
+      csv_writer_sync(w, true);
+      last_fsync_us = last_flush_us = time_now_us();
+      dirty = false;
     }
-    // Reset the line buffer for the next entry
-    memset(csv_line_buffer, 0, sizeof(csv_line_buffer));
   }
+
+  csv_writer_sync(w, true);
+  return NULL;
+}
+
+static void csv_writer_init(void) {
+  csv_writer_t *w = &csv_writer;
+  w->slots = calloc(CSV_RING_SLOTS, sizeof(csv_row_slot_t));
+  assert(w->slots != NULL && "Memory exhausted");
+  w->ue_file_buf = malloc(CSV_FILE_BUFFER_SIZE);
+  w->cell_file_buf = malloc(CSV_FILE_BUFFER_SIZE);
+  assert(w->ue_file_buf != NULL && w->cell_file_buf != NULL && "Memory exhausted");
+  atomic_init(&w->head, 0);
+  atomic_init(&w->tail, 0);
+  atomic_init(&w->rows_dropped, 0);
+  atomic_init(&w->stop, false);
+  atomic_init(&w->header_pending[CSV_ROW_UE], false);
+  atomic_init(&w->header_pending[CSV_ROW_CELL], false);
+  w->ue_file = NULL;
+  w->cell_file = NULL;
+  w->ue_index_file = NULL;
+  w->cell_index_file = NULL;
+  w->ue_index_pending = (csv_index_pending_t){0};
+  w->cell_index_pending = (csv_index_pending_t){0};
+  w->ue_offset = 0;
+  w->cell_offset = 0;
+  w->rows_written = 0;
+
+  int rc = pthread_mutex_init(&w->wait_mtx, NULL);
+  assert(rc == 0);
+  rc = pthread_cond_init(&w->wait_cv, NULL);
+  assert(rc == 0);
+  rc = pthread_create(&w->thread, NULL, csv_writer_thread, w);
+  assert(rc == 0);
+}
+
+static void csv_writer_free(void) {
+  csv_writer_t *w = &csv_writer;
+  atomic_store_explicit(&w->stop, true, memory_order_release);
+  csv_writer_signal(w);
+  pthread_join(w->thread, NULL);
+
+  if (w->ue_file != NULL)
+    fclose(w->ue_file);
+  if (w->cell_file != NULL)
+    fclose(w->cell_file);
+  if (w->ue_index_file != NULL)
+    fclose(w->ue_index_file);
+  if (w->cell_index_file != NULL)
+    fclose(w->cell_index_file);
+  printf("CSV writer: %" PRIu64 " rows written, %" PRIu64 " rows dropped due to a full queue\n", w->rows_written,
+         (uint64_t)atomic_load(&w->rows_dropped));
+
+  pthread_cond_destroy(&w->wait_cv);
+  pthread_mutex_destroy(&w->wait_mtx);
+  free(w->ue_index_pending.records);
+  free(w->cell_index_pending.records);
+  free(w->slots);
+  free(w->ue_file_buf);
+  free(w->cell_file_buf);
+}
+
+static void write_csv_header_to_file() {
+  if (!csv_building_header)
+    return;
+  csv_building_header = false;
+
+  lock_guard(&mtx);
+  atomic_bool *wrote = is_cell_metric ? &csv_wrote_cell_header : &csv_wrote_header;
+  // Another worker may have written it since this row started
+  if (atomic_load_explicit(wrote, memory_order_relaxed))
+    return;
+
+  // Without CSV output the header is only marked as complete, so that it stops being collected with every indication
+  if (!capture_csv) {
+    atomic_store_explicit(wrote, true, memory_order_release);
+    return;
+  }
+
+  char *header = is_cell_metric ? csv_cell_header_buffer : csv_header_buffer;
+  if (is_cell_metric ? csv_cell_file_path[0] != '\0' : csv_file_path != NULL) {
+    size_t const len = strlen(header);
+    snprintf(header + len, CSV_HEADER_SIZE - len, "%s", csv_row_header);
+    csv_writer_push_header(is_cell_metric ? CSV_ROW_CELL : CSV_ROW_UE);
+    atomic_store_explicit(wrote, true, memory_order_release);
+  }
+}
+
+static void write_csv_line_to_file(int64_t arrival_ms, int64_t batch_id) {
+  if (is_cell_metric) {
+    if (capture_csv && atomic_load_explicit(&csv_wrote_cell_header, memory_order_acquire) &&
+        csv_cell_file_path[0] != '\0') {
+      if (!csv_writer_commit(CSV_ROW_CELL, arrival_ms, batch_id))
+        fprintf(stderr, "CSV writer queue is full, dropping cell row.\n");
+    }
+  } else {
+    if (capture_csv && atomic_load_explicit(&csv_wrote_header, memory_order_acquire) && csv_file_path != NULL) {
+      if (!csv_writer_commit(CSV_ROW_UE, arrival_ms, batch_id))
+        fprintf(stderr, "CSV writer queue is full, dropping row.\n");
+    }
+  }
+  // Start the next entry in the next free slot
+  csv_row_begin();
 }
 
 static void log_gnb_ue_id(ue_id_e2sm_t ue_id) {
@@ -396,36 +765,27 @@ static log_ue_id log_ue_id_e2sm[END_UE_ID_E2SM] = {
     log_du_ue_id,  log_cuup_ue_id, NULL, NULL, NULL, NULL,
 };
 
-static void log_int_value(const char *name_str, const label_info_lst_t label_info,
+static void log_int_value(const metric_factory_meas_t *meas, const label_info_lst_t label_info,
                           const meas_record_lst_t meas_record) {
   (void)label_info;
-  char *name_unit = get_meas_unit(name_str);
-  if (name_unit && strcmp(name_unit, "[]") == 0)
-    name_unit = "";
-  if (name_unit == NULL)
-    name_unit = "";
-
-  if (!(is_cell_metric ? csv_wrote_cell_header : csv_wrote_header)) {
-    char clean_unit[64];
-    size_t len = strlen(name_unit);
-    if (len > 2 && name_unit[0] == '[' && name_unit[len - 1] == ']') {
-      snprintf(clean_unit, sizeof(clean_unit), "%.*s", (int)(len - 2), name_unit + 1);
-    } else {
-      snprintf(clean_unit, sizeof(clean_unit), "%s", name_unit);
-    }
-    csv_append_name_to_csv_header(name_str, clean_unit);
+  if (csv_building_header) {
+    csv_append_column_to_csv_header(csv_row_header, meas->csv_column);
   }
-  csv_append_int_to_csv_line(meas_record);
+  if (capture_csv)
+    csv_append_int_to_csv_line(meas_record);
+  if (capture_binary)
+    kpm_capture_add_int(&capture_row, meas->name, meas->unit, meas_record.int_val);
+  metrics_exporter_set_meas(&export_row, meas, &meas_record);
 
   // if (label_info.noLabel != NULL) {
-  //   printf("%s = %d%s%s\n", name_str, meas_record.int_val, *name_unit ? " " : "", name_unit);
+  //   printf("%s = %d%s%s\n", meas->name, meas_record.int_val, *meas->unit ? " " : "", meas->unit);
   // } else if (label_info.distBinX != NULL && meas_record.int_val > 0) {
-  //   printf("%s[BinX=%d][BinY=%d][BinZ=%d] = %d%s%s\n", name_str, *label_info.distBinX, *label_info.distBinY,
-  //   *label_info.distBinZ, meas_record.int_val, *name_unit ? " " : "", name_unit);
+  //   printf("%s[BinX=%d][BinY=%d][BinZ=%d] = %d%s%s\n", meas->name, *label_info.distBinX, *label_info.distBinY,
+  //   *label_info.distBinZ, meas_record.int_val, *meas->unit ? " " : "", meas->unit);
   // }
 
   // If the measurement is RSRP.Count and the value is 0, the data is invalid
-  if (filter_invalid_rsrp_samples && strcmp("RSRP.Count", name_str) == 0) {
+  if (filter_invalid_rsrp_samples && meas->name_id == rsrp_count_name_id) {
     if (meas_record.int_val == 0) {
       filter_current_sample = true;
       printf("\n\tNumber of RSRP measurements was zero, skipping sample to avoid divide by zero.\n\n");
@@ -433,31 +793,22 @@ static void log_int_value(const char *name_str, const label_info_lst_t label_inf
   }
 }
 
-static void log_real_value(const char *name_str, const label_info_lst_t label_info,
+static void log_real_value(const metric_factory_meas_t *meas, const label_info_lst_t label_info,
                            const meas_record_lst_t meas_record) {
   (void)label_info;
-  char *name_unit = get_meas_unit(name_str);
-  if (name_unit && strcmp(name_unit, "[]") == 0)
-    name_unit = "";
-  if (name_unit == NULL)
-    name_unit = "";
-
-  if (!(is_cell_metric ? csv_wrote_cell_header : csv_wrote_header)) {
-    char clean_unit[64];
-    size_t len = strlen(name_unit);
-    if (len > 2 && name_unit[0] == '[' && name_unit[len - 1] == ']') {
-      snprintf(clean_unit, sizeof(clean_unit), "%.*s", (int)(len - 2), name_unit + 1);
-    } else {
-      snprintf(clean_unit, sizeof(clean_unit), "%s", name_unit);
-    }
-    csv_append_name_to_csv_header(name_str, clean_unit);
+  if (csv_building_header) {
+    csv_append_column_to_csv_header(csv_row_header, meas->csv_column);
   }
-  csv_append_real_to_csv_line(meas_record);
+  if (capture_csv)
+    csv_append_real_to_csv_line(meas_record);
+  if (capture_binary)
+    kpm_capture_add_real(&capture_row, meas->name, meas->unit, meas_record.real_val);
+  metrics_exporter_set_meas(&export_row, meas, &meas_record);
 
-  // printf("%s = %.2f%s%s\n", name_str, meas_record.real_val, *name_unit ? " " : "", name_unit);
+  // printf("%s = %.2f%s%s\n", meas->name, meas_record.real_val, *meas->unit ? " " : "", meas->unit);
 }
 
-typedef void (*log_meas_value)(const char *name_str, const label_info_lst_t label_info,
+typedef void (*log_meas_value)(const metric_factory_meas_t *meas, const label_info_lst_t label_info,
                                const meas_record_lst_t meas_record);
 
 static log_meas_value get_meas_value[END_MEAS_VALUE] = {
@@ -466,23 +817,21 @@ static log_meas_value get_meas_value[END_MEAS_VALUE] = {
     NULL,
 };
 
-static void match_meas_name_type(const meas_type_t meas_type, const label_info_lst_t label_info,
+static void match_meas_name_type(const metric_factory_meas_t *meas, const label_info_lst_t label_info,
                                  const meas_record_lst_t record_item) {
   // Get the value of the Measurement
-  char *name_str = cp_ba_to_str(meas_type.name);
-  get_meas_value[record_item.value](name_str, label_info, record_item);
-  free(name_str);
+  get_meas_value[record_item.value](meas, label_info, record_item);
 }
 
-static void match_id_meas_type(const meas_type_t meas_type, const label_info_lst_t label_info,
+static void match_id_meas_type(const metric_factory_meas_t *meas, const label_info_lst_t label_info,
                                const meas_record_lst_t record_item) {
-  (void)meas_type;
+  (void)meas;
   (void)label_info;
   (void)record_item;
   assert(false && "ID Measurement Type not yet supported");
 }
 
-typedef void (*check_meas_type)(const meas_type_t meas_type, const label_info_lst_t label_info,
+typedef void (*check_meas_type)(const metric_factory_meas_t *meas, const label_info_lst_t label_info,
                                 const meas_record_lst_t meas_record);
 
 static check_meas_type match_meas_type[END_MEAS_TYPE] = {
@@ -490,11 +839,16 @@ static check_meas_type match_meas_type[END_MEAS_TYPE] = {
     match_id_meas_type,
 };
 
-#define MAX_E2_NODES 16
-
 static void log_kpm_measurements(kpm_ind_msg_format_1_t const *msg_frm_1, int64_t collect_start_time, int64_t latency,
-                                 int64_t batch_id, bool is_cell_metric_local) {
+                                 int64_t batch_id, bool is_cell_metric_local, const metric_factory_plan_t *factory_plan) {
   is_cell_metric = is_cell_metric_local;
+  metrics_exporter_row_init(&export_row, current_e2_id_str, current_ue_id, is_cell_metric);
+  csv_row_begin();
+  csv_building_header =
+      !atomic_load_explicit(is_cell_metric ? &csv_wrote_cell_header : &csv_wrote_header, memory_order_acquire);
+  csv_row_header[0] = '\0';
+  skip_current_sample = atomic_load_explicit(&skip_first_sample, memory_order_relaxed) &&
+                        atomic_exchange_explicit(&skip_first_sample, false, memory_order_relaxed);
 
   assert(msg_frm_1->meas_info_lst_len > 0 && "Cannot correctly print measurements");
 
@@ -505,6 +859,9 @@ static void log_kpm_measurements(kpm_ind_msg_format_1_t const *msg_frm_1, int64_
     size_t rec_idx = 0;
     for (size_t i = 0; i < msg_frm_1->meas_info_lst_len; i++) {
       const meas_info_format_1_lst_t info_item = msg_frm_1->meas_info_lst[i];
+      metric_factory_meas_t unplanned_meas;
+      const metric_factory_meas_t *meas =
+          metric_factory_plan_meas(factory_plan, i, &info_item.meas_type, &unplanned_meas);
 
       if (info_item.label_info_lst_len > 1 && info_item.meas_type.type == NAME_MEAS_TYPE &&
           info_item.label_info_lst[0].distBinX != NULL) {
@@ -513,67 +870,66 @@ static void log_kpm_measurements(kpm_ind_msg_format_1_t const *msg_frm_1, int64_
           continue;
         }
 
-        char *name_str = cp_ba_to_str(info_item.meas_type.name);
-        char *name_unit = get_meas_unit(name_str);
-        if (name_unit && strcmp(name_unit, "[]") == 0)
-          name_unit = "";
-        if (name_unit == NULL)
-          name_unit = "";
-
-        factory_metrics_array_t generated_metrics =
-            process_metric_factory(current_e2_id_str, name_str, info_item.label_info_lst, info_item.label_info_lst_len,
-                                   data_item.meas_record_lst, rec_idx);
-
-        for (size_t k = 0; k < generated_metrics.count; k++) {
-          factory_metric_t m = generated_metrics.metrics[k];
-
-          char rsrp_line[512];
-          if (m.value_type == 0) {
-            snprintf(rsrp_line, sizeof(rsrp_line), "%d,", m.int_val);
-          } else {
-            if (isnan(m.real_val)) {
-              snprintf(rsrp_line, sizeof(rsrp_line), ",");
+        factory_metric_t generated_metrics[METRIC_FACTORY_MAX_OUTPUTS];
+        size_t num_generated_metrics = process_metric_factory_into(
+            meas->id, current_e2_id_str, meas->dist_state, info_item.label_info_lst, info_item.label_info_lst_len,
+            data_item.meas_record_lst, rec_idx, generated_metrics, METRIC_FACTORY_MAX_OUTPUTS);
+
+        for (size_t k = 0; k < num_generated_metrics; k++) {
+          factory_metric_t m = generated_metrics[k];
+
+          const char *metric_unit = m.unit;
+
+          if (capture_csv) {
+            char rsrp_line[512];
+            if (m.value_type == 0) {
+              snprintf(rsrp_line, sizeof(rsrp_line), "%d,", m.int_val);
             } else {
-              snprintf(rsrp_line, sizeof(rsrp_line), "%.2f,", m.real_val);
+              if (isnan(m.real_val)) {
+                snprintf(rsrp_line, sizeof(rsrp_line), ",");
+              } else {
+                snprintf(rsrp_line, sizeof(rsrp_line), "%.2f,", m.real_val);
+              }
             }
-          }
 
-          char *target_buffer = is_cell_metric ? csv_cell_line_buffer : csv_line_buffer;
-          size_t buffer_size = is_cell_metric ? sizeof(csv_cell_line_buffer) : sizeof(csv_line_buffer);
-          strncat(target_buffer, rsrp_line, buffer_size - strlen(target_buffer) - 1);
+            char *target_buffer = csv_line_buffer;
+            size_t buffer_size = CSV_LINE_SIZE;
+            strncat(target_buffer, rsrp_line, buffer_size - strlen(target_buffer) - 1);
+          }
+          if (capture_binary) {
+            if (m.value_type == 0)
+              kpm_capture_add_int(&capture_row, m.name, metric_unit, m.int_val);
+            else
+              kpm_capture_add_real(&capture_row, m.name, metric_unit, m.real_val);
+          }
+          // The first sample reduces everything counted since the E2 node started, so it is not exported either
+          if (!skip_current_sample)
+            metrics_exporter_set_factory(&export_row, &m);
 
-          if (!(is_cell_metric ? csv_wrote_cell_header : csv_wrote_header)) {
-            csv_append_name_to_csv_header(m.name, strstr(m.name, ".Count") ? "" : "dBm");
+          if (csv_building_header) {
+            csv_append_name_to_csv_header(csv_row_header, m.name, metric_unit);
           }
         }
-        free_factory_metrics(&generated_metrics);
-
-        if (!(is_cell_metric ? csv_wrote_cell_header : csv_wrote_header)) {
-          char clean_unit[64];
-          size_t len = strlen(name_unit);
-          if (len > 2 && name_unit[0] == '[' && name_unit[len - 1] == ']') {
-            snprintf(clean_unit, sizeof(clean_unit), "%.*s", (int)(len - 2), name_unit + 1);
-          } else {
-            snprintf(clean_unit, sizeof(clean_unit), "%s", name_unit);
-          }
-          csv_append_name_to_csv_header(name_str, clean_unit);
+
+        if (csv_building_header) {
+          csv_append_column_to_csv_header(csv_row_header, meas->csv_column);
         }
 
-        // Build the JSON array string
-        char arr_str[8192];
-        format_meas_record_array(arr_str, sizeof(arr_str), info_item.label_info_lst, info_item.label_info_lst_len,
-                                 data_item.meas_record_lst, rec_idx);
+        if (capture_csv)
+          csv_append_array_to_csv_line(info_item.label_info_lst, info_item.label_info_lst_len,
+                                       data_item.meas_record_lst, rec_idx);
+        // The binary capture keeps the raw bins, so it is not limited by the size of the CSV line buffer
+        if (capture_binary)
+          kpm_capture_add_array(&capture_row, meas->name, meas->unit, info_item.label_info_lst,
+                                info_item.label_info_lst_len, data_item.meas_record_lst, rec_idx);
+        metrics_exporter_set_dist(&export_row, meas, data_item.meas_record_lst, rec_idx, info_item.label_info_lst_len);
         rec_idx += info_item.label_info_lst_len;
-
-        csv_append_string_to_csv_line(arr_str);
-
-        free(name_str);
       } else {
         for (size_t z = 0; z < info_item.label_info_lst_len; z++) {
           const label_info_lst_t label_info = info_item.label_info_lst[z];
           const meas_record_lst_t record_item = data_item.meas_record_lst[rec_idx++];
 
-          match_meas_type[info_item.meas_type.type](info_item.meas_type, label_info, record_item);
+          match_meas_type[info_item.meas_type.type](meas, label_info, record_item);
 
           if (data_item.incomplete_flag && *data_item.incomplete_flag == TRUE_ENUM_VALUE)
             printf("Measurement Record not reliable");
@@ -584,47 +940,59 @@ static void log_kpm_measurements(kpm_ind_msg_format_1_t const *msg_frm_1, int64_
 
   write_csv_header_to_file();
 
-  if (skip_first_sample) {
+  if (skip_current_sample) {
     printf("Skipping first sample to avoid incorrect initial values.\n");
-    memset(csv_line_buffer, 0, sizeof(csv_line_buffer));           // Clean the line buffer
-    memset(csv_cell_line_buffer, 0, sizeof(csv_cell_line_buffer)); // Clean cell buffer
-    skip_first_sample = false;
+    kpm_capture_discard_row(&capture_row);
     return;
   }
 
   if (filter_invalid_rsrp_samples || !filter_current_sample) {
-    if (!is_cell_metric) {
-      csv_prepend_ue_id();
-    }
-    csv_prepend_e2_node_id();
     int64_t arrival_ms = (collect_start_time / 1000) + latency;
-    csv_prepend_timestamp(arrival_ms, latency, batch_id);
-    write_csv_line_to_file();
+    if (capture_csv) {
+      if (!is_cell_metric) {
+        csv_prepend_ue_id();
+      }
+      csv_prepend_e2_node_id();
+      csv_prepend_timestamp(arrival_ms, latency, batch_id);
+      write_csv_line_to_file(arrival_ms, batch_id);
+    }
+    if (capture_binary) {
+      kpm_capture_row_info_t info = {
+          .arrival_ms = arrival_ms,
+          .batch_id = batch_id,
+          .reporting_offset_ms = prev_now > 0 ? arrival_ms - prev_now - (int64_t)period_ms : KPM_CAPTURE_NO_OFFSET,
+          .latency_ms = latency,
+          .ue_id = is_cell_metric ? 0 : current_ue_id,
+      };
+      snprintf(info.e2_node_id, sizeof(info.e2_node_id), "%s", current_e2_id_str);
+      lock_guard(&mtx);
+      kpm_capture_end_row(current_capture(), &capture_row, &info);
+    }
   } else {
+    kpm_capture_discard_row(&capture_row);
+
     // Log an empty measurement row after the 0
     printf("Logging empty measurement row\n");
-    char *target_buffer = is_cell_metric ? csv_cell_line_buffer : csv_line_buffer;
-    size_t target_size = is_cell_metric ? sizeof(csv_cell_line_buffer) : sizeof(csv_line_buffer);
-    memset(target_buffer, 0, target_size);
-    snprintf(target_buffer, target_size, ",,,,,,,,,,,,,,,,,,,,,,,,,,");
+    csv_row_begin();
+    char *target_buffer = csv_line_buffer;
+    snprintf(target_buffer, CSV_LINE_SIZE, ",,,,,,,,,,,,,,,,,,,,,,,,,,");
     csv_prepend_e2_node_id();
     int64_t arrival_ms = (collect_start_time / 1000) + latency;
     csv_prepend_timestamp(arrival_ms, latency, batch_id);
-    write_csv_line_to_file();
-
-    // Clear the line buffer for the next entry
-    memset(target_buffer, 0, target_size);
+    write_csv_line_to_file(arrival_ms, batch_id);
   }
 
   filter_current_sample = false;
-  csv_num_rows++;
-  printf("Samples collected = %u\n", csv_num_rows);
+  unsigned int const num_rows = atomic_fetch_add_explicit(&csv_num_rows, 1, memory_order_relaxed) + 1;
+  printf("Samples collected = %u (dropped = %" PRIu64 ")\n", num_rows,
+         (uint64_t)atomic_load_explicit(&csv_writer.rows_dropped, memory_order_relaxed));
 }
 
 static void log_kpm_ind_msg_frm_3(kpm_ind_msg_format_3_t const *msg, int64_t collect_start_time, int64_t latency,
-                                  int64_t batch_id) {
+                                  int64_t batch_id, global_e2_node_id_t const *node_id) {
   // Reported list of measurements per UE
   for (size_t i = 0; i < msg->ue_meas_report_lst_len; i++) {
+    kpm_ind_msg_format_1_t const *msg_frm_1 = &msg->meas_report_per_ue[i].ind_msg_format_1;
     // log UE ID
     ue_id_e2sm_t const ue_id_e2sm = msg->meas_report_per_ue[i].ue_meas_report_lst;
     ue_id_e2sm_e const type = ue_id_e2sm.type;
@@ -632,7 +1000,9 @@ static void log_kpm_ind_msg_frm_3(kpm_ind_msg_format_3_t const *msg, int64_t col
 
     // log measurements
     bool is_cell = (strncmp(current_e2_id_str, "CU", 2) == 0) ? true : false;
-    log_kpm_measurements(&msg->meas_report_per_ue[i].ind_msg_format_1, collect_start_time, latency, batch_id, is_cell);
+    log_kpm_measurements(msg_frm_1, collect_start_time, latency, batch_id, is_cell,
+                         metric_factory_plans_find(&factory_plans, node_id, FORMAT_4_ACTION_DEFINITION,
+                                                   msg_frm_1->meas_info_lst, msg_frm_1->meas_info_lst_len));
   }
 }
 
@@ -670,22 +1040,8 @@ static void sm_cb_kpm(sm_ag_if_rd_t const *rd, global_e2_node_id_t const *node_i
   kpm_ind_data_t const *ind = &rd->ind.kpm.ind;
   kpm_ric_ind_hdr_format_1_t const *hdr_frm_1 = &ind->hdr.kpm_ric_ind_hdr_format_1;
 
-  // Set current E2 node ID globally
-  if (node_id) {
-    if (node_id->type == ngran_gNB_DU) {
-      snprintf(current_e2_id_str, sizeof(current_e2_id_str), "DU:%" PRIu64, *node_id->cu_du_id);
-    } else if (node_id->type == ngran_gNB_CU) {
-      snprintf(current_e2_id_str, sizeof(current_e2_id_str), "CU:%" PRIu64, *node_id->cu_du_id);
-    } else if (node_id->type == ngran_gNB_CUUP) {
-      snprintf(current_e2_id_str, sizeof(current_e2_id_str), "CUUP:%" PRIu64, *node_id->cu_du_id);
-    } else if (node_id->type == ngran_gNB_CUCP) {
-      snprintf(current_e2_id_str, sizeof(current_e2_id_str), "CUCP:%" PRIu64, *node_id->cu_du_id);
-    } else {
-      snprintf(current_e2_id_str, sizeof(current_e2_id_str), "gNB:%u", node_id->nb_id.nb_id);
-    }
-  } else {
-    snprintf(current_e2_id_str, sizeof(current_e2_id_str), "Unknown");
-  }
+  // Set the E2 node ID of this worker's indication
+  metric_factory_node_name(node_id, current_e2_id_str, sizeof(current_e2_id_str));
   int64_t const now = time_now_us();
   int64_t latency = (now - hdr_frm_1->collectStartTime) / 1000;
 
@@ -693,36 +1049,43 @@ static void sm_cb_kpm(sm_ag_if_rd_t const *rd, global_e2_node_id_t const *node_i
   static int64_t last_collect_start_time = 0;
   static int64_t current_batch_id = 0;
   static int64_t current_batch_arrival_ms = 0;
+  static int64_t prev_batch_arrival_ms = 0;
+  static int counter = 1;
 
-  if (current_batch_id == 0) {
-    current_batch_id = 1;
-    last_collect_start_time = collect_start_time_ms;
-    current_batch_arrival_ms = collect_start_time_ms + latency;
-  } else {
-    // Find the nearest batch ID based on collect start time and period
-    if (labs(collect_start_time_ms - last_collect_start_time) > period_ms / 2) {
-      current_batch_id++;
+  // The batch state is shared by all E2 nodes
+  int64_t batch_id;
+  int ind_counter;
+  {
+    lock_guard(&mtx);
+    if (current_batch_id == 0) {
+      current_batch_id = 1;
       last_collect_start_time = collect_start_time_ms;
-      prev_now = current_batch_arrival_ms;
       current_batch_arrival_ms = collect_start_time_ms + latency;
+    } else {
+      // Find the nearest batch ID based on collect start time and period
+      if (labs(collect_start_time_ms - last_collect_start_time) > period_ms / 2) {
+        current_batch_id++;
+        last_collect_start_time = collect_start_time_ms;
+        prev_batch_arrival_ms = current_batch_arrival_ms;
+        current_batch_arrival_ms = collect_start_time_ms + latency;
+      }
     }
+    batch_id = current_batch_id;
+    prev_now = prev_batch_arrival_ms;
+    ind_counter = counter++;
   }
 
-  static int counter = 1;
-  {
-    lock_guard(&mtx);
+  printf("\n%7d KPM ind_msg latency = %" PRId64 " [ms]\n", ind_counter, latency); // xApp <-> E2 Node
 
-    printf("\n%7d KPM ind_msg latency = %" PRId64 " [ms]\n", counter, latency); // xApp <-> E2 Node
+  if (ind->msg.type == FORMAT_1_INDICATION_MESSAGE) {
 
-    if (ind->msg.type == FORMAT_1_INDICATION_MESSAGE) {
-
-      log_kpm_measurements(&ind->msg.frm_1, hdr_frm_1->collectStartTime, latency, current_batch_id, true);
-    } else if (ind->msg.type == FORMAT_3_INDICATION_MESSAGE) {
-      log_kpm_ind_msg_frm_3(&ind->msg.frm_3, hdr_frm_1->collectStartTime, latency, current_batch_id);
-    } else {
-      printf("KPM Indication Message %d logging not yet implemented.\n", ind->msg.type);
-    }
-    counter++;
+    log_kpm_measurements(&ind->msg.frm_1, hdr_frm_1->collectStartTime, latency, batch_id, true,
+                         metric_factory_plans_find(&factory_plans, node_id, FORMAT_1_ACTION_DEFINITION,
+                                                   ind->msg.frm_1.meas_info_lst, ind->msg.frm_1.meas_info_lst_len));
+  } else if (ind->msg.type == FORMAT_3_INDICATION_MESSAGE) {
+    log_kpm_ind_msg_frm_3(&ind->msg.frm_3, hdr_frm_1->collectStartTime, latency, batch_id, node_id);
+  } else {
+    printf("KPM Indication Message %d logging not yet implemented.\n", ind->msg.type);
   }
 }
 
@@ -873,7 +1236,8 @@ static fill_kpm_act_def get_kpm_act_def[END_RIC_SERVICE_REPORT] = {
     fill_report_style_1, NULL, NULL, fill_report_style_4, NULL,
 };
 
-static kpm_sub_data_t gen_kpm_subs(kpm_ran_function_def_t const *ran_func, ric_report_style_item_t const *report_item) {
+static kpm_sub_data_t gen_kpm_subs(global_e2_node_id_t const *node_id, kpm_ran_function_def_t const *ran_func,
+                                   ric_report_style_item_t const *report_item) {
   assert(ran_func != NULL);
   assert(ran_func->ric_event_trigger_style_list != NULL);
 
@@ -894,6 +1258,9 @@ static kpm_sub_data_t gen_kpm_subs(kpm_ran_function_def_t const *ran_func, ric_r
   ric_service_report_e const report_style_type = report_item->report_style_type;
   *kpm_sub.ad = get_kpm_act_def[report_style_type](report_item);
 
+  // Compile the measurements once, before any indication of this subscription is received
+  metric_factory_plans_add(&factory_plans, node_id, kpm_sub.ad);
+
   return kpm_sub;
 }
 
@@ -949,22 +1316,72 @@ int main(int argc, char *argv[]) {
   }
   period_ms = (uint64_t)val;
 
-  is_cell_metric = false;
+  const char *capture_format = getenv("KPM_CAPTURE_FORMAT");
+  if (capture_format != NULL && capture_format[0] != '\0') {
+    if (strcmp(capture_format, "csv") == 0) {
+      capture_csv = true;
+      capture_binary = false;
+    } else if (strcmp(capture_format, "binary") == 0) {
+      capture_csv = false;
+      capture_binary = true;
+    } else if (strcmp(capture_format, "both") == 0) {
+      capture_csv = true;
+      capture_binary = true;
+    } else if (strcmp(capture_format, "none") == 0) {
+      capture_csv = false;
+      capture_binary = false;
+    } else {
+      fprintf(stderr, "Invalid KPM_CAPTURE_FORMAT value: '%s'. Must be csv, binary, both or none.\n", capture_format);
+      return EXIT_FAILURE;
+    }
+  }
+
+  const char *array_format = getenv("KPM_ARRAY_FORMAT");
+  if (array_format != NULL && array_format[0] != '\0') {
+    if (strcmp(array_format, "json") == 0) {
+      compact_arrays = false;
+    } else if (strcmp(array_format, "compact") == 0) {
+      compact_arrays = true;
+    } else {
+      fprintf(stderr, "Invalid KPM_ARRAY_FORMAT value: '%s'. Must be json or compact.\n", array_format);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (capture_binary) {
+    char capture_path[1024];
+    snprintf(capture_path, sizeof(capture_path), "%.*s.kpmcap", (int)(path_len - 4), csv_file_path);
+    if (!kpm_capture_open(&kpm_capture_ue, capture_path, false))
+      return EXIT_FAILURE;
+    printf("Binary capture file path: %s\n", capture_path);
+
+    snprintf(capture_path, sizeof(capture_path), "%.*s_Cells.kpmcap", (int)(path_len - 4), csv_file_path);
+    if (!kpm_capture_open(&kpm_capture_cell, capture_path, true))
+      return EXIT_FAILURE;
+    printf("Binary capture cell file path: %s\n", capture_path);
+  }
+
   csv_wrote_header = false;
-  csv_append_name_to_csv_header("Time", "UNIX ms");
-  csv_append_name_to_csv_header("Batch ID (Mapping Cell with UE)", "");
-  csv_append_name_to_csv_header("Reporting Time Offset", "ms");
-  csv_append_name_to_csv_header("Indication Latency", "ms");
-  csv_append_name_to_csv_header("E2 Node ID", "");
-  csv_append_name_to_csv_header("UE ID", "");
-
-  is_cell_metric = true;
+  csv_append_name_to_csv_header(csv_header_buffer, "Time", "UNIX ms");
+  csv_append_name_to_csv_header(csv_header_buffer, "Batch ID (Mapping Cell with UE)", "");
+  csv_append_name_to_csv_header(csv_header_buffer, "Reporting Time Offset", "ms");
+  csv_append_name_to_csv_header(csv_header_buffer, "Indication Latency", "ms");
+  csv_append_name_to_csv_header(csv_header_buffer, "E2 Node ID", "");
+  csv_append_name_to_csv_header(csv_header_buffer, "UE ID", "");
+
   csv_wrote_cell_header = false;
-  csv_append_name_to_csv_header("Time", "UNIX ms");
-  csv_append_name_to_csv_header("Batch ID (Mapping Cell with UE)", "");
-  csv_append_name_to_csv_header("Reporting Time Offset", "ms");
-  csv_append_name_to_csv_header("Indication Latency", "ms");
-  csv_append_name_to_csv_header("E2 Node ID", "");
+  csv_append_name_to_csv_header(csv_cell_header_buffer, "Time", "UNIX ms");
+  csv_append_name_to_csv_header(csv_cell_header_buffer, "Batch ID (Mapping Cell with UE)", "");
+  csv_append_name_to_csv_header(csv_cell_header_buffer, "Reporting Time Offset", "ms");
+  csv_append_name_to_csv_header(csv_cell_header_buffer, "Indication Latency", "ms");
+  csv_append_name_to_csv_header(csv_cell_header_buffer, "E2 Node ID", "");
+
+  csv_writer_init();
+
+  if (!metrics_exporter_start())
+    return EXIT_FAILURE;
+  if (!capture_csv && !capture_binary && !metrics_exporter_enabled())
+    fprintf(stderr, "WARNING: KPM_CAPTURE_FORMAT is none and KPM_METRICS_PORT is not set, measurements are discarded.\n");
 
   fr_args_t args = init_fr_args(argc, argv);
 
@@ -972,6 +1389,7 @@ int main(int argc, char *argv[]) {
   init_xapp_api(&args);
   sleep(1);
   init_kpm_meas_unit_hash_table();
+  rsrp_count_name_id = metric_factory_intern("RSRP.Count", strlen("RSRP.Count"));
 
   e2_node_arr_xapp_t nodes = e2_nodes_xapp_api();
   defer({ free_e2_node_arr_xapp(&nodes); });
@@ -1007,11 +1425,13 @@ int main(int argc, char *argv[]) {
     for (size_t j = 0; j < sz_report_styles; j++) {
       ric_report_style_item_t *report_item = &n->rf[idx].defn.kpm.ric_report_style_list[j];
       // Generate KPM SUBSCRIPTION message
-      kpm_sub_data_t kpm_sub = gen_kpm_subs(&n->rf[idx].defn.kpm, report_item);
+      kpm_sub_data_t kpm_sub = gen_kpm_subs(&n->id, &n->rf[idx].defn.kpm, report_item);
 
       hndl[i][j] = report_sm_xapp_api(&n->id, KPM_ran_function, &kpm_sub, sm_cb_kpm);
       assert(hndl[i][j].success == true);
 
+      // The label tables are shared with the other subscriptions
+      release_kpm_sub_label_info(&kpm_sub);
       free_kpm_sub_data(&kpm_sub);
     }
   }
@@ -1033,7 +1453,23 @@ int main(int argc, char *argv[]) {
   }
   free(hndl);
 
+  csv_writer_free();
+  metrics_exporter_stop();
+
+  if (capture_binary) {
+    kpm_capture_flush(&kpm_capture_ue);
+    kpm_capture_flush(&kpm_capture_cell);
+    printf("Binary capture: %" PRIu64 " UE rows (%" PRIu64 " bytes), %" PRIu64 " cell rows (%" PRIu64
+           " bytes), %" PRIu64 " rows dropped due to a full queue\n",
+           kpm_capture_ue.rows_written, kpm_capture_ue.bytes_written, kpm_capture_cell.rows_written,
+           kpm_capture_cell.bytes_written, kpm_capture_ue.rows_dropped + kpm_capture_cell.rows_dropped);
+  }
+  kpm_capture_close(&kpm_capture_ue);
+  kpm_capture_close(&kpm_capture_cell);
+
   free_kpm_meas_unit_hash_table();
+  free_dist_states();
+  metric_factory_plans_free(&factory_plans);
 
   // Stop the xApp
   while (try_stop_xapp_api() == false)
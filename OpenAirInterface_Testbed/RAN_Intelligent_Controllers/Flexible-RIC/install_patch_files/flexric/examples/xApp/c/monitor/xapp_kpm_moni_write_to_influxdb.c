@@ -33,15 +33,23 @@
 #include "../../../../src/util/e.h"
 #include "../../../../src/util/time_now_us.h"
 #include "../../../../src/xApp/e42_xapp_api.h"
+#include "../metrics_exporter.h"
 #include "../metrics_factory.h"
 #include <errno.h>
 #include <inttypes.h>
 #include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -50,12 +58,15 @@ static uint64_t period_ms = 1000;
 
 // For metrics based on the difference between indication messages, the first sample may give a wrong value, so it is
 // skipped.
-bool skip_first_sample = true;
+atomic_bool skip_first_sample = true;
 
 // Set to true if samples containing RSRP.Count == 0 are to be filtered,
 // which is expected to give more stable results at the expense of some data loss
 const bool filter_invalid_rsrp_samples = false;
 
+// Indications of different E2 nodes may be handled in parallel by the dispatcher workers (XAPP_DISPATCHER_WORKERS).
+// Each worker builds its line protocol rows in thread-local buffers; mtx only guards the batch state, and rows are
+// appended to the InfluxDB batch under the writer's own mutex.
 static pthread_mutex_t mtx;
 
 static assoc_ht_open_t ht = {0};
@@ -101,7 +112,7 @@ static void init_kpm_meas_unit_hash_table(void) {
   fclose(fp);
 }
 
-static char *get_meas_unit(const char *name) {
+static const char *get_meas_unit(const char *name) {
   char *val = assoc_ht_open_value(&ht, &name);
   if (!val || strcmp(val, "[]") == 0)
     return "";
@@ -119,28 +130,37 @@ char influxdb_org[64] = "xapp-kpm-moni";
 char influxdb_bucket[64] = "xapp-kpm-moni";
 char influxdb_token[128]; // Input argument: argv[1]
 
+// Rows are buffered in memory and written with a single HTTP request once either threshold is reached
+size_t influxdb_batch_max_rows = 500;
+uint64_t influxdb_batch_max_age_ms = 1000;
+size_t influxdb_batch_max_bytes = 1024 * 1024;
+
+// Distribution arrays are written as plain JSON arrays, or with runs of zero bins collapsed when the environment variable
+// KPM_ARRAY_FORMAT is compact (see write_meas_record_array)
+bool compact_arrays = false;
+
 // Variables that change during runtime
-char influx_fields_buffer[16384];
-unsigned int influx_num_samples = 0;
-uint64_t current_ue_id = 0;
-bool filter_current_sample = false;
-int64_t prev_now = 0;
+atomic_uint influx_num_samples = 0;
+
+// State of the indication being logged, kept per dispatcher worker
+_Thread_local char influx_fields_buffer[16384];
+_Thread_local uint64_t current_ue_id = 0;
+_Thread_local bool filter_current_sample = false;
+// Arrival time of the previous batch, copied from the batch state when the indication arrives
+_Thread_local int64_t prev_now = 0;
 
 // Buffer to store the current E2 Node ID
-static char current_e2_id_str[256];
-
-static bool sanitize_metric_name(const char *name, char *out, size_t out_size) {
-  size_t j = 0;
-  size_t name_len = strlen(name);
-  for (size_t i = 0; i < name_len && j < out_size - 1; i++) {
-    char c = name[i];
-    if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_' || c == '.') {
-      out[j++] = c;
-    }
-  }
-  out[j] = '\0';
-  return j > 0;
-}
+static _Thread_local char current_e2_id_str[256];
+
+// Labels of the row being logged, for the metrics endpoint (see metrics_exporter.h)
+static _Thread_local metrics_exporter_row_t export_row;
+
+// Compiled measurements (factory IDs, names, units and field keys) of the subscriptions, by E2 node and action
+// definition format: format 1 is reported in indication format 1 and format 4 per UE in indication format 3
+static metric_factory_plans_t factory_plans = METRIC_FACTORY_PLANS_INIT(get_meas_unit);
+
+// Interned name of RSRP.Count, checked for invalid samples
+static uint16_t rsrp_count_name_id = METRIC_FACTORY_NO_NAME_ID;
 
 void reset_measurement_buffers() {
   memset(influx_fields_buffer, 0, sizeof(influx_fields_buffer));
@@ -167,16 +187,409 @@ void influxdb_clear_bucket() {
   printf("InfluxDB data cleared successfully up to %s.\n", current_time_iso);
 }
 
+// Persistent HTTP/1.1 connection to InfluxDB with a bounded batch of line protocol rows. The indication callbacks only
+// append rows to the batch under the mutex; the flush thread swaps the batch with send_buf and posts it without the
+// mutex, so a slow InfluxDB never holds back the callbacks.
+typedef struct {
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;
+  pthread_t flush_thread;
+  bool stop;
+
+  char host[256];
+  char port[8];
+  char request_line[512];
+  // Only used by the flush thread
+  int sock;
+  char *send_buf;
+
+  char *batch;
+  size_t batch_len;
+  size_t batch_cap;
+  size_t batch_rows;
+  int64_t batch_first_row_us;
+
+  // Statistics for sizing the batch thresholds
+  uint64_t num_flushes;
+  uint64_t num_rows_written;
+  uint64_t num_rows_dropped;
+  int64_t total_flush_us;
+  int64_t max_flush_us;
+} influxdb_writer_t;
+
+static influxdb_writer_t influx_writer = {.sock = -1};
+
+static bool parse_influxdb_url(const char *url, char *host, size_t host_size, char *port, size_t port_size) {
+  const char *prefix = "http://";
+  if (strncmp(url, prefix, strlen(prefix)) != 0) {
+    fprintf(stderr, "[InfluxDB] Only http:// URLs are supported: %s\n", url);
+    return false;
+  }
+  const char *start = url + strlen(prefix);
+  const char *end = start + strcspn(start, ":/");
+  if (end == start || (size_t)(end - start) >= host_size)
+    return false;
+  snprintf(host, host_size, "%.*s", (int)(end - start), start);
+
+  if (*end == ':') {
+    const char *port_start = end + 1;
+    size_t port_len = strcspn(port_start, "/");
+    if (port_len == 0 || port_len >= port_size)
+      return false;
+    snprintf(port, port_size, "%.*s", (int)port_len, port_start);
+  } else {
+    snprintf(port, port_size, "80");
+  }
+  return true;
+}
+
+static void influxdb_disconnect(influxdb_writer_t *w) {
+  if (w->sock >= 0) {
+    close(w->sock);
+    w->sock = -1;
+  }
+}
+
+static bool influxdb_connect(influxdb_writer_t *w) {
+  if (w->sock >= 0)
+    return true;
+
+  struct addrinfo hints = {0};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *res = NULL;
+  int rc = getaddrinfo(w->host, w->port, &hints, &res);
+  if (rc != 0) {
+    fprintf(stderr, "[InfluxDB] Failed to resolve %s:%s: %s\n", w->host, w->port, gai_strerror(rc));
+    return false;
+  }
+
+  for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      struct timeval tv = {.tv_sec = 5, .tv_usec = 0};
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+      w->sock = fd;
+      break;
+    }
+    close(fd);
+  }
+  freeaddrinfo(res);
+
+  if (w->sock < 0) {
+    fprintf(stderr, "[InfluxDB] Failed to connect to %s:%s\n", w->host, w->port);
+    return false;
+  }
+  return true;
+}
+
+// MSG_NOSIGNAL, as writing to a connection closed by the server would otherwise raise SIGPIPE and end the xApp
+static bool send_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = (size_t)iovcnt};
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+// Status of read_http_response() when the connection was closed before any byte of the response
+#define HTTP_RESPONSE_CLOSED (-2)
+
+// Reads one HTTP response from the keep-alive connection and returns its status code, HTTP_RESPONSE_CLOSED or -1 on
+// error
+static int read_http_response(influxdb_writer_t *w) {
+  char resp[4096];
+  size_t resp_len = 0;
+  char *header_end = NULL;
+
+  while (header_end == NULL) {
+    if (resp_len == sizeof(resp) - 1)
+      return -1;
+    ssize_t n = recv(w->sock, resp + resp_len, sizeof(resp) - 1 - resp_len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (resp_len == 0 && (n == 0 || (n < 0 && errno == ECONNRESET)))
+      return HTTP_RESPONSE_CLOSED;
+    if (n <= 0)
+      return -1;
+    resp_len += (size_t)n;
+    resp[resp_len] = '\0';
+    header_end = strstr(resp, "\r\n\r\n");
+  }
+
+  int status = -1;
+  if (sscanf(resp, "HTTP/1.%*d %d", &status) != 1)
+    return -1;
+
+  size_t content_length = 0;
+  bool keep_alive = true;
+  for (char *line = strstr(resp, "\r\n"); line != NULL && line < header_end; line = strstr(line + 2, "\r\n")) {
+    if (strncasecmp(line + 2, "Content-Length:", 15) == 0)
+      content_length = strtoul(line + 2 + 15, NULL, 10);
+    else if (strncasecmp(line + 2, "Connection: close", 17) == 0)
+      keep_alive = false;
+    else if (strncasecmp(line + 2, "Transfer-Encoding:", 18) == 0)
+      keep_alive = false; // Chunked bodies are not parsed, so the connection is reopened for the next batch
+  }
+
+  // Drain the response body so the next request starts on a clean stream
+  size_t body_received = resp_len - (size_t)(header_end + 4 - resp);
+  if (status >= 300 && body_received > 0)
+    fprintf(stderr, "[InfluxDB] Write returned HTTP %d: %.*s\n", status, (int)body_received, header_end + 4);
+  while (body_received < content_length) {
+    char discard[4096];
+    size_t want = content_length - body_received;
+    ssize_t n = recv(w->sock, discard, want < sizeof(discard) ? want : sizeof(discard), 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      keep_alive = false;
+      break;
+    }
+    body_received += (size_t)n;
+  }
+
+  if (!keep_alive)
+    influxdb_disconnect(w);
+  return status;
+}
+
+typedef enum {
+  INFLUXDB_POST_OK,
+  // The server answered with an error status, the rows themselves were rejected
+  INFLUXDB_POST_REJECTED,
+  // The connection failed before the whole request was sent, so the server cannot have written any row
+  INFLUXDB_POST_NOT_SENT,
+  // The reused keep-alive connection was closed by the server without an answer, as servers and proxies do with idle
+  // connections, so the request was not processed
+  INFLUXDB_POST_STALE_CONNECTION,
+  // The request was sent but no response was read, the rows may or may not have been written
+  INFLUXDB_POST_NO_RESPONSE,
+} influxdb_post_e;
+
+static influxdb_post_e influxdb_post_batch(influxdb_writer_t *w, const char *batch, size_t batch_len) {
+  bool reused = w->sock >= 0;
+  if (!influxdb_connect(w))
+    return INFLUXDB_POST_NOT_SENT;
+
+  char header[1024];
+  int header_len = snprintf(header, sizeof(header),
+                            "%s"
+                            "Host: %s:%s\r\n"
+                            "Authorization: Token %s\r\n"
+                            "Content-Type: text/plain; charset=utf-8\r\n"
+                            "Content-Length: %zu\r\n"
+                            "Connection: keep-alive\r\n"
+                            "\r\n",
+                            w->request_line, w->host, w->port, influxdb_token, batch_len);
+  if (header_len <= 0 || (size_t)header_len >= sizeof(header))
+    return INFLUXDB_POST_REJECTED;
+
+  struct iovec iov[2] = {
+      {.iov_base = header, .iov_len = (size_t)header_len},
+      {.iov_base = (char *)batch, .iov_len = batch_len},
+  };
+  if (!send_all(w->sock, iov, 2)) {
+    influxdb_disconnect(w);
+    return INFLUXDB_POST_NOT_SENT;
+  }
+
+  int status = read_http_response(w);
+  if (status < 0) {
+    influxdb_disconnect(w);
+    return reused && status == HTTP_RESPONSE_CLOSED ? INFLUXDB_POST_STALE_CONNECTION : INFLUXDB_POST_NO_RESPONSE;
+  }
+  return status >= 200 && status < 300 ? INFLUXDB_POST_OK : INFLUXDB_POST_REJECTED;
+}
+
+// Posts a batch swapped out of the writer. Called by the flush thread without the writer mutex.
+static void influxdb_send_batch(influxdb_writer_t *w, const char *batch, size_t batch_len, size_t batch_rows) {
+  int64_t start_us = time_now_us();
+  influxdb_post_e res = influxdb_post_batch(w, batch, batch_len);
+  if (res == INFLUXDB_POST_NOT_SENT || res == INFLUXDB_POST_STALE_CONNECTION) {
+    // The keep-alive connection may have been closed by the server while idle; retry once on a fresh connection.
+    // Requests that were answered or fully sent on a live connection are not retried, as the server may already have
+    // written them.
+    res = influxdb_post_batch(w, batch, batch_len);
+  }
+  int64_t flush_us = time_now_us() - start_us;
+
+  lock_guard(&w->mtx);
+  switch (res) {
+    case INFLUXDB_POST_OK:
+      w->num_flushes++;
+      w->num_rows_written += batch_rows;
+      w->total_flush_us += flush_us;
+      if (flush_us > w->max_flush_us)
+        w->max_flush_us = flush_us;
+      printf("[InfluxDB] Flushed %zu rows (%zu bytes) in %.2f ms\n", batch_rows, batch_len, flush_us / 1000.0);
+      break;
+    case INFLUXDB_POST_REJECTED:
+      // Retrying the same batch would not help
+      fprintf(stderr, "[InfluxDB] Batch of %zu rows rejected\n", batch_rows);
+      w->num_rows_dropped += batch_rows;
+      break;
+    case INFLUXDB_POST_NOT_SENT:
+    case INFLUXDB_POST_STALE_CONNECTION:
+      // Drop the batch rather than letting memory grow while InfluxDB is unreachable
+      fprintf(stderr, "[InfluxDB] Write failed, dropping %zu rows\n", batch_rows);
+      w->num_rows_dropped += batch_rows;
+      break;
+    case INFLUXDB_POST_NO_RESPONSE:
+      fprintf(stderr, "[InfluxDB] No response to a batch of %zu rows, they may not have been written\n", batch_rows);
+      w->num_rows_dropped += batch_rows;
+      break;
+  }
+}
+
+// Must be called with the writer mutex held
+static bool influxdb_batch_due(const influxdb_writer_t *w) {
+  if (w->batch_rows == 0)
+    return false;
+  return w->stop || w->batch_rows >= influxdb_batch_max_rows || w->batch_len >= influxdb_batch_max_bytes ||
+         time_now_us() - w->batch_first_row_us >= (int64_t)influxdb_batch_max_age_ms * 1000;
+}
+
+static void *influxdb_flush_thread(void *arg) {
+  influxdb_writer_t *w = (influxdb_writer_t *)arg;
+  pthread_mutex_lock(&w->mtx);
+  while (true) {
+    while (!influxdb_batch_due(w) && !(w->stop && w->batch_rows == 0)) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      uint64_t wait_ms = influxdb_batch_max_age_ms / 2 > 0 ? influxdb_batch_max_age_ms / 2 : 1;
+      deadline.tv_sec += wait_ms / 1000;
+      deadline.tv_nsec += (wait_ms % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&w->cv, &w->mtx, &deadline);
+    }
+    if (w->batch_rows == 0)
+      break; // Stopped and drained
+
+    // Swap the batch out, so that the callbacks keep appending rows while it is sent
+    char *batch = w->batch;
+    size_t batch_len = w->batch_len;
+    size_t batch_rows = w->batch_rows;
+    w->batch = w->send_buf;
+    w->send_buf = batch;
+    w->batch_len = 0;
+    w->batch_rows = 0;
+    w->batch_first_row_us = 0;
+    pthread_mutex_unlock(&w->mtx);
+
+    influxdb_send_batch(w, batch, batch_len, batch_rows);
+
+    pthread_mutex_lock(&w->mtx);
+  }
+  pthread_mutex_unlock(&w->mtx);
+  return NULL;
+}
+
+static bool influxdb_writer_init(influxdb_writer_t *w) {
+  if (!parse_influxdb_url(influxdb_url, w->host, sizeof(w->host), w->port, sizeof(w->port))) {
+    fprintf(stderr, "[InfluxDB] Invalid URL: %s\n", influxdb_url);
+    return false;
+  }
+  snprintf(w->request_line, sizeof(w->request_line), "POST /api/v2/write?org=%s&bucket=%s&precision=ms HTTP/1.1\r\n",
+           influxdb_org, influxdb_bucket);
+
+  // Leave room for one maximum-size row on top of the byte threshold
+  w->batch_cap = influxdb_batch_max_bytes + 16384 + 1;
+  w->batch = malloc(w->batch_cap);
+  w->send_buf = malloc(w->batch_cap);
+  assert(w->batch != NULL && w->send_buf != NULL && "Memory exhausted");
+  w->batch_len = 0;
+  w->batch_rows = 0;
+  w->stop = false;
+
+  int rc = pthread_mutex_init(&w->mtx, NULL);
+  assert(rc == 0);
+  rc = pthread_cond_init(&w->cv, NULL);
+  assert(rc == 0);
+  rc = pthread_create(&w->flush_thread, NULL, influxdb_flush_thread, w);
+  assert(rc == 0);
+
+  printf("[InfluxDB] Batching up to %zu rows, %zu bytes, or %" PRIu64 " ms per write to %s:%s\n",
+         influxdb_batch_max_rows, influxdb_batch_max_bytes, influxdb_batch_max_age_ms, w->host, w->port);
+  return true;
+}
+
+static void influxdb_writer_free(influxdb_writer_t *w) {
+  // The flush thread sends the last batch before it exits
+  pthread_mutex_lock(&w->mtx);
+  w->stop = true;
+  pthread_cond_signal(&w->cv);
+  pthread_mutex_unlock(&w->mtx);
+  pthread_join(w->flush_thread, NULL);
+  influxdb_disconnect(w);
+
+  printf("[InfluxDB] %" PRIu64 " flushes, %" PRIu64 " rows written, %" PRIu64 " rows dropped", w->num_flushes,
+         w->num_rows_written, w->num_rows_dropped);
+  if (w->num_flushes > 0) {
+    printf(", %.1f rows/flush, %.2f ms avg flush, %.2f ms max flush", (double)w->num_rows_written / w->num_flushes,
+           w->total_flush_us / 1000.0 / w->num_flushes, w->max_flush_us / 1000.0);
+  }
+  printf("\n");
+
+  pthread_cond_destroy(&w->cv);
+  pthread_mutex_destroy(&w->mtx);
+  free(w->batch);
+  free(w->send_buf);
+  w->batch = NULL;
+  w->send_buf = NULL;
+}
+
 void influxdb_write(char *line_protocol) {
-  char cmd[32768];
+  influxdb_writer_t *w = &influx_writer;
+  size_t len = strlen(line_protocol);
+  if (len + 2 > w->batch_cap - influxdb_batch_max_bytes) {
+    fprintf(stderr, "[InfluxDB] Line protocol row of %zu bytes is too large, dropping it\n", len);
+    return;
+  }
 
-  snprintf(cmd, sizeof(cmd),
-           "curl -XPOST '%s/api/v2/write?org=%s&bucket=%s&precision=ms' "
-           "--header 'Authorization: Token %s' "
-           "--data-raw '%s' || echo 'InfluxDB write failed'",
-           influxdb_url, influxdb_org, influxdb_bucket, influxdb_token, line_protocol);
+  lock_guard(&w->mtx);
 
-  system(cmd);
+  if (w->batch_len + len + 1 > w->batch_cap) {
+    // The flush thread is still sending the previous batch; drop the row rather than wait for InfluxDB
+    w->num_rows_dropped++;
+    if (w->num_rows_dropped == 1 || w->num_rows_dropped % 1000 == 0)
+      fprintf(stderr, "[InfluxDB] Batch full while the previous one is being sent, %" PRIu64 " rows dropped\n",
+              w->num_rows_dropped);
+    pthread_cond_signal(&w->cv);
+    return;
+  }
+
+  if (w->batch_rows == 0)
+    w->batch_first_row_us = time_now_us();
+  memcpy(w->batch + w->batch_len, line_protocol, len);
+  w->batch_len += len;
+  w->batch[w->batch_len++] = '\n';
+  w->batch_rows++;
+
+  if (influxdb_batch_due(w))
+    pthread_cond_signal(&w->cv);
 }
 
 // At the end of the measurement cycle, send the metrics to InfluxDB
@@ -251,45 +664,21 @@ static log_ue_id log_ue_id_e2sm[END_UE_ID_E2SM] = {
     log_du_ue_id,  log_cuup_ue_id, NULL, NULL, NULL, NULL,
 };
 
-static void log_int_value(const char *name_str, const label_info_lst_t label_info,
+static void log_int_value(const metric_factory_meas_t *meas, const label_info_lst_t label_info,
                           const meas_record_lst_t meas_record) {
   (void)label_info;
-  char *name_unit = get_meas_unit(name_str);
-  if (name_unit && strcmp(name_unit, "[]") == 0)
-    name_unit = "";
-  if (name_unit == NULL)
-    name_unit = "";
-
-  char safe_metric_name[128];
-  if (!sanitize_metric_name(name_str, safe_metric_name, sizeof(safe_metric_name))) {
+  if (meas->field_name[0] == '\0') {
     fprintf(stderr, "Invalid metric name detected.\n");
     return;
   }
 
-  char influx_field_name[256];
-
-  // Format unit
-  char clean_unit[64];
-  size_t unit_len = strlen(name_unit);
-  if (unit_len > 2 && name_unit[0] == '[' && name_unit[unit_len - 1] == ']') {
-    snprintf(clean_unit, sizeof(clean_unit), "%.*s", (int)(unit_len - 2), name_unit + 1);
-    unit_len -= 2;
-  } else {
-    snprintf(clean_unit, sizeof(clean_unit), "%s", name_unit);
-  }
-
-  if (unit_len > 0) {
-    snprintf(influx_field_name, sizeof(influx_field_name), "%s_%s", safe_metric_name, clean_unit);
-  } else {
-    snprintf(influx_field_name, sizeof(influx_field_name), "%s", safe_metric_name);
-  }
-
   char influx_field[512];
-  snprintf(influx_field, sizeof(influx_field), "%s=%di,", influx_field_name, meas_record.int_val);
+  snprintf(influx_field, sizeof(influx_field), "%s=%di,", meas->field_name, meas_record.int_val);
   strncat(influx_fields_buffer, influx_field, sizeof(influx_fields_buffer) - strlen(influx_fields_buffer) - 1);
+  metrics_exporter_set_meas(&export_row, meas, &meas_record);
 
   // If the measurement is RSRP.Count and the value is 0, the data is invalid
-  if (filter_invalid_rsrp_samples && strcmp("RSRP.Count", name_str) == 0) {
+  if (filter_invalid_rsrp_samples && meas->name_id == rsrp_count_name_id) {
     if (meas_record.int_val == 0) {
       filter_current_sample = true;
       // printf("\n\tNumber of RSRP measurements was zero, skipping sample to avoid divide by zero.\n\n");
@@ -297,46 +686,24 @@ static void log_int_value(const char *name_str, const label_info_lst_t label_inf
   }
 }
 
-static void log_real_value(const char *name_str, const label_info_lst_t label_info,
+static void log_real_value(const metric_factory_meas_t *meas, const label_info_lst_t label_info,
                            const meas_record_lst_t meas_record) {
   (void)label_info;
-  char *name_unit = get_meas_unit(name_str);
-  if (name_unit && strcmp(name_unit, "[]") == 0)
-    name_unit = "";
-  if (name_unit == NULL)
-    name_unit = "";
-
-  char safe_metric_name[128];
-  if (!sanitize_metric_name(name_str, safe_metric_name, sizeof(safe_metric_name))) {
+  if (meas->field_name[0] == '\0') {
     fprintf(stderr, "Invalid metric name detected.\n");
     return;
   }
 
-  char influx_field_name[256];
-  char clean_unit[64];
-  size_t unit_len = strlen(name_unit);
-  if (unit_len > 2 && name_unit[0] == '[' && name_unit[unit_len - 1] == ']') {
-    snprintf(clean_unit, sizeof(clean_unit), "%.*s", (int)(unit_len - 2), name_unit + 1);
-    unit_len -= 2;
-  } else {
-    snprintf(clean_unit, sizeof(clean_unit), "%s", name_unit);
-  }
-
-  if (unit_len > 0) {
-    snprintf(influx_field_name, sizeof(influx_field_name), "%s_%s", safe_metric_name, clean_unit);
-  } else {
-    snprintf(influx_field_name, sizeof(influx_field_name), "%s", safe_metric_name);
-  }
-
   // Check for NaN
   if (!isnan(meas_record.real_val)) {
     char influx_field[512];
-    snprintf(influx_field, sizeof(influx_field), "%s=%.2f,", influx_field_name, meas_record.real_val);
+    snprintf(influx_field, sizeof(influx_field), "%s=%.2f,", meas->field_name, meas_record.real_val);
     strncat(influx_fields_buffer, influx_field, sizeof(influx_fields_buffer) - strlen(influx_fields_buffer) - 1);
   }
+  metrics_exporter_set_meas(&export_row, meas, &meas_record);
 }
 
-typedef void (*log_meas_value)(const char *name_str, const label_info_lst_t label_info,
+typedef void (*log_meas_value)(const metric_factory_meas_t *meas, const label_info_lst_t label_info,
                                const meas_record_lst_t meas_record);
 
 static log_meas_value get_meas_value[END_MEAS_VALUE] = {
@@ -345,23 +712,21 @@ static log_meas_value get_meas_value[END_MEAS_VALUE] = {
     NULL,
 };
 
-static void match_meas_name_type(const meas_type_t meas_type, const label_info_lst_t label_info,
+static void match_meas_name_type(const metric_factory_meas_t *meas, const label_info_lst_t label_info,
                                  const meas_record_lst_t record_item) {
   // Get the value of the Measurement
-  char *name_str = cp_ba_to_str(meas_type.name);
-  get_meas_value[record_item.value](name_str, label_info, record_item);
-  free(name_str);
+  get_meas_value[record_item.value](meas, label_info, record_item);
 }
 
-static void match_id_meas_type(const meas_type_t meas_type, const label_info_lst_t label_info,
+static void match_id_meas_type(const metric_factory_meas_t *meas, const label_info_lst_t label_info,
                                const meas_record_lst_t record_item) {
-  (void)meas_type;
+  (void)meas;
   (void)label_info;
   (void)record_item;
   assert(false && "ID Measurement Type not yet supported");
 }
 
-typedef void (*check_meas_type)(const meas_type_t meas_type, const label_info_lst_t label_info,
+typedef void (*check_meas_type)(const metric_factory_meas_t *meas, const label_info_lst_t label_info,
                                 const meas_record_lst_t meas_record);
 
 static check_meas_type match_meas_type[END_MEAS_TYPE] = {
@@ -369,15 +734,16 @@ static check_meas_type match_meas_type[END_MEAS_TYPE] = {
     match_id_meas_type,
 };
 
-#define MAX_E2_NODES 16
-
 static void log_kpm_measurements(kpm_ind_msg_format_1_t const *msg_frm_1, int64_t collect_start_time, int64_t latency,
-                                 int64_t batch_id, bool is_cell_metric) {
+                                 int64_t batch_id, bool is_cell_metric, const metric_factory_plan_t *factory_plan) {
   assert(msg_frm_1->meas_info_lst_len > 0 && "Cannot correctly print measurements");
 
   // printf("Current E2 Node ID: %s\n", current_e2_id_str);
 
   reset_measurement_buffers(); // Start new line protocol
+  metrics_exporter_row_init(&export_row, current_e2_id_str, current_ue_id, is_cell_metric);
+  bool const skip_sample = atomic_load_explicit(&skip_first_sample, memory_order_relaxed) &&
+                           atomic_exchange_explicit(&skip_first_sample, false, memory_order_relaxed);
 
   // UE Measurements per granularity period
   for (size_t j = 0; j < msg_frm_1->meas_data_lst_len; j++) {
@@ -387,99 +753,76 @@ static void log_kpm_measurements(kpm_ind_msg_format_1_t const *msg_frm_1, int64_
     for (size_t i = 0; i < msg_frm_1->meas_info_lst_len; i++) {
       const meas_info_format_1_lst_t info_item = msg_frm_1->meas_info_lst[i];
 
+      metric_factory_meas_t unplanned_meas;
+      const metric_factory_meas_t *meas =
+          metric_factory_plan_meas(factory_plan, i, &info_item.meas_type, &unplanned_meas);
+
       if (info_item.label_info_lst_len > 1 && info_item.meas_type.type == NAME_MEAS_TYPE) {
-        char *name_str = cp_ba_to_str(info_item.meas_type.name);
-        char *name_unit = get_meas_unit(name_str);
-        if (name_unit && strcmp(name_unit, "[]") == 0)
-          name_unit = "";
-        if (name_unit == NULL)
-          name_unit = "";
-
-        char safe_metric_name[128];
-        if (!sanitize_metric_name(name_str, safe_metric_name, sizeof(safe_metric_name))) {
-          free(name_str);
+        if (meas->field_name[0] == '\0') {
+          rec_idx += info_item.label_info_lst_len;
           continue;
         }
 
-        char influx_field_name[256];
-        char clean_unit[64];
-        size_t unit_len = strlen(name_unit);
-        if (unit_len > 2 && name_unit[0] == '[' && name_unit[unit_len - 1] == ']') {
-          snprintf(clean_unit, sizeof(clean_unit), "%.*s", (int)(unit_len - 2), name_unit + 1);
-          unit_len -= 2;
-        } else {
-          snprintf(clean_unit, sizeof(clean_unit), "%s", name_unit);
-        }
-
-        if (unit_len > 0) {
-          snprintf(influx_field_name, sizeof(influx_field_name), "%s_%s", safe_metric_name, clean_unit);
-        } else {
-          snprintf(influx_field_name, sizeof(influx_field_name), "%s", safe_metric_name);
-        }
-
-        char arr_str[8192];
-        format_meas_record_array(arr_str, sizeof(arr_str), info_item.label_info_lst, info_item.label_info_lst_len,
-                                 data_item.meas_record_lst, rec_idx);
+        factory_metric_t generated_metrics[METRIC_FACTORY_MAX_OUTPUTS];
+        size_t num_generated_metrics = process_metric_factory_into(
+            meas->id, current_e2_id_str, meas->dist_state, info_item.label_info_lst, info_item.label_info_lst_len,
+            data_item.meas_record_lst, rec_idx, generated_metrics, METRIC_FACTORY_MAX_OUTPUTS);
 
-        factory_metrics_array_t generated_metrics =
-            process_metric_factory(current_e2_id_str, name_str, info_item.label_info_lst, info_item.label_info_lst_len,
-                                   data_item.meas_record_lst, rec_idx);
+        for (size_t k = 0; k < num_generated_metrics; k++) {
+          factory_metric_t m = generated_metrics[k];
 
-        for (size_t k = 0; k < generated_metrics.count; k++) {
-          factory_metric_t m = generated_metrics.metrics[k];
+          // The first sample reduces everything counted since the E2 node started, so it is not exported either
+          if (!skip_sample)
+            metrics_exporter_set_factory(&export_row, &m);
 
-          char m_safe_metric_name[128];
-          if (!sanitize_metric_name(m.name, m_safe_metric_name, sizeof(m_safe_metric_name))) {
+          const char *m_field_name = factory_metric_field_name(m.name_id);
+          if (m_field_name == NULL || m_field_name[0] == '\0') {
             continue;
           }
 
-          char m_influx_field_name[256];
-          const char *unit = "";
-          if (!strstr(m.name, ".Count")) {
-            if (strstr(m.name, "SINR"))
-              unit = "_dB";
-            else
-              unit = "_dBm";
-          }
-          snprintf(m_influx_field_name, sizeof(m_influx_field_name), "%s%s", m_safe_metric_name, unit);
-
           if (m.value_type != 0 && isnan(m.real_val)) {
             continue; // Omit NaN values from InfluxDB
           }
 
           char influx_field[512];
           if (m.value_type == 0) {
-            snprintf(influx_field, sizeof(influx_field), "%s=%di,", m_influx_field_name, m.int_val);
+            snprintf(influx_field, sizeof(influx_field), "%s=%di,", m_field_name, m.int_val);
           } else {
-            snprintf(influx_field, sizeof(influx_field), "%s=%.2f,", m_influx_field_name, m.real_val);
+            snprintf(influx_field, sizeof(influx_field), "%s=%.2f,", m_field_name, m.real_val);
           }
           strncat(influx_fields_buffer, influx_field, sizeof(influx_fields_buffer) - strlen(influx_fields_buffer) - 1);
         }
-        free_factory_metrics(&generated_metrics);
 
-        rec_idx += info_item.label_info_lst_len;
-
-        char influx_field[9000];
-        // Use double quotes around string values in InfluxDB line protocol
-        snprintf(influx_field, sizeof(influx_field), "%s=\"%s\",", influx_field_name, arr_str);
-        strncat(influx_fields_buffer, influx_field, sizeof(influx_fields_buffer) - strlen(influx_fields_buffer) - 1);
+        // Use double quotes around string values in InfluxDB line protocol. The array is streamed straight into the
+        // fields buffer, and the field is dropped rather than truncated if it does not fit.
+        size_t fields_len = strlen(influx_fields_buffer);
+        meas_array_buf_t sink = {.buf = influx_fields_buffer, .len = fields_len, .cap = sizeof(influx_fields_buffer)};
+        if (!meas_array_buf_write(&sink, meas->field_name, strlen(meas->field_name)) ||
+            !meas_array_buf_write(&sink, "=\"", 2) ||
+            !write_meas_record_array(meas_array_buf_write, &sink, info_item.label_info_lst,
+                                     info_item.label_info_lst_len, data_item.meas_record_lst, rec_idx,
+                                     compact_arrays) ||
+            !meas_array_buf_write(&sink, "\",", 2)) {
+          influx_fields_buffer[fields_len] = '\0';
+          fprintf(stderr, "InfluxDB fields buffer is full, dropping field %s.\n", meas->field_name);
+        }
+        metrics_exporter_set_dist(&export_row, meas, data_item.meas_record_lst, rec_idx, info_item.label_info_lst_len);
 
-        free(name_str);
+        rec_idx += info_item.label_info_lst_len;
       } else {
         for (size_t z = 0; z < info_item.label_info_lst_len; z++) {
           const label_info_lst_t label_info = info_item.label_info_lst[z];
           const meas_record_lst_t record_item = data_item.meas_record_lst[rec_idx++];
 
-          match_meas_type[info_item.meas_type.type](info_item.meas_type, label_info, record_item);
+          match_meas_type[info_item.meas_type.type](meas, label_info, record_item);
         }
       }
     }
   }
 
-  if (skip_first_sample) {
+  if (skip_sample) {
     printf("Skipping first sample to avoid incorrect initial values.\n");
     reset_measurement_buffers();
-    skip_first_sample = false;
     return;
   }
 
@@ -494,14 +837,15 @@ static void log_kpm_measurements(kpm_ind_msg_format_1_t const *msg_frm_1, int64_
   }
 
   filter_current_sample = false;
-  influx_num_samples++;
-  printf("Samples collected = %u\n", influx_num_samples);
+  unsigned int const num_samples = atomic_fetch_add_explicit(&influx_num_samples, 1, memory_order_relaxed) + 1;
+  printf("Samples collected = %u\n", num_samples);
 }
 
 static void log_kpm_ind_msg_frm_3(kpm_ind_msg_format_3_t const *msg, int64_t collect_start_time, int64_t latency,
-                                  int64_t batch_id) {
+                                  int64_t batch_id, global_e2_node_id_t const *node_id) {
   // Reported list of measurements per UE
   for (size_t i = 0; i < msg->ue_meas_report_lst_len; i++) {
+    kpm_ind_msg_format_1_t const *msg_frm_1 = &msg->meas_report_per_ue[i].ind_msg_format_1;
     // log UE ID
     ue_id_e2sm_t const ue_id_e2sm = msg->meas_report_per_ue[i].ue_meas_report_lst;
     ue_id_e2sm_e const type = ue_id_e2sm.type;
@@ -509,7 +853,9 @@ static void log_kpm_ind_msg_frm_3(kpm_ind_msg_format_3_t const *msg, int64_t col
 
     // log measurements
     bool is_cell = (strncmp(current_e2_id_str, "CU", 2) == 0) ? true : false;
-    log_kpm_measurements(&msg->meas_report_per_ue[i].ind_msg_format_1, collect_start_time, latency, batch_id, is_cell);
+    log_kpm_measurements(msg_frm_1, collect_start_time, latency, batch_id, is_cell,
+                         metric_factory_plans_find(&factory_plans, node_id, FORMAT_4_ACTION_DEFINITION,
+                                                   msg_frm_1->meas_info_lst, msg_frm_1->meas_info_lst_len));
   }
 }
 
@@ -547,22 +893,8 @@ static void sm_cb_kpm(sm_ag_if_rd_t const *rd, global_e2_node_id_t const *node_i
   kpm_ind_data_t const *ind = &rd->ind.kpm.ind;
   kpm_ric_ind_hdr_format_1_t const *hdr_frm_1 = &ind->hdr.kpm_ric_ind_hdr_format_1;
 
-  // Set current E2 node ID globally
-  if (node_id) {
-    if (node_id->type == ngran_gNB_DU) {
-      snprintf(current_e2_id_str, sizeof(current_e2_id_str), "DU:%" PRIu64, *node_id->cu_du_id);
-    } else if (node_id->type == ngran_gNB_CU) {
-      snprintf(current_e2_id_str, sizeof(current_e2_id_str), "CU:%" PRIu64, *node_id->cu_du_id);
-    } else if (node_id->type == ngran_gNB_CUUP) {
-      snprintf(current_e2_id_str, sizeof(current_e2_id_str), "CUUP:%" PRIu64, *node_id->cu_du_id);
-    } else if (node_id->type == ngran_gNB_CUCP) {
-      snprintf(current_e2_id_str, sizeof(current_e2_id_str), "CUCP:%" PRIu64, *node_id->cu_du_id);
-    } else {
-      snprintf(current_e2_id_str, sizeof(current_e2_id_str), "gNB:%u", node_id->nb_id.nb_id);
-    }
-  } else {
-    snprintf(current_e2_id_str, sizeof(current_e2_id_str), "Unknown");
-  }
+  // Set the E2 node ID of this worker's indication
+  metric_factory_node_name(node_id, current_e2_id_str, sizeof(current_e2_id_str));
   int64_t const now = time_now_us();
   int64_t latency = (now - hdr_frm_1->collectStartTime) / 1000;
 
@@ -570,36 +902,43 @@ static void sm_cb_kpm(sm_ag_if_rd_t const *rd, global_e2_node_id_t const *node_i
   static int64_t last_collect_start_time = 0;
   static int64_t current_batch_id = 0;
   static int64_t current_batch_arrival_ms = 0;
+  static int64_t prev_batch_arrival_ms = 0;
+  static int counter = 1;
 
-  if (current_batch_id == 0) {
-    current_batch_id = 1;
-    last_collect_start_time = collect_start_time_ms;
-    current_batch_arrival_ms = collect_start_time_ms + latency;
-  } else {
-    // Find the nearest batch ID based on collect start time and period
-    if (labs(collect_start_time_ms - last_collect_start_time) > period_ms / 2) {
-      current_batch_id++;
+  // The batch state is shared by all E2 nodes
+  int64_t batch_id;
+  int ind_counter;
+  {
+    lock_guard(&mtx);
+    if (current_batch_id == 0) {
+      current_batch_id = 1;
       last_collect_start_time = collect_start_time_ms;
-      prev_now = current_batch_arrival_ms;
       current_batch_arrival_ms = collect_start_time_ms + latency;
+    } else {
+      // Find the nearest batch ID based on collect start time and period
+      if (labs(collect_start_time_ms - last_collect_start_time) > period_ms / 2) {
+        current_batch_id++;
+        last_collect_start_time = collect_start_time_ms;
+        prev_batch_arrival_ms = current_batch_arrival_ms;
+        current_batch_arrival_ms = collect_start_time_ms + latency;
+      }
     }
+    batch_id = current_batch_id;
+    prev_now = prev_batch_arrival_ms;
+    ind_counter = counter++;
   }
 
-  static int counter = 1;
-  {
-    lock_guard(&mtx);
-
-    printf("\n%7d KPM ind_msg latency = %" PRId64 " [ms]\n", counter, latency); // xApp <-> E2 Node
+  printf("\n%7d KPM ind_msg latency = %" PRId64 " [ms]\n", ind_counter, latency); // xApp <-> E2 Node
 
-    if (ind->msg.type == FORMAT_1_INDICATION_MESSAGE) {
+  if (ind->msg.type == FORMAT_1_INDICATION_MESSAGE) {
 
-      log_kpm_measurements(&ind->msg.frm_1, hdr_frm_1->collectStartTime, latency, current_batch_id, true);
-    } else if (ind->msg.type == FORMAT_3_INDICATION_MESSAGE) {
-      log_kpm_ind_msg_frm_3(&ind->msg.frm_3, hdr_frm_1->collectStartTime, latency, current_batch_id);
-    } else {
-      printf("KPM Indication Message %d logging not yet implemented.\n", ind->msg.type);
-    }
-    counter++;
+    log_kpm_measurements(&ind->msg.frm_1, hdr_frm_1->collectStartTime, latency, batch_id, true,
+                         metric_factory_plans_find(&factory_plans, node_id, FORMAT_1_ACTION_DEFINITION,
+                                                   ind->msg.frm_1.meas_info_lst, ind->msg.frm_1.meas_info_lst_len));
+  } else if (ind->msg.type == FORMAT_3_INDICATION_MESSAGE) {
+    log_kpm_ind_msg_frm_3(&ind->msg.frm_3, hdr_frm_1->collectStartTime, latency, batch_id, node_id);
+  } else {
+    printf("KPM Indication Message %d logging not yet implemented.\n", ind->msg.type);
   }
 }
 
@@ -750,7 +1089,8 @@ static fill_kpm_act_def get_kpm_act_def[END_RIC_SERVICE_REPORT] = {
     fill_report_style_1, NULL, NULL, fill_report_style_4, NULL,
 };
 
-static kpm_sub_data_t gen_kpm_subs(kpm_ran_function_def_t const *ran_func, ric_report_style_item_t const *report_item) {
+static kpm_sub_data_t gen_kpm_subs(global_e2_node_id_t const *node_id, kpm_ran_function_def_t const *ran_func,
+                                   ric_report_style_item_t const *report_item) {
   assert(ran_func != NULL);
   assert(ran_func->ric_event_trigger_style_list != NULL);
 
@@ -771,6 +1111,9 @@ static kpm_sub_data_t gen_kpm_subs(kpm_ran_function_def_t const *ran_func, ric_r
   ric_service_report_e const report_style_type = report_item->report_style_type;
   *kpm_sub.ad = get_kpm_act_def[report_style_type](report_item);
 
+  // Compile the measurements once, before any indication of this subscription is received
+  metric_factory_plans_add(&factory_plans, node_id, kpm_sub.ad);
+
   return kpm_sub;
 }
 
@@ -810,16 +1153,37 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  const char *array_format = getenv("KPM_ARRAY_FORMAT");
+  if (array_format != NULL && array_format[0] != '\0') {
+    if (strcmp(array_format, "json") == 0) {
+      compact_arrays = false;
+    } else if (strcmp(array_format, "compact") == 0) {
+      compact_arrays = true;
+    } else {
+      fprintf(stderr, "Invalid KPM_ARRAY_FORMAT value: '%s'. Must be json or compact.\n", array_format);
+      return EXIT_FAILURE;
+    }
+  }
+
   if (clear_database_on_startup) {
     influxdb_clear_bucket();
   }
 
+  if (!influxdb_writer_init(&influx_writer)) {
+    return EXIT_FAILURE;
+  }
+
+  if (!metrics_exporter_start()) {
+    return EXIT_FAILURE;
+  }
+
   fr_args_t args = init_fr_args(argc, argv);
 
   // Init the xApp
   init_xapp_api(&args);
   sleep(1);
   init_kpm_meas_unit_hash_table();
+  rsrp_count_name_id = metric_factory_intern("RSRP.Count", strlen("RSRP.Count"));
 
   e2_node_arr_xapp_t nodes = e2_nodes_xapp_api();
   defer({ free_e2_node_arr_xapp(&nodes); });
@@ -855,11 +1219,13 @@ int main(int argc, char *argv[]) {
     for (size_t j = 0; j < sz_report_styles; j++) {
       ric_report_style_item_t *report_item = &n->rf[idx].defn.kpm.ric_report_style_list[j];
       // Generate KPM SUBSCRIPTION message
-      kpm_sub_data_t kpm_sub = gen_kpm_subs(&n->rf[idx].defn.kpm, report_item);
+      kpm_sub_data_t kpm_sub = gen_kpm_subs(&n->id, &n->rf[idx].defn.kpm, report_item);
 
       hndl[i][j] = report_sm_xapp_api(&n->id, KPM_ran_function, &kpm_sub, sm_cb_kpm);
       assert(hndl[i][j].success == true);
 
+      // The label tables are shared with the other subscriptions
+      release_kpm_sub_label_info(&kpm_sub);
       free_kpm_sub_data(&kpm_sub);
     }
   }
@@ -881,7 +1247,12 @@ int main(int argc, char *argv[]) {
   }
   free(hndl);
 
+  influxdb_writer_free(&influx_writer);
+  metrics_exporter_stop();
+
   free_kpm_meas_unit_hash_table();
+  free_dist_states();
+  metric_factory_plans_free(&factory_plans);
 
   // Stop the xApp
   while (try_stop_xapp_api() == false)
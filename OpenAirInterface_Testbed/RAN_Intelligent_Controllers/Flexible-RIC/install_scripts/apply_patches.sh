@@ -82,6 +82,27 @@ cp "$PARENT_DIR/install_patch_files/flexric/examples/xApp/c/metrics_factory.h" "
 echo "Adding metrics_factory.c..."
 cp "$PARENT_DIR/install_patch_files/flexric/examples/xApp/c/metrics_factory.c" "$FLEXRIC_DIR"/examples/xApp/c/
 
+echo "Adding kpm_capture.h..."
+cp "$PARENT_DIR/install_patch_files/flexric/examples/xApp/c/kpm_capture.h" "$FLEXRIC_DIR"/examples/xApp/c/
+
+echo "Adding kpm_capture.c..."
+cp "$PARENT_DIR/install_patch_files/flexric/examples/xApp/c/kpm_capture.c" "$FLEXRIC_DIR"/examples/xApp/c/
+
+echo "Adding metrics_exporter.h..."
+cp "$PARENT_DIR/install_patch_files/flexric/examples/xApp/c/metrics_exporter.h" "$FLEXRIC_DIR"/examples/xApp/c/
+
+echo "Adding metrics_exporter.c..."
+cp "$PARENT_DIR/install_patch_files/flexric/examples/xApp/c/metrics_exporter.c" "$FLEXRIC_DIR"/examples/xApp/c/
+
+echo "Adding kpm_capture_to_csv.c..."
+cp "$PARENT_DIR/install_patch_files/flexric/examples/xApp/c/monitor/kpm_capture_to_csv.c" "$FLEXRIC_DIR"/examples/xApp/c/monitor/
+
+echo "Adding metrics_factory_bench.c..."
+cp "$PARENT_DIR/install_patch_files/flexric/examples/xApp/c/monitor/metrics_factory_bench.c" "$FLEXRIC_DIR"/examples/xApp/c/monitor/
+
+echo "Adding act_proc_bench.c..."
+cp "$PARENT_DIR/install_patch_files/flexric/examples/xApp/c/monitor/act_proc_bench.c" "$FLEXRIC_DIR"/examples/xApp/c/monitor/
+
 echo "Adding xapp_kpm_moni_write_to_csv.c..."
 cp "$PARENT_DIR/install_patch_files/flexric/examples/xApp/c/monitor/xapp_kpm_moni_write_to_csv.c" "$FLEXRIC_DIR"/examples/xApp/c/monitor/
 
@@ -128,12 +149,19 @@ if [ ! -f "src/xApp/e42_xapp.c.previous" ]; then
     cp src/xApp/e42_xapp.c src/xApp/e42_xapp.c.previous
     cp src/xApp/e42_xapp.c.previous "$PARENT_DIR/install_patch_files/flexric/disable_database_option/src/xApp/e42_xapp.previous.c"
 fi
+git restore src/xApp/db/db.c
+if [ ! -f "src/xApp/db/db.c.previous" ]; then
+    cp src/xApp/db/db.c src/xApp/db/db.c.previous
+fi
 git apply --verbose --ignore-whitespace "$PARENT_DIR/install_patch_files/flexric/disable_database_option/patch.patch"
+# This file replaces the xApp database writer with one that batches the rows into transactions
+echo "Adding batched database writer db.c..."
+cp "$PARENT_DIR/install_patch_files/flexric/disable_database_option/src/xApp/db/db.c" src/xApp/db/db.c
 cd "$PARENT_DIR"
 
-# Apply patch to FlexRIC to fix the E2 node ID
+# Apply patch to FlexRIC to fix the E2 node ID and to dispatch indications to per-E2-node worker threads
 cd "$FLEXRIC_DIR"
-echo "Patching FlexRIC to fix E2 node IDs..."
+echo "Patching FlexRIC to fix E2 node IDs and shard the indication dispatcher..."
 git restore examples/xApp/c/monitor/xapp_gtp_mac_rlc_pdcp_moni.c
 git restore examples/xApp/c/monitor/xapp_rc_moni.c
 git restore examples/xApp/c/orange/xapp_es_with_cell_util.c
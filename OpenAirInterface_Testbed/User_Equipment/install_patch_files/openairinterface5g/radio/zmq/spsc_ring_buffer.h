@@ -0,0 +1,413 @@
+// NIST-developed software is provided by NIST as a public service. You may use,
+// copy, and distribute copies of the software in any medium, provided that you
+// keep intact this entire notice. You may improve, modify, and create derivative
+// works of the software or any portion of the software, and you may copy and
+// distribute such modifications or works. Modified works should carry a notice
+// stating that you changed the software and should note the date and nature of
+// any such change. Please explicitly acknowledge the National Institute of
+// Standards and Technology as the source of the software.
+//
+// NIST-developed software is expressly provided "AS IS." NIST MAKES NO WARRANTY
+// OF ANY KIND, EXPRESS, IMPLIED, IN FACT, OR ARISING BY OPERATION OF LAW,
+// INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTY OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE, NON-INFRINGEMENT, AND DATA ACCURACY. NIST
+// NEITHER REPRESENTS NOR WARRANTS THAT THE OPERATION OF THE SOFTWARE WILL BE
+// UNINTERRUPTED OR ERROR-FREE, OR THAT ANY DEFECTS WILL BE CORRECTED. NIST DOES
+// NOT WARRANT OR MAKE ANY REPRESENTATIONS REGARDING THE USE OF THE SOFTWARE OR
+// THE RESULTS THEREOF, INCLUDING BUT NOT LIMITED TO THE CORRECTNESS, ACCURACY,
+// RELIABILITY, OR USEFULNESS OF THE SOFTWARE.
+//
+// You are solely responsible for determining the appropriateness of using and
+// distributing the software and you assume all risks associated with its use,
+// including but not limited to the risks and costs of program errors, compliance
+// with applicable laws, damage to or loss of data, programs or equipment, and
+// the unavailability or interruption of operation. This software is not intended
+// to be used in any situation where a failure could cause risk of injury or
+// damage to property. The software developed by NIST employees is not subject to
+// copyright protection within the United States.
+
+
+// Lock-free replacement for overflow_buffer, used by the ZMQ channels where a single producer pushes samples and one
+// thread pops them. The head and tail are free-running counters, each written by a single side and kept on its own cache
+// line.
+//
+// For RX the producer is the ZMQ socket thread. For TX, zmq_tx_channel::transmit() pushes from the softmodem TX thread and
+// zmq_tx_channel::align() pushes zeros from the RX thread (through zmq_rx_stream::receive()). Both push while holding
+// transmit_alignment_mutex_, which serializes them and orders the producer-side state of the buffer between the two
+// threads, so they act as a single producer.
+//
+// Samples are stored as c16_t, the format used by the softmodem, which halves the memory of the cf_t buffer it
+// replaces. The softmodem pushes and pops c16_t samples without conversion, while the cf_t samples of the ZMQ socket are
+// converted on the ZMQ thread with the vectorized kernels below.
+//
+// As with overflow_buffer, samples that do not fit are dropped and replaced by the same number of zeros so that the
+// sample count (and therefore the timestamps) stays aligned. The producer writes the zeros ahead of the samples of its
+// next pushes as soon as there is room, so they are popped where the dropped samples belong, after the samples buffered
+// before them. Unlike overflow_buffer, the newest samples are dropped instead of the oldest, because the producer never
+// moves the tail.
+
+#ifndef SPSC_RING_BUFFER_H
+#define SPSC_RING_BUFFER_H
+
+#include "ring_buffer.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <limits>
+#include <linux/futex.h>
+#include <memory>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Full scale of the cf_t samples exchanged over ZMQ (1.0) corresponds to INT16_MAX
+static constexpr float zmq_c16_scale = std::numeric_limits<int16_t>::max();
+
+// Rounds as the previous scalar conversion (x * scale + 0.5, truncated), saturating out of range values
+static inline int16_t zmq_float_to_int16(float x)
+{
+  float v = x * zmq_c16_scale + 0.5f;
+  v = std::min(std::max(v, -32768.0f), 32767.0f);
+  return static_cast<int16_t>(v);
+}
+
+static inline void zmq_convert_cf_to_c16(c16_t *dst, const cf_t *src, size_t nsamps)
+{
+  const float *in = reinterpret_cast<const float *>(src);
+  int16_t *out = reinterpret_cast<int16_t *>(dst);
+  size_t n = nsamps * 2;
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256 scale = _mm256_set1_ps(zmq_c16_scale);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 lo = _mm256_set1_ps(-32768.0f);
+  const __m256 hi = _mm256_set1_ps(32767.0f);
+  for (; i + 16 <= n; i += 16) {
+    __m256 a = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i), scale), half);
+    __m256 b = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i + 8), scale), half);
+    __m256i ia = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(a, lo), hi));
+    __m256i ib = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(b, lo), hi));
+    // packs works within 128-bit lanes, so restore the order of the 64-bit groups afterwards
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(ia, ib), 0xD8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), packed);
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  const float32x4_t scale = vdupq_n_f32(zmq_c16_scale);
+  const float32x4_t half = vdupq_n_f32(0.5f);
+  const float32x4_t lo = vdupq_n_f32(-32768.0f);
+  const float32x4_t hi = vdupq_n_f32(32767.0f);
+  for (; i + 8 <= n; i += 8) {
+    float32x4_t a = vaddq_f32(vmulq_f32(vld1q_f32(in + i), scale), half);
+    float32x4_t b = vaddq_f32(vmulq_f32(vld1q_f32(in + i + 4), scale), half);
+    int32x4_t ia = vcvtq_s32_f32(vminq_f32(vmaxq_f32(a, lo), hi));
+    int32x4_t ib = vcvtq_s32_f32(vminq_f32(vmaxq_f32(b, lo), hi));
+    vst1q_s16(out + i, vcombine_s16(vqmovn_s32(ia), vqmovn_s32(ib)));
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = zmq_float_to_int16(in[i]);
+  }
+}
+
+static inline void zmq_convert_c16_to_cf(cf_t *dst, const c16_t *src, size_t nsamps)
+{
+  const int16_t *in = reinterpret_cast<const int16_t *>(src);
+  float *out = reinterpret_cast<float *>(dst);
+  size_t n = nsamps * 2;
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256 scale = _mm256_set1_ps(zmq_c16_scale);
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i)));
+    _mm256_storeu_ps(out + i, _mm256_div_ps(_mm256_cvtepi32_ps(v), scale));
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  const float32x4_t scale = vdupq_n_f32(zmq_c16_scale);
+  for (; i + 8 <= n; i += 8) {
+    int16x8_t v = vld1q_s16(in + i);
+    vst1q_f32(out + i, vdivq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), scale));
+    vst1q_f32(out + i + 4, vdivq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), scale));
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = in[i] / zmq_c16_scale;
+  }
+}
+
+static inline void zmq_copy_samples(c16_t *dst, const c16_t *src, size_t nsamps)
+{
+  memcpy(dst, src, nsamps * sizeof(c16_t));
+}
+
+static inline void zmq_copy_samples(c16_t *dst, const cf_t *src, size_t nsamps)
+{
+  zmq_convert_cf_to_c16(dst, src, nsamps);
+}
+
+static inline void zmq_copy_samples(cf_t *dst, const c16_t *src, size_t nsamps)
+{
+  zmq_convert_c16_to_cf(dst, src, nsamps);
+}
+
+// Futex based wakeup between producers and a consumer, which can be shared by several buffers so that the consumer
+// waits for all of them at once. The consumer reads sequence(), checks its condition and then calls wait(), which
+// returns immediately if ring() was called in between. ring() only makes a system call when the consumer is waiting.
+class zmq_doorbell {
+ public:
+  uint32_t sequence() const
+  {
+    return seq_.load(std::memory_order_acquire);
+  }
+
+  void wait(uint32_t seq, std::chrono::microseconds timeout)
+  {
+    waiting_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    struct timespec ts;
+    ts.tv_sec = timeout.count() / 1000000;
+    ts.tv_nsec = (timeout.count() % 1000000) * 1000;
+    syscall(SYS_futex, seq_address(), FUTEX_WAIT_PRIVATE, seq, &ts, nullptr, 0);
+    waiting_.store(false, std::memory_order_relaxed);
+  }
+
+  // Called by a producer after publishing samples
+  void ring()
+  {
+    seq_.fetch_add(1, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting_.load(std::memory_order_relaxed)) {
+      syscall(SYS_futex, seq_address(), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+  }
+
+  // Wakes the consumer unconditionally, e.g. when the stream is stopped
+  void wake()
+  {
+    seq_.fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, seq_address(), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+  }
+
+ private:
+  uint32_t *seq_address()
+  {
+    static_assert(sizeof(seq_) == sizeof(uint32_t), "futex word must be 32 bits");
+    return reinterpret_cast<uint32_t *>(&seq_);
+  }
+
+  // Written by the producers
+  std::atomic<uint32_t> seq_{0};
+  char pad_[64];
+  // Written by the consumer
+  std::atomic<bool> waiting_{false};
+};
+
+// Up to two contiguous regions of a ring buffer, the second one starting at the beginning of the storage when the
+// region wraps around
+struct zmq_sample_spans {
+  c16_t *data[2];
+  size_t len[2];
+
+  size_t total() const
+  {
+    return len[0] + len[1];
+  }
+};
+
+class spsc_overflow_buffer {
+ public:
+  explicit spsc_overflow_buffer(size_t max_size) : max_size_(max_size), buffer_(new c16_t[max_size]())
+  {
+  }
+
+  spsc_overflow_buffer(const spsc_overflow_buffer &) = delete;
+  spsc_overflow_buffer &operator=(const spsc_overflow_buffer &) = delete;
+
+  // Producer side. Returns the number of samples that did not fit and will be replaced by zeros.
+  size_t push_samples(const c16_t *samples, size_t nsamps)
+  {
+    return push(samples, nsamps);
+  }
+
+  size_t push_samples(const cf_t *samples, size_t nsamps)
+  {
+    return push(samples, nsamps);
+  }
+
+  size_t push_zeros(size_t num_zeros)
+  {
+    return push(static_cast<const c16_t *>(nullptr), num_zeros);
+  }
+
+  // Consumer side. Pops up to num_samples samples without blocking and returns how many were popped.
+  size_t pop_samples(c16_t *samples, size_t num_samples)
+  {
+    return pop(samples, num_samples);
+  }
+
+  size_t pop_samples(cf_t *samples, size_t num_samples)
+  {
+    return pop(samples, num_samples);
+  }
+
+  // Producer side. Exposes up to max_samples free slots so that samples can be written in place, e.g. received straight
+  // from a socket, and published with commit_write().
+  zmq_sample_spans peek_write(size_t max_samples)
+  {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    if (max_size_ - (head - cached_tail_) < max_samples) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+    }
+    return make_spans(head, std::min<size_t>(max_size_ - (head - cached_tail_), max_samples));
+  }
+
+  // Producer side. Publishes the first nsamps samples written to the spans of the last peek_write().
+  void commit_write(size_t nsamps)
+  {
+    head_.store(head_.load(std::memory_order_relaxed) + nsamps, std::memory_order_release);
+    doorbell_.load(std::memory_order_acquire)->ring();
+  }
+
+  // Consumer side. Exposes up to max_samples buffered samples so that they can be read in place, e.g. converted
+  // straight into the caller's buffer, and released with commit_read().
+  zmq_sample_spans peek_read(size_t max_samples)
+  {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    if (cached_head_ - tail < max_samples) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+    }
+    return make_spans(tail, std::min<uint64_t>(cached_head_ - tail, max_samples));
+  }
+
+  // Consumer side. Releases the first nsamps samples of the spans of the last peek_read().
+  void commit_read(size_t nsamps)
+  {
+    tail_.store(tail_.load(std::memory_order_relaxed) + nsamps, std::memory_order_release);
+  }
+
+  // Consumer side. Blocks until samples are available, notify() is called or the timeout expires, and returns whether
+  // samples are available.
+  bool wait_for_samples(std::chrono::microseconds timeout)
+  {
+    zmq_doorbell *doorbell = doorbell_.load(std::memory_order_acquire);
+    uint32_t seq = doorbell->sequence();
+    if (size() > 0) {
+      return true;
+    }
+    doorbell->wait(seq, timeout);
+    return size() > 0;
+  }
+
+  // Wakes a consumer blocked in wait_for_samples(), e.g. when the channel is stopped
+  void notify()
+  {
+    doorbell_.load(std::memory_order_acquire)->wake();
+  }
+
+  // Rings the given doorbell instead of the buffer's own one when samples are pushed, so that a consumer can wait for
+  // several buffers with a single wakeup. The doorbell must outlive the buffer; nullptr restores the buffer's own one.
+  void set_doorbell(zmq_doorbell *doorbell)
+  {
+    doorbell_.store(doorbell != nullptr ? doorbell : &own_doorbell_, std::memory_order_release);
+  }
+
+  // Drops all buffered samples. Must be called from the consumer side, or while the producer is stopped. Zeros that
+  // were not written yet are kept, as they belong to the producer.
+  void reset()
+  {
+    clear_samples();
+  }
+
+  void clear_samples()
+  {
+    cached_head_ = head_.load(std::memory_order_acquire);
+    tail_.store(cached_head_, std::memory_order_release);
+  }
+
+  // Number of samples that can be popped. Can be called from either side.
+  size_t size() const
+  {
+    uint64_t tail = tail_.load(std::memory_order_acquire);
+    uint64_t head = head_.load(std::memory_order_acquire);
+    return head - tail;
+  }
+
+ private:
+  static constexpr size_t cache_line_size = 64;
+
+  zmq_sample_spans make_spans(uint64_t start, size_t nsamps)
+  {
+    size_t pos = start % max_size_;
+    size_t first_chunk = std::min(nsamps, max_size_ - pos);
+    zmq_sample_spans spans = {{&buffer_[pos], &buffer_[0]}, {first_chunk, nsamps - first_chunk}};
+    return spans;
+  }
+
+  template <typename T>
+  size_t push(const T *samples, size_t nsamps)
+  {
+    // The zeros of the samples dropped before go first
+    zmq_sample_spans spans = peek_write(pending_zeros_ + nsamps);
+    size_t zeros = std::min(pending_zeros_, spans.total());
+    size_t zeros_left = zeros;
+    for (int k = 0; k < 2; k++) {
+      size_t num_zeros = std::min(zeros_left, spans.len[k]);
+      size_t len = spans.len[k] - num_zeros;
+      c16_t *dst = spans.data[k] + num_zeros;
+      zeros_left -= num_zeros;
+      memset(spans.data[k], 0, num_zeros * sizeof(c16_t));
+      if (samples != nullptr) {
+        zmq_copy_samples(dst, samples, len);
+        samples += len;
+      } else {
+        memset(dst, 0, len * sizeof(c16_t));
+      }
+    }
+    size_t overflow = nsamps - (spans.total() - zeros);
+    pending_zeros_ = pending_zeros_ - zeros + overflow;
+    commit_write(spans.total());
+    return overflow;
+  }
+
+  template <typename T>
+  size_t pop(T *samples, size_t num_samples)
+  {
+    zmq_sample_spans spans = peek_read(num_samples);
+    for (int k = 0; k < 2; k++) {
+      zmq_copy_samples(samples, spans.data[k], spans.len[k]);
+      samples += spans.len[k];
+    }
+    commit_read(spans.total());
+    return spans.total();
+  }
+
+  // Read-only after construction
+  const size_t max_size_;
+  std::unique_ptr<c16_t[]> buffer_;
+  // Only changed by set_doorbell()
+  std::atomic<zmq_doorbell *> doorbell_{&own_doorbell_};
+  char pad0_[cache_line_size];
+
+  // Written by the producer
+  std::atomic<uint64_t> head_{0};
+  uint64_t cached_tail_ = 0;
+  // Zeros replacing dropped samples that did not fit in the ring yet
+  size_t pending_zeros_ = 0;
+  char pad1_[cache_line_size];
+
+  // Written by the consumer
+  std::atomic<uint64_t> tail_{0};
+  uint64_t cached_head_ = 0;
+  char pad2_[cache_line_size];
+
+  zmq_doorbell own_doorbell_;
+};
+
+#endif
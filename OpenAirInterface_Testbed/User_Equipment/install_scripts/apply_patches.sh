@@ -97,7 +97,7 @@ if [ ! -f "radio/zmq/zmq_imported.cpp.previous" ]; then
     cp radio/zmq/zmq_imported.cpp radio/zmq/zmq_imported.cpp.previous
     cp radio/zmq/zmq_imported.cpp.previous "$PARENT_DIR/install_patch_files/openairinterface5g/radio/zmq/zmq_imported.previous.cpp"
 fi
-echo "Patching zmq_imported.cpp for C++11 compatibility..."
+echo "Patching zmq_imported.cpp for C++11 compatibility and the lock-free sample buffer..."
 git apply --verbose --ignore-whitespace "$PARENT_DIR/install_patch_files/openairinterface5g/radio/zmq/zmq_imported.cpp.patch"
 cd ..
 
@@ -107,10 +107,14 @@ if [ ! -f "radio/zmq/zmq_imported.h.previous" ]; then
     cp radio/zmq/zmq_imported.h radio/zmq/zmq_imported.h.previous
     cp radio/zmq/zmq_imported.h.previous "$PARENT_DIR/install_patch_files/openairinterface5g/radio/zmq/zmq_imported.previous.h"
 fi
-echo "Patching zmq_imported.h for C++11 compatibility..."
+echo "Patching zmq_imported.h for C++11 compatibility and the lock-free sample buffer..."
 git apply --verbose --ignore-whitespace "$PARENT_DIR/install_patch_files/openairinterface5g/radio/zmq/zmq_imported.h.patch"
 cd ..
 
+# This file adds a lock-free single-producer/single-consumer sample buffer for the ZeroMQ channels
+echo "Copying spsc_ring_buffer.h..."
+cp "$PARENT_DIR/install_patch_files/openairinterface5g/radio/zmq/spsc_ring_buffer.h" openairinterface5g/radio/zmq/spsc_ring_buffer.h
+
 # Patch nr_nas_msg.c for OpenSSL 1.1.x build compatibility (Ubuntu 20.04)
 cd openairinterface5g
 git restore openair3/NAS/NR_UE/nr_nas_msg.c
@@ -20,7 +20,11 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
 #include <vector>
 
 #include "encode_kpm.hpp"
@@ -190,13 +194,9 @@ void encode_kpm_function_description(E2SM_KPM_RANfunction_Description_t* ranfunc
   // xer_fprint(stderr, &asn_DEF_E2SM_KPM_RANfunction_Description, ranfunc_desc);
 }
 
-void kpm_report_indication_header_initialized(E2SM_KPM_IndicationHeader_t* ihead,
-                                              uint8_t* plmnid_buf, uint8_t* sst_buf,
-                                              uint8_t* sd_buf, long fqival, long qcival,
-                                              uint8_t* nrcellid_buf, uint8_t* gnbid_buf,
-                                              int gnbid_unused, uint8_t* cuupid_buf,
-                                              uint8_t* duid_buf, uint8_t* cuupname_buf) {
-  LOG_I("Start initializing mocked indication header");
+// Fills a mocked indication header whose colletStartTime is the given timestamp
+static void kpm_report_indication_header_fill(E2SM_KPM_IndicationHeader_t* ihead, const uint8_t* timestamp_buf,
+                                              size_t timestamp_len) {
   E2SM_KPM_IndicationHeader_Format1_t* ind_header =
       (E2SM_KPM_IndicationHeader_Format1_t*)calloc(1, sizeof(E2SM_KPM_IndicationHeader_Format1_t));
 
@@ -220,11 +220,10 @@ void kpm_report_indication_header_initialized(E2SM_KPM_IndicationHeader_t* ihead
   memcpy(ind_header->vendorName->buf, buf4, strlen((char*)buf4));
   ind_header->vendorName->size = strlen((char*)buf4);
 
-  uint8_t* buf = (uint8_t*)"20200613";
   TimeStamp_t* ts = (TimeStamp_t*)calloc(1, sizeof(TimeStamp_t));
-  ts->buf = (uint8_t*)calloc(strlen((char*)buf), 1);
-  ts->size = strlen((char*)buf);
-  memcpy(ts->buf, buf, ts->size);
+  ts->buf = (uint8_t*)calloc(timestamp_len, 1);
+  ts->size = timestamp_len;
+  memcpy(ts->buf, timestamp_buf, ts->size);
 
   ind_header->colletStartTime = *ts;
   if (ts) free(ts);
@@ -232,7 +231,127 @@ void kpm_report_indication_header_initialized(E2SM_KPM_IndicationHeader_t* ihead
   ihead->indicationHeader_formats.present =
       E2SM_KPM_IndicationHeader__indicationHeader_formats_PR_indicationHeader_Format1;
   ihead->indicationHeader_formats.choice.indicationHeader_Format1 = ind_header;
+}
 
+void kpm_report_indication_header_initialized(E2SM_KPM_IndicationHeader_t* ihead,
+                                              uint8_t* plmnid_buf, uint8_t* sst_buf,
+                                              uint8_t* sd_buf, long fqival, long qcival,
+                                              uint8_t* nrcellid_buf, uint8_t* gnbid_buf,
+                                              int gnbid_unused, uint8_t* cuupid_buf,
+                                              uint8_t* duid_buf, uint8_t* cuupname_buf) {
+  LOG_I("Start initializing mocked indication header");
+  uint8_t* buf = (uint8_t*)"20200613";
+  kpm_report_indication_header_fill(ihead, buf, strlen((char*)buf));
+}
+
+// Aligned-PER encoding of a full indication header, or -1 on failure
+static ssize_t kpm_report_indication_header_encode_full(const uint8_t* timestamp_buf, size_t timestamp_len,
+                                                        uint8_t* out, size_t out_size) {
+  E2SM_KPM_IndicationHeader_t* ihead = (E2SM_KPM_IndicationHeader_t*)calloc(1, sizeof(E2SM_KPM_IndicationHeader_t));
+  kpm_report_indication_header_fill(ihead, timestamp_buf, timestamp_len);
+
+  asn_enc_rval_t er = asn_encode_to_buffer(nullptr, ATS_ALIGNED_BASIC_PER, &asn_DEF_E2SM_KPM_IndicationHeader, ihead,
+                                           out, out_size);
+  ASN_STRUCT_FREE(asn_DEF_E2SM_KPM_IndicationHeader, ihead);
+
+  if (er.encoded == -1 || er.encoded > (ssize_t)out_size) {
+    LOG_E("Failed to encode %s, encoded %zd into a buffer of %zu bytes", asn_DEF_E2SM_KPM_IndicationHeader.name,
+          er.encoded, out_size);
+    return -1;
+  }
+  return er.encoded;
+}
+
+// Encoded header of one (cell, slice): the aligned-PER image and where colletStartTime sits in it.
+// Only the timestamp differs between the headers of a cell, and its bytes are copied verbatim by the encoder,
+// so later headers are the image with the new timestamp written over the old one.
+struct kpm_header_template {
+  std::vector<uint8_t> image;
+  size_t timestamp_offset = 0;
+  size_t timestamp_len = 0;
+  // False when the timestamp could not be located, e.g. because it is not octet-aligned in the encoding
+  bool patchable = false;
+};
+
+static std::mutex header_templates_mutex;
+static std::map<std::string, kpm_header_template> header_templates;
+
+// Finds the timestamp in the template by encoding the header a second time with every timestamp bit flipped;
+// the two images must differ in exactly the timestamp bytes.
+static void kpm_header_template_build(kpm_header_template& tmpl, const uint8_t* timestamp_buf, size_t timestamp_len) {
+  uint8_t buffer[8192];
+  ssize_t len = kpm_report_indication_header_encode_full(timestamp_buf, timestamp_len, buffer, sizeof(buffer));
+  if (len < 0) return;
+  tmpl.image.assign(buffer, buffer + len);
+  tmpl.timestamp_len = timestamp_len;
+
+  std::vector<uint8_t> flipped(timestamp_buf, timestamp_buf + timestamp_len);
+  for (uint8_t& b : flipped) b = ~b;
+  ssize_t flipped_len = kpm_report_indication_header_encode_full(flipped.data(), flipped.size(), buffer, sizeof(buffer));
+  if (flipped_len != len) return;
+
+  size_t first = len;
+  size_t last = 0;
+  for (size_t i = 0; i < (size_t)len; i++) {
+    if (buffer[i] != tmpl.image[i]) {
+      first = std::min(first, i);
+      last = i;
+    }
+  }
+  if (timestamp_len > 0 && first + timestamp_len - 1 == last &&
+      memcmp(&tmpl.image[first], timestamp_buf, timestamp_len) == 0 &&
+      memcmp(&buffer[first], flipped.data(), timestamp_len) == 0) {
+    tmpl.timestamp_offset = first;
+    tmpl.patchable = true;
+  } else {
+    LOG_I("Timestamp is not byte-aligned in the indication header, using full encoding for this cell");
+  }
+}
+
+ssize_t kpm_report_indication_header_encode(uint8_t* plmnid_buf, uint8_t* sst_buf, uint8_t* sd_buf,
+                                            uint8_t* nrcellid_buf, const uint8_t* timestamp_buf,
+                                            size_t timestamp_len, uint8_t* out, size_t out_size) {
+  static const bool verify = getenv("E2SIM_HEADER_TEMPLATE_VERIFY") != nullptr &&
+                             strcmp(getenv("E2SIM_HEADER_TEMPLATE_VERIFY"), "1") == 0;
+
+  std::string key((const char*)nrcellid_buf, 5);
+  key += '/';
+  key += (const char*)plmnid_buf;
+  key += '/';
+  key += (const char*)sst_buf;
+  key += '/';
+  key += (const char*)sd_buf;
+
+  std::unique_lock<std::mutex> lock(header_templates_mutex);
+  kpm_header_template& tmpl = header_templates[key];
+  if (tmpl.image.empty()) {
+    kpm_header_template_build(tmpl, timestamp_buf, timestamp_len);
+    LOG_I("Built indication header template of %zu bytes, timestamp %s", tmpl.image.size(),
+          tmpl.patchable ? "patched in place" : "not patchable");
+  }
+
+  if (!tmpl.patchable || timestamp_len != tmpl.timestamp_len || tmpl.image.size() > out_size) {
+    lock.unlock();
+    return kpm_report_indication_header_encode_full(timestamp_buf, timestamp_len, out, out_size);
+  }
+
+  size_t len = tmpl.image.size();
+  memcpy(out, tmpl.image.data(), len);
+  memcpy(out + tmpl.timestamp_offset, timestamp_buf, timestamp_len);
+
+  if (verify) {
+    uint8_t reference[8192];
+    ssize_t reference_len =
+        kpm_report_indication_header_encode_full(timestamp_buf, timestamp_len, reference, sizeof(reference));
+    if (reference_len != (ssize_t)len || memcmp(reference, out, len) != 0) {
+      LOG_E("Indication header template differs from the full encoding, disabling the template for this cell");
+      tmpl.patchable = false;
+      if (reference_len < 0 || reference_len > (ssize_t)out_size) return -1;
+      memcpy(out, reference, reference_len);
+      return reference_len;
+    }
+  }
+  return len;
 }
 
 void ue_meas_kpm_report_indication_message_initialized(
@@ -19,6 +19,7 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <string>
 
 
 
@@ -36,11 +37,20 @@ extern "C" {
   #include "ProtocolIE-Field.h"
   #include "ProtocolIE-SingleContainer.h"
   #include "InitiatingMessage.h"
+  #include "SuccessfulOutcome.h"
+  #include "RICsubscriptionDeleteRequest.h"
+  #include "RICsubscriptionDeleteResponse.h"
 }
 
 #include "kpm_callbacks.hpp"
 #include "encode_kpm.hpp"
 
+// Defined in encode_kpm.cpp; declared here because encode_kpm.hpp is not part of the patched files.
+// Encodes an indication header from a per (cell, slice) template, patching in the timestamp.
+ssize_t kpm_report_indication_header_encode(uint8_t* plmnid_buf, uint8_t* sst_buf, uint8_t* sd_buf,
+                                            uint8_t* nrcellid_buf, const uint8_t* timestamp_buf,
+                                            size_t timestamp_len, uint8_t* out, size_t out_size);
+
 #include "encode_e2apv1.hpp"
 
 #include <nlohmann/json.hpp>
@@ -51,6 +61,15 @@ extern "C" {
 #include "errno.h"
 #include "e2sim_defs.h"
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
 
 using json = nlohmann::json;
 
@@ -60,8 +79,594 @@ int gFuncId;
 
 E2Sim e2sim;
 
+// Typed view of one line of the reports file. Each report list is walked once with direct member lookups,
+// instead of building and parsing a json_pointer for every field of every UE.
+struct NeighbourCellReport {
+  int nbCellIdentity;
+  int rsrp;
+  int rsrq;
+  int rssinr;
+};
+
+struct UeMeasReport {
+  std::string ueId;
+  float throughput;
+  int prbUsage;
+  int nrCellIdentity;
+  int rsrp;
+  int rsrq;
+  int rssinr;
+  std::vector<NeighbourCellReport> neighbours;
+};
+
+struct CellMeasReport {
+  int nrCellIdentity;
+  float pdcpBytesDl;
+  float pdcpBytesUl;
+  int availPrbDl;
+  int availPrbUl;
+};
+
+enum class ReportType { None, Ue, Cell };
+
+struct ReportLine {
+  ReportType type = ReportType::None;
+  int duId = 0;
+  // measTimeStampRf in microseconds since the epoch, or -1 if the line has none
+  int64_t timestampUs = -1;
+  // Only the first ueCount/cellCount entries are valid; the vectors are kept across lines to reuse their storage
+  size_t ueCount = 0;
+  size_t cellCount = 0;
+  std::vector<UeMeasReport> ues;
+  std::vector<CellMeasReport> cells;
+};
+
+// Parses timestamps such as "2020-11-05T15:39:58.858734" (UTC) into microseconds since the epoch, or -1 on failure
+static int64_t parse_trace_timestamp_us(const std::string &str) {
+
+  struct tm tm = {};
+  int consumed = 0;
+  if (sscanf(str.c_str(), "%d-%d-%dT%d:%d:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+             &tm.tm_sec, &consumed) != 6)
+    return -1;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+
+  int64_t fraction_us = 0;
+  const char *frac = str.c_str() + consumed;
+  if (*frac == '.') {
+    int64_t scale = 100000;
+    for (frac++; *frac >= '0' && *frac <= '9'; frac++) {
+      fraction_us += (*frac - '0') * scale;
+      scale /= 10;
+    }
+  }
+  return (int64_t)timegm(&tm) * 1000000 + fraction_us;
+}
+
+static int64_t extract_timestamp_us(const json &report_json) {
+
+  auto ts = report_json.find("measTimeStampRf");
+  if (ts == report_json.end() || !ts->is_string())
+    return -1;
+  return parse_trace_timestamp_us(ts->get_ref<const std::string &>());
+}
+
+// Fills the report from a parsed line. Throws json::exception if a field is missing or has the wrong type.
+static void extract_report_line(const json &line_json, ReportLine &report) {
+
+  report.type = ReportType::None;
+  report.timestampUs = -1;
+  report.ueCount = 0;
+  report.cellCount = 0;
+
+  auto ue_report = line_json.find("ueMeasReport");
+  if (ue_report != line_json.end()) {
+    report.type = ReportType::Ue;
+    report.duId = ue_report->at("du-id").get<int>();
+    report.timestampUs = extract_timestamp_us(*ue_report);
+
+    const json &list = ue_report->at("ueMeasReportList");
+    if (report.ues.size() < list.size())
+      report.ues.resize(list.size());
+
+    for (const json &item : list) {
+      UeMeasReport &ue = report.ues[report.ueCount++];
+      ue.ueId = item.at("ue-id").get<std::string>();
+      ue.throughput = item.at("throughput").get<float>();
+      ue.prbUsage = item.at("prb_usage").get<int>();
+      ue.nrCellIdentity = item.at("nrCellIdentity").get<int>();
+
+      const json &serving = item.at("servingCellRfReport");
+      ue.rsrp = serving.at("rsrp").get<int>();
+      ue.rsrq = serving.at("rsrq").get<int>();
+      ue.rssinr = serving.at("rssinr").get<int>();
+
+      const json &neighbours = item.at("neighbourCellList");
+      ue.neighbours.resize(neighbours.size());
+      for (size_t j = 0; j < neighbours.size(); j++) {
+        const json &nb = neighbours[j];
+        const json &nb_rf = nb.at("nbCellRfReport");
+        ue.neighbours[j].nbCellIdentity = nb.at("nbCellIdentity").get<int>();
+        ue.neighbours[j].rsrp = nb_rf.at("rsrp").get<int>();
+        ue.neighbours[j].rsrq = nb_rf.at("rsrq").get<int>();
+        ue.neighbours[j].rssinr = nb_rf.at("rssinr").get<int>();
+      }
+    }
+    return;
+  }
+
+  auto cell_report = line_json.find("cellMeasReport");
+  if (cell_report != line_json.end()) {
+    report.type = ReportType::Cell;
+    report.duId = cell_report->at("du-id").get<int>();
+    report.timestampUs = extract_timestamp_us(*cell_report);
+
+    const json &list = cell_report->at("cellMeasReportList");
+    if (report.cells.size() < list.size())
+      report.cells.resize(list.size());
+
+    for (const json &item : list) {
+      CellMeasReport &cell = report.cells[report.cellCount++];
+      cell.nrCellIdentity = item.at("nrCellIdentity").get<int>();
+
+      const json &pdcp = item.at("pdcpByteMeasReport");
+      cell.pdcpBytesDl = pdcp.at("pdcpBytesDl").get<float>();
+      cell.pdcpBytesUl = pdcp.at("pdcpBytesUl").get<float>();
+
+      const json &prb = item.at("prbMeasReport");
+      cell.availPrbDl = prb.at("availPrbDl").get<int>();
+      cell.availPrbUl = prb.at("availPrbUl").get<int>();
+    }
+  }
+}
+
+// Previous extraction that resolved one json_pointer per field, kept as the baseline for the decode benchmark
+static void extract_report_line_json_pointer(json &all_ues_json, ReportLine &report) {
+
+  report.type = ReportType::None;
+  report.ueCount = 0;
+  report.cellCount = 0;
+
+  std::string first_key = all_ues_json.begin().key();
+
+  if (first_key.compare("ueMeasReport") == 0) {
+    report.type = ReportType::Ue;
+    report.duId = all_ues_json[json::json_pointer(std::string("/ueMeasReport/du-id"))].get<int>();
+
+    int numMeasReports = (all_ues_json["/ueMeasReport/ueMeasReportList"_json_pointer]).size();
+    if (report.ues.size() < (size_t)numMeasReports)
+      report.ues.resize(numMeasReports);
+
+    for (int i = 0; i < numMeasReports; i++) {
+      UeMeasReport &ue = report.ues[report.ueCount++];
+      std::string prefix = std::string("/ueMeasReport/ueMeasReportList/") + std::to_string(i);
+      ue.ueId = all_ues_json[json::json_pointer(prefix + "/ue-id")].get<std::string>();
+      ue.throughput = all_ues_json[json::json_pointer(prefix + "/throughput")].get<float>();
+      ue.prbUsage = all_ues_json[json::json_pointer(prefix + "/prb_usage")].get<int>();
+      ue.nrCellIdentity = all_ues_json[json::json_pointer(prefix + "/nrCellIdentity")].get<int>();
+      ue.rsrp = all_ues_json[json::json_pointer(prefix + "/servingCellRfReport/rsrp")].get<int>();
+      ue.rsrq = all_ues_json[json::json_pointer(prefix + "/servingCellRfReport/rsrq")].get<int>();
+      ue.rssinr = all_ues_json[json::json_pointer(prefix + "/servingCellRfReport/rssinr")].get<int>();
+
+      int numNeighborCells = (all_ues_json[json::json_pointer(prefix + "/neighbourCellList")]).size();
+      ue.neighbours.resize(numNeighborCells);
+      for (int j = 0; j < numNeighborCells; j++) {
+        std::string nb_prefix = prefix + "/neighbourCellList/" + std::to_string(j);
+        ue.neighbours[j].nbCellIdentity = all_ues_json[json::json_pointer(nb_prefix + "/nbCellIdentity")].get<int>();
+        ue.neighbours[j].rsrp = all_ues_json[json::json_pointer(nb_prefix + "/nbCellRfReport/rsrp")].get<int>();
+        ue.neighbours[j].rsrq = all_ues_json[json::json_pointer(nb_prefix + "/nbCellRfReport/rsrq")].get<int>();
+        ue.neighbours[j].rssinr = all_ues_json[json::json_pointer(nb_prefix + "/nbCellRfReport/rssinr")].get<int>();
+      }
+    }
+  } else if (first_key.compare("cellMeasReport") == 0) {
+    report.type = ReportType::Cell;
+    report.duId = all_ues_json[json::json_pointer(std::string("/cellMeasReport/du-id"))].get<int>();
+
+    int numMeasReports = (all_ues_json["/cellMeasReport/cellMeasReportList"_json_pointer]).size();
+    if (report.cells.size() < (size_t)numMeasReports)
+      report.cells.resize(numMeasReports);
+
+    for (int i = 0; i < numMeasReports; i++) {
+      CellMeasReport &cell = report.cells[report.cellCount++];
+      std::string prefix = std::string("/cellMeasReport/cellMeasReportList/") + std::to_string(i);
+      cell.nrCellIdentity = all_ues_json[json::json_pointer(prefix + "/nrCellIdentity")].get<int>();
+      cell.pdcpBytesDl = all_ues_json[json::json_pointer(prefix + "/pdcpByteMeasReport/pdcpBytesDl")].get<float>();
+      cell.pdcpBytesUl = all_ues_json[json::json_pointer(prefix + "/pdcpByteMeasReport/pdcpBytesUl")].get<float>();
+      cell.availPrbDl = all_ues_json[json::json_pointer(prefix + "/prbMeasReport/availPrbDl")].get<int>();
+      cell.availPrbUl = all_ues_json[json::json_pointer(prefix + "/prbMeasReport/availPrbUl")].get<int>();
+    }
+  }
+}
+
+// Decodes every line of a reports file with both extraction methods and prints the UE reports decoded per second.
+// JSON parsing is done up front, so only the field extraction is measured.
+static int run_decode_benchmark(const char *path, int iterations) {
+
+  std::ifstream input(path);
+  if (!input.is_open()) {
+    LOG_E("Can't open %s for the decode benchmark", path);
+    return 1;
+  }
+
+  std::vector<json> lines;
+  std::string str;
+  while (getline(input, str)) {
+    if (!str.empty())
+      lines.push_back(json::parse(str));
+  }
+
+  ReportLine baseline;
+  ReportLine typed;
+  long ue_reports_per_pass = 0;
+  for (json &line : lines) {
+    extract_report_line_json_pointer(line, baseline);
+    extract_report_line(line, typed);
+    ue_reports_per_pass += typed.ueCount;
+    for (size_t i = 0; i < typed.ueCount; i++) {
+      if (typed.ues[i].ueId != baseline.ues[i].ueId || typed.ues[i].rsrp != baseline.ues[i].rsrp ||
+          typed.ues[i].neighbours.size() != baseline.ues[i].neighbours.size()) {
+        LOG_E("Decode benchmark: extraction methods disagree on UE %zu", i);
+        return 1;
+      }
+    }
+  }
+  if (ue_reports_per_pass == 0) {
+    LOG_E("No UE measurement reports found in %s", path);
+    return 1;
+  }
+
+  auto measure = [&](void (*extract)(json &, ReportLine &)) {
+    ReportLine report;
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < iterations; n++) {
+      for (json &line : lines)
+        extract(line, report);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return (double)ue_reports_per_pass * iterations / elapsed.count();
+  };
+
+  double pointer_rate = measure(extract_report_line_json_pointer);
+  double typed_rate = measure([](json &line, ReportLine &report) { extract_report_line(line, report); });
+
+  printf("Decode benchmark of %s (%zu lines, %ld UE reports, %d iterations)\n", path, lines.size(), ue_reports_per_pass,
+         iterations);
+  printf("  json_pointer per field: %12.0f UE reports/s\n", pointer_rate);
+  printf("  pre-resolved structs:   %12.0f UE reports/s (%.1fx)\n", typed_rate, typed_rate / pointer_rate);
+  return 0;
+}
+
+// Pacing of the replayed indications, configured with environment variables:
+//   E2SIM_PACING_MODE=fixed  E2SIM_PACING_RATE indications per second (default 20)
+//   E2SIM_PACING_MODE=trace  follow the measTimeStampRf of each line, sped up by E2SIM_PACING_SPEED (default 1)
+//   E2SIM_PACING_MODE=max    send as fast as possible
+//   E2SIM_PACING_MODE=burst  send each line back-to-back, one line every E2SIM_PACING_PERIOD_MS (default 1000)
+// All waits use absolute deadlines, so the time spent encoding and sending does not accumulate as drift.
+enum class PacingMode { Fixed, Trace, Max, Burst };
+
+class PacingEngine {
+public:
+  static PacingEngine from_env() {
+
+    PacingEngine engine;
+    const char *mode = std::getenv("E2SIM_PACING_MODE");
+    if (mode == nullptr || mode[0] == '\0' || strcmp(mode, "fixed") == 0) {
+      engine.mode = PacingMode::Fixed;
+    } else if (strcmp(mode, "trace") == 0) {
+      engine.mode = PacingMode::Trace;
+    } else if (strcmp(mode, "max") == 0) {
+      engine.mode = PacingMode::Max;
+    } else if (strcmp(mode, "burst") == 0) {
+      engine.mode = PacingMode::Burst;
+    } else {
+      LOG_E("Unknown E2SIM_PACING_MODE %s, using fixed", mode);
+      engine.mode = PacingMode::Fixed;
+    }
+
+    engine.rate = env_double("E2SIM_PACING_RATE", 20.0);
+    engine.speed = env_double("E2SIM_PACING_SPEED", 1.0);
+    engine.period = std::chrono::milliseconds((long)env_double("E2SIM_PACING_PERIOD_MS", 1000.0));
+    engine.interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / engine.rate));
+    return engine;
+  }
+
+  // Waits return early once flag is set, so a deleted subscription does not sleep out a long trace gap
+  void set_cancel_flag(const std::atomic<bool> *flag) { cancel = flag; }
+
+  void start() {
+
+    start_time = Clock::now();
+    next_deadline = start_time;
+    last_report = start_time;
+    LOG_I("Pacing indications: %s", requested_str().c_str());
+  }
+
+  // Called before the indications of each line of the reports file
+  void before_line(int64_t trace_timestamp_us) {
+
+    if (mode == PacingMode::Trace) {
+      // Restart the replay clock on the first line, and when the trace has no timestamp or goes back in time
+      if (trace_timestamp_us < 0 || trace_base_us < 0 || trace_timestamp_us < trace_base_us) {
+        trace_base_us = trace_timestamp_us;
+        wall_base = Clock::now();
+      } else {
+        double offset_s = (trace_timestamp_us - trace_base_us) / 1e6 / speed;
+        wait_until(wall_base + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(offset_s)));
+      }
+    } else if (mode == PacingMode::Burst) {
+      if (lines > 0)
+        wait_until(next_deadline);
+      next_deadline += period;
+    }
+    lines++;
+  }
+
+  // Called before each indication is sent
+  void before_indication() {
+
+    if (mode == PacingMode::Fixed) {
+      wait_until(next_deadline);
+      next_deadline += interval;
+    }
+  }
+
+  void after_indication() {
+
+    indications++;
+    Clock::time_point now = Clock::now();
+    if (now - last_report >= std::chrono::seconds(10)) {
+      report();
+      last_report = now;
+    }
+  }
+
+  void report() const {
+
+    double elapsed = std::chrono::duration<double>(Clock::now() - start_time).count();
+    if (elapsed <= 0)
+      return;
+    LOG_I("Pacing: sent %ld indications in %.1f s, achieved %.1f indications/s (%.2f lines/s), requested %s",
+          indications, elapsed, indications / elapsed, lines / elapsed, requested_str().c_str());
+  }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  static double env_double(const char *name, double default_value) {
+
+    const char *str = std::getenv(name);
+    if (str == nullptr || str[0] == '\0')
+      return default_value;
+    char *end = nullptr;
+    double value = strtod(str, &end);
+    if (*end != '\0' || value <= 0) {
+      LOG_E("Invalid value %s for %s, using %g", str, name, default_value);
+      return default_value;
+    }
+    return value;
+  }
+
+  std::string requested_str() const {
+
+    char buf[128];
+    switch (mode) {
+    case PacingMode::Fixed:
+      snprintf(buf, sizeof(buf), "fixed rate of %.1f indications/s", rate);
+      break;
+    case PacingMode::Trace:
+      snprintf(buf, sizeof(buf), "trace timestamps at %.2fx speed", speed);
+      break;
+    case PacingMode::Max:
+      snprintf(buf, sizeof(buf), "as fast as possible");
+      break;
+    case PacingMode::Burst:
+      snprintf(buf, sizeof(buf), "bursts of one line every %ld ms", (long)period.count());
+      break;
+    }
+    return buf;
+  }
+
+  void wait_until(Clock::time_point deadline) {
+
+    Clock::time_point now = Clock::now();
+    if (deadline > now) {
+      while (deadline > now && !(cancel != nullptr && *cancel)) {
+        std::this_thread::sleep_until(std::min(deadline, now + std::chrono::milliseconds(100)));
+        now = Clock::now();
+      }
+    } else if (now - deadline > std::chrono::seconds(1) && mode != PacingMode::Trace) {
+      // After a stall (e.g. a slow RIC), resume the schedule from now instead of sending a catch-up burst
+      next_deadline = now;
+    }
+  }
+
+  PacingMode mode = PacingMode::Fixed;
+  double rate = 20.0;
+  double speed = 1.0;
+  std::chrono::milliseconds period{1000};
+  Clock::duration interval{};
+
+  Clock::time_point start_time;
+  Clock::time_point next_deadline;
+  Clock::time_point last_report;
+  Clock::time_point wall_base;
+  int64_t trace_base_us = -1;
+
+  long indications = 0;
+  long lines = 0;
+
+  const std::atomic<bool> *cancel = nullptr;
+};
+
+// One accepted subscription. Its reporting task keeps its own sequence number and stops once stop is set.
+struct ReportSubscription {
+  long requestorId = 0;
+  long instanceId = 0;
+  long ranFunctionId = 0;
+  long actionId = 0;
+  long seqNum = 1;
+  std::atomic<bool> stop{false};
+};
+
+static void run_report_loop(ReportSubscription &sub);
+
+// Runs the reporting task of every accepted subscription on a pool of E2SIM_REPORT_WORKERS threads (default 4),
+// so the SCTP receive path only queues the task and keeps handling subscription deletes and further subscriptions.
+// Subscriptions beyond the pool size wait in the queue until a running one finishes or is deleted.
+class SubscriptionManager {
+public:
+  void add(const std::shared_ptr<ReportSubscription> &sub) {
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (stopping)
+      return;
+
+    auto existing = active.find(Key(sub->requestorId, sub->instanceId));
+    if (existing != active.end()) {
+      LOG_I("Subscription %ld/%ld already exists, replacing it", sub->requestorId, sub->instanceId);
+      std::shared_ptr<ReportSubscription> previous = existing->second;
+      stop_locked(previous);
+    }
+
+    start_workers_locked();
+    active[Key(sub->requestorId, sub->instanceId)] = sub;
+    queue.push_back(sub);
+    if (busy + queue.size() > workers.size())
+      LOG_I("All %zu report workers are busy, subscription %ld/%ld is queued", workers.size(), sub->requestorId,
+            sub->instanceId);
+    work_cv.notify_one();
+  }
+
+  // Stops the reporting task of a subscription without waiting for it, the worker running the task picks up the next
+  // one once it returns. Returns false if the subscription is unknown.
+  bool remove(long requestorId, long instanceId) {
+
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = active.find(Key(requestorId, instanceId));
+    if (it == active.end())
+      return false;
+    std::shared_ptr<ReportSubscription> sub = it->second;
+    stop_locked(sub);
+    return true;
+  }
+
+  // Stops every subscription and joins the workers
+  void shutdown() {
+
+    std::unique_lock<std::mutex> lock(mutex);
+    stopping = true;
+    for (auto &entry : active)
+      entry.second->stop = true;
+    queue.clear();
+    work_cv.notify_all();
+
+    std::vector<std::thread> joining;
+    joining.swap(workers);
+    lock.unlock();
+    for (std::thread &worker : joining)
+      worker.join();
+  }
+
+private:
+  using Key = std::pair<long, long>;
+
+  void start_workers_locked() {
+
+    if (!workers.empty())
+      return;
+    const char *workers_str = std::getenv("E2SIM_REPORT_WORKERS");
+    int count = workers_str == nullptr ? 4 : std::atoi(workers_str);
+    if (count <= 0)
+      count = 4;
+    LOG_I("Starting %d report workers", count);
+    for (int i = 0; i < count; i++)
+      workers.emplace_back(&SubscriptionManager::worker_main, this);
+  }
+
+  // Drops sub from the queue if it has not started yet. A running task only sees the stop flag, so this never blocks
+  // the E2 receive thread behind a task waiting for its next report line; no indication of sub is sent once the
+  // flag is set (see send_indication).
+  void stop_locked(const std::shared_ptr<ReportSubscription> &sub) {
+
+    sub->stop = true;
+    auto queued = std::find(queue.begin(), queue.end(), sub);
+    if (queued != queue.end())
+      queue.erase(queued);
+    erase_locked(sub);
+  }
+
+  void erase_locked(const std::shared_ptr<ReportSubscription> &sub) {
+
+    auto it = active.find(Key(sub->requestorId, sub->instanceId));
+    if (it != active.end() && it->second == sub)
+      active.erase(it);
+  }
+
+  void worker_main() {
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      work_cv.wait(lock, [this] { return stopping || !queue.empty(); });
+      if (stopping)
+        return;
+
+      std::shared_ptr<ReportSubscription> sub = queue.front();
+      queue.pop_front();
+      busy++;
+      lock.unlock();
+
+      run_report_loop(*sub);
+
+      lock.lock();
+      busy--;
+      erase_locked(sub);
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable work_cv;
+  std::deque<std::shared_ptr<ReportSubscription>> queue;
+  std::map<Key, std::shared_ptr<ReportSubscription>> active;
+  std::vector<std::thread> workers;
+  size_t busy = 0;
+  bool stopping = false;
+};
+
+// Never destroyed, so the workers are not torn down behind a reporting task that calls exit()
+static SubscriptionManager &subscriptions() {
+
+  static SubscriptionManager *manager = new SubscriptionManager();
+  return *manager;
+}
+
+// The SCTP association is shared by the receive path and every reporting task
+static std::mutex sctp_send_mutex;
+
+static void send_e2ap_pdu(E2AP_PDU *pdu) {
+
+  std::lock_guard<std::mutex> lock(sctp_send_mutex);
+  e2sim.encode_and_send_sctp_data(pdu);
+}
+
+// Checks the stop flag under the send mutex, so an indication never follows the delete response of its subscription
+static void send_indication(const ReportSubscription &sub, E2AP_PDU *pdu) {
+
+  std::lock_guard<std::mutex> lock(sctp_send_mutex);
+  if (!sub.stop)
+    e2sim.encode_and_send_sctp_data(pdu);
+}
+
 int main(int argc, char* argv[]) {
 
+  // KPM_DECODE_BENCHMARK=<reports file> measures the report extraction and exits without connecting to the RIC
+  const char* benchmark_path = std::getenv("KPM_DECODE_BENCHMARK");
+  if (benchmark_path != nullptr && benchmark_path[0] != '\0') {
+    const char* iterations_str = std::getenv("KPM_DECODE_BENCHMARK_ITERATIONS");
+    int iterations = iterations_str == nullptr ? 1000 : std::atoi(iterations_str);
+    return run_decode_benchmark(benchmark_path, iterations > 0 ? iterations : 1000);
+  }
+
   LOG_I("Starting KPM simulator");
 
   uint8_t *nrcellid_buf = (uint8_t*)calloc(1,5);
@@ -108,6 +713,7 @@ int main(int argc, char* argv[]) {
   e2sim.register_subscription_callback(gFuncId, &callback_kpm_subscription_request);
   e2sim.run_loop(argc, argv);
 
+  subscriptions().shutdown();
 }
 
 void get_cell_id(uint8_t *nrcellid_buf, char *cid_return_buf) {
@@ -134,95 +740,183 @@ void get_cell_id(uint8_t *nrcellid_buf, char *cid_return_buf) {
 
 }
 
-void run_report_loop(long requestorId, long instanceId, long ranFunctionId, long actionId)
-{
-  std::filebuf reports_json;
-  std::streambuf *input_filebuf = &reports_json;
-
-  std::unique_ptr<viavi::RICTesterReceiver> viavi_connector;
-  if (!reports_json.open("/playpen/src/reports_file_full.json", std::ios::in)) {
-    std::cerr << "Can't open reports.json, enabling VIAVI connector instead..." << endl;
-	viavi_connector.reset(new viavi::RICTesterReceiver {3001, nullptr});
-	input_filebuf = viavi_connector->get_data_filebuf();
-  }
-
-  std::istream input {input_filebuf};
+static const char *REPORTS_FILE_PATH = "/playpen/src/reports_file_full.json";
 
-  long seqNum = 1;
+// Parses every line of the reports file once; the result is shared read-only by all subscriptions
+static std::shared_ptr<const std::vector<ReportLine>> load_report_trace(std::filebuf &reports_json) {
 
+  std::istream input {&reports_json};
+  auto trace = std::make_shared<std::vector<ReportLine>>();
+  size_t ue_reports = 0;
   std::string str;
-  
+
   while ( getline(input, str) ) {
+    if (str.empty())
+      continue;
 
     json all_ues_json;
+    try {
+      all_ues_json = json::parse(str);
+    } catch (...) {
+      LOG_I("Exception on reading json: %s", str.c_str());
+	  exit(1);
+    }
+
+    trace->emplace_back();
+    try {
+      extract_report_line(all_ues_json, trace->back());
+    } catch (const json::exception &e) {
+      LOG_I("Exception on reading report fields: %s", e.what());
+      exit(1);
+    }
+    ue_reports += trace->back().ueCount;
+  }
+
+  LOG_I("Decoded %zu lines with %zu UE reports from %s", trace->size(), ue_reports, REPORTS_FILE_PATH);
+  return trace;
+}
+
+// Returns the decoded reports file, loading it on first use, or nullptr if the file can't be opened
+static std::shared_ptr<const std::vector<ReportLine>> shared_report_trace() {
+
+  static std::mutex trace_mutex;
+  static bool trace_loaded = false;
+  static std::shared_ptr<const std::vector<ReportLine>> trace;
 
-    long fqival = 9;
-    long qcival = 9;
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  if (!trace_loaded) {
+    trace_loaded = true;
+    std::filebuf reports_json;
+    if (reports_json.open(REPORTS_FILE_PATH, std::ios::in))
+      trace = load_report_trace(reports_json);
+  }
+  return trace;
+}
+
+// Reuses the ASN.1 structures and buffers behind the indications of one reporting task.
+// The KPM message builders fill in placeholder measurement records that do not depend on the UE or cell they are
+// given, so each message structure is built on first use and re-encoded for every indication instead of being
+// allocated and freed each time.
+class IndicationEncoder {
+public:
+  IndicationEncoder() { pdu = (E2AP_PDU*)calloc(1, sizeof(E2AP_PDU)); }
+
+  IndicationEncoder(const IndicationEncoder &) = delete;
+  IndicationEncoder &operator=(const IndicationEncoder &) = delete;
+
+  ~IndicationEncoder() {
+
+    if (ue_message != nullptr)
+      ASN_STRUCT_FREE(asn_DEF_E2SM_KPM_IndicationMessage, ue_message);
+    if (cell_message != nullptr)
+      ASN_STRUCT_FREE(asn_DEF_E2SM_KPM_IndicationMessage, cell_message);
+    ASN_STRUCT_FREE(asn_DEF_E2AP_PDU, pdu);
+  }
+
+  // Encodes the indication header of a cell into header_data() and returns its size. The header is built from
+  // a template that encode_kpm.cpp keeps per cell and slice, so only the first header of a cell is fully encoded.
+  size_t encode_header(uint8_t *nrcellid_buf) {
 
     uint8_t *plmnid_buf = (uint8_t*)"747";
     uint8_t *sst_buf = (uint8_t*)"1";
     uint8_t *sd_buf = (uint8_t*)"100";
-    
+    uint8_t *collet_start_time = (uint8_t*)"20200613";
+
+    ssize_t encoded = kpm_report_indication_header_encode(plmnid_buf, sst_buf, sd_buf, nrcellid_buf,
+                                                          collet_start_time, strlen((char*)collet_start_time),
+                                                          header_buffer, sizeof(header_buffer));
+    if (encoded < 0) {
+      LOG_I("Failed to serialize data. Detail: %s.\n", asn_DEF_E2SM_KPM_IndicationHeader.name);
+      exit(1);
+    }
+    return encoded;
+  }
 
-    LOG_I("Current line: %s", str.c_str());
+  const uint8_t *header_data() const { return header_buffer; }
 
-    bool valid = false;
+  // Encodes a UE indication message into message() and returns its size
+  size_t encode_ue_message(uint8_t *nrcellid_buf, uint8_t *crnti_buf, const uint8_t *serving_buf,
+                           const uint8_t *neighbor_buf) {
 
-    try {
-      all_ues_json = json::parse(str);
-      valid = true;
-    } catch (...) {
-      LOG_I("Exception on reading json");
-	  exit(1);
+    if (ue_message == nullptr) {
+      ue_message = (E2SM_KPM_IndicationMessage_t*)calloc(1,sizeof(E2SM_KPM_IndicationMessage_t));
+      ue_meas_kpm_report_indication_message_initialized(ue_message, nrcellid_buf, crnti_buf, serving_buf, neighbor_buf);
     }
+    return encode_message(ue_message, "UE");
+  }
+
+  // Encodes a cell indication message (report style 1) into message() and returns its size
+  size_t encode_cell_message(long fiveqi, long prb_dl, long prb_ul, uint8_t *nrcellid_buf) {
+
+    if (cell_message == nullptr) {
+      long l_dl_prbs = prb_dl;
+      long l_ul_prbs = prb_ul;
+      cell_message = (E2SM_KPM_IndicationMessage_t*)calloc(1,sizeof(E2SM_KPM_IndicationMessage_t));
+      cell_meas_kpm_report_indication_message_style_1_initialized(cell_message, fiveqi,
+                prb_dl, prb_ul, nrcellid_buf, &l_dl_prbs, &l_ul_prbs);
+    }
+    return encode_message(cell_message, "Cell");
+  }
+
+  const uint8_t *message() const { return message_buffer; }
+
+  // The indication PDU, cleared of the previous indication
+  E2AP_PDU *indication_pdu() {
+
+    ASN_STRUCT_RESET(asn_DEF_E2AP_PDU, pdu);
+    return pdu;
+  }
 
-    if (valid) {
+private:
+  size_t encode_message(E2SM_KPM_IndicationMessage_t *msg, const char *kind) {
+
+    asn_enc_rval_t er_message = asn_encode_to_buffer(nullptr, ATS_ALIGNED_BASIC_PER,
+                                                     &asn_DEF_E2SM_KPM_IndicationMessage,
+                                                     msg, message_buffer, sizeof(message_buffer));
+
+    if(er_message.encoded == -1) {
+      LOG_I("Failed to serialize message data. Detail: %s.\n", asn_DEF_E2SM_KPM_IndicationMessage.name);
+      exit(1);
+    } else if(er_message.encoded > (ssize_t)sizeof(message_buffer)) {
+      LOG_I("Buffer of size %zu is too small for %s, need %zu\n", sizeof(message_buffer), asn_DEF_E2SM_KPM_IndicationMessage.name, er_message.encoded);
+      exit(1);
+    } else {
+      LOG_I("Encoded %s indication message succesfully, size in bytes: %zu", kind, er_message.encoded);
+    }
+    return er_message.encoded;
+  }
 
-      std::string first_key = all_ues_json.begin().key();
-      LOG_I("First key is %s\n", first_key.c_str());
-      
-      if (first_key.compare("ueMeasReport") == 0) {
+  E2SM_KPM_IndicationMessage_t *ue_message = nullptr;
+  E2SM_KPM_IndicationMessage_t *cell_message = nullptr;
+  E2AP_PDU *pdu = nullptr;
+  // Not cleared between encodings; the encoders write every byte they report
+  uint8_t message_buffer[8192];
+  uint8_t header_buffer[8192];
+};
+
+// Encodes and sends the indications of one line of the reports file for a subscription
+static void send_report_line(const ReportLine &report, ReportSubscription &sub, PacingEngine &pacing,
+                             IndicationEncoder &encoder)
+{
+  if (report.type == ReportType::Ue) {
 
-		json::json_pointer du_id(std::string("/ueMeasReport/du-id"));
-		int duid = all_ues_json[du_id].get<int>();
+		int duid = report.duId;
 	
 		LOG_I("Start sending UE measurement reports with DU id %d", duid);
 
-		int numMeasReports = (all_ues_json["/ueMeasReport/ueMeasReportList"_json_pointer]).size();
+		int numMeasReports = report.ueCount;
 		
-		for (int i = 0; i < numMeasReports; i++) {
-			int nextCellId;
-			int nextRsrp;
-			int nextRsrq;
-			int nextRssinr;
-			float tput;
-			int prb_usage;
-			std::string ueId;
-
-			json::json_pointer p001(std::string("/ueMeasReport/ueMeasReportList/") + std::to_string(i) +"/ue-id");
-			ueId = all_ues_json[p001].get<std::string>();
-
-			LOG_I("Preparing report data for UE %d with id %s", i, ueId);
-			
-			json::json_pointer p0(std::string("/ueMeasReport/ueMeasReportList/") + std::to_string(i) +"/throughput");
-			tput = all_ues_json[p0].get<float>();
-			
-			json::json_pointer p00(std::string("/ueMeasReport/ueMeasReportList/") + std::to_string(i) +"/prb_usage");
-			prb_usage = all_ues_json[p00].get<int>();
-			
-			json::json_pointer p1(std::string("/ueMeasReport/ueMeasReportList/") + std::to_string(i) +"/nrCellIdentity");
-			nextCellId = all_ues_json[p1].get<int>();
-			
-			json::json_pointer p2(std::string("/ueMeasReport/ueMeasReportList/") + std::to_string(i) +"/servingCellRfReport/rsrp");
-			nextRsrp = all_ues_json[p2].get<int>();
-			
-			json::json_pointer p3(std::string("/ueMeasReport/ueMeasReportList/") + std::to_string(i) +"/servingCellRfReport/rsrq");
-			nextRsrq = all_ues_json[p3].get<int>();
-			
-			json::json_pointer p4(std::string("/ueMeasReport/ueMeasReportList/") + std::to_string(i) +"/servingCellRfReport/rssinr");
-			nextRssinr = all_ues_json[p4].get<int>();
-			
-			json::json_pointer p5(std::string("/ueMeasReport/ueMeasReportList/") + std::to_string(i) +"/neighbourCellList");
+		for (int i = 0; i < numMeasReports && !sub.stop; i++) {
+			const UeMeasReport &ue = report.ues[i];
+			int nextCellId = ue.nrCellIdentity;
+			int nextRsrp = ue.rsrp;
+			int nextRsrq = ue.rsrq;
+			int nextRssinr = ue.rssinr;
+			float tput = ue.throughput;
+			int prb_usage = ue.prbUsage;
+			const std::string &ueId = ue.ueId;
+
+			LOG_I("Preparing report data for UE %d with id %s", i, ueId.c_str());
 			
 			uint8_t crnti_buf[3] = {0, };
 
@@ -247,29 +941,15 @@ void run_report_loop(long requestorId, long instanceId, long ranFunctionId, long
 				std::to_string(nextRsrq) + ", \"rssinr\": " + std::to_string(nextRssinr) + "}";
 			const uint8_t *serving_buf = reinterpret_cast<const uint8_t*>(serving_str.c_str());	
 			
-			int numNeighborCells = (all_ues_json[p5]).size();
+			int numNeighborCells = ue.neighbours.size();
 			
 			std::string neighbor_str = "[";
 			
-			int nextNbCell;
-			int nextNbRsrp;
-			int nextNbRsrq;
-			int nextNbRssinr;
-			
 			for (int j = 0; j < numNeighborCells; j++) {
-				json::json_pointer p8(std::string("/ueMeasReport/ueMeasReportList/") + std::to_string(i) +"/neighbourCellList/" + std::to_string(j) + "/nbCellIdentity");
-				nextNbCell = all_ues_json[p8].get<int>();
-				json::json_pointer p9(std::string("/ueMeasReport/ueMeasReportList/") + std::to_string(i)
-						+"/neighbourCellList/" + std::to_string(j) + "/nbCellRfReport/rsrp");
-				nextNbRsrp = all_ues_json[p9].get<int>();
-				
-				json::json_pointer p10(std::string("/ueMeasReport/ueMeasReportList/") + std::to_string(i)
-						+"/neighbourCellList/" + std::to_string(j) + "/nbCellRfReport/rsrq");
-				nextNbRsrq = all_ues_json[p10].get<int>();
-				
-				json::json_pointer p11(std::string("/ueMeasReport/ueMeasReportList/") + std::to_string(i)
-						+"/neighbourCellList/" + std::to_string(j) + "/nbCellRfReport/rssinr");
-				nextNbRssinr = all_ues_json[p11].get<int>();
+				int nextNbCell = ue.neighbours[j].nbCellIdentity;
+				int nextNbRsrp = ue.neighbours[j].rsrp;
+				int nextNbRsrq = ue.neighbours[j].rsrq;
+				int nextNbRssinr = ue.neighbours[j].rssinr;
 				
 				if (j != 0) {
 					neighbor_str += ",";
@@ -298,7 +978,6 @@ void run_report_loop(long requestorId, long instanceId, long ranFunctionId, long
 								
 			const uint8_t *neighbor_buf = reinterpret_cast<const uint8_t*>(neighbor_str.c_str());
 
-
 			uint8_t nrcellid_buf[6] = {0, };
 			nrcellid_buf[0] = 0x22;
 			nrcellid_buf[1] = 0x5B;
@@ -306,136 +985,42 @@ void run_report_loop(long requestorId, long instanceId, long ranFunctionId, long
 			nrcellid_buf[3] = nextCellId;
 			nrcellid_buf[4] = 0x70;
 
-			uint8_t gnbid_buf[4] = {0, };
-			gnbid_buf[0] = 0x22;
-			gnbid_buf[1] = 0x5B;
-			gnbid_buf[2] = 0xD6;
-
-			uint8_t cuupid_buf[2] = {0, };
-			cuupid_buf[0] = 20000;
-
-			uint8_t duid_buf[2] = {0, };
-			duid_buf[0] = 20000;
-
-			uint8_t *cuupname_buf = (uint8_t*)"GNBCUUP5";	  
-			
-			LOG_I("Encoding UE indication message step 1");
-			
-			E2SM_KPM_IndicationMessage_t *ind_msg_cucp_ue =
-				(E2SM_KPM_IndicationMessage_t*)calloc(1,sizeof(E2SM_KPM_IndicationMessage_t));
-			
-			LOG_I("Print Indication Message KPM UE %d", &ind_msg_cucp_ue);
-			
-			ue_meas_kpm_report_indication_message_initialized(ind_msg_cucp_ue, nrcellid_buf, crnti_buf, serving_buf, neighbor_buf);
-			
-			LOG_I("Encoding UE indication message step 2");
-
-			uint8_t e2sm_message_buf_cucp_ue[8192] = {0, };
-			size_t e2sm_message_buf_size_cucp_ue = 8192;
-			
-			asn_codec_ctx_t *opt_cod;
-			
-			asn_enc_rval_t er_message_cucp_ue = asn_encode_to_buffer(opt_cod,
-										ATS_ALIGNED_BASIC_PER,
-										&asn_DEF_E2SM_KPM_IndicationMessage,
-										ind_msg_cucp_ue, e2sm_message_buf_cucp_ue, e2sm_message_buf_size_cucp_ue);
-			
-			LOG_I("Encoding UE indication message step 3");
-
-			if(er_message_cucp_ue.encoded == -1) {
-				LOG_I("Failed to serialize message data. Detail: %s.\n", asn_DEF_E2SM_KPM_IndicationMessage.name);
-				exit(1);
-			} else if(er_message_cucp_ue.encoded > e2sm_message_buf_size_cucp_ue) {
-				LOG_I("Buffer of size %zu is too small for %s, need %zu\n", e2sm_message_buf_size_cucp_ue, asn_DEF_E2SM_KPM_IndicationMessage.name, er_message_cucp_ue.encoded);
-				exit(1);
-			} else {
-				LOG_I("Encoded UE indication message succesfully, size in bytes: %zu", er_message_cucp_ue.encoded)
-			}
+			LOG_I("Encoding UE indication message");
 
-			ASN_STRUCT_FREE(asn_DEF_E2SM_KPM_IndicationMessage, ind_msg_cucp_ue); 
+			size_t message_size = encoder.encode_ue_message(nrcellid_buf, crnti_buf, serving_buf, neighbor_buf);
+			size_t header_size = encoder.encode_header(nrcellid_buf);
 
-			E2SM_KPM_IndicationHeader_t* ind_header_cucp_ue =
-				(E2SM_KPM_IndicationHeader_t*)calloc(1,sizeof(E2SM_KPM_IndicationHeader_t));
-			kpm_report_indication_header_initialized(ind_header_cucp_ue, plmnid_buf, sst_buf, sd_buf, fqival, qcival, nrcellid_buf, gnbid_buf, 0, cuupid_buf, duid_buf, cuupname_buf);
-
-			asn_codec_ctx_t *opt_cod1;
-			uint8_t e2sm_header_buf_cucp_ue[8192] = {0, };
-			size_t e2sm_header_buf_size_cucp_ue = 8192;
-			
-			asn_enc_rval_t er_header_cucp_ue = asn_encode_to_buffer(opt_cod1,
-										ATS_ALIGNED_BASIC_PER,
-										&asn_DEF_E2SM_KPM_IndicationHeader,
-										ind_header_cucp_ue, e2sm_header_buf_cucp_ue, e2sm_header_buf_size_cucp_ue);
-
-			if(er_header_cucp_ue.encoded == -1) {
-				LOG_I("Failed to serialize data. Detail: %s.\n", asn_DEF_E2SM_KPM_IndicationHeader.name);
-				exit(1);
-			} else if(er_header_cucp_ue.encoded > e2sm_header_buf_size_cucp_ue) {
-				LOG_I("Buffer of size %zu is too small for %s, need %zu\n", e2sm_header_buf_size_cucp_ue, asn_DEF_E2SM_KPM_IndicationHeader.name, er_header_cucp_ue.encoded);
-				exit(1);
-			} else {
-				LOG_I("Encoded UE indication header succesfully, size in bytes: %zu", er_header_cucp_ue.encoded);
-				for(int i = 0; i < er_header_cucp_ue.encoded; i ++) {
-					printf("%x ", e2sm_header_buf_cucp_ue[i]);
-				}
-				
-			}
-			
+			E2AP_PDU *pdu_cucp_ue = encoder.indication_pdu();
 
-			ASN_STRUCT_FREE(asn_DEF_E2SM_KPM_IndicationHeader, ind_header_cucp_ue);
+			pacing.before_indication();
 			
-			E2AP_PDU *pdu_cucp_ue = (E2AP_PDU*)calloc(1,sizeof(E2AP_PDU));
+			encoding::generate_e2apv1_indication_request_parameterized(pdu_cucp_ue, sub.requestorId,
+											sub.instanceId, sub.ranFunctionId,
+											sub.actionId, sub.seqNum, (uint8_t*)encoder.header_data(),
+											header_size, (uint8_t*)encoder.message(),
+											message_size);
 			
-			encoding::generate_e2apv1_indication_request_parameterized(pdu_cucp_ue, requestorId,
-											instanceId, ranFunctionId,
-											actionId, seqNum, e2sm_header_buf_cucp_ue,
-											er_header_cucp_ue.encoded, e2sm_message_buf_cucp_ue,
-											er_message_cucp_ue.encoded);
-			
-			e2sim.encode_and_send_sctp_data(pdu_cucp_ue);
+			send_indication(sub, pdu_cucp_ue);
 			LOG_I("Measurement report for UE %d has been sent", i);
-			seqNum++;
-			std::this_thread::sleep_for (std::chrono::milliseconds(50));
+			sub.seqNum++;
+			pacing.after_indication();
 		}
-      } else if (first_key.compare("cellMeasReport") == 0) {
+  } else if (report.type == ReportType::Cell) {
 
-		json::json_pointer du_id(std::string("/cellMeasReport/du-id"));
-		int duid = all_ues_json[du_id].get<int>();
+		int duid = report.duId;
 	
 		LOG_I("Start sending Cell measurement reports with DU id %d", duid);
 		
-		int numMeasReports = (all_ues_json["/cellMeasReport/cellMeasReportList"_json_pointer]).size();
+		int numMeasReports = report.cellCount;
 		
-		for (int i = 0; i < numMeasReports; i++) {
-			int nextCellId;
-
-			float bytes_dl;
-			float bytes_ul;
-			int prb_dl;
-			int prb_ul;
-			int cellid;
-
-			json::json_pointer p00(std::string("/cellMeasReport/cellMeasReportList/") + std::to_string(i) +"/nrCellIdentity");
-			cellid = all_ues_json[p00].get<int>();
+		for (int i = 0; i < numMeasReports && !sub.stop; i++) {
+			const CellMeasReport &cell = report.cells[i];
+			int cellid = cell.nrCellIdentity;
 
 			LOG_I("Preparing report data for Cell %d with id %d", i, cellid);
 			
-			json::json_pointer p0(std::string("/cellMeasReport/cellMeasReportList/") + std::to_string(i) +"/pdcpByteMeasReport/pdcpBytesDl");
-			bytes_dl = all_ues_json[p0].get<float>();
-
-			json::json_pointer p1(std::string("/cellMeasReport/cellMeasReportList/") + std::to_string(i) +"/pdcpByteMeasReport/pdcpBytesUl");
-			bytes_ul = all_ues_json[p1].get<float>();
-			
-			json::json_pointer p2(std::string("/cellMeasReport/cellMeasReportList/") + std::to_string(i) +"/prbMeasReport/availPrbDl");
-			prb_dl = all_ues_json[p2].get<int>();
-
-			json::json_pointer p3(std::string("/cellMeasReport/cellMeasReportList/") + std::to_string(i) +"/prbMeasReport/availPrbUl");
-			prb_ul = all_ues_json[p3].get<int>();
-
-			
-			uint8_t *sst_buf = (uint8_t*)"1";
-			uint8_t *sd_buf = (uint8_t*)"100";
-			uint8_t *plmnid_buf = (uint8_t*)"747";
+			int prb_dl = cell.availPrbDl;
+			int prb_ul = cell.availPrbUl;
 
 			uint8_t nrcellid_buf[6] = {0, };
 			nrcellid_buf[0] = 0x22;
@@ -444,105 +1029,124 @@ void run_report_loop(long requestorId, long instanceId, long ranFunctionId, long
 			nrcellid_buf[3] = cellid;
 			nrcellid_buf[4] = 0x70;
 
-			uint8_t gnbid_buf[4] = {0, };
-			gnbid_buf[0] = 0x22;
-			gnbid_buf[1] = 0x5B;
-			gnbid_buf[2] = 0xD6;
-
-			uint8_t cuupid_buf[2] = {0, };
-			cuupid_buf[0] = 20000;
-
-			uint8_t duid_buf[2] = {0, };
-			duid_buf[0] = 20000;
-
-			uint8_t *cuupname_buf = (uint8_t*)"GNBCUUP5";	  	  
-
 			//Encoding Style 1 Message Body
 			
 			LOG_I("Encoding Style 1 Message body");	  
-			asn_codec_ctx_t *opt_cod2;
-			
-			E2SM_KPM_IndicationMessage_t *ind_message_style1 =
-				(E2SM_KPM_IndicationMessage_t*)calloc(1,sizeof(E2SM_KPM_IndicationMessage_t));
-			E2AP_PDU *pdu_style1 = (E2AP_PDU*)calloc(1,sizeof(E2AP_PDU));
 			
 			long fiveqi = 7;
-			long *l_dl_prbs = (long*)calloc(1, sizeof(long));
-			long *l_ul_prbs = (long*)calloc(1, sizeof(long));
-			*l_dl_prbs = (long)prb_dl;
-			*l_ul_prbs = (long)prb_ul;
-			
-			cell_meas_kpm_report_indication_message_style_1_initialized(ind_message_style1, fiveqi,
-								prb_dl, prb_ul, nrcellid_buf, l_dl_prbs, l_ul_prbs);
-			
-			uint8_t e2sm_message_buf_style1[8192] = {0, };
-			size_t e2sm_message_buf_size_style1 = 8192;
-			
-			asn_enc_rval_t er_message_style1 = asn_encode_to_buffer(opt_cod2,
-										ATS_ALIGNED_BASIC_PER,
-										&asn_DEF_E2SM_KPM_IndicationMessage,
-										ind_message_style1,
-										e2sm_message_buf_style1, e2sm_message_buf_size_style1);
-			
-			if(er_message_style1.encoded == -1) {
-				LOG_I("Failed to serialize data. Detail: %s.", asn_DEF_E2SM_KPM_IndicationMessage.name);
-				exit(1);
-			} else if(er_message_style1.encoded > e2sm_message_buf_size_style1) {
-				LOG_I("Buffer of size %zu is too small for %s, need %zu\n", e2sm_message_buf_size_style1, asn_DEF_E2SM_KPM_IndicationMessage.name, er_message_style1.encoded);
-				exit(1);
-			} else {
-				LOG_I("Encoded Cell indication message succesfully, size in bytes: %ld", er_message_style1.encoded)
-			}
+			size_t message_size = encoder.encode_cell_message(fiveqi, prb_dl, prb_ul, nrcellid_buf);
+			size_t header_size = encoder.encode_header(nrcellid_buf);
 
-			ASN_STRUCT_FREE(asn_DEF_E2SM_KPM_IndicationMessage, ind_message_style1);
+			E2AP_PDU *pdu_style1 = encoder.indication_pdu();
 			
-			uint8_t *cpid_buf2 = (uint8_t*)"CPID";
-			
-			E2SM_KPM_IndicationHeader_t* ind_header_style1 =
-				(E2SM_KPM_IndicationHeader_t*)calloc(1,sizeof(E2SM_KPM_IndicationHeader_t));
-			kpm_report_indication_header_initialized(ind_header_style1, plmnid_buf, sst_buf, sd_buf, fqival, qcival, nrcellid_buf, gnbid_buf, 0, cuupid_buf, duid_buf, cuupname_buf);
+			pacing.before_indication();
 
-			uint8_t e2sm_header_buf_style1[8192] = {0, };
-			size_t e2sm_header_buf_size_style1 = 8192;
-			
-			asn_enc_rval_t er_header_style1 = asn_encode_to_buffer(opt_cod2,
-										ATS_ALIGNED_BASIC_PER,
-										&asn_DEF_E2SM_KPM_IndicationHeader,
-										ind_header_style1,
-										e2sm_header_buf_style1, e2sm_header_buf_size_style1);
-
-			if(er_header_style1.encoded == -1) {
-				LOG_I("Failed to serialize data. Detail: %s.\n", asn_DEF_E2SM_KPM_IndicationHeader.name);
-				exit(1);
-			} else if(er_header_style1.encoded > e2sm_header_buf_size_style1) {
-				LOG_I("Buffer of size %zu is too small for %s, need %zu\n", e2sm_header_buf_size_style1, asn_DEF_E2SM_KPM_IndicationHeader.name, er_header_style1.encoded);
-				exit(1);
-			} else {
-				LOG_I("Encoded Cell indication header succesfully, size in bytes: %d", er_header_style1.encoded)
-			}
+			encoding::generate_e2apv1_indication_request_parameterized(pdu_style1, sub.requestorId,
+											sub.instanceId, sub.ranFunctionId,
+											sub.actionId, sub.seqNum, (uint8_t*)encoder.header_data(),
+											header_size,
+											(uint8_t*)encoder.message(), message_size);
 
-			ASN_STRUCT_FREE(asn_DEF_E2SM_KPM_IndicationHeader, ind_header_style1);
-			
-			encoding::generate_e2apv1_indication_request_parameterized(pdu_style1, requestorId,
-											instanceId, ranFunctionId,
-											actionId, seqNum, e2sm_header_buf_style1,
-											er_header_style1.encoded,
-											e2sm_message_buf_style1, er_message_style1.encoded);
-
-			e2sim.encode_and_send_sctp_data(pdu_style1);
-			seqNum++;
+			send_indication(sub, pdu_style1);
+			sub.seqNum++;
 			LOG_I("Measurement report for Cell %d has been sent\n", i);
-			std::this_thread::sleep_for (std::chrono::milliseconds(50));	  
+			pacing.after_indication();
 			
 		}
-	  }					           
+  }
+}
+
+// Without a reports file the lines are streamed from the VIAVI connector. It listens on a single port,
+// so only one subscription can use it at a time.
+static void run_viavi_report_loop(ReportSubscription &sub, PacingEngine &pacing, IndicationEncoder &encoder)
+{
+  static std::atomic<bool> connector_in_use{false};
+  if (connector_in_use.exchange(true)) {
+    // A replaced or deleted subscription keeps the connector until its next line has arrived
+    LOG_I("VIAVI connector in use, subscription %ld/%ld waits for it", sub.requestorId, sub.instanceId);
+    while (connector_in_use.exchange(true)) {
+      if (sub.stop)
+        return;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  }
+
+  std::cerr << "Can't open reports.json, enabling VIAVI connector instead..." << endl;
+  std::unique_ptr<viavi::RICTesterReceiver> viavi_connector(new viavi::RICTesterReceiver {3001, nullptr});
+  std::istream input {viavi_connector->get_data_filebuf()};
+
+  std::string str;
+
+  // Reused for every line, so the report vectors only allocate when a line has more UEs or cells than seen before
+  ReportLine report;
+
+  // getline blocks on the connector, so a stopped task only returns once the next line has arrived. The delete has
+  // already been answered by then and nothing is sent for that line.
+  while ( !sub.stop && getline(input, str) ) {
+
+    LOG_I("Current line: %s", str.c_str());
+
+    json all_ues_json;
+    try {
+      all_ues_json = json::parse(str);
+    } catch (...) {
+      LOG_I("Exception on reading json");
+	  exit(1);
+    }
+
+    try {
+      extract_report_line(all_ues_json, report);
+    } catch (const json::exception &e) {
+      LOG_I("Exception on reading report fields: %s", e.what());
+      exit(1);
+    }
+
+    pacing.before_line(report.timestampUs);
+    send_report_line(report, sub, pacing, encoder);
+  }
+
+  connector_in_use = false;
+}
+
+// Reporting task of one subscription, run on a SubscriptionManager worker
+static void run_report_loop(ReportSubscription &sub)
+{
+  LOG_I("Start reporting for subscription %ld/%ld, action %ld", sub.requestorId, sub.instanceId, sub.actionId);
+
+  PacingEngine pacing = PacingEngine::from_env();
+  pacing.set_cancel_flag(&sub.stop);
+  pacing.start();
+
+  IndicationEncoder encoder;
+
+  std::shared_ptr<const std::vector<ReportLine>> trace = shared_report_trace();
+  if (trace) {
+    for (size_t n = 0; n < trace->size() && !sub.stop; n++) {
+      LOG_I("Subscription %ld/%ld: sending line %zu of %zu", sub.requestorId, sub.instanceId, n + 1, trace->size());
+      pacing.before_line((*trace)[n].timestampUs);
+      send_report_line((*trace)[n], sub, pacing, encoder);
     }
+  } else {
+    run_viavi_report_loop(sub, pacing, encoder);
   }
+
+  pacing.report();
+  LOG_I("Reporting for subscription %ld/%ld %s", sub.requestorId, sub.instanceId,
+        sub.stop ? "stopped" : "reached the end of the reports");
 }
 
 
+static void callback_kpm_subscription_delete_request(E2AP_PDU_t *del_req_pdu);
+
+// Also receives subscription delete requests, which the E2 message handler routes to the subscription callback
 void callback_kpm_subscription_request(E2AP_PDU_t *sub_req_pdu) {
 
+  if (sub_req_pdu->present == E2AP_PDU_PR_initiatingMessage &&
+      sub_req_pdu->choice.initiatingMessage->procedureCode == ProcedureCode_id_RICsubscriptionDelete) {
+    callback_kpm_subscription_delete_request(sub_req_pdu);
+    return;
+  }
+
   //Record RIC Request ID
   //Go through RIC action to be Setup List
   //Find first entry with REPORT action Type
@@ -649,9 +1253,85 @@ void callback_kpm_subscription_request(E2AP_PDU_t *sub_req_pdu) {
   encoding::generate_e2apv1_subscription_response_success(e2ap_pdu, accept_array, reject_array, accept_size, reject_size, reqRequestorId, reqInstanceId);
   
   LOG_I("Encode and sending E2AP subscription success response via SCTP");
-  e2sim.encode_and_send_sctp_data(e2ap_pdu);
+  send_e2ap_pdu(e2ap_pdu);
+
+  if (actionIdsAccept.empty()) {
+    LOG_I("No REPORT action in subscription %ld/%ld, not generating data", reqRequestorId, reqInstanceId);
+    return;
+  }
 
   LOG_I("Now generating data for subscription request");
-  run_report_loop(reqRequestorId, reqInstanceId, gFuncId, reqActionId);
+  auto sub = std::make_shared<ReportSubscription>();
+  sub->requestorId = reqRequestorId;
+  sub->instanceId = reqInstanceId;
+  sub->ranFunctionId = gFuncId;
+  sub->actionId = actionIdsAccept[0];
+  subscriptions().add(sub);
+}
+
+static void generate_subscription_delete_response(E2AP_PDU *e2ap_pdu, long requestorId, long instanceId,
+                                                  long ranFunctionId) {
+
+  RICsubscriptionDeleteResponse_IEs_t *ricreqid =
+    (RICsubscriptionDeleteResponse_IEs_t*)calloc(1, sizeof(RICsubscriptionDeleteResponse_IEs_t));
+  ricreqid->id = ProtocolIE_ID_id_RICrequestID;
+  ricreqid->criticality = Criticality_reject;
+  ricreqid->value.present = RICsubscriptionDeleteResponse_IEs__value_PR_RICrequestID;
+  ricreqid->value.choice.RICrequestID.ricRequestorID = requestorId;
+  ricreqid->value.choice.RICrequestID.ricInstanceID = instanceId;
+
+  RICsubscriptionDeleteResponse_IEs_t *ranfuncid =
+    (RICsubscriptionDeleteResponse_IEs_t*)calloc(1, sizeof(RICsubscriptionDeleteResponse_IEs_t));
+  ranfuncid->id = ProtocolIE_ID_id_RANfunctionID;
+  ranfuncid->criticality = Criticality_reject;
+  ranfuncid->value.present = RICsubscriptionDeleteResponse_IEs__value_PR_RANfunctionID;
+  ranfuncid->value.choice.RANfunctionID = ranFunctionId;
+
+  SuccessfulOutcome_t *successoutcome = (SuccessfulOutcome_t*)calloc(1, sizeof(SuccessfulOutcome_t));
+  successoutcome->procedureCode = ProcedureCode_id_RICsubscriptionDelete;
+  successoutcome->criticality = Criticality_reject;
+  successoutcome->value.present = SuccessfulOutcome__value_PR_RICsubscriptionDeleteResponse;
+  ASN_SEQUENCE_ADD(&successoutcome->value.choice.RICsubscriptionDeleteResponse.protocolIEs.list, ricreqid);
+  ASN_SEQUENCE_ADD(&successoutcome->value.choice.RICsubscriptionDeleteResponse.protocolIEs.list, ranfuncid);
+
+  e2ap_pdu->present = E2AP_PDU_PR_successfulOutcome;
+  e2ap_pdu->choice.successfulOutcome = successoutcome;
+}
+
+// Stops the reporting task of the subscription and confirms the delete. Deletes of unknown subscriptions are
+// confirmed as well, so a RIC retrying a delete after a lost response does not get stuck.
+static void callback_kpm_subscription_delete_request(E2AP_PDU_t *del_req_pdu) {
+
+  RICsubscriptionDeleteRequest_t &orig_req =
+    del_req_pdu->choice.initiatingMessage->value.choice.RICsubscriptionDeleteRequest;
+  RICsubscriptionDeleteRequest_IEs_t **ies = (RICsubscriptionDeleteRequest_IEs_t**)orig_req.protocolIEs.list.array;
+
+  long reqRequestorId = 0;
+  long reqInstanceId = 0;
+  long reqFunctionId = gFuncId;
+
+  for (int i = 0; i < orig_req.protocolIEs.list.count; i++) {
+    switch (ies[i]->value.present) {
+    case RICsubscriptionDeleteRequest_IEs__value_PR_RICrequestID:
+      reqRequestorId = ies[i]->value.choice.RICrequestID.ricRequestorID;
+      reqInstanceId = ies[i]->value.choice.RICrequestID.ricInstanceID;
+      break;
+    case RICsubscriptionDeleteRequest_IEs__value_PR_RANfunctionID:
+      reqFunctionId = ies[i]->value.choice.RANfunctionID;
+      break;
+    default:
+      break;
+    }
+  }
+
+  LOG_I("Deleting subscription %ld/%ld", reqRequestorId, reqInstanceId);
+  if (!subscriptions().remove(reqRequestorId, reqInstanceId))
+    LOG_I("Subscription %ld/%ld is not active, confirming the delete anyway", reqRequestorId, reqInstanceId);
+
+  E2AP_PDU *e2ap_pdu = (E2AP_PDU*)calloc(1,sizeof(E2AP_PDU));
+  generate_subscription_delete_response(e2ap_pdu, reqRequestorId, reqInstanceId, reqFunctionId);
 
+  LOG_I("Encode and sending E2AP subscription delete response via SCTP");
+  send_e2ap_pdu(e2ap_pdu);
+  ASN_STRUCT_FREE(asn_DEF_E2AP_PDU, e2ap_pdu);
 }
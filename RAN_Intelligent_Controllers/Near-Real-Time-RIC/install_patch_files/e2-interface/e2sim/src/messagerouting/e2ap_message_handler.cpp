@@ -27,6 +27,22 @@
 
 #include "encode_e2apv1.hpp"
 
+#include "RICsubscriptionDeleteRequest.h"
+#include "ProtocolIE-Field.h"
+
+// Returns the RAN function ID of a RIC subscription delete request, or -1 if it has none
+static long get_function_id_from_subscription_delete(E2AP_PDU_t* pdu) {
+  RICsubscriptionDeleteRequest_t& req = pdu->choice.initiatingMessage->value.choice.RICsubscriptionDeleteRequest;
+  RICsubscriptionDeleteRequest_IEs_t** ies = (RICsubscriptionDeleteRequest_IEs_t**)req.protocolIEs.list.array;
+
+  for (int i = 0; i < req.protocolIEs.list.count; i++) {
+    if (ies[i]->value.present == RICsubscriptionDeleteRequest_IEs__value_PR_RANfunctionID) {
+      return ies[i]->value.choice.RANfunctionID;
+    }
+  }
+  return -1;
+}
+
 void e2ap_handle_sctp_data(int& socket_fd, sctp_buffer_t& data, bool xmlenc, E2Sim* e2sim) {
   E2AP_PDU_t* pdu = (E2AP_PDU_t*)calloc(1, sizeof(E2AP_PDU));
   ASN_STRUCT_RESET(asn_DEF_E2AP_PDU, pdu);
@@ -126,6 +142,31 @@ void e2ap_handle_sctp_data(int& socket_fd, sctp_buffer_t& data, bool xmlenc, E2S
       }
       break;
 
+    case ProcedureCode_id_RICsubscriptionDelete:  // RIC SUBSCRIPTION DELETE = 202
+      LOG_I("Received a message of RIC subscription delete procedure");
+      switch (index) {
+        case E2AP_PDU_PR_initiatingMessage: {  // initiatingMessage
+          long func_id = get_function_id_from_subscription_delete(pdu);
+          LOG_I("Received RIC subscription delete request for function with ID %ld", func_id);
+
+          // The subscription callback of the function owns its subscriptions, so it handles their deletion too
+          try {
+            SubscriptionCallback cb;
+            cb = e2sim->get_subscription_callback(func_id);
+            cb(pdu);
+          } catch (const std::out_of_range& e) {
+            LOG_E("No RAN Function with this ID exists\n");
+          }
+
+          break;
+        }
+
+        default:
+          LOG_E("Invalid message index=%d in E2AP-PDU %d", index, (int)ProcedureCode_id_RICsubscriptionDelete);
+          break;
+      }
+      break;
+
     case ProcedureCode_id_RICindication:  // 205
       LOG_I("Received a message of RIC indication procedure");
       switch (index) {
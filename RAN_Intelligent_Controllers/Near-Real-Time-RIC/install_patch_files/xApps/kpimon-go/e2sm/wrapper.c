@@ -1,5 +1,7 @@
 #include <errno.h>
 #include "wrapper.h"
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 
 /*
@@ -9,317 +11,270 @@ static int write_out(const void *buffer, size_t size, void *app_key) {
         return (wrote == size) ? 0 :-1;
 }
 */
-ranCellUeKpi_t buildRanCellUeKpi(const char *hex_values)
+// Decoded RAN function descriptions, keyed by a hash of the hex string reported by the E2 node. Nodes that are
+// subscribed again (e.g. after kpimon restarts) or that report the same description reuse the decoded measurement
+// names and the encoded action definitions instead of decoding the ASN.1 again. Descriptions that fail to decode are
+// not cached.
+// The cache holds up to RAN_FUNCTION_CACHE_MAX_ENTRIES descriptions and evicts the oldest one first. The Go code copies
+// the tables it is returned right away, but does not tell when it is done with them, so an evicted entry is only freed
+// once RAN_FUNCTION_CACHE_MAX_ENTRIES more descriptions have been evicted after it.
+#define RAN_FUNCTION_CACHE_BUCKETS 256
+#define RAN_FUNCTION_CACHE_MAX_ENTRIES 64
+#define NUM_ACTION_DEFINITIONS 4
+
+typedef struct ran_function_cache_entry
 {
-        int BUFFER_SIZE = 10240;
-        // Calculate the length of the hex string
-        size_t hex_len = strlen(hex_values);
-
-        // Allocate memory for a char array to store the hex values
-        char *hex_buffer = (char *)malloc(hex_len / 2 + 1); // Each byte is represented by 2 characters, +1 for null terminator
-        ranCellUeKpi_t res;
-        if (hex_buffer == NULL)
-        {
-                fprintf(stderr, "Memory allocation failed\n");
-                return res;
-        }
-
-        // Convert the hex string to binary data
-        for (size_t i = 0; i < hex_len; i += 2)
-        {
-                char byte[3] = {hex_values[i], hex_values[i + 1], '\0'};
-                hex_buffer[i / 2] = (char)strtol(byte, NULL, 16);
-        }
-
-        // Null-terminate the char array
-        hex_buffer[hex_len / 2] = '\0';
-
-        // Now hex_buffer contains the binary data corresponding to the hex values
+        struct ran_function_cache_entry *next;
+        uint64_t hash;
+        char *hex_values;
+        int decoded;
 
-        // Print the result
-        printf("Hex values as a string: %s\n", hex_buffer);
+        int sz1;
+        long *id_format1;
         char **name_format1;
+        int sz3;
+        long *id_format3;
         char **name_format3;
-        int sz1 = 0;
-        int sz3 = 0;
-
-        E2SM_KPM_RANfunction_Description_t *e2smKpmRanFunctDescrip = (E2SM_KPM_RANfunction_Description_t *)calloc(1, sizeof(E2SM_KPM_RANfunction_Description_t));
-
-        enum asn_transfer_syntax syntax;
-
-        syntax = ATS_ALIGNED_BASIC_PER;
-
-        asn_dec_rval_t rval = asn_decode(NULL, syntax, &asn_DEF_E2SM_KPM_RANfunction_Description, (void **)&e2smKpmRanFunctDescrip, hex_buffer, hex_len);
 
-        if (rval.code == RC_OK)
+        // Indexed by determine - 1 (see encode_action_Definition)
+        int encoded;
+        int *action_definitions[NUM_ACTION_DEFINITIONS];
+        int action_definition_lengths[NUM_ACTION_DEFINITIONS];
+} ran_function_cache_entry_t;
+
+static ran_function_cache_entry_t *ran_function_cache[RAN_FUNCTION_CACHE_BUCKETS];
+// Cached entries in insertion order, and the evicted entries waiting to be freed, both indexed by the slot that the
+// next insertion reuses
+static ran_function_cache_entry_t *ran_function_cache_order[RAN_FUNCTION_CACHE_MAX_ENTRIES];
+static ran_function_cache_entry_t *ran_function_cache_evicted[RAN_FUNCTION_CACHE_MAX_ENTRIES];
+static size_t ran_function_cache_slot;
+static pthread_mutex_t ran_function_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Value of a hex digit, -1 if c is not one
+static int hex_digit_value(unsigned char c)
+{
+        if (c >= '0' && c <= '9')
         {
-                printf("[INFO] E2SM KPM RAN Function Description decode successful rval.code = %d \n", rval.code);
-
-                // asn_fprint(stdout, &asn_DEF_E2SM_KPM_RANfunction_Description, e2smKpmRanFunctDescrip);
-
-                for (int i = 0; i < e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.count; i++)
-                {
-                        if (e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->ric_ActionFormat_Type == 1)
-                        {
-                                sz1 = e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->measInfo_Action_List.list.count;
-                                name_format1 = (char **)malloc(sz1 * sizeof(char *));
-                                for (int j = 0; j < sz1; j++)
-                                {
-                                        size_t bufsize = e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->measInfo_Action_List.list.array[j]->measName.size;
-                                        name_format1[j] = (char *)malloc(bufsize + 1); // For null terminator
-                                        memcpy(name_format1[j], e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->measInfo_Action_List.list.array[j]->measName.buf, bufsize);
-                                        name_format1[j][bufsize] = '\0';
-                                }
-                        }
-
-                        if (e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->ric_ActionFormat_Type == 3)
-                        {
-                                sz3 = e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->measInfo_Action_List.list.count;
-                                name_format3 = (char **)malloc(sz3 * sizeof(char *));
-                                for (int j = 0; j < sz3; j++)
-                                {
-                                        size_t bufsize = e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->measInfo_Action_List.list.array[j]->measName.size;
-                                        name_format3[j] = (char *)malloc(bufsize + 1); // For null terminator
-                                        memcpy(name_format3[j], e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->measInfo_Action_List.list.array[j]->measName.buf, bufsize);
-                                        name_format3[j][bufsize] = '\0';
-                                }
-                        }
-                }
+                return c - '0';
         }
-        else
+        if (c >= 'a' && c <= 'f')
         {
-                printf("[INFO] E2SM KPM RAN Function Description decode failed rval.code = %d \n", rval.code);
+                return c - 'a' + 10;
         }
-
-        res.ueKpi = name_format3;
-        res.cellKpi = name_format1;
-        res.ueKpiSize = sz3;
-        res.cellKpiSize = sz1;
-        return res;
+        if (c >= 'A' && c <= 'F')
+        {
+                return c - 'A' + 10;
+        }
+        return -1;
 }
 
-void freeMemorydRanCellUeKpi(ranCellUeKpi_t res)
+// FNV-1a
+static uint64_t hash_hex_values(const char *hex_values)
 {
-        if (res.cellKpi != NULL)
+        uint64_t hash = 14695981039346656037ULL;
+        for (const unsigned char *c = (const unsigned char *)hex_values; *c != '\0'; c++)
         {
+                hash ^= *c;
+                hash *= 1099511628211ULL;
+        }
+        return hash;
+}
 
-                for (int i = 0; i < res.cellKpiSize; i++)
-                {
-                        free(res.cellKpi[i]);
-                }
+// Copies the IDs and names of a measurement list. The names are stored in the same allocation as the pointers to them.
+static void copy_meas_info_action_list(const MeasurementInfo_Action_List_t *list, int *sz, long **ids, char ***names, int format)
+{
+        *sz = list->list.count;
+        *ids = (long *)calloc(*sz > 0 ? *sz : 1, sizeof(long));
 
-                free(res.cellKpi);
+        size_t names_size = *sz * sizeof(char *);
+        for (int j = 0; j < *sz; j++)
+        {
+                names_size += list->list.array[j]->measName.size + 1;
         }
+        *names = (char **)malloc(names_size > 0 ? names_size : 1);
+        char *name = (char *)(*names + *sz);
 
-        if (res.ueKpi != NULL)
+        for (int j = 0; j < *sz; j++)
         {
-                for (int i = 0; i < res.ueKpiSize; i++)
+                const MeasurementInfo_Action_Item_t *item = list->list.array[j];
+                if (item->measID != NULL)
                 {
-                        free(res.ueKpi[i]);
+                        (*ids)[j] = *item->measID;
                 }
-                free(res.ueKpi);
+                else
+                {
+                        fprintf(stderr, "Null pointer encountered for id_format%d: measID at index %d\n", format, j);
+                        (*ids)[j] = j + 1;
+                }
+                memcpy(name, item->measName.buf, item->measName.size);
+                name[item->measName.size] = '\0';
+                (*names)[j] = name;
+                name += item->measName.size + 1;
         }
 }
-// determine
-// 1 for format1 by id, 2 for format1 by name , 3 for format3 by id, 4 for format3 by name
-struct encode_act_Def_result encode_action_Definition(const char *hex_values, int determine)
-{
 
-        encode_act_Def_result_t res = {0};
-        int BUFFER_SIZE = 10240;
-        // Calculate the length of the hex string
-        size_t hex_len = strlen(hex_values);
-
-        // Allocate memory for a char array to store the hex values
-        char *hex_buffer = (char *)malloc(hex_len / 2 + 1); // Each byte is represented by 2 characters, +1 for null terminator
+static void ran_function_cache_entry_free(ran_function_cache_entry_t *entry)
+{
+        if (entry == NULL)
+        {
+                return;
+        }
+        free(entry->hex_values);
+        free(entry->id_format1);
+        free(entry->name_format1);
+        free(entry->id_format3);
+        free(entry->name_format3);
+        for (int i = 0; i < NUM_ACTION_DEFINITIONS; i++)
+        {
+                free(entry->action_definitions[i]);
+        }
+        free(entry);
+}
 
-        if (hex_buffer == NULL)
+static void decode_ran_function(ran_function_cache_entry_t *entry)
+{
+        size_t hex_len = strlen(entry->hex_values);
+        if (hex_len % 2 != 0)
+        {
+                fprintf(stderr, "[ERROR] E2SM KPM RAN Function Description has an odd number of hex digits (%zu)\n", hex_len);
+                return;
+        }
+        size_t len = hex_len / 2;
+        unsigned char *buffer = (unsigned char *)malloc(len + 1);
+        if (buffer == NULL)
         {
                 fprintf(stderr, "Memory allocation failed\n");
-                return res;
+                return;
         }
-
-        // Convert the hex string to binary data
-        for (size_t i = 0; i < hex_len; i += 2)
+        for (size_t i = 0; i < len; i++)
         {
-                char byte[3] = {hex_values[i], hex_values[i + 1], '\0'};
-                hex_buffer[i / 2] = (char)strtol(byte, NULL, 16);
+                int high = hex_digit_value((unsigned char)entry->hex_values[2 * i]);
+                int low = hex_digit_value((unsigned char)entry->hex_values[2 * i + 1]);
+                if (high < 0 || low < 0)
+                {
+                        fprintf(stderr, "[ERROR] E2SM KPM RAN Function Description has a non-hex character at offset %zu\n",
+                                high < 0 ? 2 * i : 2 * i + 1);
+                        free(buffer);
+                        return;
+                }
+                buffer[i] = (unsigned char)(high << 4 | low);
         }
+        buffer[len] = '\0';
 
-        // Null-terminate the char array
-        hex_buffer[hex_len / 2] = '\0';
-
-        // Now hex_buffer contains the binary data corresponding to the hex values
-
-        // Print the result
-        printf("Hex values as a string: %s\n", hex_buffer);
-
-        long *id_format1;
-        long *id_format3;
-        char **name_format1;
-        char **name_format3;
-        int sz1 = 0;
-        int sz3 = 0;
-
-        E2SM_KPM_RANfunction_Description_t *e2smKpmRanFunctDescrip = (E2SM_KPM_RANfunction_Description_t *)calloc(1, sizeof(E2SM_KPM_RANfunction_Description_t));
-
-        enum asn_transfer_syntax syntax;
-
-        syntax = ATS_ALIGNED_BASIC_PER;
-
-        asn_dec_rval_t rval = asn_decode(NULL, syntax, &asn_DEF_E2SM_KPM_RANfunction_Description, (void **)&e2smKpmRanFunctDescrip, hex_buffer, hex_len);
+        E2SM_KPM_RANfunction_Description_t *e2smKpmRanFunctDescrip = NULL;
+        asn_dec_rval_t rval = asn_decode(NULL, ATS_ALIGNED_BASIC_PER, &asn_DEF_E2SM_KPM_RANfunction_Description, (void **)&e2smKpmRanFunctDescrip, buffer, len);
+        free(buffer);
 
         if (rval.code == RC_OK)
         {
                 printf("[INFO] E2SM KPM RAN Function Description decode successful rval.code = %d \n", rval.code);
 
-                // asn_fprint(stdout, &asn_DEF_E2SM_KPM_RANfunction_Description, e2smKpmRanFunctDescrip);
-
+                entry->decoded = 1;
                 for (int i = 0; i < e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.count; i++)
                 {
-
-                        if (e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->ric_ActionFormat_Type == 1)
+                        const RIC_ReportStyle_Item_t *style = e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i];
+                        // As before, the last report style of each format is used
+                        if (style->ric_ActionFormat_Type == 1)
                         {
-                                sz1 = e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->measInfo_Action_List.list.count;
-                                id_format1 = (long *)calloc(sz1, sizeof(long));
-                                name_format1 = (char **)malloc(sz1 * sizeof(char *));
-                                for (int j = 0; j < sz1; j++)
-                                {
-                                        if (e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->measInfo_Action_List.list.array[j]->measID != NULL)
-                                        {
-                                                id_format1[j] = *(e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->measInfo_Action_List.list.array[j]->measID);
-                                        }
-                                        else
-                                        {
-                                                fprintf(stderr, "Null pointer encountered for id_format1: measID at index %d\n", j);
-                                                id_format1[j] = j + 1; // = -1;
-                                        }
-                                        size_t bufsize = e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->measInfo_Action_List.list.array[j]->measName.size;
-                                        name_format1[j] = (char *)malloc(bufsize + 1); // For null terminator
-                                        memcpy(name_format1[j], e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->measInfo_Action_List.list.array[j]->measName.buf, bufsize);
-                                        name_format1[j][bufsize] = '\0';
-                                }
+                                free(entry->id_format1);
+                                free(entry->name_format1);
+                                copy_meas_info_action_list(&style->measInfo_Action_List, &entry->sz1, &entry->id_format1, &entry->name_format1, 1);
                         }
-
-                        if (e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->ric_ActionFormat_Type == 3)
+                        if (style->ric_ActionFormat_Type == 3)
                         {
-                                sz3 = e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->measInfo_Action_List.list.count;
-                                id_format3 = (long *)calloc(sz3, sizeof(long));
-                                name_format3 = (char **)malloc(sz3 * sizeof(char *));
-                                for (int j = 0; j < sz3; j++)
-                                {
-                                        if (e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->measInfo_Action_List.list.array[j]->measID != NULL)
-                                        {
-                                                id_format3[j] = *(e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->measInfo_Action_List.list.array[j]->measID);
-                                        }
-                                        else
-                                        {
-                                                fprintf(stderr, "Null pointer encountered for id_format3: measID at index %d\n", j);
-                                                id_format3[j] = j + 1; // = -1;
-                                        }
-                                        size_t bufsize = e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->measInfo_Action_List.list.array[j]->measName.size;
-                                        name_format3[j] = (char *)malloc(bufsize + 1); // For null terminator
-                                        memcpy(name_format3[j], e2smKpmRanFunctDescrip->ric_ReportStyle_List->list.array[i]->measInfo_Action_List.list.array[j]->measName.buf, bufsize);
-                                        name_format3[j][bufsize] = '\0';
-                                }
+                                free(entry->id_format3);
+                                free(entry->name_format3);
+                                copy_meas_info_action_list(&style->measInfo_Action_List, &entry->sz3, &entry->id_format3, &entry->name_format3, 3);
                         }
                 }
         }
         else
         {
                 printf("[INFO] E2SM KPM RAN Function Description decode failed rval.code = %d \n", rval.code);
-                // Don't forget to free the allocated memory when done
-                if (hex_buffer)
-                {
-                        free(hex_buffer);
-                        hex_buffer = NULL;
-                }
-                if (id_format1)
-                {
-                        free(id_format1);
-                        id_format1 = NULL;
-                }
-                if (name_format1)
-                {
-                        for (int i = 0; i < sz1; i++)
-                        {
-                                if (name_format1[i] != NULL)
-                                {
-                                        free(name_format1[i]);
-                                        name_format1[i] = NULL;
-                                }
-                        }
-                        free(name_format1);
-                        name_format1 = NULL;
-                }
-                if (id_format3)
+        }
+        ASN_STRUCT_FREE(asn_DEF_E2SM_KPM_RANfunction_Description, e2smKpmRanFunctDescrip);
+}
+
+// Evicts the oldest entry if the cache is full, and caches entry in its place
+static void ran_function_cache_insert(ran_function_cache_entry_t **bucket, ran_function_cache_entry_t *entry)
+{
+        ran_function_cache_entry_t *oldest = ran_function_cache_order[ran_function_cache_slot];
+        if (oldest != NULL)
+        {
+                ran_function_cache_entry_t **link = &ran_function_cache[oldest->hash % RAN_FUNCTION_CACHE_BUCKETS];
+                while (*link != oldest)
                 {
-                        free(id_format3);
-                        id_format3 = NULL;
+                        link = &(*link)->next;
                 }
-                if (name_format3)
+                *link = oldest->next;
+                ran_function_cache_entry_free(ran_function_cache_evicted[ran_function_cache_slot]);
+                ran_function_cache_evicted[ran_function_cache_slot] = oldest;
+        }
+        ran_function_cache_order[ran_function_cache_slot] = entry;
+        ran_function_cache_slot = (ran_function_cache_slot + 1) % RAN_FUNCTION_CACHE_MAX_ENTRIES;
+
+        entry->next = *bucket;
+        *bucket = entry;
+}
+
+// Returns the cached entry of the description, decoding it the first time, or NULL if it cannot be decoded. Must be
+// called with the cache mutex held.
+static ran_function_cache_entry_t *get_ran_function(const char *hex_values)
+{
+        uint64_t hash = hash_hex_values(hex_values);
+        ran_function_cache_entry_t **bucket = &ran_function_cache[hash % RAN_FUNCTION_CACHE_BUCKETS];
+        for (ran_function_cache_entry_t *entry = *bucket; entry != NULL; entry = entry->next)
+        {
+                if (entry->hash == hash && strcmp(entry->hex_values, hex_values) == 0)
                 {
-                        for (int i = 0; i < sz3; i++)
-                        {
-                                if (name_format3[i] != NULL)
-                                {
-                                        free(name_format3[i]);
-                                        name_format3[i] = NULL;
-                                }
-                        }
-                        free(name_format3);
-                        name_format3 = NULL;
+                        return entry;
                 }
-                return res;
         }
-        printf("\n");
-        printf("measID format 1\n");
-        for (int i = 0; i < sz1; i++)
+
+        ran_function_cache_entry_t *entry = (ran_function_cache_entry_t *)calloc(1, sizeof(ran_function_cache_entry_t));
+        char *hex_copy = strdup(hex_values);
+        if (entry == NULL || hex_copy == NULL)
         {
-                printf("%ld, ", id_format1[i]);
+                fprintf(stderr, "Memory allocation failed\n");
+                free(entry);
+                free(hex_copy);
+                return NULL;
         }
-        printf("\n");
-        printf("measName format 1\n");
-        for (int i = 0; i < sz1; i++)
+        entry->hash = hash;
+        entry->hex_values = hex_copy;
+        decode_ran_function(entry);
+        if (!entry->decoded)
         {
-                printf("%s, ", name_format1[i]);
+                ran_function_cache_entry_free(entry);
+                return NULL;
         }
-        printf("\n");
-        printf("measID format 3\n");
-        for (int i = 0; i < sz3; i++)
+        ran_function_cache_insert(bucket, entry);
+        return entry;
+}
+
+static int *copy_action_definition(const unsigned char *buf, int length)
+{
+        if (length <= 0)
         {
-                printf("%ld, ", id_format3[i]);
+                return NULL;
         }
-        printf("\n");
-        printf("measName format 3\n");
-        for (int i = 0; i < sz3; i++)
+        int *array = (int *)malloc(length * sizeof(int));
+        for (int i = 0; array != NULL && i < length; i++)
         {
-                printf("%s, ", name_format3[i]);
+                array[i] = (int)buf[i];
         }
+        return array;
+}
 
-        unsigned char bufFormat3[BUFFER_SIZE];
-        size_t buf_sizeFormat3 = BUFFER_SIZE;
-
-        long ricStyleTypeFormat3 = 3;
+// Encodes the action definitions of formats 1 and 3, by ID and by name, once per description
+static void encode_action_definitions(ran_function_cache_entry_t *entry)
+{
+        int BUFFER_SIZE = 10240;
+        unsigned char buf[BUFFER_SIZE];
+        size_t buf_size;
         unsigned long granulPeriod = 10000;
-
-        int encodedLengthFormat3ByName = e2sm_encode_ric_action_definition_format3_by_name(&bufFormat3[0], &buf_sizeFormat3, name_format3, sz3, ricStyleTypeFormat3, granulPeriod);
-        printf("length of buff= %ld \n", strlen(bufFormat3));
-        printf("size of buff= %ld \n", sizeof(bufFormat3));
-        printf("declared size of buff= %ld \n", BUFFER_SIZE);
-        printf("encoded length of buff= %ld \n", encodedLengthFormat3ByName);
-        int arrayFormat3ByName[encodedLengthFormat3ByName];
-        for (int i = 0; i < encodedLengthFormat3ByName; i++)
-        {
-                // printf("%d ",(int)bufFormat3[i]);
-                arrayFormat3ByName[i] = (int)bufFormat3[i];
-        }
-
-        unsigned char bufFormat1[BUFFER_SIZE];
-        size_t buf_sizeFormat1 = BUFFER_SIZE;
-
         long ricStyleTypeFormat1 = 1;
-        // unsigned long granulPeriod = 10000;
+        long ricStyleTypeFormat3 = 3;
 
         // get plmn id during run time of kpimon
         unsigned char p[] = {0x00, 0x1F, 0x01};
@@ -327,104 +282,105 @@ struct encode_act_Def_result encode_action_Definition(const char *hex_values, in
         // get nr cell id for 5g cell or eutra cell id for 4g cell
         unsigned char nR[] = {0x12, 0x34, 0x56, 0x00, 0x10};
 
-        int encodedLengthFormat1ByName = e2sm_encode_ric_action_definition_format1_by_name(&bufFormat1[0], &buf_sizeFormat1, name_format1, sz1, ricStyleTypeFormat1, granulPeriod, p, nR);
-        printf("\n\n\n");
-        int arrayFormat1ByName[encodedLengthFormat1ByName];
-        for (int i = 0; i < encodedLengthFormat1ByName; i++)
-        {
-                // printf("%d ",(int)bufFormat1[i]);
-                arrayFormat1ByName[i] = (int)bufFormat1[i];
-        }
-
-        unsigned char bufFormat1ById[BUFFER_SIZE];
-        size_t buf_sizeFormat1ById = BUFFER_SIZE;
-
-        int encodedLengthFormat1ById = e2sm_encode_ric_action_definition_format1_by_id(&bufFormat1ById[0], &buf_sizeFormat1ById, id_format1, sz1, ricStyleTypeFormat1, granulPeriod, p, nR);
-        printf("\n\n\n");
-        int arrayFormat1ById[encodedLengthFormat1ById];
-        for (int i = 0; i < encodedLengthFormat1ById; i++)
+        printf("\n");
+        printf("measID format 1\n");
+        for (int i = 0; i < entry->sz1; i++)
         {
-                // printf("%d ",(int)bufFormat1ById[i]);
-                arrayFormat1ById[i] = (int)bufFormat1ById[i];
+                printf("%ld, ", entry->id_format1[i]);
         }
-
-        unsigned char bufFormat3ById[BUFFER_SIZE];
-        size_t buf_sizeFormat3ById = BUFFER_SIZE;
-
-        int encodedLengthFormat3ById = e2sm_encode_ric_action_definition_format3_by_id(&bufFormat3ById[0], &buf_sizeFormat3ById, id_format3, sz3, ricStyleTypeFormat3, granulPeriod);
-        printf("\n\n\n");
-        int arrayFormat3ById[encodedLengthFormat3ById];
-        for (int i = 0; i < encodedLengthFormat3ById; i++)
+        printf("\n");
+        printf("measName format 1\n");
+        for (int i = 0; i < entry->sz1; i++)
         {
-                // printf("%d ",(int)bufFormat3ById[i]);
-                arrayFormat3ById[i] = (int)bufFormat3ById[i];
+                printf("%s, ", entry->name_format1[i]);
         }
-
-        ASN_STRUCT_FREE(asn_DEF_E2SM_KPM_RANfunction_Description, e2smKpmRanFunctDescrip);
-
-        // Don't forget to free the allocated memory when done
-        if (hex_buffer)
+        printf("\n");
+        printf("measID format 3\n");
+        for (int i = 0; i < entry->sz3; i++)
         {
-                free(hex_buffer);
-                hex_buffer = NULL;
+                printf("%ld, ", entry->id_format3[i]);
         }
-        if (id_format1)
+        printf("\n");
+        printf("measName format 3\n");
+        for (int i = 0; i < entry->sz3; i++)
         {
-                free(id_format1);
-                id_format1 = NULL;
+                printf("%s, ", entry->name_format3[i]);
         }
-        if (name_format1)
+        printf("\n");
+
+        // The PLMN and cell ID hardcoded in format 1 are removed from the result (8 bytes)
+        buf_size = BUFFER_SIZE;
+        int length = e2sm_encode_ric_action_definition_format1_by_id(buf, &buf_size, entry->id_format1, entry->sz1, ricStyleTypeFormat1, granulPeriod, p, nR);
+        entry->action_definitions[0] = copy_action_definition(buf, length);
+        entry->action_definition_lengths[0] = length > 8 ? length - 8 : 0;
+
+        buf_size = BUFFER_SIZE;
+        length = e2sm_encode_ric_action_definition_format1_by_name(buf, &buf_size, (const char **)entry->name_format1, entry->sz1, ricStyleTypeFormat1, granulPeriod, p, nR);
+        entry->action_definitions[1] = copy_action_definition(buf, length);
+        entry->action_definition_lengths[1] = length > 8 ? length - 8 : 0;
+
+        buf_size = BUFFER_SIZE;
+        length = e2sm_encode_ric_action_definition_format3_by_id(buf, &buf_size, entry->id_format3, entry->sz3, ricStyleTypeFormat3, granulPeriod);
+        entry->action_definitions[2] = copy_action_definition(buf, length);
+        entry->action_definition_lengths[2] = length > 0 ? length : 0;
+
+        buf_size = BUFFER_SIZE;
+        length = e2sm_encode_ric_action_definition_format3_by_name(buf, &buf_size, entry->name_format3, entry->sz3, ricStyleTypeFormat3, granulPeriod);
+        entry->action_definitions[3] = copy_action_definition(buf, length);
+        entry->action_definition_lengths[3] = length > 0 ? length : 0;
+        printf("encoded length of action definitions= %d, %d, %d, %d \n", entry->action_definition_lengths[0],
+               entry->action_definition_lengths[1], entry->action_definition_lengths[2], entry->action_definition_lengths[3]);
+}
+
+// The returned measurement names belong to the description cache, see RAN_FUNCTION_CACHE_MAX_ENTRIES for how long they
+// stay valid. All fields are zero if the description cannot be decoded.
+ranCellUeKpi_t buildRanCellUeKpi(const char *hex_values)
+{
+        ranCellUeKpi_t res = {0};
+
+        pthread_mutex_lock(&ran_function_cache_mutex);
+        ran_function_cache_entry_t *entry = get_ran_function(hex_values);
+        if (entry != NULL)
         {
-                for (int i = 0; i < sz1; i++)
-                {
-                        if (name_format1[i] != NULL)
-                        {
-                                free(name_format1[i]);
-                                name_format1[i] = NULL;
-                        }
-                }
-                free(name_format1);
-                name_format1 = NULL;
+                res.ueKpi = entry->name_format3;
+                res.cellKpi = entry->name_format1;
+                res.ueKpiSize = entry->sz3;
+                res.cellKpiSize = entry->sz1;
         }
-        if (id_format3)
+        pthread_mutex_unlock(&ran_function_cache_mutex);
+        return res;
+}
+
+// Kept for the Go code: the names returned by buildRanCellUeKpi() are owned by the description cache
+void freeMemorydRanCellUeKpi(ranCellUeKpi_t res)
+{
+        (void)res;
+}
+
+// determine
+// 1 for format1 by id, 2 for format1 by name , 3 for format3 by id, 4 for format3 by name
+// The returned array belongs to the description cache, see RAN_FUNCTION_CACHE_MAX_ENTRIES for how long it stays valid.
+struct encode_act_Def_result encode_action_Definition(const char *hex_values, int determine)
+{
+        encode_act_Def_result_t res = {0};
+        if (determine < 1 || determine > NUM_ACTION_DEFINITIONS)
         {
-                free(id_format3);
-                id_format3 = NULL;
+                return res;
         }
-        if (name_format3)
+
+        pthread_mutex_lock(&ran_function_cache_mutex);
+        ran_function_cache_entry_t *entry = get_ran_function(hex_values);
+        if (entry != NULL)
         {
-                for (int i = 0; i < sz3; i++)
+                if (!entry->encoded)
                 {
-                        if (name_format3[i] != NULL)
-                        {
-                                free(name_format3[i]);
-                                name_format3[i] = NULL;
-                        }
+                        encode_action_definitions(entry);
+                        entry->encoded = 1;
                 }
-                free(name_format3);
-                name_format3 = NULL;
-        }
-
-        switch (determine)
-        {
-        case 1:
-                res.array = arrayFormat1ById;
-                res.length = encodedLengthFormat1ById - 8; // removing hardcoded plmn and cellid
-                return res;
-        case 2:
-                res.array = arrayFormat1ByName;
-                res.length = encodedLengthFormat1ByName - 8; // removing hardcoded plmn and cellid
-                return res;
-        case 3:
-                res.array = arrayFormat3ById;
-                res.length = encodedLengthFormat3ById;
-                return res;
-        case 4:
-                res.array = arrayFormat3ByName;
-                res.length = encodedLengthFormat3ByName;
-                return res;
-                break;
+                res.array = entry->action_definitions[determine - 1];
+                res.length = entry->action_definition_lengths[determine - 1];
         }
+        pthread_mutex_unlock(&ran_function_cache_mutex);
         return res;
 }
 
@@ -79,7 +79,9 @@ OUTPUT_FILE="logs/e2sim_output.txt"
 
 echo "Starting a new container 'oransim'..."
 sudo rm -rf $OUTPUT_FILE
-docker run -d -it --name oransim -e RAN_FUNC_ID="$RAN_FUNC_ID" -v "$(pwd)/logs:/app/logs" oransim:0.0.999
+# Pacing of the replayed indications (E2SIM_PACING_MODE=fixed, trace, max or burst) and the number of subscriptions
+# reporting concurrently (E2SIM_REPORT_WORKERS), passed to the container if set
+docker run -d -it --name oransim -e RAN_FUNC_ID="$RAN_FUNC_ID" -e E2SIM_PACING_MODE -e E2SIM_PACING_RATE -e E2SIM_PACING_SPEED -e E2SIM_PACING_PERIOD_MS -e E2SIM_REPORT_WORKERS -v "$(pwd)/logs:/app/logs" oransim:0.0.999
 
 kubectl get svc -n ricplt | grep e2term-sctp || true
 